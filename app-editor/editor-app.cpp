@@ -63,10 +63,14 @@ scene_editor_app::scene_editor_app() : polymer_app(1920, 1080, "Polymer Editor")
        "../assets/shaders/wireframe_geom.glsl",
        "../assets/shaders/renderer");
 
+    // Variants used in earlier sessions start compiling in the background now instead of on first draw
+    shaderMonitor.load_variant_manifest("program-cache/variants.json");
+
     fullscreen_surface.reset(new simple_texture_view());
 
     renderer_settings initialSettings;
     initialSettings.renderSize = int2(width, height);
+    initialSettings.entityIdPass = true; // selection is picked from the renderer
     scene.collision_system = orchestrator.create_system<collision_system>(&orchestrator);
     scene.xform_system = orchestrator.create_system<transform_system>(&orchestrator);
     scene.identifier_system = orchestrator.create_system<identifier_system>(&orchestrator);
@@ -117,7 +121,9 @@ void scene_editor_app::on_window_resize(int2 size)
     {
         renderer_settings settings;
         settings.renderSize = size;
+        settings.entityIdPass = true;
         scene.render_system->reconfigure(settings);
+        pending_picks.clear(); // requested from the previous renderer
         scene.render_system->get_skybox()->onParametersChanged(); // reconfigure directional light
     }
 }
@@ -168,41 +174,55 @@ void scene_editor_app::on_input(const app_input_event & event)
             if (event.value[0] == GLFW_KEY_SPACE && event.action == GLFW_RELEASE) {}
         }
 
-        // Raycast for editor/gizmo selection on mouse up
-        if (event.type == app_input_event::MOUSE && event.action == GLFW_RELEASE && event.value[0] == GLFW_MOUSE_BUTTON_LEFT)
+        // A drag that starts off the gizmo selects everything drawn within its rectangle
+        if (event.type == app_input_event::MOUSE && event.action == GLFW_PRESS && event.value[0] == GLFW_MOUSE_BUTTON_LEFT)
         {
-            int width, height;
-            glfwGetWindowSize(window, &width, &height);
+            marquee_tracking = !gizmo->active();
+            marquee_start = event.cursor;
+        }
 
-            const ray r = cam.get_world_ray(event.cursor, float2(static_cast<float>(width), static_cast<float>(height)));
+        // Pick for editor/gizmo selection on mouse up
+        if (event.type == app_input_event::MOUSE && event.action == GLFW_RELEASE && event.value[0] == GLFW_MOUSE_BUTTON_LEFT)
+        {
+            const bool marquee = marquee_tracking && length(event.cursor - marquee_start) > 4.f;
+            marquee_tracking = false;
 
-            if (length(r.direction) > 0 && !gizmo->active())
+            if (!gizmo->active())
             {
-                std::vector<entity> selectedObjects;
-                entity_hit_result result = scene.collision_system->raycast(r);
-                if (result.e != kInvalidEntity) selectedObjects.push_back(result.e);
-
-                // New object was selected
-                if (selectedObjects.size() > 0)
+                const int2 cursor = int2(event.cursor);
+                pick_region region = { cursor, cursor + int2(1, 1) };
+                if (marquee)
                 {
-                    // Multi-selection
-                    if (event.mods & GLFW_MOD_CONTROL)
-                    {
-                        auto existingSelection = gizmo->get_selection();
-                        for (auto s : selectedObjects)
-                        {
-                            if (!gizmo->selected(s)) existingSelection.push_back(s);
-                        }
-                        gizmo->set_selection(existingSelection);
-                    }
-                    // Single Selection
-                    else
-                    {
-                        gizmo->set_selection(selectedObjects);
-                    }
+                    region.min = int2(min(event.cursor, marquee_start));
+                    region.max = int2(max(event.cursor, marquee_start)) + int2(1, 1);
                 }
+
+                const uint32_t request = scene.render_system->get_renderer()->get_entity_picker().request(region);
+                pending_picks.push_back({ request, marquee, (event.mods & GLFW_MOD_CONTROL) != 0 });
             }
+        }
+    }
+}
 
+void scene_editor_app::select(const std::vector<entity> & selected, const bool additive)
+{
+    // New object was selected
+    if (selected.size() > 0)
+    {
+        // Multi-selection
+        if (additive)
+        {
+            auto existingSelection = gizmo->get_selection();
+            for (auto s : selected)
+            {
+                if (!gizmo->selected(s)) existingSelection.push_back(s);
+            }
+            gizmo->set_selection(existingSelection);
+        }
+        // Single Selection
+        else
+        {
+            gizmo->set_selection(selected);
         }
     }
 }
@@ -260,11 +280,10 @@ void scene_editor_app::on_update(const app_update_event & e)
 
     set_working_directory(working_dir_on_launch);
 
-    editorProfiler.begin("on_update");
+    POLYMER_PROFILE_SCOPE(editorProfiler, "on_update");
     flycam.update(e.timestep_ms);
     shaderMonitor.handle_recompile();
     gizmo->on_update(cam, float2(static_cast<float>(width), static_cast<float>(height)));
-    editorProfiler.end("on_update");
 }
 
 void scene_editor_app::draw_entity_scenegraph(const entity e)
@@ -343,7 +362,7 @@ void scene_editor_app::on_draw()
     const float4x4 viewProjectionMatrix = (projectionMatrix * viewMatrix);
 
     {
-        editorProfiler.begin("gather-scene");
+        profile_scope gatherScope(editorProfiler, "gather-scene");
 
         // Clear out transient scene payload data
         renderer_payload.views.clear();
@@ -389,15 +408,32 @@ void scene_editor_app::on_draw()
         // Add single-viewport camera
         renderer_payload.views.push_back(view_data(0, cam.pose, projectionMatrix));
 
-        editorProfiler.end("gather-scene");
+        gatherScope.end();
 
         // Submit scene to the scene renderer
-        editorProfiler.begin("submit-scene");
-        scene.render_system->get_renderer()->render_frame(renderer_payload);
-        editorProfiler.end("submit-scene");
+        {
+            POLYMER_PROFILE_SCOPE(editorProfiler, "submit-scene");
+            scene.render_system->get_renderer()->render_frame(renderer_payload);
+        }
+
+        // Apply the picks whose ids have been read back
+        pick_results.clear();
+        scene.render_system->get_renderer()->get_entity_picker().poll(pick_results);
+        for (const entity_pick_result & result : pick_results)
+        {
+            auto pending = std::find_if(pending_picks.begin(), pending_picks.end(), [&](const pending_pick & p) { return p.request == result.request; });
+            if (pending == pending_picks.end()) continue;
+
+            // A click selects the entity under the cursor, a marquee every entity within it
+            std::vector<entity> selectedObjects = result.entities;
+            if (!pending->marquee && selectedObjects.size() > 1) selectedObjects.resize(1);
+
+            select(selectedObjects, pending->additive);
+            pending_picks.erase(pending);
+        }
 
         // Draw to screen framebuffer
-        glUseProgram(0);
+        gl_state().use_program(0);
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
         glViewport(0, 0, width, height);
         fullscreen_surface->draw(scene.render_system->get_renderer()->get_color_texture(0));
@@ -410,8 +446,8 @@ void scene_editor_app::on_draw()
     }
 
     // Draw selected objects as wireframe by directly
-    editorProfiler.begin("wireframe-rendering");
     {
+        POLYMER_PROFILE_SCOPE(editorProfiler, "wireframe-rendering");
         glDisable(GL_DEPTH_TEST);
 
         gl_shader & program = wireframeHandle.get()->get_variant()->shader;
@@ -434,11 +470,17 @@ void scene_editor_app::on_draw()
 
         glEnable(GL_DEPTH_TEST);
     }
-    editorProfiler.end("wireframe-rendering");
 
-    editorProfiler.begin("imgui-menu");
+    profile_scope menuScope(editorProfiler, "imgui-menu");
     igm->begin_frame();
 
+    // Outline of the marquee being dragged
+    if (marquee_tracking && ImGui::IsMouseDown(0))
+    {
+        const ImVec2 cursor = ImGui::GetIO().MousePos;
+        ImGui::GetOverlayDrawList()->AddRect(ImVec2(marquee_start.x, marquee_start.y), cursor, IM_COL32(255, 255, 255, 192));
+    }
+
     gui::imgui_menu_stack menu(*this, ImGui::GetIO().KeysDown);
     menu.app_menu_begin();
     {
@@ -477,6 +519,17 @@ void scene_editor_app::on_draw()
             request_screenshot("scene-editor");
         }
 
+        if (menu.item("Export Renderer Trace"))
+        {
+            const auto export_path = windows_file_dialog("chrome trace", "json", false);
+            set_working_directory(working_dir_on_launch); // required because the dialog resets the cwd
+            if (!export_path.empty())
+            {
+                std::ofstream trace_file(export_path);
+                scene.render_system->get_renderer()->renderProfiler.export_chrome_trace(trace_file);
+            }
+        }
+
         if (menu.item("Exit", GLFW_MOD_ALT, GLFW_KEY_F4)) exit();
         menu.end();
 
@@ -528,9 +581,9 @@ void scene_editor_app::on_draw()
 
     menu.app_menu_end();
 
-    editorProfiler.end("imgui-menu");
+    menuScope.end();
 
-    editorProfiler.begin("imgui-editor");
+    profile_scope editorScope(editorProfiler, "imgui-editor");
     if (show_imgui)
     {
         static int horizSplit = 380;
@@ -648,8 +701,7 @@ void scene_editor_app::on_draw()
                 renderer_settings lastSettings = scene.render_system->get_renderer()->settings;
                 if (build_imgui(im_ui_ctx, "Renderer", *scene.render_system->get_renderer()))
                 {
-                    scene.render_system->get_renderer()->gpuProfiler.set_enabled(scene.render_system->get_renderer()->settings.performanceProfiling);
-                    scene.render_system->get_renderer()->cpuProfiler.set_enabled(scene.render_system->get_renderer()->settings.performanceProfiling);
+                    scene.render_system->get_renderer()->renderProfiler.set_enabled(scene.render_system->get_renderer()->settings.performanceProfiling);
                 }
 
                 ImGui::Dummy({ 0, 10 });
@@ -687,13 +739,39 @@ void scene_editor_app::on_draw()
 
             if (scene.render_system->get_renderer()->settings.performanceProfiling)
             {
-                for (auto & t : scene.render_system->get_renderer()->gpuProfiler.get_data()) ImGui::Text("[Renderer GPU] %s %f ms", t.first.c_str(), t.second);
-                for (auto & t : scene.render_system->get_renderer()->cpuProfiler.get_data()) ImGui::Text("[Renderer CPU] %s %f ms", t.first.c_str(), t.second);
+                for (auto & t : scene.render_system->get_renderer()->renderProfiler.get_summary())
+                {
+                    const char * type = (t.type == profile_sample_type::gpu) ? "GPU" : "CPU";
+                    ImGui::Text("[Renderer %s] %*s%s %f ms (max %f)", type, t.depth * 2, "", t.label().c_str(), t.average_ms, t.max_ms);
+                }
+
+                const gl_state_counters stateCounters = gl_state().get_frame_counters();
+                ImGui::Text("[Renderer GL] %u state calls issued, %u elided", stateCounters.issued, stateCounters.elided);
+
+                auto * renderer = scene.render_system->get_renderer();
+                if (renderer->settings.occlusionCulling || renderer->settings.hizCulling)
+                {
+                    ImGui::Text("[Renderer Occlusion] %u of %u draws culled", renderer->get_occluded_draw_count(), renderer->get_draw_count());
+                }
+                if (renderer->settings.occlusionCulling)
+                {
+                    const occlusion_culling_stats & occlusion = renderer->get_occlusion_stats();
+                    ImGui::Text("[Renderer Occlusion] %u occluders (%u triangles)", occlusion.occluders, occlusion.triangles);
+                }
+                if (renderer->settings.hizCulling && renderer->settings.hizGpuCulling)
+                {
+                    ImGui::Text("[Renderer Occlusion] %u draws culled on the gpu", renderer->get_gpu_occluded_draw_count());
+                }
+                if (renderer->settings.dynamicResolution)
+                {
+                    const uint2 viewport = renderer->get_viewport_size();
+                    ImGui::Text("[Renderer Resolution] %u x %u (scale %.2f)", viewport.x, viewport.y, renderer->get_resolution_scale());
+                }
             }
 
             ImGui::Dummy({ 0, 10 });
 
-            for (auto & t : editorProfiler.get_data()) ImGui::Text("[Editor] %s %f ms", t.first.c_str(), t.second);
+            for (auto & t : editorProfiler.get_summary()) ImGui::Text("[Editor] %*s%s %f ms", t.depth * 2, "", t.label().c_str(), t.average_ms);
         }
         gui::imgui_fixed_window_end();
 
@@ -705,19 +783,20 @@ void scene_editor_app::on_draw()
     }
 
     igm->end_frame();
-    editorProfiler.end("imgui-editor");
+    editorScope.end();
 
     {
-        editorProfiler.begin("gizmo_on_draw");
+        POLYMER_PROFILE_SCOPE(editorProfiler, "gizmo_on_draw");
         glClear(GL_DEPTH_BUFFER_BIT);
         gizmo->on_draw();
-        editorProfiler.end("gizmo_on_draw");
     }
 
     gl_check_error(__FILE__, __LINE__);
 
     glFlush();
 
+    editorProfiler.end_frame();
+
     // `should_open_material_window` flag required because opening a new window directly 
     // from an ImGui instance trashes some piece of state somewhere
     if (should_open_material_window)
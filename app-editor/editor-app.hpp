@@ -31,8 +31,8 @@ struct scene_editor_app final : public polymer_app
 {
     perspective_camera cam;
     fps_camera_controller flycam;
-    profiler<simple_cpu_timer> editorProfiler;
-    gl_shader_monitor shaderMonitor { "../assets/" };
+    profiler editorProfiler;
+    gl_shader_monitor shaderMonitor { "../assets/", "program-cache" };
     gl_renderable_grid grid{ 1.f, 512, 512 };
 
     imgui_ui_context im_ui_ctx;
@@ -58,10 +58,18 @@ struct scene_editor_app final : public polymer_app
     entity_orchestrator orchestrator;
     environment scene;
 
+    // Clicks and marquee drags are picked from the renderer's entity id pass; results arrive a frame or so later
+    struct pending_pick { uint32_t request; bool marquee; bool additive; };
+    std::vector<pending_pick> pending_picks;
+    std::vector<entity_pick_result> pick_results;
+    bool marquee_tracking = false;
+    float2 marquee_start;
+
     void draw_entity_scenegraph(const entity e);
+    void select(const std::vector<entity> & selected, const bool additive);
 
     scene_editor_app();
-    ~scene_editor_app() {}
+    ~scene_editor_app() { shaderMonitor.save_variant_manifest("program-cache/variants.json"); }
 
     void open_material_editor();
     void open_asset_browser();
@@ -231,7 +231,7 @@ struct material_editor_window final : public glfw_window
                 preview_renderer->render_frame(preview_payload);
             }
 
-            glUseProgram(0);
+            gl_state().use_program(0);
             glBindFramebuffer(GL_FRAMEBUFFER, 0);
             glViewport(0, previewHeight, width, height);
 
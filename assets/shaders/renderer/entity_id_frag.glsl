@@ -0,0 +1,12 @@
+#include "renderer_common.glsl"
+
+out uint f_id;
+
+void main()
+{
+#ifdef LOD_CROSS_FADE
+    if (lod_fade_discard(gl_FragCoord.xy)) discard;
+#endif
+
+    f_id = u_pickId;
+}
@@ -4,5 +4,8 @@ out vec4 f_color;
 
 void main()
 {
+#ifdef LOD_CROSS_FADE
+    if (lod_fade_discard(gl_FragCoord.xy)) discard;
+#endif
 	
 }
\ No newline at end of file
@@ -18,10 +18,38 @@ in vec2 v_texcoord;
 in vec3 v_tangent;
 in vec3 v_bitangent;
 
-// Material Uniforms
-uniform float u_roughness = 1;
-uniform float u_metallic = 1;
-uniform float u_opacity = 1;
+// Material parameters of every pbr material drawn in the frame, indexed by the object's material index (see uniforms::pbr_material)
+struct PbrMaterialData
+{
+    vec3 albedo;
+    float opacity;
+    vec3 emissive;
+    float emissiveStrength;
+    float roughness;
+    float metallic;
+    float specularLevel;  // dielectrics have an F0 between 0.2 - 0.5, often exposed as the "specular level" parameter
+    float occlusionStrength;
+    float ambientStrength;
+    float shadowOpacity;
+    vec2 texcoordScale;
+};
+
+layout(binding = 7, std430) readonly buffer PbrMaterialBuffer
+{
+    PbrMaterialData u_pbrMaterials[];
+};
+
+#define u_albedo u_pbrMaterials[u_materialIndex].albedo
+#define u_opacity u_pbrMaterials[u_materialIndex].opacity
+#define u_emissive u_pbrMaterials[u_materialIndex].emissive
+#define u_emissiveStrength u_pbrMaterials[u_materialIndex].emissiveStrength
+#define u_roughness u_pbrMaterials[u_materialIndex].roughness
+#define u_metallic u_pbrMaterials[u_materialIndex].metallic
+#define u_specularLevel u_pbrMaterials[u_materialIndex].specularLevel
+#define u_occlusionStrength u_pbrMaterials[u_materialIndex].occlusionStrength
+#define u_ambientStrength u_pbrMaterials[u_materialIndex].ambientStrength
+#define u_shadowOpacity u_pbrMaterials[u_materialIndex].shadowOpacity
+#define u_texcoordScale u_pbrMaterials[u_materialIndex].texcoordScale
 
 #ifdef HAS_ALBEDO_MAP
     uniform sampler2D s_albedo;
@@ -49,15 +77,6 @@ uniform float u_opacity = 1;
 
 // Lighting & Shadowing Uniforms
 uniform float u_pointLightAttenuation = 1.0;
-uniform float u_shadowOpacity = 1.0;
-
-// Dielectrics have an F0 between 0.2 - 0.5, often exposed as the "specular level" parameter
-uniform vec3 u_albedo = vec3(1, 1, 1);
-uniform vec3 u_emissive = vec3(1, 1, 1);
-uniform float u_specularLevel = 0.04;
-uniform float u_occlusionStrength = 1.0;
-uniform float u_ambientStrength = 1.0;
-uniform float u_emissiveStrength = 1.0;
 
 #ifdef ENABLE_SHADOWS
     uniform sampler2DArray s_csmArray;
@@ -142,7 +161,12 @@ void compute_ibl(LightingInfo data, vec3 n, vec3 refl)
 
 void main()
 {   
+#ifdef LOD_CROSS_FADE
+    if (lod_fade_discard(gl_FragCoord.xy)) discard;
+#endif
+
     // Surface properties
+    vec2 texcoord = v_texcoord * u_texcoordScale;
     vec3 albedo = u_albedo;
     vec3 N = normalize(v_normal);
 
@@ -150,20 +174,20 @@ void main()
     float metallic = u_metallic;
 
 #ifdef HAS_NORMAL_MAP
-    vec3 nSample = normalize(texture(s_normal, v_texcoord).xyz * 2.0 - 1.0);
+    vec3 nSample = unpack_normal_map(texture(s_normal, texcoord));
     N = normalize(calc_normal_map(v_normal, normalize(v_tangent), normalize(v_bitangent), normalize(nSample)).xyz);
 #endif
 
 #ifdef HAS_ROUGHNESS_MAP
-    roughness = texture(s_roughness, v_texcoord).r * roughness;
+    roughness = texture(s_roughness, texcoord).r * roughness;
 #endif
 
 #ifdef HAS_METALNESS_MAP
-    metallic = texture(s_metallic, v_texcoord).r * metallic;
+    metallic = texture(s_metallic, texcoord).r * metallic;
 #endif
 
 #ifdef HAS_ALBEDO_MAP
-    albedo *= sRGBToLinear(texture(s_albedo, v_texcoord).rgb, DEFAULT_GAMMA); 
+    albedo *= sRGBToLinear(texture(s_albedo, texcoord).rgb, DEFAULT_GAMMA); 
 #endif
 
 //#ifdef HAS_NORMAL_MAP
@@ -233,9 +257,11 @@ void main()
         Lo += NdotL * u_directionalLight.color * (diffuseContrib + specContrib);
     }
 
-    // Compute point lights
-    for (int i = 0; i < u_activePointLights; ++i)
+    // Compute the point lights assigned to this fragment's cluster
+    const uvec2 cluster = get_light_cluster(gl_FragCoord.xy, -v_view_space_position.z);
+    for (uint c = 0u; c < cluster.y; ++c)
     {
+        const uint i = u_lightIndices[cluster.x + c];
         vec3 L = normalize(u_pointLights[i].position - v_world_position); 
         vec3 H = normalize(L + V);  
 
@@ -278,11 +304,11 @@ void main()
     #endif
 
     #ifdef HAS_EMISSIVE_MAP
-        Lo += texture(s_emissive, v_texcoord).rgb * u_emissiveStrength; 
+        Lo += texture(s_emissive, texcoord).rgb * u_emissiveStrength; 
     #endif
 
     #ifdef HAS_OCCLUSION_MAP
-        float ao = texture(s_occlusion, v_texcoord).r;
+        float ao = texture(s_occlusion, texcoord).r;
         Lo = mix(Lo, Lo * ao, u_occlusionStrength);
     #endif
 
@@ -8,11 +8,14 @@ in vec2 v_texcoord;
 in vec3 v_tangent;
 in vec3 v_bitangent;
 
-// Material Uniforms
-uniform vec3 u_diffuseColor;
-uniform vec3 u_specularColor;
-uniform float u_specularShininess;
-uniform float u_specularStrength;
+// Material Uniforms (see uniforms::blinn_phong_material)
+layout(binding = 3, std140) uniform BlinnPhongMaterial
+{
+    vec3 u_diffuseColor;
+    float u_specularShininess;
+    vec3 u_specularColor;
+    float u_specularStrength;
+};
 
 uniform sampler2D s_diffuse;
 uniform sampler2D s_normal;
@@ -41,11 +44,15 @@ vec3 blinn_phong_specular(const in float NdotH, const in float LdotH, const in v
 
 void main()
 {   
+#ifdef LOD_CROSS_FADE
+    if (lod_fade_discard(gl_FragCoord.xy)) discard;
+#endif
+
     vec3 diffuseColor = u_diffuseColor;
     vec3 N = normalize(v_normal);
 
 #ifdef HAS_NORMAL_MAP
-    vec3 nSample = normalize(texture(s_normal, v_texcoord).xyz * 2.0 - 1.0);
+    vec3 nSample = unpack_normal_map(texture(s_normal, v_texcoord));
     N = normalize(calc_normal_map(v_normal, normalize(v_tangent), normalize(v_bitangent), nSample).xyz);
 #endif
 
@@ -77,9 +84,11 @@ void main()
         Lo += (diffuseContrib + specContrib);
     }
 
-    // Compute point lights
-    for (int i = 0; i < u_activePointLights; ++i)
+    // Compute the point lights assigned to this fragment's cluster
+    const uvec2 cluster = get_light_cluster(gl_FragCoord.xy, -v_view_space_position.z);
+    for (uint c = 0u; c < cluster.y; ++c)
     {
+        const uint i = u_lightIndices[cluster.x + c];
         vec3 L = normalize(u_pointLights[i].position - v_world_position); 
         vec3 H = normalize(L + V);  
 
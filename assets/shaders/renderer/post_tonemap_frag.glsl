@@ -1,13 +1,15 @@
 #version 330
 
 uniform sampler2D s_texColor;
+uniform vec2 u_uvScale = vec2(1.0); // drawn part of s_texColor under dynamic resolution
+uniform vec2 u_uvMax = vec2(1.0);
+uniform float u_exposure = 1.0;
 
 in vec2 v_texcoord0;
 
 out vec4 f_color;
 
 const float gamma     = 2.2;
-const float exposure  = 1.0;
 const float pureWhite = 1.0;
 
 vec3 uncharted2_tonemap(in vec3 x) 
@@ -43,7 +45,7 @@ vec3 aces_film_tonemap(in vec3 x)
 
 void main()
 {
-    vec3 color = texture(s_texColor, v_texcoord0).rgb * exposure;
+    vec3 color = texture(s_texColor, min(v_texcoord0 * u_uvScale, u_uvMax)).rgb * u_exposure;
     f_color = vec4(color, 1); //vec4(apply_uncharted2_tonemap(color), 1.0);
 
     // Reinhard tonemapping operator - see: "Photographic Tone Reproduction for Digital Images", eq. 4
@@ -8,9 +8,25 @@
 
 #define TWO_CASCADES // fixme
 
-const int MAX_POINT_LIGHTS = 4;
+// With INSTANCED_STEREO, every draw is instanced once per eye and the vertex stage routes each instance
+// to its own layer of the render target. Per-view and per-object blocks then hold one record per eye,
+// indexed by VIEW_INDEX: the instance in the vertex stage and the layer in later stages.
+#ifdef INSTANCED_STEREO
+    #extension GL_ARB_shader_viewport_layer_array : enable
+    #extension GL_AMD_vertex_shader_layer : enable
+    #define NUM_VIEWS 2
+    #define VIEW_INDEX gl_Layer
+#else
+    #define NUM_VIEWS 1
+    #define VIEW_INDEX 0
+#endif
+
 const int NUM_CASCADES = 2;
 
+const uint LIGHT_CLUSTERS_X = 16u;
+const uint LIGHT_CLUSTERS_Y = 9u;
+const uint LIGHT_CLUSTERS_Z = 24u;
+
 struct DirectionalLight
 {
     vec3 color;
@@ -28,7 +44,6 @@ struct PointLight
 layout(binding = 0, std140) uniform PerScene
 {
     DirectionalLight u_directionalLight;
-    PointLight u_pointLights[MAX_POINT_LIGHTS];
     float u_time;
     int u_activePointLights;
     int sunlightActive;
@@ -40,21 +55,85 @@ layout(binding = 0, std140) uniform PerScene
     float u_cascadesFar[NUM_CASCADES];
 };
 
+struct ViewData
+{
+    mat4 viewMatrix;
+    mat4 viewProjMatrix;
+    vec4 eyePos;
+    vec4 clusterDepth; // near, far, slice scale, slice bias
+};
+
+struct ObjectData
+{
+    mat4 modelMatrix;
+    mat4 modelMatrixIT;
+    mat4 modelViewMatrix;
+    float receiveShadow;
+    float lodFade;
+    uint materialIndex;
+    uint pickId;
+};
+
 layout(binding = 1, std140) uniform PerView
 {
-    mat4 u_viewMatrix;
-    mat4 u_viewProjMatrix;
-    vec4 u_eyePos;
+    ViewData u_views[NUM_VIEWS];
 };
 
 layout(binding = 2, std140) uniform PerObject
 {
-    mat4 u_modelMatrix;
-    mat4 u_modelMatrixIT;
-    mat4 u_modelViewMatrix;
-    float u_receiveShadow;
+    ObjectData u_objects[NUM_VIEWS];
+};
+
+#define u_viewMatrix u_views[VIEW_INDEX].viewMatrix
+#define u_viewProjMatrix u_views[VIEW_INDEX].viewProjMatrix
+#define u_eyePos u_views[VIEW_INDEX].eyePos
+#define u_clusterDepth u_views[VIEW_INDEX].clusterDepth
+#define u_modelMatrix u_objects[VIEW_INDEX].modelMatrix
+#define u_modelMatrixIT u_objects[VIEW_INDEX].modelMatrixIT
+#define u_modelViewMatrix u_objects[VIEW_INDEX].modelViewMatrix
+#define u_receiveShadow u_objects[VIEW_INDEX].receiveShadow
+#define u_lodFade u_objects[VIEW_INDEX].lodFade
+#define u_materialIndex u_objects[VIEW_INDEX].materialIndex
+#define u_pickId u_objects[VIEW_INDEX].pickId
+
+#ifdef LOD_CROSS_FADE
+// True for fragments the other level of a cross-fade covers. The incoming level keeps the pixels whose
+// dither threshold is below the fade and the outgoing one (negative fade) the rest, so every pixel is drawn once.
+bool lod_fade_discard(vec2 fragCoord)
+{
+    if (u_lodFade == 0.0) return false;
+    const float bayer[16] = float[16](0.0, 8.0, 2.0, 10.0, 12.0, 4.0, 14.0, 6.0, 3.0, 11.0, 1.0, 9.0, 15.0, 7.0, 13.0, 5.0);
+    ivec2 p = ivec2(fragCoord) & 3;
+    float threshold = (bayer[p.y * 4 + p.x] + 0.5) / 16.0;
+    return (u_lodFade > 0.0) ? (threshold >= u_lodFade) : (threshold < -u_lodFade);
+}
+#endif
+
+// Clustered light lists (see clustered_lighting)
+layout(binding = 4, std430) readonly buffer PointLightBuffer
+{
+    PointLight u_pointLights[];
 };
 
+layout(binding = 5, std430) readonly buffer LightClusterBuffer
+{
+    uvec2 u_lightClusters[]; // first index, count
+};
+
+layout(binding = 6, std430) readonly buffer LightIndexBuffer
+{
+    uint u_lightIndices[];
+};
+
+// Returns the (first index, count) range of the lights affecting a fragment
+uvec2 get_light_cluster(vec2 fragCoord, float viewDepth)
+{
+    uvec2 tile = min(uvec2(fragCoord * invResolution * vec2(LIGHT_CLUSTERS_X, LIGHT_CLUSTERS_Y)), uvec2(LIGHT_CLUSTERS_X - 1u, LIGHT_CLUSTERS_Y - 1u));
+    uint slice = uint(clamp(log(max(viewDepth, 1e-4)) * u_clusterDepth.z + u_clusterDepth.w, 0.0, float(LIGHT_CLUSTERS_Z - 1u)));
+    uint viewOffset = uint(VIEW_INDEX) * LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y * LIGHT_CLUSTERS_Z; // eyes are stored back to back
+    return u_lightClusters[viewOffset + (slice * LIGHT_CLUSTERS_Y + tile.y) * LIGHT_CLUSTERS_X + tile.x];
+}
+
 vec2 get_shadow_offsets(vec3 N, vec3 L) 
 {
   float cos_alpha = clamp(dot(N, L), 0.0, 1.0);
@@ -135,6 +214,14 @@ vec4 calc_normal_map(vec3 normal, vec3 tangent, vec3 bitangent, vec3 sampledMap)
     return vec4(TBN * sampledMap, 1.0); 
 }
 
+// Tangent space normal from the first two channels of a normal map. The third is rebuilt rather than read,
+// so two channel (BC5) maps decode the same as three channel ones.
+vec3 unpack_normal_map(vec4 texel)
+{
+    vec2 xy = texel.xy * 2.0 - 1.0;
+    return vec3(xy, sqrt(max(1.0 - dot(xy, xy), 0.0)));
+}
+
 // Converts a Beckmann roughness parameter to a Phong specular power
 float roughness_to_specular_power(in float m) 
 {
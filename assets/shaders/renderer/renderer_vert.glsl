@@ -1,5 +1,12 @@
 #include "renderer_common.glsl"
 
+// The layer is only known once this stage has written it, so eyes are selected by instance here
+#ifdef INSTANCED_STEREO
+    #undef VIEW_INDEX
+    #define VIEW_INDEX (gl_InstanceID & 1)
+    flat out int v_layer; // for geometry stages, which must forward the layer themselves
+#endif
+
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inNormal;
 layout(location = 2) in vec3 inColor;
@@ -19,6 +26,10 @@ uniform vec2 u_texCoordScale = vec2(1, 1);
 
 void main()
 {
+#ifdef INSTANCED_STEREO
+    gl_Layer = VIEW_INDEX;
+    v_layer = VIEW_INDEX;
+#endif
     vec4 worldPosition = u_modelMatrix * vec4(inPosition, 1.0);
     gl_Position = u_viewProjMatrix * worldPosition;
     v_view_space_position = (u_modelViewMatrix * vec4(inPosition, 1.0)).xyz;
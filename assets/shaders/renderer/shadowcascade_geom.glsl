@@ -1,16 +1,19 @@
 #include "renderer_common.glsl"
 
-layout(triangles, invocations = 4) in; // one for each cascade
+layout(triangles, invocations = NUM_CASCADES) in; // one for each cascade
 layout(triangle_strip, max_vertices = 3) out;
 
 uniform mat4 u_cascadeViewMatrixArray[NUM_CASCADES];
 uniform mat4 u_cascadeProjMatrixArray[NUM_CASCADES];
+uniform int u_cascadeMask; // cascades the caster overlaps
 
 out float g_layer;
 out vec3 vs_position;
 
 void main() 
 {
+    if ((u_cascadeMask & (1 << gl_InvocationID)) == 0) return;
+
     for (int i = 0; i < gl_in.length(); ++i) 
     {
         vec4 pos = (u_cascadeViewMatrixArray[gl_InvocationID] * gl_in[i].gl_Position);
@@ -13,5 +13,9 @@ uniform sampler2D s_texture;
 
 void main()
 {   
+#ifdef LOD_CROSS_FADE
+    if (lod_fade_discard(gl_FragCoord.xy)) discard;
+#endif
+
     f_color = texture(s_texture, vec2(1 - v_texcoord.x, 1 - v_texcoord.y));
 }
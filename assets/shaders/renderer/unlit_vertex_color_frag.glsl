@@ -12,5 +12,9 @@ out vec4 f_color;
 
 void main()
 {   
+#ifdef LOD_CROSS_FADE
+    if (lod_fade_discard(gl_FragCoord.xy)) discard;
+#endif
+
     f_color = vec4(v_color, 1);
 }
@@ -28,5 +28,9 @@ vec4 wireframe(vec4 fill, vec4 stroke, float lineWidth)
 
 void main()
 {
+#ifdef LOD_CROSS_FADE
+    if (lod_fade_discard(gl_FragCoord.xy)) discard;
+#endif
+
     f_color = wireframe(vec4(0, 0, 0, 0), u_color, 1.33); 
 }
@@ -5,16 +5,27 @@ layout(triangle_strip, max_vertices = 3) out;
 
 out vec3 triangleDist;
 
+// A geometry stage replaces the layer written by the vertex stage, so forward it
+#ifdef INSTANCED_STEREO
+    flat in int v_layer[];
+    #define SET_LAYER() gl_Layer = v_layer[0]
+#else
+    #define SET_LAYER()
+#endif
+
 void main()
 {
+    SET_LAYER();
     gl_Position = gl_in[0].gl_Position;
     triangleDist = vec3(1, 0, 0);
     EmitVertex();
 
+    SET_LAYER();
     gl_Position = gl_in[1].gl_Position;
     triangleDist = vec3(0, 1, 0);
     EmitVertex();
     
+    SET_LAYER();
     gl_Position = gl_in[2].gl_Position;
     triangleDist = vec3(0, 0, 1);
     EmitVertex();
@@ -16,7 +16,6 @@ vec3 HosekWilkie(float cos_theta, float gamma, float cos_gamma)
 
 // clean this up to use shader include
 
-const int MAX_POINT_LIGHTS = 4;
 const int NUM_CASCADES = 2;
 
 struct DirectionalLight
@@ -36,9 +35,9 @@ struct PointLight
 layout(binding = 0, std140) uniform PerScene
 {
     DirectionalLight u_directionalLight;
-    PointLight u_pointLights[MAX_POINT_LIGHTS];
     float u_time;
     int u_activePointLights;
+    int sunlightActive;
     vec2 resolution;
     vec2 invResolution;
     vec4 u_cascadesPlane[NUM_CASCADES];
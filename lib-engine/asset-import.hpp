@@ -5,6 +5,7 @@
 
 #include "environment.hpp"
 #include "asset-resolver.hpp"
+#include "mesh-lod.hpp"
 
 namespace polymer
 {
@@ -67,8 +68,7 @@ namespace polymer
 
             const std::string handle_id = name_no_ext + "/" + m.first;
 
-            create_handle_for_asset(handle_id.c_str(), make_mesh_from_geometry(mesh));
-            create_handle_for_asset(handle_id.c_str(), std::move(mesh));
+            create_mesh_assets_with_lods(handle_id, std::move(mesh));
 
             if (num_models == 1) created_entities.push_back(create_model(handle_id, handle_id, env, orch));
             else children.push_back(create_model(handle_id, handle_id, env, orch));
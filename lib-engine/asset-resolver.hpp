@@ -11,8 +11,8 @@
  * (todo) Presently we assume that all handle identifiers refer to unique assets, however this is a weak
  * assumption and is likely untrue in practice and should be fixed.
  *
- * (todo) The asset_resolver is single-threaded and called on the main thread because it may also
- * touch GPU resources. This must be changed to load asynchronously. 
+ * Images are decoded (or cooked) on the workers of an `image_decode_service` and uploaded on the calling
+ * thread as they complete. (todo) Meshes are still imported on the main thread, one at a time.
  */
 
 #pragma once
@@ -29,6 +29,8 @@
 #include "system-render.hpp"
 
 #include "../lib-model-io/model-io.hpp"
+#include "mesh-lod.hpp"
+#include "image-decode.hpp"
 #include "json.hpp"
 
 namespace polymer
@@ -59,9 +61,22 @@ namespace polymer
         std::vector<std::string> shader_names;
         std::vector<std::string> material_names;
         std::vector<std::string> texture_names;
+        std::unordered_map<std::string, texture_map_type> texture_types;   // by the first material slot a texture was found in
+
+        std::shared_ptr<texture_cook_cache> cook_cache;
+        std::unique_ptr<image_decode_service> decoder;
+
+        void add_texture(const texture_handle & handle, const texture_map_type type)
+        {
+            texture_names.push_back(handle.name);
+            texture_types.insert({ handle.name, type });
+        }
 
         // fixme - what to do if we find multiples? 
-        void walk_directory(path root)
+        // Images are handed to `streamer` when there is one; their handles are assigned once the low mips are resident.
+        // With compression enabled, the cooked version of an image is loaded in its place. Other images are decoded
+        // in parallel and assigned by the time this returns.
+        void walk_directory(path root, texture_streamer * streamer)
         {
             scoped_timer t("load + resolve");
 
@@ -83,8 +98,30 @@ namespace polymer
                     {
                         if (name == filename_no_ext)
                         {
-                            create_handle_for_asset(name.c_str(), load_image(path, false));
-                            log::get()->engine_log->info("resolved {} ({})", name, typeid(gl_texture_2d).name());
+                            const texture_map_type type = texture_types[name];
+
+                            if (streamer)
+                            {
+                                streamer->add(name, path, type, cook_cache);
+                                log::get()->engine_log->info("streaming {} ({})", name, typeid(gl_texture_2d).name());
+                            }
+                            else if (cook_cache)
+                            {
+                                std::shared_ptr<const texture_cook_cache> cooker = cook_cache;
+                                decoder->run<gli::texture2d>(name, [cooker, path, type]() { return cooker->load_or_cook(path, type); }, [name](gli::texture2d & cooked)
+                                {
+                                    create_handle_for_asset(name.c_str(), load_compressed_texture(cooked));
+                                    log::get()->engine_log->info("resolved {} ({})", name, typeid(gl_texture_2d).name());
+                                });
+                            }
+                            else
+                            {
+                                decoder->decode(path, false, [name](decoded_image & image)
+                                {
+                                    create_handle_for_asset(name.c_str(), upload_image(image));
+                                    log::get()->engine_log->info("resolved {} ({})", name, typeid(gl_texture_2d).name());
+                                });
+                            }
                         }
                     }
                 }
@@ -108,19 +145,28 @@ namespace polymer
 
                                 const std::string handle_id = filename_no_ext + "/" + m.first;
 
-                                create_handle_for_asset(handle_id.c_str(), make_mesh_from_geometry(mesh));
-                                create_handle_for_asset(handle_id.c_str(), std::move(mesh));
+                                create_mesh_assets_with_lods(handle_id, std::move(mesh));
 
                                 log::get()->engine_log->info("resolved {} ({})", handle_id, typeid(gl_mesh).name());
                             }
                         }
                     }
                 }
+
+                // Uploads whatever has been decoded meanwhile
+                decoder->process_completions();
             }
+
+            decoder->finish();
         }
 
     public:
 
+        // Cooking encodes every image on its first load, which the encoders of texture-cook.hpp are too slow for
+        // outside of tools and editors, so it is opt in. A relative cookDirectory is taken from the asset directory.
+        bool compressTextures{ false };                 // cook images into block compressed textures (see texture-cook.hpp)
+        std::string cookDirectory{ "texture-cache" };
+
         void resolve(const std::string & asset_dir, environment * scene, material_library * library)
         {
             assert(scene != nullptr);
@@ -148,28 +194,36 @@ namespace polymer
                 {
                     shader_names.push_back(pbr->shader.name);
 
-                    texture_names.push_back(pbr->albedo.name);
-                    texture_names.push_back(pbr->normal.name);
-                    texture_names.push_back(pbr->metallic.name);
-                    texture_names.push_back(pbr->roughness.name);
-                    texture_names.push_back(pbr->emissive.name);
-                    texture_names.push_back(pbr->height.name);
-                    texture_names.push_back(pbr->occlusion.name);
+                    add_texture(pbr->albedo, texture_map_type::color);
+                    add_texture(pbr->normal, texture_map_type::normal);
+                    add_texture(pbr->metallic, texture_map_type::scalar);
+                    add_texture(pbr->roughness, texture_map_type::scalar);
+                    add_texture(pbr->emissive, texture_map_type::color);
+                    add_texture(pbr->height, texture_map_type::scalar);
+                    add_texture(pbr->occlusion, texture_map_type::scalar);
                 }
 
                 if (auto * phong = dynamic_cast<polymer_blinn_phong_standard*>(mat.second.get()))
                 {
                     shader_names.push_back(phong->shader.name);
 
-                    texture_names.push_back(phong->diffuse.name);
-                    texture_names.push_back(phong->normal.name);
+                    add_texture(phong->diffuse, texture_map_type::color);
+                    add_texture(phong->normal, texture_map_type::normal);
                 }
             }
 
             remove_duplicates(shader_names);
             remove_duplicates(texture_names);
 
-            walk_directory(asset_dir);
+            if (compressTextures && !cook_cache)
+            {
+                const path cookPath(cookDirectory);
+                cook_cache = std::make_shared<texture_cook_cache>((cookPath.is_absolute() ? cookPath : path(asset_dir) / cookPath).string());
+            }
+            if (!decoder) decoder.reset(new image_decode_service());
+
+            pbr_renderer * renderer = scene->render_system->get_renderer();
+            walk_directory(asset_dir, renderer ? renderer->get_texture_streamer() : nullptr);
         }
     };
 
@@ -6,68 +6,36 @@
 #include "math-core.hpp"
 #include "bullet_utils.hpp"
 #include "gl-api.hpp"
+#include "renderer-debug.hpp"
 
 #include "stb/stb_easy_font.h"
 #include "btBulletCollisionCommon.h"
 
 namespace polymer
 {
+    // Lines, boxes, spheres and transforms from bullet are recorded as the shapes of a renderer_debug, so every
+    // collider in the world is drawn with a few instanced draws rather than tessellated into lines by bullet
     class physics_visualizer : public btIDebugDraw
     {
-        constexpr const static char debugVertexShader[] = R"(#version 330
-            layout(location = 0) in vec3 vertex;
-            layout(location = 1) in vec3 color;
-            uniform mat4 u_mvp;
-            out vec3 outColor;
-            void main()
-            {
-                gl_Position = u_mvp * vec4(vertex.xyz, 1);
-                outColor = color;
-            }
-        )";
-
-        constexpr static const char debugFragmentShader[] = R"(#version 330
-            in vec3 outColor;
-            out vec4 f_color;
-            void main()
-            {
-                f_color = vec4(outColor.rgb, 1);
-            }
-        )";
-
         std::vector<std::pair<float3, std::string>> text;
-        struct Vertex { float3 position; float3 color; };
-        std::vector<Vertex> vertices;
-        gl_mesh debugMesh;
-        gl_shader debugShader;
+        renderer_debug debug;
 
         int debugMode = 0;
         bool hasNewInfo{ false };
 
     public:
 
-        physics_visualizer()
-        {
-            debugShader = gl_shader(debugVertexShader, debugFragmentShader);
-        }
+        physics_visualizer() = default;
 
         void draw(const float4x4 & viewProj)
         {
-            debugMesh.set_vertices(vertices.size(), vertices.data(), GL_DYNAMIC_DRAW);
-            debugMesh.set_attribute(0, &Vertex::position);
-            debugMesh.set_attribute(1, &Vertex::color);
-            debugMesh.set_non_indexed(GL_LINES);
-
-            debugShader.bind();
-            debugShader.uniform("u_mvp", viewProj);
-            debugMesh.draw_elements();
-            debugShader.unbind();
+            debug.draw(viewProj);
         }
 
         void clear()
         {
             text.clear();
-            vertices.clear();
+            debug.clear();
         }
 
         void drawContactPoint(const btVector3 & pointOnB, const btVector3 & normalOnB, btScalar distance, int lifeTime, const btVector3 & color)
@@ -77,8 +45,37 @@ namespace polymer
 
         void drawLine(const btVector3 & from, const btVector3 & to, const btVector3 & color)
         {
-            vertices.push_back({ from_bt(from), from_bt(color) });
-            vertices.push_back({ from_bt(to), from_bt(color) });
+            debug.draw_line(from_bt(from), from_bt(to), from_bt(color));
+        }
+
+        void drawSphere(btScalar radius, const btTransform & transform, const btVector3 & color) override
+        {
+            debug.draw_sphere(make_pose(transform), radius, from_bt(color));
+        }
+
+        void drawSphere(const btVector3 & p, btScalar radius, const btVector3 & color) override
+        {
+            debug.draw_sphere(transform(from_bt(p)), radius, from_bt(color));
+        }
+
+        void drawBox(const btVector3 & bbMin, const btVector3 & bbMax, const btVector3 & color) override
+        {
+            debug.draw_box(aabb_3d(from_bt(bbMin), from_bt(bbMax)), from_bt(color));
+        }
+
+        void drawBox(const btVector3 & bbMin, const btVector3 & bbMax, const btTransform & trans, const btVector3 & color) override
+        {
+            debug.draw_box(make_pose(trans), aabb_3d(from_bt(bbMin), from_bt(bbMax)), from_bt(color));
+        }
+
+        void drawAabb(const btVector3 & from, const btVector3 & to, const btVector3 & color) override
+        {
+            debug.draw_box(aabb_3d(from_bt(from), from_bt(to)), from_bt(color));
+        }
+
+        void drawTransform(const btTransform & transform, btScalar orthoLen) override
+        {
+            debug.draw_axis(make_pose(transform), float3(1, 1, 1), orthoLen);
         }
 
         void draw3dText(const btVector3 & position, const char * textString)
@@ -0,0 +1,83 @@
+/*
+ * Dynamic resolution. Render targets are allocated once at the full render size and every frame draws into
+ * a viewport scaled down from it, so changing the scale never reallocates anything; the post pass then
+ * stretches that viewport over the full size output.
+ *
+ * The scale is driven by a PI controller toward a gpu frame time budget. Frame times are measured with
+ * timer queries and arrive a few frames late, which is why the gains are small: the controller has to
+ * tolerate its own corrections showing up with a delay. It is written in velocity form, moving the scale
+ * by the change of the error and by the error itself, so clamping the scale never winds anything up.
+ * Nothing here touches the GPU.
+ */
+
+#pragma once
+
+#ifndef polymer_dynamic_resolution_hpp
+#define polymer_dynamic_resolution_hpp
+
+#include "math-core.hpp"
+#include <algorithm>
+
+namespace polymer
+{
+    ///////////////////////////////////////
+    //   dynamic_resolution_controller   //
+    ///////////////////////////////////////
+
+    class dynamic_resolution_controller
+    {
+        float scale{ 1.f };
+        float previousError{ 0.f };
+        bool hasSample{ false };
+
+    public:
+
+        float budgetMs{ 11.1f };            // gpu time a frame should take
+        float proportionalGain{ 0.2f };     // scale change per change of the relative error
+        float integralGain{ 0.05f };        // scale change per frame of relative error
+        float minScale{ 0.5f };
+        float maxScale{ 1.f };
+
+        // Feeds the gpu time of one frame and returns the new scale of the viewport's width and height
+        float update(const float gpuMs)
+        {
+            // Relative headroom, positive when under budget. Clamped so that a single hitch cannot
+            // drop straight to the minimum scale.
+            const float error = std::min<float>(std::max<float>((budgetMs - gpuMs) / budgetMs, -1.f), 1.f);
+
+            const float delta = hasSample ? error - previousError : 0.f;
+            scale = std::min<float>(std::max<float>(scale + proportionalGain * delta + integralGain * error, minScale), maxScale);
+
+            previousError = error;
+            hasSample = true;
+            return scale;
+        }
+
+        void reset()
+        {
+            scale = maxScale;
+            previousError = 0.f;
+            hasSample = false;
+        }
+
+        float get_scale() const { return scale; }
+    };
+
+    // Size of the viewport drawn at `scale`, rounded to a multiple of `granularity` pixels so that small
+    // corrections of the scale do not change the viewport every frame
+    inline uint2 scaled_viewport(const uint2 maxSize, const float scale, const uint32_t granularity = 8)
+    {
+        if (scale >= 1.f) return maxSize;
+
+        uint2 size;
+        for (int i = 0; i < 2; ++i)
+        {
+            const uint32_t rounded = static_cast<uint32_t>(std::round(maxSize[i] * scale / granularity)) * granularity;
+            size[i] = std::min<uint32_t>(std::max<uint32_t>(rounded, granularity), maxSize[i]);
+        }
+        return size;
+    }
+
+} // end namespace polymer
+
+#endif // end polymer_dynamic_resolution_hpp
@@ -13,58 +13,6 @@
 
 namespace polymer
 {
-    ///////////////////////////////////////
-    //   Compile-Time Constant Hashing   //
-    ///////////////////////////////////////
-
-    // https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
-    using poly_hash_value = uint64_t;
-    constexpr poly_hash_value hash_offset_basis = 0x84222325;
-    constexpr poly_hash_value hash_prime_multiplier = 0x000001b3;
-
-    namespace detail
-    {
-        // Helper function for performing the recursion for the compile time hash.
-        template <std::size_t N>
-        inline constexpr poly_hash_value const_hash(const char(&str)[N], int start, poly_hash_value hash)
-        {
-            // Perform the static_cast to uint64_t otherwise MSVC complains, about integral constant overflow (warning C4307).
-            return (start == N || start == N - 1) ? hash : const_hash(str, start + 1, static_cast<poly_hash_value>((hash ^ static_cast<unsigned char>(str[start])) * static_cast<uint64_t>(hash_prime_multiplier)));
-        }
-    }  // namespace detail
-
-    // Compile-time hash function.
-    template <std::size_t N>
-    inline constexpr poly_hash_value const_hash(const char(&str)[N])
-    {
-        return N <= 1 ? 0 : detail::const_hash(str, 0, hash_offset_basis);
-    }
-
-    inline poly_hash_value hash(poly_hash_value basis, const char * str, size_t len)
-    {
-        if (str == nullptr || *str == 0 || len == 0) return 0;
-
-        size_t count = 0;
-        poly_hash_value value = basis;
-        while (*str && count < len)
-        {
-            value = (value ^ static_cast<unsigned char>(*str++)) * hash_prime_multiplier;
-            ++count;
-        }
-        return value;
-    }
-
-    inline poly_hash_value hash(const char * str, size_t len)
-    {
-        return hash(hash_offset_basis, str, len);
-    }
-
-    inline poly_hash_value hash(const char * str)
-    {
-        const size_t npos = -1;
-        return hash(str, npos);
-    }
-
     // Functor for hashable types in STL containers.
     struct hasher
     {
@@ -0,0 +1,140 @@
+#include "entity-picking.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+
+using namespace polymer;
+
+namespace
+{
+    bool fence_signaled(const GLsync fence)
+    {
+        // Flushed so the fence of a copy issued this frame is certain to be reached
+        const GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        return result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED;
+    }
+}
+
+std::vector<uint32_t> polymer::collect_pick_ids(const uint32_t * ids, const size_t count)
+{
+    std::unordered_map<uint32_t, size_t> coverage;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (ids[i]) ++coverage[ids[i]];
+    }
+
+    std::vector<std::pair<uint32_t, size_t>> sorted(coverage.begin(), coverage.end());
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<uint32_t, size_t> & a, const std::pair<uint32_t, size_t> & b)
+    {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+
+    std::vector<uint32_t> result;
+    result.reserve(sorted.size());
+    for (const auto & s : sorted) result.push_back(s.first);
+    return result;
+}
+
+pick_region polymer::map_pick_region(const pick_region & region, const int2 renderSize, const int2 viewportSize)
+{
+    const float2 scale = float2(viewportSize) / float2(max(renderSize, int2(1, 1)));
+
+    // Widened to whole texels, so a region of a single pixel always covers at least one
+    int2 lo = int2(static_cast<int>(std::floor(region.min.x * scale.x)), static_cast<int>(std::floor(region.min.y * scale.y)));
+    int2 hi = int2(static_cast<int>(std::ceil(region.max.x * scale.x)), static_cast<int>(std::ceil(region.max.y * scale.y)));
+    lo = clamp(lo, int2(0, 0), viewportSize);
+    hi = clamp(hi, lo, viewportSize);
+
+    // Rows are counted from the bottom of the target
+    pick_region texels;
+    texels.min = int2(lo.x, viewportSize.y - hi.y);
+    texels.max = int2(hi.x, viewportSize.y - lo.y);
+    return texels;
+}
+
+///////////////////////
+//   entity_picker   //
+///////////////////////
+
+entity_picker::~entity_picker()
+{
+    for (auto & s : slots) if (s.fence) glDeleteSync(s.fence);
+}
+
+uint32_t entity_picker::request(const pick_region & region)
+{
+    queued.push_back({ nextRequest, region });
+    return nextRequest++;
+}
+
+void entity_picker::capture(const GLuint framebuffer, const int2 renderSize, const int2 viewportSize, const std::vector<entity> & componentEntities)
+{
+    gl_state().bind_framebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+
+    size_t taken = 0;
+    for (auto & slot : slots)
+    {
+        if (taken == queued.size()) break;
+        if (slot.fence) continue;
+
+        const queued_request & q = queued[taken++];
+        const pick_region texelRegion = map_pick_region(q.region, renderSize, viewportSize);
+        const int2 size = texelRegion.max - texelRegion.min;
+
+        slot.request = q.request;
+        slot.region = q.region;
+        slot.texelCount = size_t(size.x) * size.y;
+        slot.entities = componentEntities;
+
+        if (slot.texelCount)
+        {
+            const GLsizeiptr bytes = static_cast<GLsizeiptr>(slot.texelCount * sizeof(uint32_t));
+            if (slot.buffer.size < bytes) slot.buffer.set_buffer_data(bytes, nullptr, GL_STREAM_READ);
+
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+            glReadPixels(texelRegion.min.x, texelRegion.min.y, size.x, size.y, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+
+        // Regions outside of the target are answered too, with no entities
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    queued.erase(queued.begin(), queued.begin() + taken);
+
+    gl_check_error(__FILE__, __LINE__);
+}
+
+void entity_picker::poll(std::vector<entity_pick_result> & results)
+{
+    const size_t first = results.size();
+
+    for (auto & slot : slots)
+    {
+        if (!slot.fence || !fence_signaled(slot.fence)) continue;
+
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+
+        entity_pick_result r;
+        r.request = slot.request;
+        r.region = slot.region;
+
+        if (slot.texelCount)
+        {
+            texels.resize(slot.texelCount);
+            glGetNamedBufferSubDataEXT(slot.buffer, 0, texels.size() * sizeof(uint32_t), texels.data());
+
+            for (const uint32_t id : collect_pick_ids(texels.data(), texels.size()))
+            {
+                if (id <= slot.entities.size() && slot.entities[id - 1] != kInvalidEntity) r.entities.push_back(slot.entities[id - 1]);
+            }
+        }
+
+        slot.entities.clear();
+        results.push_back(std::move(r));
+    }
+
+    // Slots complete in the order they were issued, but are not visited in that order
+    std::sort(results.begin() + first, results.end(), [](const entity_pick_result & a, const entity_pick_result & b) { return a.request < b.request; });
+}
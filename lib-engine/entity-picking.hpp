@@ -0,0 +1,94 @@
+/*
+ * Picking from an id buffer. While picks are requested, the renderer draws the visible objects of its first
+ * view into a single-sampled R32UI target, each writing one plus the index of its render component in the
+ * frame's payload, so zero is left where nothing was drawn. The requested regions of that target are copied
+ * into a ring of pixel buffers in the same frame and fenced. poll() picks each copy up once its fence has
+ * signaled, usually a frame later, and maps the ids back to entities through the list of components the
+ * frame was drawn with; the cpu never waits on the gpu, and picking needs neither cpu geometry nor colliders.
+ */
+
+#pragma once
+
+#ifndef polymer_entity_picking_hpp
+#define polymer_entity_picking_hpp
+
+#include "math-core.hpp"
+#include "gl-api.hpp"
+#include "ecs/core-ecs.hpp"
+
+namespace polymer
+{
+    // Pixels of the render size with the origin at the top left, as cursor positions are; `max` is exclusive
+    struct pick_region
+    {
+        int2 min;
+        int2 max;
+    };
+
+    struct entity_pick_result
+    {
+        uint32_t request;
+        pick_region region;
+        std::vector<entity> entities;   // distinct, the one covering the most pixels first
+    };
+
+    // Distinct non-zero ids among `count` texels, by the number of texels holding them and then by id
+    std::vector<uint32_t> collect_pick_ids(const uint32_t * ids, const size_t count);
+
+    // Texels of the id target covering `region`, clamped to it, with the bottom left origin of the target.
+    // Frames drawn at a reduced resolution fill the lower left `viewportSize` texels of a `renderSize` target.
+    pick_region map_pick_region(const pick_region & region, const int2 renderSize, const int2 viewportSize);
+
+    ///////////////////////
+    //   entity_picker   //
+    ///////////////////////
+
+    class entity_picker
+    {
+        static const uint32_t ring_slots = 3;
+
+        struct readback_slot
+        {
+            gl_buffer buffer;
+            GLsync fence{ nullptr };
+            uint32_t request{ 0 };
+            pick_region region;
+            size_t texelCount{ 0 };
+            std::vector<entity> entities;   // of the components drawn in the frame of the copy
+        };
+
+        struct queued_request
+        {
+            uint32_t request;
+            pick_region region;
+        };
+
+        std::vector<queued_request> queued;
+        readback_slot slots[ring_slots];
+        uint32_t nextRequest{ 1 };
+        std::vector<uint32_t> texels;
+
+    public:
+
+        entity_picker() = default;
+        ~entity_picker();
+
+        entity_picker(const entity_picker &) = delete;
+        entity_picker & operator = (const entity_picker &) = delete;
+
+        // Queues a pick of the entities drawn within `region` by the next frame; returns the id of the request
+        uint32_t request(const pick_region & region);
+        bool has_requests() const { return !queued.empty(); }
+
+        // Called by the renderer after drawing ids into the color attachment of `framebuffer`. Queues the copy
+        // of as many requests as there are free slots; the rest wait for a later frame. `componentEntities`
+        // holds the entity of every render component, indexed as the ids were written.
+        void capture(const GLuint framebuffer, const int2 renderSize, const int2 viewportSize, const std::vector<entity> & componentEntities);
+
+        // Appends the results of the copies whose fences have signaled; never waits
+        void poll(std::vector<entity_pick_result> & results);
+    };
+
+} // end namespace polymer
+
+#endif // end polymer_entity_picking_hpp
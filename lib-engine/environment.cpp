@@ -17,6 +17,7 @@ render_component polymer::assemble_render_component(environment & env, const ent
     r.mesh = env.render_system->get_mesh_component(e);
     r.world_transform = env.xform_system->get_world_transform(e);
     r.local_transform = env.xform_system->get_local_transform(e);
+    if (env.collision_system) r.geometry = env.collision_system->get_component(e);
     return r;
 }
 
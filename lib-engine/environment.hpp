@@ -151,7 +151,9 @@ namespace polymer
         mesh_component(entity e) : base_component(e) {}
         mesh_component(entity e, gpu_mesh_handle handle) : base_component(e), mesh(handle) {}
         void set_mesh_render_mode(const GLenum mode) { if (mode != GL_TRIANGLE_STRIP) mesh.get().set_non_indexed(mode); }
-        void draw() const { mesh.get().draw_elements(); }
+        void draw(const int instances = 0, const uint32_t lod = 0) const { mesh.get().draw_elements(instances, lod); }
+        void draw_indirect(const GLintptr offset, const uint32_t lod = 0) const { mesh.get().draw_indirect(offset, lod); }
+        gl_draw_indirect_command get_indirect_command(const uint32_t instances = 1, const uint32_t lod = 0) const { return mesh.get().get_indirect_command(instances, lod); }
     };
     POLYMER_SETUP_TYPEID(mesh_component);
 
@@ -178,6 +180,7 @@ namespace polymer
         material_handle material{ material_library::kDefaultMaterialId };
         bool receive_shadow{ true };
         bool cast_shadow{ true };
+        bool static_caster{ false }; // never moves, so its shadow can be cached
         material_component() {};
         material_component(entity e) : base_component(e) {}
         material_component(entity e, material_handle handle) : base_component(e), material(handle) {}
@@ -188,6 +191,7 @@ namespace polymer
         f("material_handle", o.material);
         f("receive_shadow", o.receive_shadow);
         f("cast_shadow", o.cast_shadow);
+        f("static_caster", o.static_caster);
     }
 
     inline void to_json(json & j, const material_component & p) {
@@ -196,6 +200,7 @@ namespace polymer
 
     inline void from_json(const json & archive, material_component & m) {
         visit_fields(m, [&archive](const char * name, auto & field, auto... metadata) {
+            if (!archive.count(name)) return; // "static_caster" is missing from older scenes
             field = archive.at(name).get<std::remove_reference_t<decltype(field)>>();
         });
     };
@@ -208,6 +213,7 @@ namespace polymer
     struct geometry_component : public base_component
     {
         cpu_mesh_handle geom;
+        bool occluder{ false }; // authored as a low-poly occlusion proxy; always rasterized by the occlusion culler
         geometry_component() {};
         geometry_component(entity e) : base_component(e) {}
         geometry_component(entity e, cpu_mesh_handle handle) : base_component(e), geom(handle) {}
@@ -216,6 +222,7 @@ namespace polymer
 
     template<class F> void visit_fields(geometry_component & o, F f) {
         f("cpu_mesh_handle", o.geom);
+        f("occluder", o.occluder);
     }
 
     inline void to_json(json & j, const geometry_component & p) {
@@ -224,6 +231,7 @@ namespace polymer
 
     inline void from_json(const json & archive, geometry_component & m) {
         visit_fields(m, [&archive](const char * name, auto & field, auto... metadata) {
+            if (!archive.count(name)) return; // "occluder" is missing from older scenes
             field = archive.at(name).get<std::remove_reference_t<decltype(field)>>();
         });
     };
@@ -344,6 +352,7 @@ namespace polymer
         polymer::mesh_component * mesh{ nullptr };
         const polymer::world_transform_component * world_transform{ nullptr };
         const polymer::local_transform_component * local_transform{ nullptr };
+        const polymer::geometry_component * geometry{ nullptr }; // optional, for occlusion culling
     };
     POLYMER_SETUP_TYPEID(render_component);
 
@@ -353,6 +362,7 @@ namespace polymer
         f("mesh_component", o.mesh);
         f("world_transform_component", o.world_transform);
         f("local_transform_component", o.local_transform);
+        f("geometry_component", o.geometry);
     }
 
     class render_system;;
@@ -0,0 +1,114 @@
+#include "fused-resolve.hpp"
+
+#include <algorithm>
+
+using namespace polymer;
+
+namespace
+{
+    const uint64_t texel_bytes = 4; // rgba8
+
+    // Each invocation writes one output texel. The color math mirrors post_tonemap_frag.glsl, which samples
+    // the resolved texture with `u_uvScale` and `u_uvMax`; when the viewport is smaller than the output the
+    // four resolved texels of that bilinear footprint are resolved here instead.
+    constexpr const char fused_resolve_comp[] = R"(
+        layout(local_size_x = 8, local_size_y = 8) in;
+
+        #if LAYERED
+        layout(binding = 0) uniform sampler2DMSArray s_color;
+        #else
+        layout(binding = 0) uniform sampler2DMS s_color;
+        #endif
+        layout(rgba8, binding = 0) uniform writeonly image2D u_output;
+        uniform int u_layer;
+        uniform int u_samples;
+        uniform ivec2 u_viewport;
+        uniform float u_exposure = 1.0;
+
+        vec3 resolve(ivec2 p)
+        {
+            p = clamp(p, ivec2(0), u_viewport - 1);
+
+            vec3 sum = vec3(0.0);
+            for (int s = 0; s < u_samples; ++s)
+            {
+                #if LAYERED
+                sum += texelFetch(s_color, ivec3(p, u_layer), s).rgb;
+                #else
+                sum += texelFetch(s_color, p, s).rgb;
+                #endif
+            }
+            return sum / float(u_samples);
+        }
+
+        void main()
+        {
+            ivec2 outputSize = imageSize(u_output);
+            ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+            if (any(greaterThanEqual(p, outputSize))) return;
+
+            vec3 color;
+            if (u_viewport == outputSize) color = resolve(p);
+            else
+            {
+                vec2 uvScale = vec2(u_viewport) / vec2(outputSize);
+                vec2 uvMax = (vec2(u_viewport) - 0.5) / vec2(outputSize);
+                vec2 uv = min((vec2(p) + 0.5) / vec2(outputSize) * uvScale, uvMax);
+
+                vec2 texel = uv * vec2(outputSize) - 0.5;
+                ivec2 base = ivec2(floor(texel));
+                vec2 f = texel - vec2(base);
+
+                vec3 bottom = mix(resolve(base), resolve(base + ivec2(1, 0)), f.x);
+                vec3 top = mix(resolve(base + ivec2(0, 1)), resolve(base + ivec2(1, 1)), f.x);
+                color = mix(bottom, top, f.y);
+            }
+
+            imageStore(u_output, p, vec4(color * u_exposure, 1.0));
+        }
+    )";
+}
+
+resolve_traffic polymer::estimate_resolve_traffic(const uint2 viewport, const uint2 outputSize, const uint32_t samples)
+{
+    const uint64_t drawn = uint64_t(viewport.x) * viewport.y * texel_bytes;
+    const uint64_t output = uint64_t(outputSize.x) * outputSize.y * texel_bytes;
+    const uint64_t multisampled = drawn * std::max<uint32_t>(samples, 1);
+
+    resolve_traffic t;
+    t.fusedBytes = multisampled + output;
+    t.separateBytes = (multisampled + drawn) + (drawn + output);   // blit, then full-screen pass
+    return t;
+}
+
+////////////////////////////
+//   fused_resolve_pass   //
+////////////////////////////
+
+bool fused_resolve_pass::is_supported(const uint32_t samples)
+{
+    return samples > 0 && (GLAD_GL_VERSION_4_3 || GLAD_GL_ARB_compute_shader);
+}
+
+void fused_resolve_pass::execute(const GLuint colorTexture, const int layer, const uint32_t samples, const uint2 viewport,
+    const GLuint outputTexture, const uint2 outputSize, const float exposure)
+{
+    const bool layered = layer >= 0;
+    gl_shader_compute & program = programs[layered];
+    if (!program.handle())
+    {
+        program = gl_shader_compute(std::string("#version 450\n#define LAYERED ") + (layered ? "1" : "0") + "\n" + fused_resolve_comp);
+    }
+
+    gl_state().bind_texture(0, layered ? GL_TEXTURE_2D_MULTISAMPLE_ARRAY : GL_TEXTURE_2D_MULTISAMPLE, colorTexture);
+    program.uniform("u_layer", std::max(layer, 0));
+    program.uniform("u_samples", static_cast<int>(samples));
+    program.uniform("u_viewport", int2(viewport));
+    program.uniform("u_exposure", exposure);
+
+    glBindImageTexture(0, outputTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+    program.dispatch((outputSize.x + 7) / 8, (outputSize.y + 7) / 8, 1);
+
+    // The output is sampled, drawn over or copied by whatever consumes the frame
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+}
@@ -0,0 +1,63 @@
+/*
+ * Fused resolve. The default output path of a view blits its multisampled color into a single sampled
+ * texture, then draws a full-screen quad that reads it back to tonemap it into the view's output, so the
+ * resolved image makes a round trip through memory between the two. The fused path does both in a single
+ * compute dispatch: every invocation averages the samples of its texel, applies exposure and tonemapping
+ * and stores the final color, leaving only the multisampled read and the output write. Depth cannot be
+ * written through an image and is still resolved with a depth-only blit.
+ *
+ * The output matches the full-screen pass, including the bilinear stretch of a viewport drawn below the
+ * render size under dynamic resolution. Both paths are timed by the renderer's profiler; the memory each
+ * one moves is estimated by estimate_resolve_traffic().
+ */
+
+#pragma once
+
+#ifndef polymer_fused_resolve_hpp
+#define polymer_fused_resolve_hpp
+
+#include "math-core.hpp"
+#include "gl-api.hpp"
+
+namespace polymer
+{
+    // Bytes read and written by the color resolve and tonemap of the views of a frame, by either path
+    struct resolve_traffic
+    {
+        uint64_t fusedBytes{ 0 };
+        uint64_t separateBytes{ 0 };    // blit, then full-screen pass
+
+        resolve_traffic & operator += (const resolve_traffic & r)
+        {
+            fusedBytes += r.fusedBytes;
+            separateBytes += r.separateBytes;
+            return *this;
+        }
+    };
+
+    // Estimate for one view drawn into the lower left `viewport` texels of rgba8 targets, ignoring caches
+    // and framebuffer compression
+    resolve_traffic estimate_resolve_traffic(const uint2 viewport, const uint2 outputSize, const uint32_t samples);
+
+    ////////////////////////////
+    //   fused_resolve_pass   //
+    ////////////////////////////
+
+    class fused_resolve_pass
+    {
+        gl_shader_compute programs[2];  // for 2d and array multisampled textures, created when first used
+
+    public:
+
+        // Compute shaders and multisampled color to resolve
+        static bool is_supported(const uint32_t samples);
+
+        // Resolves the lower left `viewport` texels of `colorTexture` (a layer of it if `layer` is zero or more)
+        // into all of the rgba8 `outputTexture`
+        void execute(const GLuint colorTexture, const int layer, const uint32_t samples, const uint2 viewport,
+            const GLuint outputTexture, const uint2 outputSize, const float exposure);
+    };
+
+} // end namespace polymer
+
+#endif // end polymer_fused_resolve_hpp
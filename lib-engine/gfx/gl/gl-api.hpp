@@ -4,6 +4,7 @@
 #define polymer_gl_api_hpp
 
 #include "glfw-app.hpp"
+#include "gl-state-cache.hpp"
 #include <map>
 #include <unordered_map>
 #include <string>
@@ -133,6 +134,38 @@ namespace
         default: throw std::logic_error("unknown element type"); break;
         }
     }
+
+    // Walks the active (non-block) uniforms of a linked program via the program interface query API and
+    // records their locations keyed by the same FNV hash used by `polymer::const_hash`. Array uniforms are
+    // reported as `name[0]`, so they are additionally registered under their base name.
+    inline void reflect_uniform_locations(GLuint program, std::unordered_map<polymer::poly_hash_value, GLint> & locations)
+    {
+        locations.clear();
+
+        GLint numUniforms = 0;
+        glGetProgramInterfaceiv(program, GL_UNIFORM, GL_ACTIVE_RESOURCES, &numUniforms);
+
+        const GLenum properties[3] = { GL_BLOCK_INDEX, GL_LOCATION, GL_NAME_LENGTH };
+
+        for (GLint i = 0; i < numUniforms; ++i)
+        {
+            GLint values[3];
+            glGetProgramResourceiv(program, GL_UNIFORM, i, 3, properties, 3, nullptr, values);
+            if (values[0] != -1 || values[1] == -1) continue; // skip uniform block members
+
+            std::vector<char> name(values[2]);
+            glGetProgramResourceName(program, GL_UNIFORM, i, static_cast<GLsizei>(name.size()), nullptr, name.data());
+
+            std::string uniformName(name.data());
+            locations[polymer::hash(uniformName.c_str(), uniformName.size())] = values[1];
+
+            const size_t arrayBracket = uniformName.find("[0]");
+            if (arrayBracket != std::string::npos)
+            {
+                locations[polymer::hash(uniformName.c_str(), arrayBracket)] = values[1];
+            }
+        }
+    }
 }
 
 template<typename factory_t>
@@ -151,11 +184,11 @@ public:
     GLuint id() const { if (!handle) factory_t::create(handle); return handle; };
 };
 
-struct gl_buffer_factory { static void create(GLuint & x) { glCreateBuffers(1, &x); }; static void destroy(GLuint x) { glDeleteBuffers(1, &x); }; };
-struct gl_texture_factory { static void create(GLuint & x) { glGenTextures(1, &x); }; static void destroy(GLuint x) { glDeleteTextures(1, &x); }; };
-struct gl_vertex_array_factory { static void create(GLuint & x) { glGenVertexArrays(1, &x); }; static void destroy(GLuint x) { glDeleteVertexArrays(1, &x); }; };
+struct gl_buffer_factory { static void create(GLuint & x) { glCreateBuffers(1, &x); }; static void destroy(GLuint x) { gl_state().forget(x); glDeleteBuffers(1, &x); }; };
+struct gl_texture_factory { static void create(GLuint & x) { glGenTextures(1, &x); }; static void destroy(GLuint x) { gl_state().forget(x); glDeleteTextures(1, &x); }; };
+struct gl_vertex_array_factory { static void create(GLuint & x) { glGenVertexArrays(1, &x); }; static void destroy(GLuint x) { gl_state().forget(x); glDeleteVertexArrays(1, &x); }; };
 struct gl_renderbuffer_factory { static void create(GLuint & x) { glGenRenderbuffers(1, &x); }; static void destroy(GLuint x) { glDeleteRenderbuffers(1, &x); }; };
-struct gl_framebuffer_factory { static void create(GLuint & x) { glGenFramebuffers(1, &x); }; static void destroy(GLuint x) { glDeleteFramebuffers(1, &x); }; };
+struct gl_framebuffer_factory { static void create(GLuint & x) { glGenFramebuffers(1, &x); }; static void destroy(GLuint x) { gl_state().forget(x); glDeleteFramebuffers(1, &x); }; };
 struct gl_query_factory { static void create(GLuint & x) { glGenQueries(1, &x); }; static void destroy(GLuint x) { glDeleteQueries(1, &x); }; };
 struct gl_sampler_factory { static void create(GLuint & x) { glGenSamplers(1, &x); }; static void destroy(GLuint x) { glDeleteSamplers(1, &x); }; };
 struct gl_transform_feedback_factory { static void create(GLuint & x) { glGenTransformFeedbacks(1, &x); }; static void destroy(GLuint x) { glDeleteTransformFeedbacks(1, &x); }; };
@@ -268,6 +301,23 @@ class gl_shader
 {
     GLuint program{ 0 };
     bool enabled{ false };
+    std::unordered_map<polymer::poly_hash_value, GLint> uniformLocations;
+    std::vector<GLuint> pendingStages;  // stages of a deferred link, kept for their info logs until finish_link()
+
+    void check_link_status()
+    {
+        GLint status, length;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+
+        if (status == GL_FALSE)
+        {
+            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+            std::vector<GLchar> buffer(length);
+            glGetProgramInfoLog(program, (GLsizei)buffer.size(), nullptr, buffer.data());
+            std::cerr << "GL Link Error: " << buffer.data() << std::endl;
+            throw std::runtime_error("GLSL Link Failure");
+        }
+    }
 
 protected:
 
@@ -286,18 +336,9 @@ public:
         glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
 
         glLinkProgram(program);
+        check_link_status();
 
-        GLint status, length;
-        glGetProgramiv(program, GL_LINK_STATUS, &status);
-
-        if (status == GL_FALSE)
-        {
-            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
-            std::vector<GLchar> buffer(length);
-            glGetProgramInfoLog(program, (GLsizei)buffer.size(), nullptr, buffer.data());
-            std::cerr << "GL Link Error: " << buffer.data() << std::endl;
-            throw std::runtime_error("GLSL Link Failure");
-        }
+        ::reflect_uniform_locations(program, uniformLocations);
     }
 
     gl_shader(const std::string & vert, const std::string & frag, const std::string & geom = "")
@@ -305,6 +346,7 @@ public:
         program = glCreateProgram();
 
         glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_FALSE);
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 
         ::compile_shader(program, GL_VERTEX_SHADER, vert.c_str());
         ::compile_shader(program, GL_FRAGMENT_SHADER, frag.c_str());
@@ -312,21 +354,76 @@ public:
         if (geom.length() != 0) ::compile_shader(program, GL_GEOMETRY_SHADER, geom.c_str());
 
         glLinkProgram(program);
+        check_link_status();
 
-        GLint status, length;
-        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        ::reflect_uniform_locations(program, uniformLocations);
+    }
 
-        if (status == GL_FALSE)
+    // Issues the compiles and the link without querying any status, so a driver exposing
+    // GL_KHR_parallel_shader_compile can build the program on its own threads. Poll link_completed()
+    // and call finish_link() before using the program.
+    struct deferred_link {};
+    gl_shader(deferred_link, const std::string & vert, const std::string & frag, const std::string & geom = "")
+    {
+        program = glCreateProgram();
+
+        glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_FALSE);
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+        const std::pair<GLenum, const std::string *> stages[3] = { { GL_VERTEX_SHADER, &vert }, { GL_FRAGMENT_SHADER, &frag }, { GL_GEOMETRY_SHADER, &geom } };
+        for (auto & stage : stages)
         {
-            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
-            std::vector<GLchar> buffer(length);
-            glGetProgramInfoLog(program, (GLsizei)buffer.size(), nullptr, buffer.data());
-            std::cerr << "GL Link Error: " << buffer.data() << std::endl;
-            throw std::runtime_error("GLSL Link Failure");
+            if (stage.second->empty()) continue;
+            const char * source = stage.second->c_str();
+            GLuint shader = glCreateShader(stage.first);
+            glShaderSource(shader, 1, &source, nullptr);
+            glCompileShader(shader);
+            glAttachShader(program, shader);
+            pendingStages.push_back(shader);
         }
+
+        glLinkProgram(program);
     }
 
-    ~gl_shader() { if (program) glDeleteProgram(program); }
+    // Never blocks with GL_KHR_parallel_shader_compile; without it the driver may already be done, and
+    // finish_link() waits for it if not
+    bool link_completed() const
+    {
+        if (pendingStages.empty() || !GLAD_GL_KHR_parallel_shader_compile) return true;
+        GLint completed = GL_FALSE;
+        glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &completed);
+        return completed == GL_TRUE;
+    }
+
+    // Reports compile and link errors like the other constructors and reflects the uniforms
+    void finish_link()
+    {
+        std::vector<GLuint> stages;
+        std::swap(stages, pendingStages);
+
+        for (GLuint shader : stages)
+        {
+            GLint status, length;
+            glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+            if (status == GL_FALSE)
+            {
+                glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+                std::vector<GLchar> buffer(length);
+                glGetShaderInfoLog(shader, (GLsizei)buffer.size(), nullptr, buffer.data());
+                std::cerr << "GL Compile Error: " << buffer.data() << std::endl;
+            }
+            glDeleteShader(shader);
+        }
+
+        check_link_status();
+        ::reflect_uniform_locations(program, uniformLocations);
+    }
+
+    ~gl_shader()
+    {
+        for (GLuint shader : pendingStages) glDeleteShader(shader);
+        if (program) { gl_state().forget(program); glDeleteProgram(program); }
+    }
 
     gl_shader(gl_shader && r) : gl_shader()
     { 
@@ -337,11 +434,55 @@ public:
     {
         std::swap(program, r.program);
         std::swap(enabled, r.enabled);
+        std::swap(uniformLocations, r.uniformLocations);
+        std::swap(pendingStages, r.pendingStages);
         return *this;
     }
 
     GLuint handle() const { return program; }
-    GLint get_uniform_location(const std::string & name) const { return glGetUniformLocation(program, name.c_str()); }
+
+    // The linked program in a driver specific format, for gl_program_cache
+    std::vector<uint8_t> get_binary(GLenum & format) const
+    {
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        std::vector<uint8_t> binary(length);
+        if (length > 0) glGetProgramBinary(program, length, nullptr, &format, binary.data());
+        return binary;
+    }
+
+    // Replaces the program with one returned by get_binary(). Drivers reject binaries from other versions or
+    // devices; the shader is then left empty and false is returned, so the caller can compile from source.
+    bool load_binary(const GLenum format, const void * binary, const GLsizei length)
+    {
+        if (program) { gl_state().forget(program); glDeleteProgram(program); }
+        uniformLocations.clear();
+
+        program = glCreateProgram();
+        glProgramBinary(program, format, binary, length);
+
+        GLint status;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if (status == GL_FALSE)
+        {
+            glDeleteProgram(program);
+            program = 0;
+            return false;
+        }
+
+        ::reflect_uniform_locations(program, uniformLocations);
+        return true;
+    }
+
+    // Locations are reflected once at link time; unknown names resolve to -1, which GL silently ignores.
+    GLint get_uniform_location(const polymer::poly_hash_value id) const
+    {
+        auto itr = uniformLocations.find(id);
+        if (itr != uniformLocations.end()) return itr->second;
+        return -1;
+    }
+
+    GLint get_uniform_location(const std::string & name) const { return get_uniform_location(polymer::hash(name.c_str(), name.size())); }
 
     std::map<uint32_t, std::string> reflect()
     {
@@ -360,6 +501,16 @@ public:
         return locations;
     }
 
+    // Overloads taking a precomputed hash, i.e. `shader.uniform(polymer::const_hash("u_time"), t)`
+    void uniform(const polymer::poly_hash_value id, int scalar) const { glProgramUniform1i(program, get_uniform_location(id), scalar); }
+    void uniform(const polymer::poly_hash_value id, float scalar) const { glProgramUniform1f(program, get_uniform_location(id), scalar); }
+    void uniform(const polymer::poly_hash_value id, const linalg::aliases::float2 & vec) const { glProgramUniform2fv(program, get_uniform_location(id), 1, vec.data()); }
+    void uniform(const polymer::poly_hash_value id, const linalg::aliases::float3 & vec) const { glProgramUniform3fv(program, get_uniform_location(id), 1, vec.data()); }
+    void uniform(const polymer::poly_hash_value id, const linalg::aliases::float4 & vec) const { glProgramUniform4fv(program, get_uniform_location(id), 1, vec.data()); }
+    void uniform(const polymer::poly_hash_value id, const linalg::aliases::float3x3 & mat) const { glProgramUniformMatrix3fv(program, get_uniform_location(id), 1, GL_FALSE, mat.data()); }
+    void uniform(const polymer::poly_hash_value id, const linalg::aliases::float4x4 & mat) const { glProgramUniformMatrix4fv(program, get_uniform_location(id), 1, GL_FALSE, mat.data()); }
+    void uniform(const polymer::poly_hash_value id, const int elements, const std::vector<linalg::aliases::float4x4> & mat) const { glProgramUniformMatrix4fv(program, get_uniform_location(id), elements, GL_FALSE, mat[0].data()); }
+
     void uniform(const std::string & name, int scalar) const { glProgramUniform1i(program, get_uniform_location(name), scalar); }
     void uniform(const std::string & name, float scalar) const { glProgramUniform1f(program, get_uniform_location(name), scalar); }
     void uniform(const std::string & name, const linalg::aliases::float2 & vec) const { glProgramUniform2fv(program, get_uniform_location(name), 1, vec.data() ); }
@@ -377,20 +528,22 @@ public:
 
     void texture(GLint loc, GLenum target, int unit, GLuint tex) const
     {
-        glBindMultiTextureEXT(GL_TEXTURE0 + unit, target, tex);
+        gl_state().bind_texture(unit, target, tex);
         glProgramUniform1i(program, loc, unit);
     }
 
     void texture(const char * name, int unit, GLuint tex, GLenum target) const { texture(get_uniform_location(name), target, unit, tex); }
+    void texture(const polymer::poly_hash_value id, int unit, GLuint tex, GLenum target) const { texture(get_uniform_location(id), target, unit, tex); }
 
-    void bind() { if (program > 0) enabled = true; glUseProgram(program); }
-    void unbind() { enabled = false; glUseProgram(0); }
+    void bind() { if (program > 0) enabled = true; gl_state().use_program(program); }
+    void unbind() { enabled = false; gl_state().use_program(0); }
 };
 
 
 class gl_shader_compute
 {
     GLuint program{ 0 };
+    std::unordered_map<polymer::poly_hash_value, GLint> uniformLocations;
 
 protected:
 
@@ -422,6 +575,8 @@ public:
             std::cerr << "GL Link Error: " << buffer.data() << std::endl;
             throw std::runtime_error("GLSL Link Failure");
         }
+
+        ::reflect_uniform_locations(program, uniformLocations);
     }
 
     std::map<uint32_t, std::string> reflect()
@@ -441,7 +596,7 @@ public:
         return locations;
     }
 
-    ~gl_shader_compute() { if (program) glDeleteProgram(program); }
+    ~gl_shader_compute() { if (program) { gl_state().forget(program); glDeleteProgram(program); } }
 
     gl_shader_compute(gl_shader_compute && r) : gl_shader_compute()
     {
@@ -451,15 +606,24 @@ public:
     gl_shader_compute & operator = (gl_shader_compute && r)
     {
         std::swap(program, r.program);
+        std::swap(uniformLocations, r.uniformLocations);
         return *this;
     }
 
     GLuint handle() const { return program; }
-    GLint get_uniform_location(const std::string & name) const { return glGetUniformLocation(program, name.c_str()); }
+
+    GLint get_uniform_location(const polymer::poly_hash_value id) const
+    {
+        auto itr = uniformLocations.find(id);
+        if (itr != uniformLocations.end()) return itr->second;
+        return -1;
+    }
+
+    GLint get_uniform_location(const std::string & name) const { return get_uniform_location(polymer::hash(name.c_str(), name.size())); }
 
     void dispatch(const GLuint numGroupsX, const GLuint numGroupsY, const GLuint numGroupsZ) const
     {
-        glUseProgram(program);
+        gl_state().use_program(program);
         glDispatchCompute(numGroupsX, numGroupsY, numGroupsZ);
     }
 
@@ -470,7 +634,7 @@ public:
 
     void dispatch_group_size(const GLuint numGroupsX, const GLuint numGroupsY, const GLuint numGroupsZ, const GLuint groupSizeX, const GLuint groupSizeY, const GLuint groupSizeZ) const
     {
-        glUseProgram(program);
+        gl_state().use_program(program);
         glDispatchComputeGroupSizeARB(numGroupsX, numGroupsY, numGroupsZ, groupSizeX, groupSizeY, groupSizeZ);
     }
 
@@ -500,12 +664,13 @@ public:
     void uniform(const std::string & name, float scalar) const {  glProgramUniform1f(program, get_uniform_location(name), scalar); }
     void uniform(const std::string & name, const linalg::aliases::float2 & vec) const { glProgramUniform2fv(program, get_uniform_location(name), 1, &vec.x); }
     void uniform(const std::string & name, const linalg::aliases::float4 & vec) const { glProgramUniform4fv(program, get_uniform_location(name), 1, &vec.x); }
+    void uniform(const std::string & name, const linalg::aliases::int2 & vec) const { glProgramUniform2iv(program, get_uniform_location(name), 1, &vec.x); }
+    void uniform(const std::string & name, const linalg::aliases::float4x4 & mat) const { glProgramUniformMatrix4fv(program, get_uniform_location(name), 1, GL_FALSE, mat.data()); }
     void uniform(const std::string & name, const int elements, const std::vector<linalg::aliases::float4> & vec) const { glProgramUniform4fv(program, get_uniform_location(name), elements, &vec[0].x); }
 
     void texture(GLint loc, GLenum target, int unit, GLuint tex) const
     {
-        glUseProgram(program);
-        glBindMultiTextureEXT(GL_TEXTURE0 + unit, target, tex);
+        gl_state().bind_texture(unit, target, tex);
         glProgramUniform1i(program, loc, unit);
     }
 
@@ -519,6 +684,17 @@ public:
 //   gl_mesh   //
 ////////////////
 
+// Layout of DrawElementsIndirectCommand. DrawArraysIndirectCommand reads the first four fields as
+// (count, instanceCount, first, baseInstance), so `baseVertex` must stay zero for non-indexed meshes.
+struct gl_draw_indirect_command
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint first;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
 class gl_mesh
 {
     gl_vertex_array_object vao;
@@ -559,7 +735,8 @@ public:
     {
         if (vertexBuffer.size)
         {
-            glBindVertexArray(vao);
+            // The vertex array is left bound; redundant rebinds of the same mesh are elided by the state cache
+            gl_state().bind_vertex_array(vao);
 
             submesh & idx = indexBuffers[submesh_index]; // note: will default construct
 
@@ -574,7 +751,39 @@ public:
                 if (instances) glDrawArraysInstanced(drawMode, 0, static_cast<GLsizei>(vertexBuffer.size / vertexStride), instances);
                 else glDrawArrays(drawMode, 0, static_cast<GLsizei>(vertexBuffer.size / vertexStride));
             }
-            glBindVertexArray(0);
+        }
+    }
+
+    // The command drawn by draw_elements(instances); an instance count of zero skips the draw
+    gl_draw_indirect_command get_indirect_command(GLuint instances = 1, int submesh_index = 0)
+    {
+        gl_draw_indirect_command cmd = {};
+        if (!vertexBuffer.size) return cmd;
+
+        submesh & idx = indexBuffers[submesh_index];
+        cmd.count = idx.count ? static_cast<GLuint>(idx.count) : static_cast<GLuint>(vertexBuffer.size / vertexStride);
+        cmd.instanceCount = instances;
+        return cmd;
+    }
+
+    // Sources the command at `offset` in the buffer bound to GL_DRAW_INDIRECT_BUFFER
+    void draw_indirect(GLintptr offset, int submesh_index = 0)
+    {
+        if (vertexBuffer.size)
+        {
+            gl_state().bind_vertex_array(vao);
+
+            submesh & idx = indexBuffers[submesh_index];
+
+            if (idx.count)
+            {
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, idx.indexBuffer);
+                glDrawElementsIndirect(drawMode, indexType, reinterpret_cast<const GLvoid *>(offset));
+            }
+            else
+            {
+                glDrawArraysIndirect(drawMode, reinterpret_cast<const GLvoid *>(offset));
+            }
         }
     }
 
@@ -6,80 +6,169 @@
 #include "gl-api.hpp"
 #include "util.hpp"
 
+#include <deque>
+#include <memory>
+
+// Asynchronous GPU timer built on GL_TIMESTAMP queries. Every frame records into its own slot of
+// begin/end query pairs, and slots are only read back once all of their results are available, which
+// normally happens two or three frames later. A slot is never reused while it still holds unread results;
+// if the GPU falls further behind, another slot is created instead, so collecting never stalls the
+// pipeline and no sample is lost. Since timestamps (unlike GL_TIME_ELAPSED) can be issued at any time,
+// scopes are free to nest.
+//
+// Timestamps are reported in the caller's CPU clock: each frame samples the current GPU time next to a
+// CPU time supplied by the caller, and results are expressed relative to that pair.
+
 class gl_gpu_timer
 {
-    struct query_timer
+    struct frame_slot
     {
-        GLuint query;
-        bool active;
+        uint64_t frame{ 0 };
+        uint64_t cpuBaseNs{ 0 };
+        GLint64 gpuBaseNs{ 0 };
+        uint32_t used{ 0 };
+        std::vector<GLuint> queries; // begin/end pairs
     };
 
-    GLsync sync;
-    size_t activeIdx;
-    std::vector<query_timer> queries;
+    static const uint32_t queries_per_allocation = 32;
+
+    std::vector<std::unique_ptr<frame_slot>> slots;
+    std::vector<frame_slot *> freeSlots;
+    std::deque<frame_slot *> pendingSlots;  // oldest first
+    frame_slot * recording{ nullptr };
+
+    void submit_recording()
+    {
+        if (!recording) return;
+        if (recording->used > 0) pendingSlots.push_back(recording);
+        else freeSlots.push_back(recording);
+        recording = nullptr;
+    }
+
+    bool results_available(const frame_slot & slot) const
+    {
+        for (uint32_t i = 0; i < slot.used * 2; ++i)
+        {
+            GLint available = 0;
+            glGetQueryObjectiv(slot.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) return false;
+        }
+        return true;
+    }
 
 public:
 
+    struct result
+    {
+        uint64_t frame;     // as passed to begin_frame()
+        uint32_t scope;     // as returned by start()
+        uint64_t begin_ns;  // in the cpu clock passed to begin_frame()
+        uint64_t end_ns;
+
+        double elapsed_ms() const { return (end_ns - begin_ns) * 1e-6; }
+    };
+
+    // Slots are created lazily, so no GL context is required until the first begin_frame()
+    explicit gl_gpu_timer(const uint32_t expectedLatency = 3) { slots.reserve(expectedLatency + 1); }
+
     ~gl_gpu_timer()
     {
-        for (size_t i = 0; i < queries.size(); ++i)
+        for (auto & s : slots)
         {
-            glDeleteQueries(1, &queries[i].query);
+            if (!s->queries.empty()) glDeleteQueries(static_cast<GLsizei>(s->queries.size()), s->queries.data());
         }
     }
 
-    void start()
+    gl_gpu_timer(const gl_gpu_timer &) = delete;
+    gl_gpu_timer & operator = (const gl_gpu_timer &) = delete;
+
+    // Submits the slot of the previous frame and starts recording into a free one
+    void begin_frame(const uint64_t frame, const uint64_t cpuNowNs)
     {
-        activeIdx = queries.size();
+        submit_recording();
 
-        // Reuse inactive queries
-        for (size_t i = 0; i < queries.size(); ++i)
+        if (freeSlots.empty())
         {
-            if (queries[i].active == false)
-            {
-                activeIdx = i;
-                queries[i].active = true;
-                break;
-            }
+            slots.emplace_back(new frame_slot());
+            freeSlots.push_back(slots.back().get());
         }
-        
-        // Generate new query
-        if (activeIdx == queries.size())
+
+        recording = freeSlots.back();
+        freeSlots.pop_back();
+
+        recording->frame = frame;
+        recording->used = 0;
+        recording->cpuBaseNs = cpuNowNs;
+        glGetInteger64v(GL_TIMESTAMP, &recording->gpuBaseNs);
+    }
+
+    // Hands the frame's queries over to collect(); optional, as begin_frame() does the same
+    void end_frame()
+    {
+        submit_recording();
+    }
+
+    uint32_t start()
+    {
+        assert(recording && "gl_gpu_timer::begin_frame() must be called before start()");
+
+        if (recording->used * 2 == recording->queries.size())
         {
-            query_timer qt;
-            glCreateQueries(GL_TIME_ELAPSED, 1, &qt.query);
-            qt.active = true;
-            queries.push_back(qt);
+            const size_t first = recording->queries.size();
+            recording->queries.resize(first + queries_per_allocation * 2);
+            glGenQueries(queries_per_allocation * 2, &recording->queries[first]);
         }
 
-        glBeginQuery(GL_TIME_ELAPSED, queries[activeIdx].query);
+        const uint32_t scope = recording->used++;
+        glQueryCounter(recording->queries[scope * 2], GL_TIMESTAMP);
+        return scope;
     }
 
-    void stop()
+    void stop(const uint32_t scope)
     {
-        glEndQuery(GL_TIME_ELAPSED);
+        assert(recording && scope < recording->used);
+        glQueryCounter(recording->queries[scope * 2 + 1], GL_TIMESTAMP);
     }
 
-    double elapsed_ms()
+    // Reports every scope of each submitted frame whose results have all arrived, oldest frame first.
+    // Stops at the first frame that is still in flight and picks it up again on a later call.
+    template<typename F>
+    void collect(F && callback)
     {
-        double timer_elapsed = 0;
-        for (size_t i = 0; i < queries.size(); ++i)
+        while (!pendingSlots.empty())
         {
-            if (queries[i].active == true)
+            frame_slot * slot = pendingSlots.front();
+            if (!results_available(*slot)) break;
+
+            for (uint32_t i = 0; i < slot->used; ++i)
             {
-                uint64_t elapsed = 0;
-                glGetQueryObjectui64v(queries[i].query, GL_QUERY_RESULT_NO_WAIT, &elapsed);
-                if (!elapsed)
-                    continue;
+                GLuint64 begin = 0, end = 0;
+                glGetQueryObjectui64v(slot->queries[i * 2 + 0], GL_QUERY_RESULT, &begin);
+                glGetQueryObjectui64v(slot->queries[i * 2 + 1], GL_QUERY_RESULT, &end);
+
+                const int64_t beginOffset = std::max<int64_t>(0, static_cast<int64_t>(begin) - slot->gpuBaseNs);
+                const int64_t endOffset = std::max<int64_t>(beginOffset, static_cast<int64_t>(end) - slot->gpuBaseNs);
 
-                timer_elapsed = elapsed * 1E-6f; // convert into milliseconds
-                queries[i].active = false;
+                result r;
+                r.frame = slot->frame;
+                r.scope = i;
+                r.begin_ns = slot->cpuBaseNs + beginOffset;
+                r.end_ns = slot->cpuBaseNs + endOffset;
+                callback(r);
             }
-        }
 
-        return timer_elapsed;
+            pendingSlots.pop_front();
+            freeSlots.push_back(slot);
+        }
     }
 
+    // The oldest frame that may still report results, or ~0 if nothing is outstanding
+    uint64_t oldest_outstanding_frame() const
+    {
+        if (!pendingSlots.empty()) return pendingSlots.front()->frame;
+        if (recording) return recording->frame;
+        return ~0ull;
+    }
 };
 
 #endif // end timer_gl_gpu_h
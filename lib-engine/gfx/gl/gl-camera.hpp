@@ -154,14 +154,12 @@ namespace polymer
         {
             const std::vector<std::string> faceNames = {{"positive_x"}, {"negative_x"}, {"positive_y"}, {"negative_y"}, {"positive_z"}, {"negative_z"}};
             std::vector<uint8_t> data(static_cast<size_t>(resolution * resolution * 3));
-            glBindTexture(GL_TEXTURE_CUBE_MAP, cubeMapColor);
             for (int i = 0; i < 6; ++i)
             {
-                glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, GL_UNSIGNED_BYTE, data.data());
+                glGetTextureImageEXT(cubeMapColor, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, GL_UNSIGNED_BYTE, data.data());
                 stbi_write_png( std::string(faceNames[i] + ".png").c_str(), static_cast<int>(resolution), static_cast<int>(resolution), 3, data.data(), static_cast<int>(resolution) * 3);
                 gl_check_error(__FILE__, __LINE__);
             }
-            glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
             shouldCapture = false;
         }
 
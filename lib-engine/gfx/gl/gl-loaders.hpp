@@ -6,50 +6,98 @@
 #include "file_io.hpp"
 #include "gl-api.hpp"
 #include "stb/stb_image.h" 
+#include "tinyexr/tinyexr.h"
 #include "gli/gli.hpp"
 
+#include <algorithm>
+#include <memory>
+
 namespace polymer
 {
 
+    // Swaps rows in place, without a scratch row
     inline void flip_image_inplace(unsigned char * pixels, const uint32_t width, const uint32_t height, const uint32_t bytes_per_pixel)
     {
-        const size_t stride = width * bytes_per_pixel;
-        std::vector<unsigned char> row(stride);
-        unsigned char * low = pixels;
-        unsigned char * high = &pixels[(height - 1) * stride];
-
-        for (; low < high; low += stride, high -= stride)
+        const size_t stride = size_t(width) * bytes_per_pixel;
+        for (uint32_t y = 0; y < height / 2; ++y)
         {
-            std::memcpy(row.data(), low, stride);
-            std::memcpy(low, high, stride);
-            std::memcpy(high, row.data(), stride);
+            unsigned char * low = &pixels[y * stride];
+            unsigned char * high = &pixels[(height - 1 - y) * stride];
+            std::swap_ranges(low, low + stride, high);
         }
     }
 
-    inline std::vector<uint8_t> load_image_data(const std::string & path)
+    // Texels of an image in the row order of its file, or bottom row first when flipped. Holds the buffer the
+    // decoder allocated, so the texels reach the caller without a copy.
+    struct decoded_image
     {
-        auto binaryFile = read_file_binary(path);
-
-        int width, height, nBytes;
-        auto data = stbi_load_from_memory(binaryFile.data(), (int)binaryFile.size(), &width, &height, &nBytes, 0);
-        std::vector<uint8_t> d(width * height * nBytes);
-        std::memcpy(d.data(), data, nBytes * width * height);
-        stbi_image_free(data);
-        return d;
-    }
+        uint32_t width{ 0 };
+        uint32_t height{ 0 };
+        uint32_t channels{ 0 };
+        bool hdr{ false };                              // 32 bit float texels (OpenEXR) instead of 8 bit
+        std::unique_ptr<uint8_t, void(*)(void *)> pixels{ nullptr, &std::free };
+
+        size_t texel_bytes() const { return channels * (hdr ? sizeof(float) : sizeof(uint8_t)); }
+        size_t size_bytes() const { return texel_bytes() * width * height; }
+    };
 
-    inline gl_texture_2d load_image(const std::string & path, bool flip = false)
+    // Decodes a png, jpg, tga, bmp, ... (stb_image) or OpenEXR (tinyexr) file held in memory. The global
+    // stbi_set_flip_vertically_on_load() is never set; `flip` applies to this call only, so images can be
+    // decoded on several threads at once. Throws if the file cannot be decoded.
+    inline decoded_image decode_image(const uint8_t * file, const size_t size, const bool flip)
     {
-        auto binaryFile = polymer::read_file_binary(path);
+        static const uint8_t exr_magic[4] = { 0x76, 0x2f, 0x31, 0x01 };
+
+        decoded_image image;
+        if (size >= 4 && std::memcmp(file, exr_magic, 4) == 0)
+        {
+            float * rgba{ nullptr };
+            int width, height;
+            const char * err{ nullptr };
+            if (LoadEXRFromMemory(&rgba, &width, &height, file, size, &err) != TINYEXR_SUCCESS)
+            {
+                const std::string reason = err ? err : "unknown error";
+                if (err) FreeEXRErrorMessage(err);
+                throw std::runtime_error("could not decode exr image (" + reason + ")");
+            }
+
+            image.width = width;
+            image.height = height;
+            image.channels = 4;
+            image.hdr = true;
+            image.pixels = { reinterpret_cast<uint8_t *>(rgba), &std::free };
+        }
+        else
+        {
+            // stbi_failure_reason() is shared by all threads in this version of stb, so it may name another failure
+            int width, height, nBytes;
+            uint8_t * data = stbi_load_from_memory(file, (int)size, &width, &height, &nBytes, 0);
+            if (!data) throw std::runtime_error(std::string("could not decode image (") + stbi_failure_reason() + ")");
+
+            image.width = width;
+            image.height = height;
+            image.channels = nBytes;
+            image.pixels = { data, &stbi_image_free };
+        }
+
+        if (flip) flip_image_inplace(image.pixels.get(), image.width, image.height, static_cast<uint32_t>(image.texel_bytes()));
+        return image;
+    }
 
-        if (flip) stbi_set_flip_vertically_on_load(1);
-        else stbi_set_flip_vertically_on_load(0);
+    inline decoded_image load_image_data(const std::string & path, bool flip = false)
+    {
+        const auto binaryFile = read_file_binary(path);
+        return decode_image(binaryFile.data(), binaryFile.size(), flip);
+    }
 
-        int width, height, nBytes;
-        auto data = stbi_load_from_memory(binaryFile.data(), (int)binaryFile.size(), &width, &height, &nBytes, 0);
+    inline gl_texture_2d upload_image(const decoded_image & image)
+    {
+        const GLsizei width = image.width, height = image.height;
+        const void * data = image.pixels.get();
 
         gl_texture_2d tex;
-        switch (nBytes)
+        if (image.hdr) tex.setup(width, height, GL_RGBA16F, GL_RGBA, GL_FLOAT, data, true);
+        else switch (image.channels)
         {
         case 1: tex.setup(width, height, GL_RED, GL_RED, GL_UNSIGNED_BYTE, data, true); break;
         case 2: tex.setup(width, height, GL_RED, GL_RED, GL_UNSIGNED_SHORT, data, true); break;
@@ -60,11 +108,37 @@ namespace polymer
 
         glTextureParameteriEXT(tex, GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTextureParameteriEXT(tex, GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-
-        stbi_image_free(data);
         return tex;
     }
 
+    inline gl_texture_2d load_image(const std::string & path, bool flip = false)
+    {
+        return upload_image(load_image_data(path, flip));
+    }
+
+    // Uploads every level of a block compressed texture, such as one made by cook_texture()
+    inline gl_texture_2d load_compressed_texture(const gli::texture2d & tex)
+    {
+        gli::gl GL(gli::gl::PROFILE_GL33);
+        const gli::gl::format fmt = GL.translate(tex.format(), tex.swizzles());
+
+        gl_texture_2d t;
+        for (std::size_t level = 0; level < tex.levels(); ++level)
+        {
+            const auto extent = tex.extent(level);
+            glCompressedTextureImage2DEXT(t, GL_TEXTURE_2D, GLint(level), fmt.Internal, GLsizei(extent.x), GLsizei(extent.y), 0, GLsizei(tex[level].size()), tex[level].data());
+        }
+
+        glTextureParameteriEXT(t, GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTextureParameteriEXT(t, GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, tex.levels() > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glTextureParameteriEXT(t, GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTextureParameteriEXT(t, GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTextureParameteriEXT(t, GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, GLint(tex.levels() - 1));
+        t.width = static_cast<float>(tex.extent(0).x);
+        t.height = static_cast<float>(tex.extent(0).y);
+        return t;
+    }
+
     inline gl_texture_2d load_cubemap(const gli::texture_cube & tex)
     {
         gl_texture_2d t;
@@ -105,6 +105,7 @@ namespace polymer
             nvgEndFrame(nvg);
             glBindFramebuffer(GL_FRAMEBUFFER, 0);
             glUseProgram(0);
+            gl_state().invalidate(); // nanovg changes state without restoring it
         }
 
         gl_texture_2d & surface_texture(const uint32_t surface_idx)
@@ -12,6 +12,7 @@
 #include "../../serialization.hpp"
 
 #include <functional>
+#include <array>
 
 #if defined(POLYMER_PLATFORM_WINDOWS)
 #pragma warning(push)
@@ -177,6 +178,23 @@ namespace polymer
         gl_mesh skyMesh;
         virtual void render_internal(const float4x4 & viewProjection, const float3 & sunDir, const float4x4 & modelToWorld) = 0;
 
+        // Called by recompute() implementations once the model data is up to date
+        void parameters_changed(float turbidity, float albedo, float normalizedSunY)
+        {
+            const std::array<float, 5> parameters = { sunPosition.x, sunPosition.y, turbidity, albedo, normalizedSunY };
+            if (parameters != computedParameters)
+            {
+                computedParameters = parameters;
+                ++version;
+            }
+            if (onParametersChanged) onParametersChanged();
+        }
+
+    private:
+
+        std::array<float, 5> computedParameters = { -1.f, -1.f, -1.f, -1.f, -1.f };
+        uint64_t version{ 0 };
+
     public:
     
         float2 sunPosition;
@@ -194,22 +212,21 @@ namespace polymer
 
         void render(const float4x4 & viewProj, const float3 & eyepoint, const float farClip)
         {
-            GLboolean blendEnabled;
-            glGetBooleanv(GL_BLEND, &blendEnabled);
-        
-            GLboolean cullFaceEnabled;
-            glGetBooleanv(GL_CULL_FACE, &cullFaceEnabled);
-        
-            glDisable(GL_BLEND);
-            glDisable(GL_CULL_FACE);
+            gl_state_cache & state = gl_state();
+
+            const bool blendEnabled = state.is_enabled(GL_BLEND);
+            const bool cullFaceEnabled = state.is_enabled(GL_CULL_FACE);
+
+            state.disable(GL_BLEND);
+            state.disable(GL_CULL_FACE);
         
             // Largest non-clipped sphere
             float4x4 world = (make_translation_matrix(eyepoint) * make_scaling_matrix(farClip * .99));
         
             render_internal(viewProj, get_sun_direction(), world);
         
-            if (blendEnabled) glEnable(GL_BLEND);
-            if (cullFaceEnabled) glEnable(GL_CULL_FACE);
+            state.set_enabled(GL_BLEND, blendEnabled);
+            state.set_enabled(GL_CULL_FACE, cullFaceEnabled);
         }
     
         // Set in degrees. Theta = 0 - 90, Phi = 0 - 360
@@ -232,6 +249,10 @@ namespace polymer
         }
 
         virtual void recompute(float turbidity, float albedo, float normalizedSunY) = 0;
+
+        // Changes whenever recompute() produces a different sky, so anything derived from the sky
+        // (such as a baked cubemap) knows when to update; recomputing the same sky keeps it
+        uint64_t get_version() const { return version; }
     };
 
     class gl_hosek_sky : public gl_procedural_sky
@@ -245,19 +266,19 @@ namespace polymer
             gl_shader & shader = sky.get()->get();
 
             shader.bind();
-            shader.uniform("ViewProjection", viewProjection);
-            shader.uniform("World", modelToWorld);
-            shader.uniform("A", data.A);
-            shader.uniform("B", data.B);
-            shader.uniform("C", data.C);
-            shader.uniform("D", data.D);
-            shader.uniform("E", data.E);
-            shader.uniform("F", data.F);
-            shader.uniform("G", data.G);
-            shader.uniform("H", data.H);
-            shader.uniform("I", data.I);
-            shader.uniform("Z", data.Z);
-            shader.uniform("SunDirection", sunDir);
+            shader.uniform(const_hash("ViewProjection"), viewProjection);
+            shader.uniform(const_hash("World"), modelToWorld);
+            shader.uniform(const_hash("A"), data.A);
+            shader.uniform(const_hash("B"), data.B);
+            shader.uniform(const_hash("C"), data.C);
+            shader.uniform(const_hash("D"), data.D);
+            shader.uniform(const_hash("E"), data.E);
+            shader.uniform(const_hash("F"), data.F);
+            shader.uniform(const_hash("G"), data.G);
+            shader.uniform(const_hash("H"), data.H);
+            shader.uniform(const_hash("I"), data.I);
+            shader.uniform(const_hash("Z"), data.Z);
+            shader.uniform(const_hash("SunDirection"), sunDir);
             skyMesh.draw_elements();
             shader.unbind();
         }
@@ -269,7 +290,7 @@ namespace polymer
         virtual void recompute(float turbidity, float albedo, float normalizedSunY) override
         {
             data = ::detail::HosekSkyRadianceData::compute(get_sun_direction(), turbidity, albedo, normalizedSunY);
-            if (onParametersChanged) onParametersChanged();
+            parameters_changed(turbidity, albedo, normalizedSunY);
         }
     };
 
@@ -293,15 +314,15 @@ namespace polymer
             gl_shader & shader = sky.get()->get();
 
             shader.bind();
-            shader.uniform("ViewProjection", viewProjection);
-            shader.uniform("World", modelToWorld);
-            shader.uniform("A", data.A);
-            shader.uniform("B", data.B);
-            shader.uniform("C", data.C);
-            shader.uniform("D", data.D);
-            shader.uniform("E", data.E);
-            shader.uniform("Z", data.Z);
-            shader.uniform("SunDirection", sunDir);
+            shader.uniform(const_hash("ViewProjection"), viewProjection);
+            shader.uniform(const_hash("World"), modelToWorld);
+            shader.uniform(const_hash("A"), data.A);
+            shader.uniform(const_hash("B"), data.B);
+            shader.uniform(const_hash("C"), data.C);
+            shader.uniform(const_hash("D"), data.D);
+            shader.uniform(const_hash("E"), data.E);
+            shader.uniform(const_hash("Z"), data.Z);
+            shader.uniform(const_hash("SunDirection"), sunDir);
             skyMesh.draw_elements();
             shader.unbind();
         }
@@ -316,7 +337,7 @@ namespace polymer
         virtual void recompute(float turbidity, float albedo, float normalizedSunY) override
         {
             data = ::detail::PreethamSkyRadianceData::compute(get_sun_direction(), turbidity, albedo, normalizedSunY);
-            if (onParametersChanged) onParametersChanged();
+            parameters_changed(turbidity, albedo, normalizedSunY);
         }
     
     };
@@ -0,0 +1,295 @@
+#pragma once
+
+#ifndef polymer_gl_state_cache_hpp
+#define polymer_gl_state_cache_hpp
+
+#include "glfw-app.hpp"
+#include <array>
+#include <unordered_map>
+
+////////////////////////
+//   gl_state_cache   //
+////////////////////////
+
+// Shadow copy of the pipeline state touched by the renderer. Calls that would not change
+// the driver's state are dropped before reaching the API, and every call is counted as either
+// issued or elided so the savings can be inspected per-frame. Entries start out unknown: the
+// first call for any piece of state is always forwarded. Code that changes state behind the
+// cache's back (third-party ui libraries, raw GL calls) must call invalidate() afterwards.
+
+struct gl_state_counters
+{
+    uint32_t issued{ 0 };
+    uint32_t elided{ 0 };
+};
+
+class gl_state_cache
+{
+    enum capability_state : uint8_t { cap_unknown, cap_disabled, cap_enabled };
+
+    static const int max_texture_units = 32;
+    static const int max_buffer_bindings = 16;
+    static const GLuint unknown = ~0u;
+
+    std::unordered_map<GLenum, capability_state> capabilities;
+
+    GLuint program{ unknown };
+    GLuint vertexArray{ unknown };
+    GLuint drawFramebuffer{ unknown };
+    GLuint readFramebuffer{ unknown };
+    std::array<GLuint, max_texture_units> textures;
+    std::array<GLenum, max_texture_units> textureTargets;
+    std::array<GLuint, max_buffer_bindings> uniformBuffers;
+    std::array<GLuint, max_buffer_bindings> storageBuffers;
+
+    GLint viewport[4];
+    GLenum depthFunc{ unknown };
+    GLenum cullFace{ unknown };
+    GLenum blendSrc{ unknown }, blendDst{ unknown };
+    GLint depthMask{ -1 };
+    GLint colorMask[4];
+    GLuint stencilMask{ unknown };
+    GLenum stencilFunc{ unknown }; GLint stencilRef{ -1 }; GLuint stencilFuncMask{ unknown };
+    GLenum stencilFail{ unknown }, stencilDepthFail{ unknown }, stencilPass{ unknown };
+
+    gl_state_counters current;
+    gl_state_counters lastFrame;
+
+    bool filter(const bool redundant)
+    {
+        if (redundant) ++current.elided;
+        else ++current.issued;
+        return !redundant;
+    }
+
+    GLuint * buffer_slot(GLenum target, GLuint index)
+    {
+        if (index >= max_buffer_bindings) return nullptr;
+        if (target == GL_UNIFORM_BUFFER) return &uniformBuffers[index];
+        if (target == GL_SHADER_STORAGE_BUFFER) return &storageBuffers[index];
+        return nullptr;
+    }
+
+public:
+
+    gl_state_cache() { invalidate(); }
+
+    // Forget everything that has been recorded, forcing the next call of every kind to be issued
+    void invalidate()
+    {
+        capabilities.clear();
+        program = vertexArray = drawFramebuffer = readFramebuffer = unknown;
+        textures.fill(unknown);
+        textureTargets.fill(0);
+        uniformBuffers.fill(unknown);
+        storageBuffers.fill(unknown);
+        viewport[0] = viewport[1] = viewport[2] = viewport[3] = -1;
+        depthFunc = cullFace = blendSrc = blendDst = unknown;
+        depthMask = -1;
+        colorMask[0] = colorMask[1] = colorMask[2] = colorMask[3] = -1;
+        stencilMask = stencilFunc = stencilFuncMask = unknown;
+        stencilRef = -1;
+        stencilFail = stencilDepthFail = stencilPass = unknown;
+    }
+
+    // GL recycles the names of deleted objects, so any binding recorded for a deleted name must be
+    // dropped. Names are not unique across object types; this conservatively forgets all of them.
+    void forget(const GLuint name)
+    {
+        if (program == name) program = unknown;
+        if (vertexArray == name) vertexArray = unknown;
+        if (drawFramebuffer == name) drawFramebuffer = unknown;
+        if (readFramebuffer == name) readFramebuffer = unknown;
+        for (auto & t : textures) if (t == name) t = unknown;
+        for (auto & b : uniformBuffers) if (b == name) b = unknown;
+        for (auto & b : storageBuffers) if (b == name) b = unknown;
+    }
+
+    // Called once at the top of a frame. The state outside of the renderer is unknown, so the
+    // shadow copy is invalidated and the running counters are published as the last frame's.
+    void begin_frame()
+    {
+        lastFrame = current;
+        current = {};
+        invalidate();
+    }
+
+    gl_state_counters get_frame_counters() const { return lastFrame; }
+
+    // Counts of the frame in progress, complete once the renderer returns from it
+    gl_state_counters get_running_counters() const { return current; }
+
+    // Drops the counts recorded so far, of both the last frame and the one in progress
+    void reset_counters()
+    {
+        current = {};
+        lastFrame = {};
+    }
+
+    //////////////////////
+    //   capabilities   //
+    //////////////////////
+
+    void set_enabled(const GLenum cap, const bool enable)
+    {
+        capability_state & s = capabilities[cap];
+        const capability_state desired = enable ? cap_enabled : cap_disabled;
+        if (!filter(s == desired)) return;
+        s = desired;
+        if (enable) glEnable(cap);
+        else glDisable(cap);
+    }
+
+    void enable(const GLenum cap) { set_enabled(cap, true); }
+    void disable(const GLenum cap) { set_enabled(cap, false); }
+
+    // Only reaches the driver the first time an unknown capability is queried
+    bool is_enabled(const GLenum cap)
+    {
+        capability_state & s = capabilities[cap];
+        if (s == cap_unknown) s = glIsEnabled(cap) ? cap_enabled : cap_disabled;
+        return s == cap_enabled;
+    }
+
+    ////////////////////////
+    //   fixed function   //
+    ////////////////////////
+
+    void depth_func(const GLenum func)
+    {
+        if (!filter(depthFunc == func)) return;
+        depthFunc = func;
+        glDepthFunc(func);
+    }
+
+    void depth_mask(const GLboolean mask)
+    {
+        if (!filter(depthMask == mask)) return;
+        depthMask = mask;
+        glDepthMask(mask);
+    }
+
+    void color_mask(const GLboolean r, const GLboolean g, const GLboolean b, const GLboolean a)
+    {
+        if (!filter(colorMask[0] == r && colorMask[1] == g && colorMask[2] == b && colorMask[3] == a)) return;
+        colorMask[0] = r; colorMask[1] = g; colorMask[2] = b; colorMask[3] = a;
+        glColorMask(r, g, b, a);
+    }
+
+    void cull_face(const GLenum mode)
+    {
+        if (!filter(cullFace == mode)) return;
+        cullFace = mode;
+        glCullFace(mode);
+    }
+
+    void blend_func(const GLenum src, const GLenum dst)
+    {
+        if (!filter(blendSrc == src && blendDst == dst)) return;
+        blendSrc = src; blendDst = dst;
+        glBlendFunc(src, dst);
+    }
+
+    void stencil_mask(const GLuint mask)
+    {
+        if (!filter(stencilMask == mask)) return;
+        stencilMask = mask;
+        glStencilMask(mask);
+    }
+
+    void stencil_func(const GLenum func, const GLint ref, const GLuint mask)
+    {
+        if (!filter(stencilFunc == func && stencilRef == ref && stencilFuncMask == mask)) return;
+        stencilFunc = func; stencilRef = ref; stencilFuncMask = mask;
+        glStencilFunc(func, ref, mask);
+    }
+
+    void stencil_op(const GLenum sfail, const GLenum dpfail, const GLenum dppass)
+    {
+        if (!filter(stencilFail == sfail && stencilDepthFail == dpfail && stencilPass == dppass)) return;
+        stencilFail = sfail; stencilDepthFail = dpfail; stencilPass = dppass;
+        glStencilOp(sfail, dpfail, dppass);
+    }
+
+    void viewport_rect(const GLint x, const GLint y, const GLsizei w, const GLsizei h)
+    {
+        if (!filter(viewport[0] == x && viewport[1] == y && viewport[2] == w && viewport[3] == h)) return;
+        viewport[0] = x; viewport[1] = y; viewport[2] = w; viewport[3] = h;
+        glViewport(x, y, w, h);
+    }
+
+    //////////////////
+    //   bindings   //
+    //////////////////
+
+    void use_program(const GLuint p)
+    {
+        if (!filter(program == p)) return;
+        program = p;
+        glUseProgram(p);
+    }
+
+    void bind_vertex_array(const GLuint vao)
+    {
+        if (!filter(vertexArray == vao)) return;
+        vertexArray = vao;
+        glBindVertexArray(vao);
+    }
+
+    void bind_framebuffer(const GLenum target, const GLuint fbo)
+    {
+        const bool draw = (target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER);
+        const bool read = (target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER);
+        if (!filter((!draw || drawFramebuffer == fbo) && (!read || readFramebuffer == fbo))) return;
+        if (draw) drawFramebuffer = fbo;
+        if (read) readFramebuffer = fbo;
+        glBindFramebuffer(target, fbo);
+    }
+
+    void bind_texture(const int unit, const GLenum target, const GLuint tex)
+    {
+        if (unit >= max_texture_units)
+        {
+            ++current.issued;
+            glBindMultiTextureEXT(GL_TEXTURE0 + unit, target, tex);
+            return;
+        }
+        if (!filter(textures[unit] == tex && textureTargets[unit] == target)) return;
+        textures[unit] = tex;
+        textureTargets[unit] = target;
+        glBindMultiTextureEXT(GL_TEXTURE0 + unit, target, tex);
+    }
+
+    void bind_buffer_base(const GLenum target, const GLuint index, const GLuint buffer)
+    {
+        GLuint * slot = buffer_slot(target, index);
+        if (!slot)
+        {
+            ++current.issued;
+            glBindBufferBase(target, index, buffer);
+            return;
+        }
+        if (!filter(*slot == buffer)) return;
+        *slot = buffer;
+        glBindBufferBase(target, index, buffer);
+    }
+};
+
+// GL state is owned by a context rather than a thread, and the editor drives several windows
+// from one thread, so there is one cache per current GLFW context.
+inline gl_state_cache & gl_state()
+{
+    static thread_local GLFWwindow * lastContext{ nullptr };
+    static thread_local gl_state_cache * lastCache{ nullptr };
+    static thread_local std::unordered_map<GLFWwindow *, gl_state_cache> caches;
+
+    GLFWwindow * context = glfwGetCurrentContext();
+    if (context != lastContext || !lastCache)
+    {
+        lastContext = context;
+        lastCache = &caches[context];
+    }
+    return *lastCache;
+}
+
+#endif // end polymer_gl_state_cache_hpp
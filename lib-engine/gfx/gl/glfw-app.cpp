@@ -2,6 +2,7 @@
 #include "util.hpp"
 #include "math-spatial.hpp"
 #include "gl-api.hpp"
+#include "gl-async-gpu-timer.hpp"
 #include "human_time.hpp"
 #include "stb/stb_image_write.h"
 
@@ -195,18 +196,29 @@ int glfw_window::get_mods() const
 
 /// @fixme - theoretically gl_context is leaky
 polymer_app::polymer_app(int w, int h, const std::string title, int samples) : glfw_window(new gl_context(), w, h, title, samples) {}
-polymer_app::~polymer_app() {}
+polymer_app::~polymer_app()
+{
+    // Already released by the render thread, on its own context, when rendering was pipelined
+    gpuTimer.reset();
+}
 
 void polymer_app::request_screenshot(const std::string & filename)
 {
-    screenshotPath = filename;
+    // The window is queried here, since GLFW only allows it on the main thread
+    int width, height;
+    glfwGetWindowSize(window, &width, &height);
+    const int2 size(width, height);
+
+    run_on_render_thread([this, filename, size]()
+    {
+        screenshotPath = filename;
+        screenshotSize = size;
+    });
 }
 
 void polymer_app::screenshot_impl()
 {
-    int width, height;
-    glfwGetWindowSize(window, &width, &height);
-    int2 size(width, height);
+    const int2 size = screenshotSize;
     HumanTime t;
     auto timestamp = t.make_timestamp();
     std::vector<uint8_t> screenShot(size.x * size.y * 4);
@@ -217,9 +229,103 @@ void polymer_app::screenshot_impl()
     screenshotPath.clear();
 }
 
+void polymer_app::set_render_thread(const uint32_t maxFramesInFlight)
+{
+    if (renderThread.joinable()) throw std::runtime_error("render thread must be configured before main_loop()");
+    if (maxFramesInFlight > 2) throw std::invalid_argument("at most two frames may be in flight");
+    framesInFlight = maxFramesInFlight;
+}
+
+void polymer_app::run_on_render_thread(std::function<void()> task)
+{
+    if (!using_render_thread())
+    {
+        task();
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(renderTaskMutex);
+    renderTasks.push_back(std::move(task));
+}
+
+app_frame_timing polymer_app::get_frame_timing() const
+{
+    std::lock_guard<std::mutex> guard(timingMutex);
+    return timing;
+}
+
+void polymer_app::draw_frame()
+{
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> guard(renderTaskMutex);
+        std::swap(tasks, renderTasks);
+    }
+    for (auto & t : tasks) t();
+
+    // Frames are reported once their timestamps have arrived, so the render thread never stalls on the gpu;
+    // the most recent complete frame wins
+    if (!gpuTimer) gpuTimer.reset(new gl_gpu_timer(framesInFlight + 3));
+
+    float gpuMs = -1.f;
+    gpuTimer->collect([&gpuMs](const gl_gpu_timer::result & r) { gpuMs = static_cast<float>(r.elapsed_ms()); });
+
+    const auto t0 = std::chrono::high_resolution_clock::now();
+    gpuTimer->begin_frame(drawnFrames, std::chrono::duration_cast<std::chrono::nanoseconds>(t0.time_since_epoch()).count());
+    const uint32_t gpuScope = gpuTimer->start();
+    on_draw();
+    gpuTimer->stop(gpuScope);
+    gpuTimer->end_frame();
+    const auto t1 = std::chrono::high_resolution_clock::now();
+
+    if (screenshotPath.size() > 0) screenshot_impl();
+
+    drawnFrames++;
+
+    std::lock_guard<std::mutex> guard(timingMutex);
+    timing.draw_ms = std::chrono::duration<float, std::milli>(t1 - t0).count();
+    if (gpuMs >= 0.f) timing.gpu_ms = gpuMs;
+}
+
+void polymer_app::render_loop()
+{
+    glfwMakeContextCurrent(window);
+
+    while (true)
+    {
+        int32_t slot;
+        readySlots.wait_and_consume(slot);
+        if (slot < 0) break;
+
+        drawSlot = static_cast<uint32_t>(slot);
+
+        try
+        {
+            draw_frame();
+        }
+        catch (...)
+        {
+            // ...
+        }
+
+        freeSlots.produce(slot);
+    }
+
+    gpuTimer.reset();
+    glfwMakeContextCurrent(nullptr);
+}
+
 void polymer_app::main_loop() 
 {
     auto t0 = std::chrono::high_resolution_clock::now();
+
+    if (using_render_thread())
+    {
+        // The render thread takes ownership of the context for the lifetime of the loop
+        glfwMakeContextCurrent(nullptr);
+        for (int32_t slot = 0; slot < static_cast<int32_t>(get_frame_slot_count()); ++slot) freeSlots.produce(slot);
+        renderThread = std::thread(&polymer_app::render_loop, this);
+    }
     
     while (!glfwWindowShouldClose(window)) 
     {
@@ -248,20 +354,55 @@ void polymer_app::main_loop()
             e.elapsedFrames = elapsedFrames;
 
             on_update(e);
-            on_draw();
 
-            if (screenshotPath.size() > 0) screenshot_impl();
+            if (using_render_thread())
+            {
+                // Blocks when the render thread is |framesInFlight| frames behind
+                const auto w0 = std::chrono::high_resolution_clock::now();
+                int32_t slot;
+                freeSlots.wait_and_consume(slot);
+                const auto w1 = std::chrono::high_resolution_clock::now();
+
+                on_submit(static_cast<uint32_t>(slot));
+                readySlots.produce(slot);
+
+                const auto t2 = std::chrono::high_resolution_clock::now();
+
+                std::lock_guard<std::mutex> guard(timingMutex);
+                timing.wait_ms = std::chrono::duration<float, std::milli>(w1 - w0).count();
+                timing.update_ms = std::chrono::duration<float, std::milli>((t2 - t1) - (w1 - w0)).count();
+            }
+            else
+            {
+                on_submit(0);
+
+                const auto t2 = std::chrono::high_resolution_clock::now();
+                {
+                    std::lock_guard<std::mutex> guard(timingMutex);
+                    timing.update_ms = std::chrono::duration<float, std::milli>(t2 - t1).count();
+                }
+
+                draw_frame();
+            }
         }
         catch(...)
         {
             // ...
         }
     }
+
+    if (using_render_thread())
+    {
+        int32_t stop = -1;
+        readySlots.produce(stop);
+        renderThread.join();
+        glfwMakeContextCurrent(window);
+    }
 }
 
 void polymer_app::exit()
 {
-    glfwMakeContextCurrent(window);
+    if (!using_render_thread()) glfwMakeContextCurrent(window);
     glfwSetWindowShouldClose(window, 1);
 }
 
@@ -5,11 +5,14 @@
 
 #include "util.hpp"
 #include "math-core.hpp"
+#include "queue-mpmc-blocking.hpp"
 
 #include <thread>
 #include <chrono>
 #include <codecvt>
 #include <string>
+#include <functional>
+#include <mutex>
 
 #if defined(POLYMER_PLATFORM_WINDOWS)
     #define GL_GLEXT_PROTOTYPES
@@ -21,6 +24,8 @@
 #define GLFW_INCLUDE_GLU
 #include <GLFW/glfw3.h>
 
+class gl_gpu_timer;
+
 namespace polymer
 {
 
@@ -33,6 +38,15 @@ namespace polymer
         uint64_t elapsedFrames;
     };
 
+    // Per-stage timings of the most recently completed frame, in milliseconds
+    struct app_frame_timing
+    {
+        float update_ms{ 0.f };     // main thread: on_update + on_submit
+        float wait_ms{ 0.f };       // main thread: blocked waiting for a free frame slot
+        float draw_ms{ 0.f };       // render thread: on_draw (cpu submission)
+        float gpu_ms{ 0.f };        // gpu time spent on on_draw's commands, reported a few frames late
+    };
+
     // fixme - move to events file
     struct app_input_event
     {
@@ -109,7 +123,29 @@ namespace polymer
         static void enter_fullscreen(GLFWwindow * window, int2 & windowedSize, int2 & windowedPos);
         static void exit_fullscreen(GLFWwindow * window, const int2 & windowedSize, const int2 & windowedPos);
         int2 windowedSize, windowedPos;
-        std::string screenshotPath;
+        std::string screenshotPath;     // set and cleared on the thread owning the GL context
+        int2 screenshotSize;
+
+        // Pipelined rendering. Frames are handed between the main and render threads through a fixed
+        // set of slots: the main thread fills a free slot and marks it ready, the render thread draws
+        // it and returns it to the free list. With N frames in flight there are N + 1 slots.
+        uint32_t framesInFlight{ 0 };
+        uint32_t drawSlot{ 0 };
+        std::thread renderThread;
+        mpmc_queue_blocking<int32_t> freeSlots;
+        mpmc_queue_blocking<int32_t> readySlots;
+
+        std::mutex renderTaskMutex;
+        std::vector<std::function<void()>> renderTasks;
+
+        std::unique_ptr<gl_gpu_timer> gpuTimer;     // created and destroyed on the thread owning the GL context
+        uint64_t drawnFrames{ 0 };
+
+        mutable std::mutex timingMutex;
+        app_frame_timing timing;
+
+        void render_loop();
+        void draw_frame();
 
     public:
 
@@ -121,6 +157,30 @@ namespace polymer
         void set_fullscreen(bool state);
         bool get_fullscreen();
         void request_screenshot(const std::string & filename);
+
+        // Move on_draw() onto a dedicated render thread that owns the window's GL context while the
+        // main thread runs on_update() for the next frame. |maxFramesInFlight| bounds how far the
+        // simulation may run ahead of rendering (1 or 2); 0 restores the serial loop. Must be called
+        // before main_loop(). While enabled, on_update() and on_submit() run without a GL context and
+        // GLFW window queries belong in on_submit(), since GLFW only permits them on the main thread.
+        void set_render_thread(const uint32_t maxFramesInFlight);
+        bool using_render_thread() const { return framesInFlight > 0; }
+
+        // Number of frame slots an app should allocate for its per-frame render data
+        uint32_t get_frame_slot_count() const { return framesInFlight + 1; }
+
+        // Slot being consumed by the current on_draw()
+        uint32_t get_draw_slot() const { return drawSlot; }
+
+        // Executed on the thread owning the GL context before the next on_draw(), or immediately
+        // when rendering is not pipelined.
+        void run_on_render_thread(std::function<void()> task);
+
+        app_frame_timing get_frame_timing() const;
+
+        // Called on the main thread after on_update() with a slot the render thread is not reading.
+        // Everything on_draw() needs for this frame should be captured into that slot.
+        virtual void on_submit(const uint32_t slot) { }
     };
         
     extern int Main(int argc, char * argv[]);
@@ -0,0 +1,410 @@
+#include "hiz-culling.hpp"
+
+#include <algorithm>
+
+using namespace polymer;
+
+namespace
+{
+    // Boxes with a corner closer than this in clip w straddle the near plane and are always visible
+    const float min_clip_w = 1e-3f;
+
+    const uint32_t readback_slots_per_view = 3;
+    const uint32_t counter_readback_slots = 3;
+
+    // Each texel of the destination covers two by two texels of the source; when the source has an odd
+    // width or height, the last column or row of the destination also covers the one left over. A depth
+    // buffer drawn at a reduced resolution only fills the lower left `u_sourceExtent` texels; its footprint
+    // is scaled by `u_sourceScale` so that every level still covers the full viewport.
+    constexpr const char hiz_downsample_comp[] = R"(#version 450
+        layout(local_size_x = 8, local_size_y = 8) in;
+
+        layout(binding = 0) uniform sampler2D s_source;
+        layout(r32f, binding = 0) uniform writeonly image2D u_destination;
+        uniform int u_sourceLevel;
+        uniform ivec2 u_sourceExtent;
+        uniform vec2 u_sourceScale;
+
+        void main()
+        {
+            ivec2 destinationSize = imageSize(u_destination);
+            ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+            if (any(greaterThanEqual(p, destinationSize))) return;
+
+            ivec2 sourceSize = u_sourceExtent;
+            ivec2 first = ivec2(floor(vec2(p * 2) * u_sourceScale));
+            ivec2 last = ivec2(ceil(vec2(p * 2 + 2) * u_sourceScale)) - 1;
+            last = min(mix(last, sourceSize - 1, equal(p, destinationSize - 1)), sourceSize - 1);
+
+            float farthest = 0.0;
+            for (int y = first.y; y <= last.y; ++y)
+                for (int x = first.x; x <= last.x; ++x)
+                    farthest = max(farthest, texelFetch(s_source, ivec2(x, y), u_sourceLevel).r);
+
+            imageStore(u_destination, p, vec4(farthest));
+        }
+    )";
+
+    // Mirrors hiz_depth_pyramid::is_visible with a base shift of one (level 0 is half the render size)
+    constexpr const char hiz_cull_comp[] = R"(#version 450
+        layout(local_size_x = 64) in;
+
+        struct draw_command { uint count; uint instanceCount; uint first; int baseVertex; uint baseInstance; };
+
+        layout(std430, binding = 0) readonly buffer DrawBounds { vec4 b_bounds[]; };
+        layout(std430, binding = 1) buffer DrawCommands { draw_command b_commands[]; };
+        layout(std430, binding = 2) buffer CullStats { uint b_culled; };
+
+        layout(binding = 0) uniform sampler2D s_hiz0;
+        layout(binding = 1) uniform sampler2D s_hiz1;
+        uniform mat4 u_viewProj0;
+        uniform mat4 u_viewProj1;
+        uniform ivec2 u_renderSize;
+        uniform int u_viewCount;
+        uniform int u_drawCount;
+
+        bool visible_in_view(vec3 boundsMin, vec3 boundsMax, mat4 viewProj, sampler2D hiz)
+        {
+            vec3 ndcMin = vec3(1e30), ndcMax = vec3(-1e30);
+            for (int c = 0; c < 8; ++c)
+            {
+                vec3 corner = vec3((c & 1) != 0 ? boundsMax.x : boundsMin.x, (c & 2) != 0 ? boundsMax.y : boundsMin.y, (c & 4) != 0 ? boundsMax.z : boundsMin.z);
+                vec4 clip = viewProj * vec4(corner, 1.0);
+                if (clip.w < 1e-3) return true;
+                vec3 ndc = clip.xyz / clip.w;
+                ndcMin = min(ndcMin, ndc);
+                ndcMax = max(ndcMax, ndc);
+            }
+
+            // Nothing is known about what was outside of the previous view
+            if (any(lessThan(ndcMin.xy, vec2(-1.0))) || any(greaterThan(ndcMax.xy, vec2(1.0)))) return true;
+
+            vec2 pixelMin = (ndcMin.xy * 0.5 + 0.5) * vec2(u_renderSize);
+            vec2 pixelMax = (ndcMax.xy * 0.5 + 0.5) * vec2(u_renderSize);
+            float nearest = ndcMin.z * 0.5 + 0.5;
+
+            int levelCount = textureQueryLevels(hiz);
+            float extent = max(max(pixelMax.x - pixelMin.x, pixelMax.y - pixelMin.y), 1.0);
+            int level = clamp(int(ceil(log2(extent))) - 1, 0, levelCount - 1);
+
+            ivec2 levelSize = textureSize(hiz, level);
+            ivec2 first = min(ivec2(pixelMin) >> (level + 1), levelSize - 1);
+            ivec2 last = min(min(ivec2(pixelMax), u_renderSize - 1) >> (level + 1), levelSize - 1);
+
+            float farthest = 0.0;
+            for (int y = first.y; y <= last.y; ++y)
+                for (int x = first.x; x <= last.x; ++x)
+                    farthest = max(farthest, texelFetch(hiz, ivec2(x, y), level).r);
+
+            return nearest <= farthest;
+        }
+
+        void main()
+        {
+            uint i = gl_GlobalInvocationID.x;
+            if (i >= uint(u_drawCount)) return;
+
+            vec4 boundsMin = b_bounds[i * 2 + 0];
+            vec4 boundsMax = b_bounds[i * 2 + 1];
+            if (boundsMin.w == 0.0) return;
+
+            bool visible = visible_in_view(boundsMin.xyz, boundsMax.xyz, u_viewProj0, s_hiz0);
+            if (!visible && u_viewCount > 1) visible = visible_in_view(boundsMin.xyz, boundsMax.xyz, u_viewProj1, s_hiz1);
+
+            if (!visible)
+            {
+                b_commands[i].instanceCount = 0;
+                atomicAdd(b_culled, 1);
+            }
+        }
+    )";
+
+    bool fence_signaled(const GLsync fence)
+    {
+        const GLenum result = glClientWaitSync(fence, 0, 0);
+        return result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED;
+    }
+}
+
+///////////////////////////
+//   hiz_depth_pyramid   //
+///////////////////////////
+
+void hiz_depth_pyramid::build(const float * depth, const uint2 size, const uint2 viewport, const uint32_t shift, const float4x4 & viewProjectionMatrix)
+{
+    viewProj = viewProjectionMatrix;
+    viewportSize = viewport;
+    baseShift = shift;
+
+    const size_t levelCount = 1 + static_cast<size_t>(std::floor(std::log2(static_cast<float>(std::max<uint32_t>(std::max<uint32_t>(size.x, size.y), 1u)))));
+    sizes.resize(levelCount);
+    levels.resize(levelCount);
+
+    sizes[0] = max(size, uint2(1));
+    levels[0].assign(depth, depth + size.x * size.y);
+
+    for (size_t l = 1; l < levelCount; ++l)
+    {
+        const uint2 src = sizes[l - 1];
+        const uint2 dst = max(src / 2u, uint2(1));
+        const std::vector<float> & source = levels[l - 1];
+        std::vector<float> & destination = levels[l];
+
+        sizes[l] = dst;
+        destination.resize(dst.x * dst.y);
+
+        for (uint32_t y = 0; y < dst.y; ++y)
+        {
+            const uint32_t lastY = (y == dst.y - 1) ? src.y - 1 : std::min(y * 2 + 1, src.y - 1);
+            for (uint32_t x = 0; x < dst.x; ++x)
+            {
+                const uint32_t lastX = (x == dst.x - 1) ? src.x - 1 : std::min(x * 2 + 1, src.x - 1);
+
+                float farthest = 0.f;
+                for (uint32_t sy = y * 2; sy <= lastY; ++sy)
+                {
+                    for (uint32_t sx = x * 2; sx <= lastX; ++sx) farthest = std::max(farthest, source[sy * src.x + sx]);
+                }
+                destination[y * dst.x + x] = farthest;
+            }
+        }
+    }
+}
+
+bool hiz_depth_pyramid::is_visible(const aabb_3d & localBounds, const float4x4 & modelMatrix) const
+{
+    if (levels.empty()) return true;
+
+    const float4x4 mvp = viewProj * modelMatrix;
+
+    float3 ndcMin(std::numeric_limits<float>::max());
+    float3 ndcMax(std::numeric_limits<float>::lowest());
+
+    for (int c = 0; c < 8; ++c)
+    {
+        const float3 corner((c & 1) ? localBounds._max.x : localBounds._min.x, (c & 2) ? localBounds._max.y : localBounds._min.y, (c & 4) ? localBounds._max.z : localBounds._min.z);
+        const float4 clip = mvp * float4(corner, 1.f);
+        if (clip.w < min_clip_w) return true;
+
+        const float3 ndc = clip.xyz() / clip.w;
+        ndcMin = min(ndcMin, ndc);
+        ndcMax = max(ndcMax, ndc);
+    }
+
+    // Nothing is known about what was outside of the previous view
+    if (ndcMin.x < -1.f || ndcMin.y < -1.f || ndcMax.x > 1.f || ndcMax.y > 1.f) return true;
+
+    const float2 pixelMin = (ndcMin.xy() * 0.5f + 0.5f) * float2(viewportSize);
+    const float2 pixelMax = (ndcMax.xy() * 0.5f + 0.5f) * float2(viewportSize);
+    const float nearest = ndcMin.z * 0.5f + 0.5f;
+
+    // The coarsest level at which the bounds cover at most two by two texels
+    const float extent = std::max(std::max(pixelMax.x - pixelMin.x, pixelMax.y - pixelMin.y), 1.f);
+    const int level = clamp(static_cast<int>(std::ceil(std::log2(extent))) - static_cast<int>(baseShift), 0, static_cast<int>(levels.size()) - 1);
+    const uint32_t shift = baseShift + level;
+
+    const uint2 levelSize = sizes[level];
+    const std::vector<float> & texels = levels[level];
+
+    const uint2 first = min(uint2(pixelMin) >> shift, levelSize - 1u);
+    const uint2 last = min(min(uint2(pixelMax), viewportSize - 1u) >> shift, levelSize - 1u);
+
+    float farthest = 0.f;
+    for (uint32_t y = first.y; y <= last.y; ++y)
+    {
+        for (uint32_t x = first.x; x <= last.x; ++x) farthest = std::max(farthest, texels[y * levelSize.x + x]);
+    }
+
+    return nearest <= farthest;
+}
+
+/////////////////////
+//   hiz_culling   //
+/////////////////////
+
+hiz_culling::hiz_culling(const uint32_t viewCount, const uint2 size) : renderSize(size), baseSize(max(size / 2u, uint2(1))), pyramids(viewCount)
+{
+    assert(viewCount >= 1 && viewCount <= 2);
+
+    const uint32_t levelCount = 1 + static_cast<uint32_t>(std::floor(std::log2(static_cast<float>(std::max<uint32_t>(baseSize.x, baseSize.y)))));
+
+    for (auto & p : pyramids)
+    {
+        p.levelCount = levelCount;
+        glTextureStorage2DEXT(p.texture, GL_TEXTURE_2D, levelCount, GL_R32F, baseSize.x, baseSize.y);
+        glTextureParameteriEXT(p.texture, GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTextureParameteriEXT(p.texture, GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTextureParameteriEXT(p.texture, GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTextureParameteriEXT(p.texture, GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    // The first level narrow enough to be tested on the cpu
+    while (readbackLevel + 1 < levelCount && std::max(baseSize.x >> readbackLevel, 1u) > max_readback_width) ++readbackLevel;
+
+    const uint2 readbackSize = max(baseSize >> readbackLevel, uint2(1));
+    readbacks.resize(viewCount * readback_slots_per_view);
+    for (auto & r : readbacks) r.buffer.set_buffer_data(readbackSize.x * readbackSize.y * sizeof(float), nullptr, GL_STREAM_READ);
+
+    const uint32_t zero = 0;
+    counterBuffer.set_buffer_data(sizeof(uint32_t), &zero, GL_DYNAMIC_COPY);
+    counterReadbacks.resize(counter_readback_slots);
+    for (auto & c : counterReadbacks) c.buffer.set_buffer_data(sizeof(uint32_t), nullptr, GL_STREAM_READ);
+
+    downsampleProgram = gl_shader_compute(hiz_downsample_comp);
+    cullProgram = gl_shader_compute(hiz_cull_comp);
+
+    gl_check_error(__FILE__, __LINE__);
+}
+
+hiz_culling::~hiz_culling()
+{
+    for (auto & r : readbacks) if (r.fence) glDeleteSync(r.fence);
+    for (auto & c : counterReadbacks) if (c.fence) glDeleteSync(c.fence);
+}
+
+void hiz_culling::build(const uint32_t view, const GLuint depthTexture, const uint2 depthSize, const float4x4 & viewProj, const bool readback)
+{
+    view_pyramid & p = pyramids[view];
+
+    // Level 0 reads the depth texture, every other level the one above it
+    for (uint32_t level = 0; level < p.levelCount; ++level)
+    {
+        const uint2 levelSize = max(baseSize >> level, uint2(1));
+
+        if (level == 0)
+        {
+            gl_state().bind_texture(0, GL_TEXTURE_2D, depthTexture);
+            downsampleProgram.uniform("u_sourceLevel", 0);
+            downsampleProgram.uniform("u_sourceExtent", int2(depthSize));
+            downsampleProgram.uniform("u_sourceScale", float2(depthSize) / float2(renderSize));
+        }
+        else
+        {
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+            gl_state().bind_texture(0, GL_TEXTURE_2D, p.texture);
+            downsampleProgram.uniform("u_sourceLevel", static_cast<int>(level - 1));
+            downsampleProgram.uniform("u_sourceExtent", int2(max(baseSize >> (level - 1), uint2(1))));
+            downsampleProgram.uniform("u_sourceScale", float2(1, 1));
+        }
+
+        glBindImageTexture(0, p.texture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        downsampleProgram.dispatch((levelSize.x + 7) / 8, (levelSize.y + 7) / 8, 1);
+    }
+
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+    p.viewProj = viewProj;
+    p.valid = true;
+    ++frame;
+
+    if (!readback) return;
+
+    // If every slot of this view is still in flight the gpu is far behind; skip rather than wait
+    for (uint32_t s = 0; s < readback_slots_per_view; ++s)
+    {
+        readback_slot & slot = readbacks[view * readback_slots_per_view + s];
+        if (slot.fence) continue;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        glGetTextureImageEXT(p.texture, GL_TEXTURE_2D, readbackLevel, GL_RED, GL_FLOAT, nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.view = view;
+        slot.frame = frame;
+        slot.viewProj = viewProj;
+        break;
+    }
+}
+
+void hiz_culling::poll()
+{
+    const uint2 readbackSize = max(baseSize >> readbackLevel, uint2(1));
+    std::vector<float> texels;
+
+    for (auto & slot : readbacks)
+    {
+        if (!slot.fence || !fence_signaled(slot.fence)) continue;
+
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+
+        // Slots may complete out of order; only keep the newest copy of each view
+        view_pyramid & p = pyramids[slot.view];
+        if (slot.frame < p.cpuFrame) continue;
+
+        texels.resize(readbackSize.x * readbackSize.y);
+        glGetNamedBufferSubDataEXT(slot.buffer, 0, texels.size() * sizeof(float), texels.data());
+        p.cpu.build(texels.data(), readbackSize, renderSize, readbackLevel + 1, slot.viewProj);
+        p.cpuFrame = slot.frame;
+    }
+
+    for (auto & slot : counterReadbacks)
+    {
+        if (!slot.fence || !fence_signaled(slot.fence)) continue;
+
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+        glGetNamedBufferSubDataEXT(slot.buffer, 0, sizeof(uint32_t), &culledDraws);
+    }
+}
+
+bool hiz_culling::has_readback() const
+{
+    for (const auto & p : pyramids) if (p.cpu.empty()) return false;
+    return true;
+}
+
+bool hiz_culling::is_visible(const aabb_3d & localBounds, const float4x4 & modelMatrix) const
+{
+    for (const auto & p : pyramids)
+    {
+        if (p.cpu.is_visible(localBounds, modelMatrix)) return true;
+    }
+    return false;
+}
+
+bool hiz_culling::has_pyramid() const
+{
+    for (const auto & p : pyramids) if (!p.valid) return false;
+    return true;
+}
+
+void hiz_culling::cull_draws(const std::vector<gl_draw_indirect_command> & commands, const std::vector<hiz_draw_bounds> & bounds)
+{
+    assert(commands.size() == bounds.size());
+    if (commands.empty()) return;
+
+    commandBuffer.set_buffer_data(commands.size() * sizeof(gl_draw_indirect_command), commands.data(), GL_STREAM_DRAW);
+    boundsBuffer.set_buffer_data(bounds.size() * sizeof(hiz_draw_bounds), bounds.data(), GL_STREAM_DRAW);
+
+    const uint32_t zero = 0;
+    glNamedBufferSubDataEXT(counterBuffer, 0, sizeof(uint32_t), &zero);
+
+    gl_state_cache & state = gl_state();
+    state.bind_buffer_base(GL_SHADER_STORAGE_BUFFER, 0, boundsBuffer);
+    state.bind_buffer_base(GL_SHADER_STORAGE_BUFFER, 1, commandBuffer);
+    state.bind_buffer_base(GL_SHADER_STORAGE_BUFFER, 2, counterBuffer);
+
+    const view_pyramid & last = pyramids.back();
+    state.bind_texture(0, GL_TEXTURE_2D, pyramids[0].texture);
+    state.bind_texture(1, GL_TEXTURE_2D, last.texture);
+    cullProgram.uniform("u_viewProj0", pyramids[0].viewProj);
+    cullProgram.uniform("u_viewProj1", last.viewProj);
+    cullProgram.uniform("u_renderSize", int2(renderSize));
+    cullProgram.uniform("u_viewCount", static_cast<int>(pyramids.size()));
+    cullProgram.uniform("u_drawCount", static_cast<int>(commands.size()));
+    cullProgram.dispatch((static_cast<uint32_t>(commands.size()) + 63) / 64, 1, 1);
+
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    for (auto & slot : counterReadbacks)
+    {
+        if (slot.fence) continue;
+        glNamedCopyBufferSubDataEXT(counterBuffer, slot.buffer, 0, 0, sizeof(uint32_t));
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        break;
+    }
+
+    gl_check_error(__FILE__, __LINE__);
+}
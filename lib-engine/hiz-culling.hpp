@@ -0,0 +1,145 @@
+/*
+ * Hierarchical-Z occlusion culling. After a frame is rendered, the resolved depth of every view is reduced
+ * into a pyramid where each texel holds the farthest depth of the texels below it. The next frame tests the
+ * bounds of its renderables against that pyramid, projected with the matrix the depth was rendered with:
+ * a box whose nearest point lies behind the farthest depth of the texels it covers cannot be visible.
+ * Objects culled in one frame are missing from the depth of the next, which only makes the test more
+ * conservative; anything outside of the previous view is assumed visible.
+ *
+ * Two variants share the pyramid. The readback variant copies a coarse level into a ring of pixel buffers
+ * and picks each one up once its fence has signaled, usually two or three frames later, so the cpu never
+ * waits on the gpu; packets are then culled on the worker pool while they are built. The gpu variant never
+ * leaves the device: a compute shader tests every draw and zeroes the instance count of its entry in an
+ * indirect draw buffer, and the number of culled draws is read back asynchronously for statistics.
+ */
+
+#pragma once
+
+#ifndef polymer_hiz_culling_hpp
+#define polymer_hiz_culling_hpp
+
+#include "math-core.hpp"
+#include "geometry.hpp"
+#include "gl-api.hpp"
+
+namespace polymer
+{
+    ///////////////////////////
+    //   hiz_depth_pyramid   //
+    ///////////////////////////
+
+    // Cpu copy of a max-depth pyramid. Depths are window depths in [0, 1], larger is farther.
+    class hiz_depth_pyramid
+    {
+        float4x4 viewProj;
+        uint2 viewportSize;
+        uint32_t baseShift{ 0 };                // each texel of level 0 covers (1 << baseShift) pixels squared
+        std::vector<uint2> sizes;
+        std::vector<std::vector<float>> levels;
+
+    public:
+
+        // `depth` is level 0, typically a level of the gpu pyramid: each of its texels covers (1 << shift) pixels
+        // of a `viewport` sized depth buffer, the last row and column extending to the edge of the viewport
+        void build(const float * depth, const uint2 size, const uint2 viewport, const uint32_t shift, const float4x4 & viewProjectionMatrix);
+
+        // True if any part of the bounds may be visible. Const and safe to call concurrently.
+        bool is_visible(const aabb_3d & localBounds, const float4x4 & modelMatrix) const;
+
+        bool empty() const { return levels.empty(); }
+        uint32_t get_level_count() const { return static_cast<uint32_t>(levels.size()); }
+        uint2 get_level_size(const uint32_t level) const { return sizes[level]; }
+        const std::vector<float> & get_level(const uint32_t level) const { return levels[level]; }
+    };
+
+    /////////////////////
+    //   hiz_culling   //
+    /////////////////////
+
+    struct hiz_draw_bounds
+    {
+        float4 min;                 // world space; w = 0 for draws that must never be culled
+        float4 max;
+    };
+
+    class hiz_culling
+    {
+        struct view_pyramid
+        {
+            gl_texture_2d texture;
+            uint32_t levelCount{ 0 };
+            float4x4 viewProj;
+            bool valid{ false };
+            hiz_depth_pyramid cpu;  // most recent readback
+            uint64_t cpuFrame{ 0 };
+        };
+
+        struct readback_slot
+        {
+            gl_buffer buffer;
+            GLsync fence{ nullptr };
+            uint32_t view{ 0 };
+            uint64_t frame{ 0 };
+            float4x4 viewProj;
+        };
+
+        struct counter_slot
+        {
+            gl_buffer buffer;
+            GLsync fence{ nullptr };
+        };
+
+        uint2 renderSize;
+        uint2 baseSize;                         // level 0 is half the render size, rounded down
+        uint32_t readbackLevel{ 0 };
+        uint64_t frame{ 0 };
+
+        std::vector<view_pyramid> pyramids;
+        std::vector<readback_slot> readbacks;
+        gl_shader_compute downsampleProgram;
+        gl_shader_compute cullProgram;
+
+        gl_buffer boundsBuffer;
+        gl_buffer commandBuffer;
+        gl_buffer counterBuffer;
+        std::vector<counter_slot> counterReadbacks;
+        uint32_t culledDraws{ 0 };
+
+    public:
+
+        // Readback levels are at most this wide
+        static const uint32_t max_readback_width = 128;
+
+        hiz_culling(const uint32_t viewCount, const uint2 renderSize);
+        ~hiz_culling();
+
+        hiz_culling(const hiz_culling &) = delete;
+        hiz_culling & operator = (const hiz_culling &) = delete;
+
+        // Reduces the resolved depth of a view, rendered with `viewProj` into the lower left `depthSize` texels
+        // of `depthTexture`, into its pyramid and optionally queues an asynchronous readback of a coarse level
+        // for `is_visible`. `depthSize` is below the render size when the view was drawn at a reduced resolution.
+        void build(const uint32_t view, const GLuint depthTexture, const uint2 depthSize, const float4x4 & viewProj, const bool readback);
+
+        // Picks up readbacks and culling statistics whose fences have signaled; never waits
+        void poll();
+
+        // Cpu test against the latest readback of every view; visible if visible in any of them
+        bool is_visible(const aabb_3d & localBounds, const float4x4 & modelMatrix) const;
+        bool has_readback() const;
+
+        // Uploads one indirect command and world bounds per draw and culls them on the gpu. The results are
+        // consumed by binding get_command_buffer() to GL_DRAW_INDIRECT_BUFFER.
+        void cull_draws(const std::vector<gl_draw_indirect_command> & commands, const std::vector<hiz_draw_bounds> & bounds);
+        bool has_pyramid() const;
+
+        GLuint get_command_buffer() const { return commandBuffer; }
+        GLuint get_pyramid_texture(const uint32_t view) const { return pyramids[view].texture; }
+
+        // Draws culled by the most recent cull_draws() call whose results have arrived
+        uint32_t get_gpu_culled_count() const { return culledDraws; }
+    };
+
+} // end namespace polymer
+
+#endif // end polymer_hiz_culling_hpp
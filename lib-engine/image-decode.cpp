@@ -0,0 +1,57 @@
+#include "image-decode.hpp"
+
+using namespace polymer;
+
+//////////////////////////////
+//   image_decode_service   //
+//////////////////////////////
+
+image_decode_service::image_decode_service(const uint32_t numThreads) : workers(std::max<uint32_t>(numThreads, 1)) {}
+
+void image_decode_service::complete(std::function<void()> && completion)
+{
+    {
+        std::lock_guard<std::mutex> lock(completedMutex);
+        completed.push_back(std::move(completion));
+    }
+    completedCondition.notify_all();
+}
+
+void image_decode_service::decode(const std::string & path, const bool flip, std::function<void(decoded_image &)> done)
+{
+    run<decoded_image>(path, [path, flip]() { return load_image_data(path, flip); }, std::move(done));
+}
+
+size_t image_decode_service::process_completions(const size_t maxCount)
+{
+    std::vector<std::function<void()>> ready;
+    {
+        std::lock_guard<std::mutex> lock(completedMutex);
+        while (!completed.empty() && ready.size() < maxCount)
+        {
+            ready.push_back(std::move(completed.front()));
+            completed.pop_front();
+        }
+    }
+
+    for (auto & completion : ready)
+    {
+        // A failing upload must not take the completions after it down with it
+        try { completion(); }
+        catch (const std::exception & e) { log::get()->engine_log->warn("image_decode_service: completion failed ({})", e.what()); }
+        --pending;
+    }
+
+    return ready.size();
+}
+
+void image_decode_service::finish()
+{
+    while (pending > 0)
+    {
+        if (process_completions() > 0) continue;
+
+        std::unique_lock<std::mutex> lock(completedMutex);
+        completedCondition.wait(lock, [this] { return !completed.empty(); });
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * Parallel image decoding. Files are read and decoded by decode_image() on a pool of worker threads, and
+ * each result waits in a completion queue until the thread that owns the gl context runs its completion
+ * with `process_completions()`, typically to upload it. Loading a few hundred textures is then bound by
+ * the workers rather than by one core decoding png and jpg files in turn, and the uploads overlap the
+ * decodes still in flight.
+ */
+
+#pragma once
+
+#ifndef polymer_image_decode_hpp
+#define polymer_image_decode_hpp
+
+#include "gl-loaders.hpp"
+#include "thread-pool.hpp"
+#include "logging.hpp"
+
+#include <deque>
+#include <limits>
+
+namespace polymer
+{
+    //////////////////////////////
+    //   image_decode_service   //
+    //////////////////////////////
+
+    class image_decode_service
+    {
+        std::mutex completedMutex;
+        std::condition_variable completedCondition;
+        std::deque<std::function<void()>> completed;
+        std::atomic<uint32_t> pending{ 0 };
+
+        // Last, so the workers are joined before the queue they complete into is destroyed
+        simple_thread_pool workers;
+
+        void complete(std::function<void()> && completion);
+
+    public:
+
+        explicit image_decode_service(const uint32_t numThreads = std::max<uint32_t>(std::thread::hardware_concurrency(), 2) - 1);
+
+        image_decode_service(const image_decode_service &) = delete;
+        image_decode_service & operator = (const image_decode_service &) = delete;
+
+        // Runs `work` on a worker and queues `done` with its result. If `work` throws, the failure is logged
+        // under `name` when the completions are processed, and `done` is dropped.
+        template<class T>
+        void run(const std::string & name, std::function<T()> work, std::function<void(T &)> done)
+        {
+            ++pending;
+            workers.enqueue([this, name, work, done]()
+            {
+                std::function<void()> completion;
+                try
+                {
+                    auto result = std::make_shared<T>(work());
+                    completion = [result, done]() { done(*result); };
+                }
+                catch (const std::exception & e)
+                {
+                    const std::string error = e.what();
+                    completion = [name, error]() { log::get()->engine_log->warn("image_decode_service: {} failed ({})", name, error); };
+                }
+                catch (...)
+                {
+                    // Still completed, so that `pending` drops and finish() returns
+                    completion = [name]() { log::get()->engine_log->warn("image_decode_service: {} failed (unknown exception)", name); };
+                }
+                complete(std::move(completion));
+            });
+        }
+
+        // Decodes the image file at `path`, see decode_image()
+        void decode(const std::string & path, const bool flip, std::function<void(decoded_image &)> done);
+
+        // Runs queued completions on the calling thread, oldest first; returns how many ran. Call from one thread only.
+        size_t process_completions(const size_t maxCount = std::numeric_limits<size_t>::max());
+
+        // Processes completions as they arrive until everything submitted so far has completed
+        void finish();
+
+        uint32_t get_pending_count() const { return pending; }
+    };
+
+} // end namespace polymer
+
+#endif // end polymer_image_decode_hpp
@@ -16,25 +16,21 @@ polymer_default_material::polymer_default_material()
     shader = shader_handle("default-shader");
 }
 
-void polymer_default_material::use()
+void polymer_default_material::use(const material_view_layout & layout)
 {
-    resolve_variants();
-    compiled_shader->shader.bind();
+    resolve_variants(layout);
+    get_variant(layout)->shader.bind();
 }
 
-void polymer_default_material::resolve_variants()
+void polymer_default_material::resolve_variants(const material_view_layout & layout)
 {
-    if (!compiled_shader)
-    {
-        std::shared_ptr<gl_shader_asset> asset = shader.get();
-        compiled_shader = asset->get_variant();
-    }
+    resolve_variant(layout, {});
 }
 
-uint32_t polymer_default_material::id()
+uint32_t polymer_default_material::id(const material_view_layout & layout)
 {
-    resolve_variants();
-    return compiled_shader->shader.handle();
+    resolve_variants(layout);
+    return get_variant(layout)->shader.handle();
 }
 
 /////////////////////////////
@@ -43,27 +39,24 @@ uint32_t polymer_default_material::id()
 
 polymer_fx_material::polymer_fx_material() {}
 
-void polymer_fx_material::use()
+void polymer_fx_material::use(const material_view_layout & layout)
 {
     if (!shader.assigned()) return;
-    resolve_variants();
-    compiled_shader->shader.bind();
+    resolve_variants(layout);
+    get_variant(layout)->shader.bind();
 }
 
-void polymer_fx_material::resolve_variants()
+void polymer_fx_material::resolve_variants(const material_view_layout & layout)
 {
-    if (!compiled_shader && shader.assigned())
-    {
-        std::shared_ptr<gl_shader_asset> asset = shader.get();
-        compiled_shader = asset->get_variant();
-    }
+    if (!shader.assigned()) return;
+    resolve_variant(layout, {});
 }
 
-uint32_t polymer_fx_material::id()
+uint32_t polymer_fx_material::id(const material_view_layout & layout)
 {
     if (!shader.assigned()) return 0;
-    resolve_variants();
-    return compiled_shader->shader.handle();
+    resolve_variants(layout);
+    return get_variant(layout)->shader.handle();
 }
 
 ////////////////////////////
@@ -75,25 +68,21 @@ polymer_wireframe_material::polymer_wireframe_material()
     shader = shader_handle("renderer-wireframe");
 }
 
-void polymer_wireframe_material::use()
+void polymer_wireframe_material::use(const material_view_layout & layout)
 {
-    resolve_variants();
-    compiled_shader->shader.bind();
+    resolve_variants(layout);
+    get_variant(layout)->shader.bind();
 }
 
-void polymer_wireframe_material::resolve_variants()
+void polymer_wireframe_material::resolve_variants(const material_view_layout & layout)
 {
-    if (!compiled_shader)
-    {
-        std::shared_ptr<gl_shader_asset> asset = shader.get();
-        compiled_shader = asset->get_variant();
-    }
+    resolve_variant(layout, {});
 }
 
-uint32_t polymer_wireframe_material::id()
+uint32_t polymer_wireframe_material::id(const material_view_layout & layout)
 {
-    resolve_variants();
-    return compiled_shader->shader.handle();
+    resolve_variants(layout);
+    return get_variant(layout)->shader.handle();
 }
 
 /////////////////////////////////////////
@@ -105,7 +94,7 @@ polymer_blinn_phong_standard::polymer_blinn_phong_standard()
     shader = shader_handle("phong-forward-lighting");
 }
 
-void polymer_blinn_phong_standard::resolve_variants()
+void polymer_blinn_phong_standard::resolve_variants(const material_view_layout & layout)
 {
     std::vector<std::string> processed_defines;
 
@@ -119,55 +108,54 @@ void polymer_blinn_phong_standard::resolve_variants()
     if (diffuse.assigned()) processed_defines.push_back("HAS_DIFFUSE_MAP");
     if (normal.assigned()) processed_defines.push_back("HAS_NORMAL_MAP");
 
-    const auto variant_hash = shader.get()->hash(processed_defines);
+    // Compiles again whenever the set of defines changes
+    resolve_variant(layout, processed_defines);
+}
 
-    // First time
-    if (!compiled_shader)
-    {
-        compiled_shader = shader.get()->get_variant(processed_defines);
-        return;
-    }
-    else if (compiled_shader->hash != variant_hash)
-    {
-        // We updated the set of defines and need to recompile
-        compiled_shader = shader.get()->get_variant(processed_defines);
-        return;
-    }
+uint32_t polymer_blinn_phong_standard::id(const material_view_layout & layout)
+{
+    resolve_variants(layout);
+    return get_variant(layout)->shader.handle();
 }
 
-uint32_t polymer_blinn_phong_standard::id()
+void polymer_blinn_phong_standard::use(const material_view_layout & layout)
 {
-    resolve_variants();
-    return compiled_shader->shader.handle();
+    resolve_variants(layout);
+    get_variant(layout)->shader.bind();
+    update_material_buffer();
+    gl_state().bind_buffer_base(GL_UNIFORM_BUFFER, uniforms::blinn_phong_material::binding, materialBuffer);
 }
 
-void polymer_blinn_phong_standard::use()
+void polymer_blinn_phong_standard::update_material_buffer()
 {
-    resolve_variants();
-    gl_shader & program = compiled_shader->shader;
-    program.bind();
-    program.uniform("u_diffuseColor", diffuseColor);
+    uniforms::blinn_phong_material params = {};
+    params.diffuseColor = diffuseColor;
+    params.specularShininess = specularShininess;
+    params.specularColor = specularColor;
+    params.specularStrength = specularStrength;
+
+    if (!materialBufferUploaded || std::memcmp(&params, &uploadedParams, sizeof(params)) != 0)
+    {
+        materialBuffer.set_buffer_data(sizeof(params), &params, GL_DYNAMIC_DRAW);
+        uploadedParams = params;
+        materialBufferUploaded = true;
+    }
 }
 
-void polymer_blinn_phong_standard::update_uniforms()
+void polymer_blinn_phong_standard::update_uniforms(const material_view_layout & layout)
 {
-    resolve_variants();
-    gl_shader & program = compiled_shader->shader;
-    program.bind();
+    resolve_variants(layout);
+    const cached_variant & variant = get_variant(layout);
+    gl_shader & program = variant->shader;
 
-    program.uniform("u_diffuseColor", diffuseColor);
-    program.uniform("u_specularColor", specularColor);
-    program.uniform("u_specularShininess", specularShininess);
-    program.uniform("u_specularStrength", specularStrength);
+    update_material_buffer();
 
-    program.uniform("u_texCoordScale", float2(texcoordScale));
+    program.uniform(const_hash("u_texCoordScale"), float2(texcoordScale));
 
     bindpoint = 0;
 
-    if (compiled_shader->enabled("HAS_DIFFUSE_MAP")) program.texture("s_diffuse", bindpoint++, diffuse.get(), GL_TEXTURE_2D);
-    if (compiled_shader->enabled("HAS_NORMAL_MAP")) program.texture("s_normal", bindpoint++, normal.get(), GL_TEXTURE_2D);
-
-    program.unbind();
+    if (variant->enabled("HAS_DIFFUSE_MAP")) program.texture(const_hash("s_diffuse"), bindpoint++, diffuse.get(), GL_TEXTURE_2D);
+    if (variant->enabled("HAS_NORMAL_MAP")) program.texture(const_hash("s_normal"), bindpoint++, normal.get(), GL_TEXTURE_2D);
 }
 
 //////////////////////////////////////////////////////
@@ -179,7 +167,7 @@ polymer_pbr_standard::polymer_pbr_standard()
     shader = shader_handle("pbr-forward-lighting");
 }
 
-void polymer_pbr_standard::resolve_variants() 
+void polymer_pbr_standard::resolve_variants(const material_view_layout & layout) 
 {
     std::vector<std::string> processed_defines;
 
@@ -197,84 +185,143 @@ void polymer_pbr_standard::resolve_variants()
     if (occlusion.assigned()) processed_defines.push_back("HAS_OCCLUSION_MAP");
     if (emissive.assigned()) processed_defines.push_back("HAS_EMISSIVE_MAP");
 
-    const auto variant_hash = shader.get()->hash(processed_defines);
+    // Compiles again whenever the set of defines changes
+    resolve_variant(layout, processed_defines);
+}
 
-    // First time
-    if (!compiled_shader)
-    {
-        compiled_shader = shader.get()->get_variant(processed_defines);
-        return;
-    }
-    else if (compiled_shader->hash != variant_hash)
+uint32_t polymer_pbr_standard::id(const material_view_layout & layout)
+{
+    resolve_variants(layout);
+    return get_variant(layout)->shader.handle();
+}
+
+uniforms::pbr_material polymer_pbr_standard::get_parameters() const
+{
+    uniforms::pbr_material params = {};
+    params.albedo = baseAlbedo;
+    params.opacity = opacity;
+    params.emissive = baseEmissive;
+    params.emissiveStrength = emissiveStrength;
+    params.roughness = roughnessFactor;
+    params.metallic = metallicFactor;
+    params.specularLevel = specularLevel;
+    params.occlusionStrength = occlusionStrength;
+    params.ambientStrength = ambientStrength;
+    params.shadowOpacity = shadowOpacity;
+    params.texcoordScale = texcoordScale;
+    return params;
+}
+
+bool polymer_pbr_standard::shares_bindings(const polymer_pbr_standard & other, const material_view_layout & layout) const
+{
+    if (this == &other) return true;
+    if (!get_variant(layout) || get_variant(layout) != other.get_variant(layout)) return false;
+
+    // The same variant samples the same set of maps; they must also be the same textures
+    const std::vector<const texture_handle *> mine = get_textures(), theirs = other.get_textures();
+    for (size_t i = 0; i < mine.size(); ++i)
     {
-        // We updated the set of defines and need to recompile
-        compiled_shader = shader.get()->get_variant(processed_defines);
-        return;
+        if (mine[i]->assigned() != theirs[i]->assigned()) return false;
+        if (mine[i]->assigned() && GLuint(mine[i]->get()) != GLuint(theirs[i]->get())) return false;
     }
+    return true;
 }
 
-uint32_t polymer_pbr_standard::id()
+void polymer_pbr_standard::update_uniforms(const material_view_layout & layout)
 {
-    resolve_variants();
-    return compiled_shader->shader.handle();
+    resolve_variants(layout);
+    const cached_variant & variant = get_variant(layout);
+    gl_shader & program = variant->shader;
+
+    bindpoint = 0;
+
+    if (variant->enabled("HAS_ALBEDO_MAP")) program.texture(const_hash("s_albedo"), bindpoint++, albedo.get(), GL_TEXTURE_2D);
+    if (variant->enabled("HAS_NORMAL_MAP")) program.texture(const_hash("s_normal"), bindpoint++, normal.get(), GL_TEXTURE_2D);
+    if (variant->enabled("HAS_ROUGHNESS_MAP")) program.texture(const_hash("s_roughness"), bindpoint++, roughness.get(), GL_TEXTURE_2D);
+    if (variant->enabled("HAS_METALNESS_MAP")) program.texture(const_hash("s_metallic"), bindpoint++, metallic.get(), GL_TEXTURE_2D);
+    if (variant->enabled("HAS_EMISSIVE_MAP")) program.texture(const_hash("s_emissive"), bindpoint++, emissive.get(), GL_TEXTURE_2D);
+    if (variant->enabled("HAS_HEIGHT_MAP")) program.texture(const_hash("s_height"), bindpoint++, height.get(), GL_TEXTURE_2D);
+    if (variant->enabled("HAS_OCCLUSION_MAP")) program.texture(const_hash("s_occlusion"), bindpoint++, occlusion.get(), GL_TEXTURE_2D);
 }
 
-void polymer_pbr_standard::update_uniforms()
+void polymer_pbr_standard::update_uniforms_ibl(GLuint irradiance, GLuint radiance, const material_view_layout & layout)
 {
-    resolve_variants();
-    gl_shader & program = compiled_shader->shader;
-    program.bind();
-
-    program.uniform("u_roughness", roughnessFactor);
-    program.uniform("u_metallic", metallicFactor);
-    program.uniform("u_opacity", opacity);
-    program.uniform("u_albedo", baseAlbedo);
-    program.uniform("u_emissive", baseEmissive);
-    program.uniform("u_specularLevel", specularLevel);
-    program.uniform("u_occlusionStrength", occlusionStrength);
-    program.uniform("u_ambientStrength", ambientStrength);
-    program.uniform("u_emissiveStrength", emissiveStrength);
-    program.uniform("u_shadowOpacity", shadowOpacity);
-    program.uniform("u_texCoordScale", texcoordScale);
+    resolve_variants(layout);
+    const cached_variant & variant = get_variant(layout);
+    gl_shader & program = variant->shader;
+    if (!variant->enabled("USE_IMAGE_BASED_LIGHTING")) throw std::runtime_error("should not be called unless USE_IMAGE_BASED_LIGHTING is defined.");
 
-    bindpoint = 0;
+    program.texture(const_hash("sc_irradiance"), bindpoint++, irradiance, GL_TEXTURE_CUBE_MAP);
+    program.texture(const_hash("sc_radiance"), bindpoint++, radiance, GL_TEXTURE_CUBE_MAP);
+}
+
+void polymer_pbr_standard::update_uniforms_shadow(GLuint handle, const material_view_layout & layout)
+{
+    resolve_variants(layout);
+    const cached_variant & variant = get_variant(layout);
+    gl_shader & program = variant->shader;
+    if (!variant->enabled("ENABLE_SHADOWS")) throw std::runtime_error("should not be called unless ENABLE_SHADOWS is defined.");
+
+    program.texture(const_hash("s_csmArray"), bindpoint++, handle, GL_TEXTURE_2D_ARRAY);
+}
+
+void polymer_pbr_standard::use(const material_view_layout & layout)
+{
+    resolve_variants(layout);
+    get_variant(layout)->shader.bind();
+}
 
-    if (compiled_shader->enabled("HAS_ALBEDO_MAP")) program.texture("s_albedo", bindpoint++, albedo.get(), GL_TEXTURE_2D);
-    if (compiled_shader->enabled("HAS_NORMAL_MAP")) program.texture("s_normal", bindpoint++, normal.get(), GL_TEXTURE_2D);
-    if (compiled_shader->enabled("HAS_ROUGHNESS_MAP")) program.texture("s_roughness", bindpoint++, roughness.get(), GL_TEXTURE_2D);
-    if (compiled_shader->enabled("HAS_METALNESS_MAP")) program.texture("s_metallic", bindpoint++, metallic.get(), GL_TEXTURE_2D);
-    if (compiled_shader->enabled("HAS_EMISSIVE_MAP")) program.texture("s_emissive", bindpoint++, emissive.get(), GL_TEXTURE_2D);
-    if (compiled_shader->enabled("HAS_HEIGHT_MAP")) program.texture("s_height", bindpoint++, height.get(), GL_TEXTURE_2D);
-    if (compiled_shader->enabled("HAS_OCCLUSION_MAP")) program.texture("s_occlusion", bindpoint++, occlusion.get(), GL_TEXTURE_2D);
+/////////////////////////////
+//   pbr_material_buffer   //
+/////////////////////////////
 
-    program.unbind();
+std::vector<uint2> polymer::find_changed_records(const std::vector<uniforms::pbr_material> & records, const std::vector<uniforms::pbr_material> & previous)
+{
+    std::vector<uint2> runs;
+    for (uint32_t i = 0; i < records.size(); ++i)
+    {
+        const bool changed = i >= previous.size() || std::memcmp(&records[i], &previous[i], sizeof(uniforms::pbr_material)) != 0;
+        if (!changed) continue;
+
+        if (!runs.empty() && runs.back().x + runs.back().y == i) ++runs.back().y;
+        else runs.push_back({ i, 1 });
+    }
+    return runs;
 }
 
-void polymer_pbr_standard::update_uniforms_ibl(GLuint irradiance, GLuint radiance)
+uint32_t pbr_material_buffer::add(const polymer_pbr_standard & material)
 {
-    resolve_variants();
-    gl_shader & program = compiled_shader->shader;
-    if (!compiled_shader->enabled("USE_IMAGE_BASED_LIGHTING")) throw std::runtime_error("should not be called unless USE_IMAGE_BASED_LIGHTING is defined.");
-
-    program.bind();
-    program.texture("sc_irradiance", bindpoint++, irradiance, GL_TEXTURE_CUBE_MAP);
-    program.texture("sc_radiance", bindpoint++, radiance, GL_TEXTURE_CUBE_MAP);
-    program.unbind();
+    records.push_back(material.get_parameters());
+    return static_cast<uint32_t>(records.size() - 1);
 }
 
-void polymer_pbr_standard::update_uniforms_shadow(GLuint handle)
+void pbr_material_buffer::upload()
 {
-    resolve_variants();
-    gl_shader & program = compiled_shader->shader;
-    if (!compiled_shader->enabled("ENABLE_SHADOWS")) throw std::runtime_error("should not be called unless ENABLE_SHADOWS is defined.");
+    const GLsizeiptr stride = sizeof(uniforms::pbr_material);
+    writtenRecords = 0;
+
+    // Storage buffers may not be empty
+    if (records.empty()) records.push_back({});
+
+    if (records.size() > capacity)
+    {
+        capacity = std::max<uint32_t>(static_cast<uint32_t>(records.size()), std::max<uint32_t>(capacity * 2, 64));
+        buffer.set_buffer_data(capacity * stride, nullptr, GL_DYNAMIC_DRAW);
+        uploaded.clear();
+    }
+
+    for (const uint2 & run : find_changed_records(records, uploaded))
+    {
+        buffer.set_buffer_sub_data(run.y * stride, run.x * stride, &records[run.x]);
+        writtenRecords += run.y;
+    }
 
-    program.bind();
-    program.texture("s_csmArray", bindpoint++, handle, GL_TEXTURE_2D_ARRAY);
-    program.unbind();
+    // Records beyond this frame's count are still valid in the buffer
+    if (uploaded.size() < records.size()) uploaded.resize(records.size());
+    std::copy(records.begin(), records.end(), uploaded.begin());
 }
 
-void polymer_pbr_standard::use()
+void pbr_material_buffer::bind() const
 {
-    resolve_variants();
-    compiled_shader->shader.bind();
+    gl_state().bind_buffer_base(GL_SHADER_STORAGE_BUFFER, uniforms::pbr_material::binding, buffer);
 }
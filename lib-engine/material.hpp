@@ -5,6 +5,7 @@
 
 #include "gl-api.hpp"
 #include "math-core.hpp"
+#include "uniforms.hpp"
 #include "asset-handle-utils.hpp"
 #include "shader-library.hpp"
 #include "ecs/typeid.hpp"
@@ -17,18 +18,71 @@ namespace polymer
 
     typedef std::shared_ptr<polymer::shader_variant> cached_variant;
 
+    //////////////////////////////
+    //   material_view_layout   //
+    //////////////////////////////
+
+    // How the renderer drawing a material lays out its views, which selects defines every variant needs. Materials
+    // are shared between renderers with different settings, so the layout is passed in by the renderer on every
+    // call and a variant is cached for each layout rather than for the last one resolved.
+    struct material_view_layout
+    {
+        bool instancedStereo{ false };  // selects the INSTANCED_STEREO variant
+        bool lodCrossFade{ false };     // selects the LOD_CROSS_FADE variant
+        bool compileAsync{ false };     // new variants compile in the background; not part of the variant
+
+        static const uint32_t count = 4;
+        uint32_t index() const { return (instancedStereo ? 1u : 0u) | (lodCrossFade ? 2u : 0u); }
+
+        std::vector<std::string> defines() const
+        {
+            std::vector<std::string> defines;
+            if (instancedStereo) defines.push_back("INSTANCED_STEREO");
+            if (lodCrossFade) defines.push_back("LOD_CROSS_FADE");
+            return defines;
+        }
+    };
+
     ////////////////////////////
     //   material_interface   //
     ////////////////////////////
 
     struct material_interface
     {
-        mutable cached_variant compiled_shader{ nullptr };  // cached on first access (because needs to happen on GL thread)
-        shader_handle shader;                               // typically set during object inflation / deserialization
-        virtual void update_uniforms() {}                   // generic interface for overriding specific uniform sets
-        virtual void use() {}                               // generic interface for binding the program
-        virtual void resolve_variants() = 0;                // all overridden functions need to call this to cache the shader
-        virtual uint32_t id() = 0;                          // returns the gl handle, used for sorting materials by type to minimize state changes in the renderer
+        mutable cached_variant compiled_variants[material_view_layout::count];  // per view layout, cached on first access (because needs to happen on GL thread)
+        shader_handle shader;                                                   // typically set during object inflation / deserialization
+        virtual void update_uniforms(const material_view_layout & layout = {}) {}  // generic interface for overriding specific uniform sets
+        virtual void use(const material_view_layout & layout = {}) {}              // generic interface for binding the program
+        virtual void resolve_variants(const material_view_layout & layout = {}) = 0;   // all overridden functions need to call this to cache the shader
+        virtual uint32_t id(const material_view_layout & layout = {}) = 0;         // returns the gl handle, used for sorting materials by type to minimize state changes in the renderer
+        virtual std::vector<const texture_handle *> get_textures() const { return {}; }    // sampled maps, whose on-screen size the renderer reports to the texture streamer
+
+        // The variant of `layout` as of its last resolve; null before the first
+        const cached_variant & get_variant(const material_view_layout & layout = {}) const { return compiled_variants[layout.index()]; }
+
+        // True while the variant of `layout` is still compiling; it must not be drawn until then
+        bool is_pending(const material_view_layout & layout = {}) const { return get_variant(layout) && get_variant(layout)->pending; }
+
+    protected:
+
+        // Caches the variant of the material's `defines` and those of `layout` unless it is the one already cached
+        void resolve_variant(const material_view_layout & layout, std::vector<std::string> defines)
+        {
+            for (auto & define : layout.defines()) defines.push_back(define);
+
+            cached_variant & variant = compiled_variants[layout.index()];
+            std::shared_ptr<gl_shader_asset> asset = shader.get();
+            if (!variant || variant->hash != asset->hash(defines))
+            {
+                variant = layout.compileAsync ? asset->request_variant(defines) : asset->get_variant(defines);
+            }
+            else if (variant->pending)
+            {
+                // Polled here too, so materials become ready without a gl_shader_monitor driving the asset
+                if (layout.compileAsync) asset->poll_pending();
+                else variant = asset->get_variant(defines);
+            }
+        }
     };
 
     //////////////////////////////////
@@ -38,9 +92,9 @@ namespace polymer
     struct polymer_default_material final : public material_interface
     {
         polymer_default_material();
-        virtual void use() override final;
-        virtual void resolve_variants() override final;
-        virtual uint32_t id() override final;
+        virtual void use(const material_view_layout & layout = {}) override final;
+        virtual void resolve_variants(const material_view_layout & layout = {}) override final;
+        virtual uint32_t id(const material_view_layout & layout = {}) override final;
     };
     POLYMER_SETUP_TYPEID(polymer_default_material);
 
@@ -55,9 +109,9 @@ namespace polymer
     struct polymer_fx_material final : public material_interface
     {
         polymer_fx_material();
-        virtual void use() override final;
-        virtual void resolve_variants() override final;
-        virtual uint32_t id() override final;
+        virtual void use(const material_view_layout & layout = {}) override final;
+        virtual void resolve_variants(const material_view_layout & layout = {}) override final;
+        virtual uint32_t id(const material_view_layout & layout = {}) override final;
     };
     POLYMER_SETUP_TYPEID(polymer_fx_material);
 
@@ -73,9 +127,9 @@ namespace polymer
     {
         float4 color{ 1, 1, 1, 0.5f};
         polymer_wireframe_material();
-        virtual void use() override final;
-        virtual void resolve_variants() override final;
-        virtual uint32_t id() override final;
+        virtual void use(const material_view_layout & layout = {}) override final;
+        virtual void resolve_variants(const material_view_layout & layout = {}) override final;
+        virtual uint32_t id(const material_view_layout & layout = {}) override final;
     };
     POLYMER_SETUP_TYPEID(polymer_wireframe_material);
 
@@ -91,13 +145,20 @@ namespace polymer
     {
         int bindpoint = 0;
 
+        // Parameters live in a per-material uniform block, re-uploaded only when they differ from the last upload
+        gl_buffer materialBuffer;
+        bool materialBufferUploaded{ false };
+        uniforms::blinn_phong_material uploadedParams;
+        void update_material_buffer();
+
     public:
 
         polymer_blinn_phong_standard();
-        virtual void use() override final;
-        virtual void resolve_variants() override final;
-        virtual uint32_t id() override final;
-        virtual void update_uniforms() override final;
+        virtual void use(const material_view_layout & layout = {}) override final;
+        virtual void resolve_variants(const material_view_layout & layout = {}) override final;
+        virtual uint32_t id(const material_view_layout & layout = {}) override final;
+        virtual void update_uniforms(const material_view_layout & layout = {}) override final;
+        virtual std::vector<const texture_handle *> get_textures() const override final { return { &diffuse, &normal }; }
 
         float2 texcoordScale{ 1.f, 1.f };
 
@@ -140,6 +201,8 @@ namespace polymer
     //   polymer_pbr_standard   //
     //////////////////////////////
 
+    // Parameters are not bound by the material. The renderer packs them into a pbr_material_buffer, where
+    // shaders look them up by the material index of the object being drawn.
     class polymer_pbr_standard final : public material_interface
     {
         int bindpoint = 0;
@@ -148,13 +211,20 @@ namespace polymer
 
         polymer_pbr_standard();
 
-        virtual void update_uniforms() override final;
-        virtual void use() override final;
-        virtual void resolve_variants() override final;
-        virtual uint32_t id() override final;
+        virtual void update_uniforms(const material_view_layout & layout = {}) override final;
+        virtual void use(const material_view_layout & layout = {}) override final;
+        virtual void resolve_variants(const material_view_layout & layout = {}) override final;
+        virtual uint32_t id(const material_view_layout & layout = {}) override final;
+        virtual std::vector<const texture_handle *> get_textures() const override final { return { &albedo, &normal, &metallic, &roughness, &emissive, &height, &occlusion }; }
+
+        void update_uniforms_shadow(GLuint handle, const material_view_layout & layout = {});
+        void update_uniforms_ibl(GLuint irradiance, GLuint radiance, const material_view_layout & layout = {});
+
+        uniforms::pbr_material get_parameters() const;
 
-        void update_uniforms_shadow(GLuint handle);
-        void update_uniforms_ibl(GLuint irradiance, GLuint radiance);
+        // True if drawing with `other` after this material, both in `layout`, needs no change of program or
+        // textures, so draws of both may be submitted back to back
+        bool shares_bindings(const polymer_pbr_standard & other, const material_view_layout & layout) const;
 
         float3 baseAlbedo{1.f, 1.f, 1.f};
 
@@ -219,6 +289,42 @@ namespace polymer
         });
     }
 
+    /////////////////////////////
+    //   pbr_material_buffer   //
+    /////////////////////////////
+
+    // Runs of `records` as (first, count) that differ from `previous` or lie beyond its end
+    std::vector<uint2> find_changed_records(const std::vector<uniforms::pbr_material> & records, const std::vector<uniforms::pbr_material> & previous);
+
+    // The parameters of every pbr material drawn in a frame, as fixed-stride records of one storage buffer.
+    // Materials are added in the order they are first drawn, which is the same from one frame to the next
+    // while the scene does not change, so only the records of materials whose parameters were edited since
+    // the last frame are written. Switching between materials of the same variant and textures then needs no
+    // binding at all; the record is picked by the material index of the object.
+    class pbr_material_buffer
+    {
+        std::vector<uniforms::pbr_material> records;    // of the current frame
+        std::vector<uniforms::pbr_material> uploaded;   // as held by the buffer
+        gl_buffer buffer;
+        uint32_t capacity{ 0 };
+        uint32_t writtenRecords{ 0 };
+
+    public:
+
+        void clear() { records.clear(); }
+
+        // Returns the index of the material's record
+        uint32_t add(const polymer_pbr_standard & material);
+
+        // Writes the records that changed, reallocating the buffer if it is too small
+        void upload();
+
+        void bind() const;
+
+        uint32_t get_record_count() const { return static_cast<uint32_t>(records.size()); }
+        uint32_t get_written_record_count() const { return writtenRecords; }   // by the last upload()
+    };
+
     template<class F> void visit_subclasses(material_interface * p, F f)
     {
         f("polymer_default_material", dynamic_cast<polymer_default_material *>(p));
@@ -0,0 +1,107 @@
+/*
+ * Runtime levels of detail for meshes simplified with generate_lod_chain(). Every level indexes the vertices
+ * of the source mesh, so the levels are uploaded as submeshes 1..N of the source gl_mesh and share its vertex
+ * buffer. The chain is registered as an asset under the same name as the mesh, which is how the renderer
+ * finds the error of each level.
+ *
+ * A level is selected by projecting its object space error to the screen: the coarsest level whose error
+ * covers fewer than a threshold number of pixels is drawn. A hysteresis band keeps objects near a boundary
+ * from switching back and forth, and an optional cross-fade draws both levels with complementary dither
+ * patterns for a few frames after a switch.
+ */
+
+#pragma once
+
+#ifndef polymer_mesh_lod_hpp
+#define polymer_mesh_lod_hpp
+
+#include "math-core.hpp"
+#include "gl-api.hpp"
+#include "asset-handle-utils.hpp"
+#include "gl-mesh-util.hpp"
+#include "../lib-model-io/model-io.hpp"
+
+namespace polymer
+{
+    typedef asset_handle<mesh_lod_chain> lod_chain_handle;
+
+    // Pixels covered by one object space unit at `distance` from the eye along the view axis
+    inline float projected_pixels_per_unit(const float4x4 & projectionMatrix, const float viewportHeight, const float distance)
+    {
+        return 0.5f * viewportHeight * projectionMatrix[1][1] / std::max(distance, 1e-4f);
+    }
+
+    // Coarsest level whose projected error is at most `maxErrorPixels`. A finer level is picked as soon as the current
+    // one exceeds the threshold; a coarser one only once it is within the threshold shrunk by `hysteresis`.
+    inline uint32_t select_mesh_lod(const mesh_lod_chain & chain, const float pixelsPerUnit, const uint32_t current, const float maxErrorPixels, const float hysteresis)
+    {
+        const auto coarsest_within = [&](const float limit)
+        {
+            uint32_t level = 0;
+            while (level < chain.levels.size() && chain.levels[level].error * pixelsPerUnit <= limit) ++level;
+            return level;
+        };
+
+        const uint32_t finest = coarsest_within(maxErrorPixels);
+        const uint32_t coarsest = coarsest_within(maxErrorPixels * (1.f - hysteresis));
+
+        if (current > finest) return finest;
+        if (current < coarsest) return coarsest;
+        return current;
+    }
+
+    struct mesh_lod_state
+    {
+        uint32_t level{ 0 };
+        uint32_t previousLevel{ 0 };
+        float fade{ 1.f };              // progress from previousLevel to level; 1 once no cross-fade is running
+        uint64_t lastFrame{ 0 };        // last frame the state was updated, for pruning
+        bool initialized{ false };
+    };
+
+    // Advances the state by one frame toward `target`. A switch during a cross-fade restarts it from the current level.
+    inline void update_mesh_lod(mesh_lod_state & state, const uint32_t target, const uint32_t fadeFrames)
+    {
+        if (!state.initialized)
+        {
+            state.level = state.previousLevel = target;
+            state.fade = 1.f;
+            state.initialized = true;
+        }
+        else if (target != state.level)
+        {
+            state.previousLevel = state.level;
+            state.level = target;
+            state.fade = fadeFrames ? 0.f : 1.f;
+        }
+        else if (state.fade < 1.f)
+        {
+            state.fade = std::min(state.fade + 1.f / fadeFrames, 1.f);
+        }
+    }
+
+    // Uploads every level as the submesh of the same index; submesh 0 remains the source
+    inline void set_lod_submeshes(gl_mesh & mesh, const mesh_lod_chain & chain)
+    {
+        for (size_t i = 0; i < chain.levels.size(); ++i)
+        {
+            const std::vector<uint3> & faces = chain.levels[i].faces;
+            mesh.set_index_data(GL_TRIANGLES, GL_UNSIGNED_INT, static_cast<GLsizei>(faces.size() * 3), faces.data(), GL_STATIC_DRAW, static_cast<int>(i + 1));
+        }
+    }
+
+    // Registers the gpu mesh, its level of detail chain and the cpu mesh under `asset_id`
+    inline void create_mesh_assets_with_lods(const std::string & asset_id, runtime_mesh && mesh, const mesh_lod_settings & settings = {})
+    {
+        gl_mesh gpuMesh = make_mesh_from_geometry(mesh);
+        mesh_lod_chain chain = generate_lod_chain(mesh, settings);
+        set_lod_submeshes(gpuMesh, chain);
+
+        create_handle_for_asset(asset_id.c_str(), std::move(gpuMesh));
+        create_handle_for_asset(asset_id.c_str(), std::move(chain));
+        create_handle_for_asset(asset_id.c_str(), std::move(mesh));
+    }
+
+} // end namespace polymer
+
+#endif // end polymer_mesh_lod_hpp
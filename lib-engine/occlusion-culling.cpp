@@ -0,0 +1,316 @@
+#include "occlusion-culling.hpp"
+
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+    #define POLYMER_OCCLUSION_SSE2
+    #include <emmintrin.h>
+#endif
+
+using namespace polymer;
+
+namespace
+{
+    // Vertices closer than this in clip w are not projected; triangles touching them are dropped
+    // as occluders and boxes touching them are always visible
+    const float min_clip_w = 1e-3f;
+
+    const uint32_t min_rows_per_band = 8;
+}
+
+//////////////////////////
+//   occlusion_culler   //
+//////////////////////////
+
+occlusion_culler::occlusion_culler(const uint2 resolution) : size((resolution.x + 3) & ~3u, std::max<uint32_t>(resolution.y, 1))
+{
+    depth.resize(size.x * size.y, 0.f);
+}
+
+void occlusion_culler::begin_frame(const float4x4 & viewProjectionMatrix)
+{
+    viewProj = viewProjectionMatrix;
+    std::fill(depth.begin(), depth.end(), 0.f);
+    candidates.clear();
+    stats = {};
+}
+
+bool occlusion_culler::project_bounds(const aabb_3d & localBounds, const float4x4 & modelMatrix, float2 & screenMin, float2 & screenMax, float & nearestZ) const
+{
+    const float4x4 mvp = viewProj * modelMatrix;
+
+    screenMin = float2(std::numeric_limits<float>::max());
+    screenMax = float2(std::numeric_limits<float>::lowest());
+    nearestZ = 0.f;
+
+    for (int c = 0; c < 8; ++c)
+    {
+        const float3 corner((c & 1) ? localBounds._max.x : localBounds._min.x, (c & 2) ? localBounds._max.y : localBounds._min.y, (c & 4) ? localBounds._max.z : localBounds._min.z);
+        const float4 clip = mvp * float4(corner, 1.f);
+        if (clip.w < min_clip_w) return false;
+
+        const float invW = 1.f / clip.w;
+        const float2 screen((clip.x * invW * 0.5f + 0.5f) * size.x, (clip.y * invW * 0.5f + 0.5f) * size.y);
+        screenMin = min(screenMin, screen);
+        screenMax = max(screenMax, screen);
+        nearestZ = std::max(nearestZ, invW);
+    }
+    return true;
+}
+
+void occlusion_culler::add_occluder(const runtime_mesh & mesh, const aabb_3d & localBounds, const float4x4 & modelMatrix, const bool tagged)
+{
+    if (mesh.vertices.empty() || mesh.faces.empty()) return;
+
+    stats.candidates++;
+
+    float2 screenMin, screenMax;
+    float nearestZ;
+    float area = 1.f; // bounds crossing the near plane are as close as it gets
+
+    if (project_bounds(localBounds, modelMatrix, screenMin, screenMax, nearestZ))
+    {
+        const float2 clippedMin = max(screenMin, float2(0.f));
+        const float2 clippedMax = min(screenMax, float2(size));
+        if (clippedMax.x <= clippedMin.x || clippedMax.y <= clippedMin.y) return; // off-screen
+        area = ((clippedMax.x - clippedMin.x) * (clippedMax.y - clippedMin.y)) / (size.x * size.y);
+    }
+
+    candidates.push_back({ &mesh, modelMatrix, area, tagged });
+}
+
+void occlusion_culler::setup_triangles(const candidate & c, std::vector<screen_triangle> & out) const
+{
+    const float4x4 mvp = viewProj * c.modelMatrix;
+    const runtime_mesh & mesh = *c.mesh;
+
+    std::vector<screen_vertex> verts(mesh.vertices.size());
+    for (size_t i = 0; i < mesh.vertices.size(); ++i)
+    {
+        const float4 clip = mvp * float4(mesh.vertices[i], 1.f);
+        screen_vertex & v = verts[i];
+        v.valid = clip.w >= min_clip_w;
+        if (!v.valid) continue;
+        const float invW = 1.f / clip.w;
+        v.x = (clip.x * invW * 0.5f + 0.5f) * size.x;
+        v.y = (clip.y * invW * 0.5f + 0.5f) * size.y;
+        v.z = invW;
+    }
+
+    out.clear();
+    for (const uint3 & f : mesh.faces)
+    {
+        const screen_vertex & a = verts[f.x];
+        const screen_vertex & b = verts[f.y];
+        const screen_vertex & d = verts[f.z];
+        if (!a.valid || !b.valid || !d.valid) continue;
+
+        screen_triangle t;
+        t.v[0] = float2(a.x, a.y); t.z[0] = a.z;
+        t.v[1] = float2(b.x, b.y); t.z[1] = b.z;
+        t.v[2] = float2(d.x, d.y); t.z[2] = d.z;
+        t.minY = std::min(std::min(a.y, b.y), d.y);
+        t.maxY = std::max(std::max(a.y, b.y), d.y);
+
+        const float minX = std::min(std::min(a.x, b.x), d.x);
+        const float maxX = std::max(std::max(a.x, b.x), d.x);
+        if (maxX < 0.f || t.maxY < 0.f || minX > size.x || t.minY > size.y) continue;
+
+        out.push_back(t);
+    }
+}
+
+// Edge functions are evaluated at pixel centers; all three are non-negative inside a counter-clockwise
+// triangle. Both windings are rasterized, since a back face is never nearer than the front face covering it.
+void occlusion_culler::rasterize_band(const uint32_t firstRow, const uint32_t lastRow)
+{
+    for (const auto & list : triangles)
+    {
+        for (const screen_triangle & tri : list)
+        {
+            if (tri.maxY < firstRow || tri.minY > lastRow) continue;
+
+            float2 v0 = tri.v[0], v1 = tri.v[1], v2 = tri.v[2];
+            float z0 = tri.z[0], z1 = tri.z[1], z2 = tri.z[2];
+
+            float area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+            if (area == 0.f) continue;
+            if (area < 0.f)
+            {
+                std::swap(v1, v2);
+                std::swap(z1, z2);
+                area = -area;
+            }
+
+            // E(x, y) = A * x + B * y + C for the edge opposite of each vertex
+            const float A0 = v1.y - v2.y, B0 = v2.x - v1.x, C0 = v1.x * v2.y - v2.x * v1.y;
+            const float A1 = v2.y - v0.y, B1 = v0.x - v2.x, C1 = v2.x * v0.y - v0.x * v2.y;
+            const float A2 = v0.y - v1.y, B2 = v1.x - v0.x, C2 = v0.x * v1.y - v1.x * v0.y;
+
+            // 1/w interpolated with the normalized edge functions as barycentrics
+            const float invArea = 1.f / area;
+            const float zA = (A0 * z0 + A1 * z1 + A2 * z2) * invArea;
+            const float zB = (B0 * z0 + B1 * z1 + B2 * z2) * invArea;
+            const float zC = (C0 * z0 + C1 * z1 + C2 * z2) * invArea;
+
+            const float minX = std::min(std::min(v0.x, v1.x), v2.x);
+            const float maxX = std::max(std::max(v0.x, v1.x), v2.x);
+
+            const int32_t x0 = std::max<int32_t>(0, static_cast<int32_t>(std::floor(minX)));
+            const int32_t x1 = std::min<int32_t>(size.x - 1, static_cast<int32_t>(std::ceil(maxX)));
+            const int32_t y0 = std::max<int32_t>(firstRow, static_cast<int32_t>(std::floor(tri.minY)));
+            const int32_t y1 = std::min<int32_t>(lastRow, static_cast<int32_t>(std::ceil(tri.maxY)));
+            if (x0 > x1 || y0 > y1) continue;
+
+            // Groups of four start on a multiple of four and the width is padded, so they never leave the row
+            const int32_t groupStart = x0 & ~3;
+
+        #if defined(POLYMER_OCCLUSION_SSE2)
+            const __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+            const __m128 a0 = _mm_set1_ps(A0), a1 = _mm_set1_ps(A1), a2 = _mm_set1_ps(A2), za = _mm_set1_ps(zA);
+            const __m128 zero = _mm_setzero_ps();
+
+            for (int32_t y = y0; y <= y1; ++y)
+            {
+                const float py = y + 0.5f;
+                const __m128 r0 = _mm_set1_ps(B0 * py + C0);
+                const __m128 r1 = _mm_set1_ps(B1 * py + C1);
+                const __m128 r2 = _mm_set1_ps(B2 * py + C2);
+                const __m128 rz = _mm_set1_ps(zB * py + zC);
+                float * row = &depth[y * size.x];
+
+                for (int32_t x = groupStart; x <= x1; x += 4)
+                {
+                    const __m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), offsets);
+                    const __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), r0);
+                    const __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), r1);
+                    const __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), r2);
+                    const __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+                    if (!_mm_movemask_ps(inside)) continue;
+
+                    const __m128 z = _mm_add_ps(_mm_mul_ps(za, px), rz);
+                    const __m128 current = _mm_loadu_ps(row + x);
+                    const __m128 nearer = _mm_max_ps(current, z);
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, current)));
+                }
+            }
+        #else
+            for (int32_t y = y0; y <= y1; ++y)
+            {
+                const float py = y + 0.5f;
+                float * row = &depth[y * size.x];
+
+                for (int32_t x = groupStart; x <= x1; ++x)
+                {
+                    const float px = x + 0.5f;
+                    if (A0 * px + B0 * py + C0 < 0.f || A1 * px + B1 * py + C1 < 0.f || A2 * px + B2 * py + C2 < 0.f) continue;
+                    row[x] = std::max(row[x], zA * px + zB * py + zC);
+                }
+            }
+        #endif
+        }
+    }
+}
+
+void occlusion_culler::rasterize(simple_thread_pool * pool)
+{
+    // Tagged occluders first, then the largest on screen
+    std::sort(candidates.begin(), candidates.end(), [](const candidate & a, const candidate & b)
+    {
+        if (a.tagged != b.tagged) return a.tagged;
+        return a.screenArea > b.screenArea;
+    });
+
+    uint32_t numSelected = 0;
+    uint32_t numAutomatic = 0;
+    for (const candidate & c : candidates)
+    {
+        if (!c.tagged)
+        {
+            if (numAutomatic == maxOccluders || c.screenArea < minOccluderArea) break;
+            ++numAutomatic;
+        }
+        ++numSelected;
+    }
+
+    triangles.resize(numSelected);
+    stats.occluders = numSelected;
+
+    const uint32_t numBands = pool ? std::max<uint32_t>(1, std::min<uint32_t>(std::thread::hardware_concurrency(), size.y / min_rows_per_band)) : 1;
+
+    if (numBands == 1)
+    {
+        for (uint32_t i = 0; i < numSelected; ++i) setup_triangles(candidates[i], triangles[i]);
+        for (const auto & list : triangles) stats.triangles += static_cast<uint32_t>(list.size());
+        rasterize_band(0, size.y - 1);
+        return;
+    }
+
+    std::vector<std::future<void>> tasks;
+    for (uint32_t i = 0; i < numSelected; ++i)
+    {
+        tasks.emplace_back(pool->enqueue([this, i]() { setup_triangles(candidates[i], triangles[i]); }));
+    }
+    for (auto & t : tasks) t.get();
+    for (const auto & list : triangles) stats.triangles += static_cast<uint32_t>(list.size());
+
+    // Bands own disjoint rows of the buffer
+    tasks.clear();
+    for (uint32_t b = 0; b < numBands; ++b)
+    {
+        const uint32_t first = (size.y * b) / numBands;
+        const uint32_t last = (size.y * (b + 1)) / numBands - 1;
+        tasks.emplace_back(pool->enqueue([this, first, last]() { rasterize_band(first, last); }));
+    }
+    for (auto & t : tasks) t.get();
+}
+
+bool occlusion_culler::is_visible(const aabb_3d & localBounds, const float4x4 & modelMatrix) const
+{
+    float2 screenMin, screenMax;
+    float nearestZ;
+    if (!project_bounds(localBounds, modelMatrix, screenMin, screenMax, nearestZ)) return true;
+
+    if (screenMax.x < 0.f || screenMax.y < 0.f || screenMin.x > size.x || screenMin.y > size.y) return false;
+
+    // Every pixel the rectangle touches, not only those whose centers it covers
+    const int32_t x0 = clamp(static_cast<int32_t>(std::floor(screenMin.x)), 0, static_cast<int32_t>(size.x) - 1);
+    const int32_t x1 = clamp(static_cast<int32_t>(std::ceil(screenMax.x)) - 1, x0, static_cast<int32_t>(size.x) - 1);
+    const int32_t y0 = clamp(static_cast<int32_t>(std::floor(screenMin.y)), 0, static_cast<int32_t>(size.y) - 1);
+    const int32_t y1 = clamp(static_cast<int32_t>(std::ceil(screenMax.y)) - 1, y0, static_cast<int32_t>(size.y) - 1);
+
+    // Visible as soon as one pixel is farther than the nearest point of the box
+    for (int32_t y = y0; y <= y1; ++y)
+    {
+        const float * row = &depth[y * size.x];
+        int32_t x = x0;
+
+    #if defined(POLYMER_OCCLUSION_SSE2)
+        const __m128 z = _mm_set1_ps(nearestZ);
+        for (; x + 3 <= x1; x += 4)
+        {
+            if (_mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(row + x), z))) return true;
+        }
+    #endif
+
+        for (; x <= x1; ++x)
+        {
+            if (row[x] < nearestZ) return true;
+        }
+    }
+
+    return false;
+}
+
+void occlusion_culler::test(const std::vector<aabb_3d> & bounds, const std::vector<float4x4> & modelMatrices, std::vector<uint8_t> & visible)
+{
+    assert(bounds.size() == modelMatrices.size());
+
+    visible.resize(bounds.size());
+    for (size_t i = 0; i < bounds.size(); ++i)
+    {
+        visible[i] = is_visible(bounds[i], modelMatrices[i]) ? 1 : 0;
+        stats.tested++;
+        if (!visible[i]) stats.culled++;
+    }
+}
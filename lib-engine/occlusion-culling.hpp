@@ -0,0 +1,97 @@
+/*
+ * CPU occlusion culling in the spirit of Masked Occlusion Culling (Andersson et al. 2015). A handful of
+ * large occluders are rasterized into a low resolution depth buffer, and the screen-space bounds of each
+ * renderable are tested against it before any draw is issued. The buffer stores 1/w, which is affine in
+ * screen space, so interpolated depths are exact at pixel centers and "larger" always means "nearer".
+ *
+ * Occluders are either tagged by an author (typically a low-poly proxy) or chosen automatically by the
+ * screen area of their bounds. The buffer is split into horizontal bands that are rasterized on worker
+ * threads without any synchronization; rows are processed four pixels at a time with SSE2 where available.
+ * Nothing here touches the GPU, so the culler can be exercised and benchmarked headless.
+ */
+
+#pragma once
+
+#ifndef polymer_occlusion_culling_hpp
+#define polymer_occlusion_culling_hpp
+
+#include "math-core.hpp"
+#include "geometry.hpp"
+#include "thread-pool.hpp"
+
+namespace polymer
+{
+    struct occlusion_culling_stats
+    {
+        uint32_t candidates{ 0 };           // occluders offered this frame
+        uint32_t occluders{ 0 };            // occluders selected and rasterized
+        uint32_t triangles{ 0 };            // triangles that reached the rasterizer
+        uint32_t tested{ 0 };               // renderables tested against the buffer
+        uint32_t culled{ 0 };               // renderables found to be occluded or off-screen
+    };
+
+    //////////////////////////
+    //   occlusion_culler   //
+    //////////////////////////
+
+    class occlusion_culler
+    {
+        struct candidate
+        {
+            const runtime_mesh * mesh;
+            float4x4 modelMatrix;
+            float screenArea;
+            bool tagged;
+        };
+
+        struct screen_vertex { float x, y, z; bool valid; };
+
+        struct screen_triangle
+        {
+            float2 v[3];
+            float z[3];
+            float minY, maxY;
+        };
+
+        uint2 size;
+        float4x4 viewProj;
+        std::vector<float> depth;                           // 1/w per pixel, 0 where nothing has been drawn
+        std::vector<candidate> candidates;
+        std::vector<std::vector<screen_triangle>> triangles; // one list per selected occluder
+        occlusion_culling_stats stats;
+
+        bool project_bounds(const aabb_3d & localBounds, const float4x4 & modelMatrix, float2 & screenMin, float2 & screenMax, float & nearestZ) const;
+        void setup_triangles(const candidate & c, std::vector<screen_triangle> & out) const;
+        void rasterize_band(const uint32_t firstRow, const uint32_t lastRow);
+
+    public:
+
+        uint32_t maxOccluders{ 32 };                        // automatically selected occluders; tagged ones are always used
+        float minOccluderArea{ 0.01f };                     // fraction of the screen the bounds of an automatic occluder must cover
+
+        // The width is rounded up to a multiple of four pixels
+        explicit occlusion_culler(const uint2 resolution = { 256, 128 });
+
+        // Clears the buffer and the occluders of the previous frame
+        void begin_frame(const float4x4 & viewProjectionMatrix);
+
+        // Offers a mesh as an occluder; its triangles must be closed or at least front-facing toward the viewer
+        void add_occluder(const runtime_mesh & mesh, const aabb_3d & localBounds, const float4x4 & modelMatrix, const bool tagged);
+
+        // Selects the occluders and fills the depth buffer, on `pool` if one is provided
+        void rasterize(simple_thread_pool * pool = nullptr);
+
+        // True if any part of the bounds may be visible. Does not modify the culler and may be called concurrently.
+        bool is_visible(const aabb_3d & localBounds, const float4x4 & modelMatrix) const;
+
+        // Tests every entry and writes 1 (visible) or 0 to `visible`; records the results in the stats
+        void test(const std::vector<aabb_3d> & bounds, const std::vector<float4x4> & modelMatrices, std::vector<uint8_t> & visible);
+
+        uint2 get_resolution() const { return size; }
+        const std::vector<float> & get_depth_buffer() const { return depth; }
+        const occlusion_culling_stats & get_stats() const { return stats; }
+    };
+
+} // end namespace polymer
+
+#endif // end polymer_occlusion_culling_hpp
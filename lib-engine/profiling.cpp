@@ -0,0 +1,313 @@
+#include "profiling.hpp"
+
+#include <algorithm>
+
+using namespace polymer;
+
+namespace
+{
+    std::atomic<uint64_t> next_profiler_instance{ 1 };
+
+    poly_hash_value scope_key(const poly_hash_value id, const uint32_t index)
+    {
+        return id ^ (static_cast<poly_hash_value>(index) * 0x9E3779B97F4A7C15ull);
+    }
+
+    void write_json_string(std::ostream & out, const char * str)
+    {
+        out << '"';
+        for (const char * c = str; c && *c; ++c)
+        {
+            if (*c == '"' || *c == '\\') out << '\\';
+            out << *c;
+        }
+        out << '"';
+    }
+}
+
+//////////////////
+//   profiler   //
+//////////////////
+
+profiler::profiler(const size_t historyFrames)
+    : instance(next_profiler_instance++), epoch(std::chrono::steady_clock::now()), history(std::max<size_t>(historyFrames, 1))
+{
+
+}
+
+profiler::~profiler()
+{
+
+}
+
+void profiler::set_enabled(const bool newState)
+{
+    enabled.store(newState, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> guard(historyMutex);
+    historyHead = 0;
+    historyCount = 0;
+}
+
+uint64_t profiler::now_ns() const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+// Buffers are owned by the profiler. Each thread caches the buffer it was given per profiler instance,
+// so the registry mutex is only taken the first time a thread records into a given profiler. Instance
+// ids are never reused, so entries left behind by destroyed profilers are never matched again.
+profile_thread_buffer & profiler::local_buffer()
+{
+    static thread_local std::vector<std::pair<uint64_t, profile_thread_buffer *>> cache;
+
+    for (auto & entry : cache)
+    {
+        if (entry.first == instance) return *entry.second;
+    }
+
+    std::lock_guard<std::mutex> guard(threadMutex);
+    threads.emplace_back(new profile_thread_buffer(static_cast<uint32_t>(threads.size())));
+    threads.back()->name = "thread " + std::to_string(threads.size() - 1);
+    cache.emplace_back(instance, threads.back().get());
+    return *threads.back();
+}
+
+void profiler::set_thread_name(const std::string & name)
+{
+    profile_thread_buffer & buffer = local_buffer();
+    std::lock_guard<std::mutex> guard(threadMutex);
+    buffer.name = name;
+}
+
+uint16_t profiler::enter_scope()
+{
+    return local_buffer().depth++;
+}
+
+void profiler::leave_scope(const profile_marker & marker, const uint32_t index, const uint64_t begin_ns, const uint16_t depth)
+{
+    profile_thread_buffer & buffer = local_buffer();
+    buffer.depth = depth;
+
+    profile_sample s;
+    s.id = marker.id;
+    s.name = marker.name;
+    s.begin_ns = begin_ns;
+    s.end_ns = now_ns();
+    s.frame = get_frame_index();
+    s.index = index;
+    s.thread = buffer.thread;
+    s.depth = depth;
+    s.type = profile_sample_type::cpu;
+    buffer.push(s);
+}
+
+void profiler::begin_gpu_scope(const profile_marker & marker, const uint32_t index)
+{
+    // The timer only opens a slot for frames that issue gpu scopes
+    const uint64_t frame = get_frame_index();
+    if (gpuFrames.empty() || gpuFrames.back().frame != frame)
+    {
+        gpuTimer.begin_frame(frame, now_ns());
+        gpuFrames.push_back({ frame, {} });
+    }
+
+    const uint32_t scope = gpuTimer.start();
+    gpuFrames.back().scopes.push_back({ marker.name, marker.id, index, static_cast<uint16_t>(gpuScopeStack.size()) });
+    assert(scope + 1 == gpuFrames.back().scopes.size());
+    gpuScopeStack.push_back(scope);
+}
+
+void profiler::end_gpu_scope()
+{
+    if (gpuScopeStack.empty()) return;
+    gpuTimer.stop(gpuScopeStack.back());
+    gpuScopeStack.pop_back();
+}
+
+void profiler::end_frame()
+{
+    const uint64_t frameEnd = now_ns();
+
+    // Poll (never wait on) the timestamps of previous frames
+    assert(gpuScopeStack.empty() && "gpu profile scope left open across frames");
+    gpuTimer.end_frame();
+
+    resolvedGpuSamples.clear();
+    gpuTimer.collect([this](const gl_gpu_timer::result & r)
+    {
+        while (!gpuFrames.empty() && gpuFrames.front().frame < r.frame) gpuFrames.pop_front();
+        assert(!gpuFrames.empty() && gpuFrames.front().frame == r.frame);
+
+        const gpu_scope_record & record = gpuFrames.front().scopes[r.scope];
+
+        profile_sample s;
+        s.id = record.id;
+        s.name = record.name;
+        s.begin_ns = r.begin_ns;
+        s.end_ns = r.end_ns;
+        s.frame = r.frame;
+        s.index = record.index;
+        s.thread = profile_sample::no_index;
+        s.depth = record.depth;
+        s.type = profile_sample_type::gpu;
+        resolvedGpuSamples.push_back(s);
+    });
+
+    const uint64_t outstanding = gpuTimer.oldest_outstanding_frame();
+    while (!gpuFrames.empty() && gpuFrames.front().frame < outstanding) gpuFrames.pop_front();
+
+    const auto by_start_time = [](const profile_sample & a, const profile_sample & b)
+    {
+        if (a.begin_ns != b.begin_ns) return a.begin_ns < b.begin_ns;
+        return a.depth < b.depth;
+    };
+
+    {
+        std::lock_guard<std::mutex> historyGuard(historyMutex);
+
+        profile_frame & f = history[historyHead];
+        f.index = get_frame_index();
+        f.begin_ns = frameBegin;
+        f.end_ns = frameEnd;
+        f.dropped = 0;
+        f.samples.clear();
+
+        {
+            std::lock_guard<std::mutex> threadGuard(threadMutex);
+            for (auto & t : threads) f.dropped += t->drain(f.samples);
+        }
+
+        // Parents close after their children, so sort by start time to restore the call order
+        std::sort(f.samples.begin(), f.samples.end(), by_start_time);
+
+        historyHead = (historyHead + 1) % history.size();
+        historyCount = std::min(historyCount + 1, history.size());
+
+        // File gpu samples under the frame that issued them; if it has left the history already,
+        // they are kept with the current one rather than dropped
+        for (const auto & s : resolvedGpuSamples)
+        {
+            profile_frame * target = &f;
+            for (size_t i = 0; i < historyCount; ++i)
+            {
+                profile_frame & candidate = history[(historyHead + history.size() - 1 - i) % history.size()];
+                if (candidate.index == s.frame) { target = &candidate; break; }
+            }
+            target->samples.insert(std::upper_bound(target->samples.begin(), target->samples.end(), s, by_start_time), s);
+        }
+    }
+
+    frameBegin = frameEnd;
+    frameIndex.fetch_add(1, std::memory_order_relaxed);
+}
+
+void profiler::for_each_frame(const std::function<void(const profile_frame &)> & fn) const
+{
+    std::lock_guard<std::mutex> guard(historyMutex);
+    const size_t first = (historyHead + history.size() - historyCount) % history.size();
+    for (size_t i = 0; i < historyCount; ++i)
+    {
+        fn(history[(first + i) % history.size()]);
+    }
+}
+
+std::vector<profile_summary> profiler::get_summary(const size_t numFrames) const
+{
+    struct accumulator
+    {
+        profile_summary summary;
+        uint64_t lastFrame;
+        double frameTotal;
+        double total;
+        size_t order;
+    };
+
+    std::unordered_map<poly_hash_value, accumulator> scopes;
+    size_t order = 0;
+
+    std::lock_guard<std::mutex> guard(historyMutex);
+    const size_t count = std::min(numFrames, historyCount);
+
+    // Walk from the most recent frame backwards so the ordering reflects the latest frame
+    for (size_t i = 0; i < count; ++i)
+    {
+        const profile_frame & f = history[(historyHead + history.size() - 1 - i) % history.size()];
+
+        for (const auto & s : f.samples)
+        {
+            const poly_hash_value key = scope_key(s.id, s.index) ^ static_cast<poly_hash_value>(s.type);
+            auto it = scopes.find(key);
+            if (it == scopes.end())
+            {
+                accumulator a = {};
+                a.summary = { s.name, s.index, s.depth, s.type, 0.0, 0.0, 0 };
+                a.lastFrame = ~0ull;
+                a.order = order++;
+                it = scopes.emplace(key, a).first;
+            }
+
+            // A scope entered several times within a frame (e.g. on every worker) is accumulated
+            accumulator & a = it->second;
+            if (a.lastFrame != f.index)
+            {
+                if (a.summary.count) a.summary.max_ms = std::max(a.summary.max_ms, a.frameTotal);
+                a.lastFrame = f.index;
+                a.frameTotal = 0.0;
+                a.summary.count++;
+            }
+            a.frameTotal += s.duration_ms();
+            a.total += s.duration_ms();
+        }
+    }
+
+    std::vector<accumulator *> sorted;
+    for (auto & kvp : scopes)
+    {
+        accumulator & a = kvp.second;
+        a.summary.max_ms = std::max(a.summary.max_ms, a.frameTotal);
+        a.summary.average_ms = a.total / a.summary.count;
+        sorted.push_back(&a);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const accumulator * a, const accumulator * b) { return a->order < b->order; });
+
+    std::vector<profile_summary> result;
+    for (auto * a : sorted) result.push_back(a->summary);
+    return result;
+}
+
+void profiler::export_chrome_trace(std::ostream & out) const
+{
+    const uint32_t gpuTrack = 0xFFFF;
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+    {
+        std::lock_guard<std::mutex> guard(threadMutex);
+        for (auto & t : threads)
+        {
+            out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << t->thread << ",\"args\":{\"name\":";
+            write_json_string(out, t->name.c_str());
+            out << "}},\n";
+        }
+    }
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << gpuTrack << ",\"args\":{\"name\":\"gpu\"}}";
+
+    for_each_frame([&](const profile_frame & f)
+    {
+        for (const auto & s : f.samples)
+        {
+            const bool gpu = (s.type == profile_sample_type::gpu);
+            out << ",\n{\"name\":";
+            write_json_string(out, s.name);
+            out << ",\"cat\":\"" << (gpu ? "gpu" : "cpu") << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << (gpu ? gpuTrack : s.thread);
+            out << ",\"ts\":" << std::fixed << (s.begin_ns * 1e-3) << ",\"dur\":" << ((s.end_ns - s.begin_ns) * 1e-3) << std::defaultfloat;
+            out << ",\"args\":{\"frame\":" << s.frame;
+            if (s.index != profile_sample::no_index) out << ",\"index\":" << s.index;
+            out << "}}";
+        }
+    });
+
+    out << "\n]}\n";
+}
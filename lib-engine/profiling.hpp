@@ -1,8 +1,14 @@
 /*
- * A profiler can be templated on either a `simple_cpu_timer` or `gl_gpu_timer`
- * These timers are completely unrelated, but use the notion of an implicit interface
- * at compile time, such that both objects implement function signatures for 
- * start(), stop(), and elapsed_ms().
+ * Hierarchical scoped profiler. Scopes are identified by a name with static storage duration
+ * (a string literal) and its compile-time hash, so opening a scope never allocates or builds
+ * a string. Each thread that records samples owns a single-producer ring buffer; the thread
+ * driving the profiler drains all of them once per frame in end_frame(), which makes it safe to
+ * instrument work executing on thread pools. GPU scopes are timed with the timestamp ring in
+ * `gl_gpu_timer` and resolved without blocking a few frames later; resolved GPU samples are filed
+ * under the frame that issued them, so both timelines of a frame can be read side by side.
+ *
+ * Collected frames are kept in a rolling history that can be summarized for on-screen display
+ * or written out in the Chrome `trace_event` format (chrome://tracing, ui.perfetto.dev).
  */
 
 #pragma once
@@ -10,58 +16,271 @@
 #ifndef polymer_profiling_hpp
 #define polymer_profiling_hpp
 
-#include "queue-circular.hpp"
 #include "gfx/gl/gl-async-gpu-timer.hpp"
 #include "simple_timer.hpp"
+#include "util.hpp"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <memory>
+#include <ostream>
 
 namespace polymer
 {
-    template<typename T>
+    // A name and its hash, normally created at compile time by the POLYMER_PROFILE_* macros
+    struct profile_marker
+    {
+        poly_hash_value id;
+        const char * name;
+
+        template<size_t N>
+        constexpr profile_marker(const char(&str)[N]) : id(const_hash(str)), name(str) {}
+    };
+
+    enum class profile_sample_type : uint8_t
+    {
+        cpu,
+        gpu
+    };
+
+    struct profile_sample
+    {
+        static const uint32_t no_index = ~0u;
+
+        poly_hash_value id{ 0 };
+        const char * name{ nullptr };
+        uint64_t begin_ns{ 0 };             // relative to the construction of the profiler
+        uint64_t end_ns{ 0 };
+        uint64_t frame{ 0 };                // frame the sample was opened in
+        uint32_t index{ no_index };         // optional disambiguator, e.g. the view being rendered
+        uint32_t thread{ 0 };               // registration order of the recording thread
+        uint16_t depth{ 0 };                // nesting depth on the recording thread
+        profile_sample_type type{ profile_sample_type::cpu };
+
+        double duration_ms() const { return (end_ns - begin_ns) * 1e-6; }
+    };
+
+    struct profile_frame
+    {
+        uint64_t index{ 0 };
+        uint64_t begin_ns{ 0 };
+        uint64_t end_ns{ 0 };
+        uint32_t dropped{ 0 };              // samples lost to full thread buffers
+        std::vector<profile_sample> samples;
+    };
+
+    // Per-scope statistics over the recent history, ordered as the scopes appeared in the last frame
+    struct profile_summary
+    {
+        const char * name;
+        uint32_t index;
+        uint16_t depth;
+        profile_sample_type type;
+        double average_ms;
+        double max_ms;
+        uint32_t count;                     // number of frames the scope appeared in
+
+        std::string label() const
+        {
+            return (index == profile_sample::no_index) ? std::string(name) : std::string(name) + "[" + std::to_string(index) + "]";
+        }
+    };
+
+    //////////////////////////////
+    //   profile_thread_buffer  //
+    //////////////////////////////
+
+    // Lock-free single producer (the owning thread) / single consumer (profiler::end_frame) ring
+    class profile_thread_buffer
+    {
+        static const uint32_t capacity = 4096;
+
+        std::vector<profile_sample> samples;
+        std::atomic<uint32_t> head{ 0 };
+        std::atomic<uint32_t> tail{ 0 };
+        std::atomic<uint32_t> dropped{ 0 };
+
+    public:
+
+        const uint32_t thread;
+        uint16_t depth{ 0 }; // only touched by the owning thread
+        std::string name;
+
+        explicit profile_thread_buffer(const uint32_t thread) : samples(capacity), thread(thread) {}
+
+        void push(const profile_sample & s)
+        {
+            const uint32_t h = head.load(std::memory_order_relaxed);
+            if (h - tail.load(std::memory_order_acquire) == capacity)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            samples[h & (capacity - 1)] = s;
+            head.store(h + 1, std::memory_order_release);
+        }
+
+        uint32_t drain(std::vector<profile_sample> & out)
+        {
+            const uint32_t t = tail.load(std::memory_order_relaxed);
+            const uint32_t h = head.load(std::memory_order_acquire);
+            for (uint32_t i = t; i != h; ++i) out.push_back(samples[i & (capacity - 1)]);
+            tail.store(h, std::memory_order_release);
+            return dropped.exchange(0, std::memory_order_relaxed);
+        }
+    };
+
+    //////////////////
+    //   profiler   //
+    //////////////////
+
     class profiler
     {
-        struct data_point
+        struct gpu_scope_record
         {
-            circular_queue<double> average{ 30 };
-            T timer;
+            const char * name;
+            poly_hash_value id;
+            uint32_t index;
+            uint16_t depth;
         };
 
-        std::unordered_map<std::string, data_point> dataPoints;
+        struct gpu_frame_records
+        {
+            uint64_t frame;
+            std::vector<gpu_scope_record> scopes; // indexed by the scope returned by gl_gpu_timer::start()
+        };
+
+        const uint64_t instance;
+        const std::chrono::steady_clock::time_point epoch;
+
+        std::atomic<bool> enabled{ true };
+        std::atomic<uint64_t> frameIndex{ 0 };
+        uint64_t frameBegin{ 0 };
+
+        mutable std::mutex threadMutex;
+        std::vector<std::unique_ptr<profile_thread_buffer>> threads;
+
+        // Only touched by the thread that owns the GL context and calls end_frame()
+        gl_gpu_timer gpuTimer;
+        std::deque<gpu_frame_records> gpuFrames;
+        std::vector<uint32_t> gpuScopeStack;
+        std::vector<profile_sample> resolvedGpuSamples;
+
+        mutable std::mutex historyMutex;
+        std::vector<profile_frame> history;
+        size_t historyHead{ 0 };
+        size_t historyCount{ 0 };
+
+        profile_thread_buffer & local_buffer();
+
+    public:
+
+        explicit profiler(const size_t historyFrames = 120);
+        ~profiler();
+
+        profiler(const profiler &) = delete;
+        profiler & operator = (const profiler &) = delete;
+
+        void set_enabled(const bool newState);
+        bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+        uint64_t now_ns() const;
+        uint64_t get_frame_index() const { return frameIndex.load(std::memory_order_relaxed); }
+
+        // Label the calling thread in exported traces
+        void set_thread_name(const std::string & name);
+
+        // CPU scopes; may be called from any thread. Prefer profile_scope / POLYMER_PROFILE_SCOPE.
+        uint16_t enter_scope();
+        void leave_scope(const profile_marker & marker, const uint32_t index, const uint64_t begin_ns, const uint16_t depth);
+
+        // GPU scopes; must be called on the thread owning the GL context
+        void begin_gpu_scope(const profile_marker & marker, const uint32_t index = profile_sample::no_index);
+        void end_gpu_scope();
+
+        // Collects every CPU sample recorded since the previous call into the history and starts a new frame.
+        // GPU samples of earlier frames whose results have arrived are added to the frame that issued them.
+        void end_frame();
 
-        bool enabled{ true };
+        // Visits the history from the oldest to the most recent frame
+        void for_each_frame(const std::function<void(const profile_frame &)> & fn) const;
+
+        std::vector<profile_summary> get_summary(const size_t numFrames = 30) const;
+
+        void export_chrome_trace(std::ostream & out) const;
+    };
+
+    ///////////////////////
+    //   profile_scope   //
+    ///////////////////////
+
+    class profile_scope
+    {
+        profiler * p{ nullptr };
+        const profile_marker marker;
+        const uint32_t index;
+        uint64_t begin_ns{ 0 };
+        uint16_t depth{ 0 };
 
     public:
 
-        void set_enabled(bool newState)
+        profile_scope(profiler & prof, const profile_marker & marker, const uint32_t index = profile_sample::no_index) : marker(marker), index(index)
         {
-            enabled = newState;
-            dataPoints.clear();
+            if (!prof.is_enabled()) return;
+            p = &prof;
+            depth = p->enter_scope();
+            begin_ns = p->now_ns();
         }
 
-        void begin(const std::string & id)
+        ~profile_scope() { end(); }
+
+        // Closes the scope before the end of the enclosing block
+        void end()
         {
-            if (!enabled) return;
-            dataPoints[id].timer.start();
+            if (p) p->leave_scope(marker, index, begin_ns, depth);
+            p = nullptr;
         }
 
-        void end(const std::string & id)
+        profile_scope(const profile_scope &) = delete;
+        profile_scope & operator = (const profile_scope &) = delete;
+    };
+
+    class gpu_profile_scope
+    {
+        profiler * p{ nullptr };
+
+    public:
+
+        gpu_profile_scope(profiler & prof, const profile_marker & marker, const uint32_t index = profile_sample::no_index)
         {
-            if (!enabled) return;
-            dataPoints[id].timer.stop();
-            const double t = dataPoints[id].timer.elapsed_ms();
-            if (t > 0.0) dataPoints[id].average.put(t);
+            if (!prof.is_enabled()) return;
+            p = &prof;
+            p->begin_gpu_scope(marker, index);
         }
 
-        std::vector<std::pair<std::string, float>> get_data()
+        ~gpu_profile_scope()
         {
-            std::vector<std::pair<std::string, float>> data;
-            for (auto & d : dataPoints)
-            {
-                data.emplace_back(d.first, static_cast<float>(compute_mean(d.second.average)));
-            }
-            return data;
+            if (p) p->end_gpu_scope();
         }
+
+        gpu_profile_scope(const gpu_profile_scope &) = delete;
+        gpu_profile_scope & operator = (const gpu_profile_scope &) = delete;
     };
 
 } // end namespace polymer
 
+// The marker is a function-local constant, so the name is hashed by the compiler
+#define POLYMER_PROFILE_CONCAT_IMPL(a, b) a##b
+#define POLYMER_PROFILE_CONCAT(a, b) POLYMER_PROFILE_CONCAT_IMPL(a, b)
+
+#define POLYMER_PROFILE_SCOPE(prof, name, ...) \
+    static constexpr polymer::profile_marker POLYMER_PROFILE_CONCAT(profile_marker_, __LINE__){ name }; \
+    polymer::profile_scope POLYMER_PROFILE_CONCAT(profile_scope_, __LINE__)((prof), POLYMER_PROFILE_CONCAT(profile_marker_, __LINE__), ##__VA_ARGS__)
+
+#define POLYMER_PROFILE_GPU_SCOPE(prof, name, ...) \
+    static constexpr polymer::profile_marker POLYMER_PROFILE_CONCAT(profile_gpu_marker_, __LINE__){ name }; \
+    polymer::gpu_profile_scope POLYMER_PROFILE_CONCAT(profile_gpu_scope_, __LINE__)((prof), POLYMER_PROFILE_CONCAT(profile_gpu_marker_, __LINE__), ##__VA_ARGS__)
+
 #endif // end polymer_profiling_hpp
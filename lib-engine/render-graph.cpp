@@ -0,0 +1,310 @@
+#include "render-graph.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+using namespace polymer;
+
+namespace
+{
+    void create_storage(const GLuint texture, const render_target_desc & d)
+    {
+        const GLsizei width = static_cast<GLsizei>(d.size.x), height = static_cast<GLsizei>(d.size.y);
+
+        if (d.samples && d.layers) glTextureStorage3DMultisampleEXT(texture, GL_TEXTURE_2D_MULTISAMPLE_ARRAY, d.samples, d.format, width, height, d.layers, GL_TRUE);
+        else if (d.samples) glTextureStorage2DMultisampleEXT(texture, GL_TEXTURE_2D_MULTISAMPLE, d.samples, d.format, width, height, GL_TRUE);
+        else
+        {
+            const GLenum target = d.layers ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+            if (d.layers) glTextureStorage3DEXT(texture, target, 1, d.format, width, height, d.layers);
+            else glTextureStorage2DEXT(texture, target, 1, d.format, width, height);
+
+            glTextureParameteriEXT(texture, target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTextureParameteriEXT(texture, target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTextureParameteriEXT(texture, target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTextureParameteriEXT(texture, target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+
+        gl_check_error(__FILE__, __LINE__);
+    }
+
+    GLenum depth_attachment(const GLenum format)
+    {
+        return (format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8) ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+    }
+}
+
+uint64_t render_target_desc::size_bytes() const
+{
+    uint64_t texelBytes = 4;
+    switch (format)
+    {
+    case GL_R8: texelBytes = 1; break;
+    case GL_RG8: case GL_R16F: texelBytes = 2; break;
+    case GL_RGBA16F: case GL_RG32F: case GL_DEPTH32F_STENCIL8: texelBytes = 8; break;
+    case GL_RGBA32F: texelBytes = 16; break;
+    }
+    return uint64_t(size.x) * size.y * texelBytes * std::max<uint32_t>(samples, 1) * std::max<uint32_t>(layers, 1);
+}
+
+//////////////////////
+//   render_graph   //
+//////////////////////
+
+const render_graph::resource_node & render_graph::node(const render_resource r) const
+{
+    if (r.id >= resources.size()) throw std::invalid_argument("render_graph: invalid resource");
+    return resources[r.id];
+}
+
+void render_graph::clear()
+{
+    resources.clear();
+    passes.clear();
+    slots.clear();
+    compiled = false;
+}
+
+render_resource render_graph::create_texture(const char * name, const render_target_desc & desc)
+{
+    resource_node n;
+    n.name = name;
+    n.desc = desc;
+    n.transient = true;
+    resources.push_back(n);
+    return { static_cast<uint32_t>(resources.size() - 1) };
+}
+
+render_resource render_graph::import_texture(const char * name, const GLuint texture, const render_target_desc & desc)
+{
+    resource_node n;
+    n.name = name;
+    n.desc = desc;
+    n.texture = texture;
+    resources.push_back(n);
+    return { static_cast<uint32_t>(resources.size() - 1) };
+}
+
+render_resource render_graph::import_state(const char * name)
+{
+    return import_texture(name, 0, {});
+}
+
+void render_graph::export_resource(const render_resource r)
+{
+    node(r);
+    resources[r.id].exported = true;
+}
+
+void render_graph::add_pass(const profile_marker & name, const uint32_t index, std::initializer_list<render_resource> reads,
+    std::initializer_list<render_resource> writes, std::function<void(render_pass_context &)> execute)
+{
+    pass_node pass = { name, index, {}, {}, std::move(execute) };
+
+    for (const render_resource & r : reads)
+    {
+        if (!r.valid()) continue;
+        const resource_node & n = node(r);
+        if (n.transient && !n.written) throw std::runtime_error(std::string("render_graph: ") + name.name + " reads " + n.name + " before any pass writes it");
+        pass.reads.push_back(r.id);
+    }
+
+    for (const render_resource & r : writes)
+    {
+        if (!r.valid()) continue;
+        node(r);
+        resources[r.id].written = true;
+        pass.writes.push_back(r.id);
+    }
+
+    passes.push_back(std::move(pass));
+    compiled = false;
+}
+
+void render_graph::compile()
+{
+    // Walking backwards, a pass is kept if the frame or a later kept pass needs something it writes. Everything
+    // a kept pass writes is needed too, since passes draw over what earlier ones wrote.
+    std::vector<bool> needed(resources.size());
+    for (size_t r = 0; r < resources.size(); ++r) needed[r] = resources[r].exported;
+
+    for (size_t p = passes.size(); p-- > 0;)
+    {
+        pass_node & pass = passes[p];
+        pass.culled = !pass.writes.empty() && std::none_of(pass.writes.begin(), pass.writes.end(), [&](const uint32_t r) { return needed[r]; });
+        if (pass.culled) continue;
+
+        for (const uint32_t r : pass.reads) needed[r] = true;
+        for (const uint32_t r : pass.writes) needed[r] = true;
+    }
+
+    for (resource_node & r : resources)
+    {
+        r.firstPass = ~0u;
+        r.lastPass = 0;
+        r.slot = ~0u;
+    }
+
+    for (uint32_t p = 0; p < passes.size(); ++p)
+    {
+        if (passes[p].culled) continue;
+
+        const auto touch = [&](const uint32_t r)
+        {
+            resources[r].firstPass = std::min<uint32_t>(resources[r].firstPass, p);
+            resources[r].lastPass = std::max<uint32_t>(resources[r].lastPass, p);
+        };
+        for (const uint32_t r : passes[p].reads) touch(r);
+        for (const uint32_t r : passes[p].writes) touch(r);
+    }
+
+    // Transients in the order they come alive each take the first slot of their description that is free by then
+    std::vector<uint32_t> order(resources.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](const uint32_t a, const uint32_t b) { return resources[a].firstPass < resources[b].firstPass; });
+
+    slots.clear();
+    std::vector<uint32_t> slotLastPass;
+    for (const uint32_t r : order)
+    {
+        resource_node & n = resources[r];
+        if (!n.transient || n.firstPass == ~0u) continue;
+
+        uint32_t slot = 0;
+        while (slot < slots.size() && !(slots[slot] == n.desc && slotLastPass[slot] < n.firstPass)) ++slot;
+        if (slot == slots.size())
+        {
+            slots.push_back(n.desc);
+            slotLastPass.push_back(0);
+        }
+
+        n.slot = slot;
+        slotLastPass[slot] = n.lastPass;
+    }
+
+    compiled = true;
+}
+
+void render_graph::assign_textures()
+{
+    // Textures no transient was placed in for a while are released, along with every framebuffer, which may refer to them
+    const size_t poolSize = pool.size();
+    pool.erase(std::remove_if(pool.begin(), pool.end(), [&](const std::unique_ptr<pooled_texture> & t) { return t->unusedFrames >= keepUnusedFrames; }), pool.end());
+    if (pool.size() != poolSize) framebuffers.clear();
+
+    // An imported name seen with another description belongs to a new texture now, so framebuffers using it go too
+    for (const resource_node & n : resources)
+    {
+        if (n.transient || !n.texture) continue;
+
+        auto it = importedTextures.find(n.texture);
+        if (it != importedTextures.end() && it->second == n.desc) continue;
+        importedTextures[n.texture] = n.desc;
+
+        for (auto fb = framebuffers.begin(); fb != framebuffers.end();)
+        {
+            if (std::find(fb->first.begin() + 1, fb->first.end(), n.texture) != fb->first.end()) fb = framebuffers.erase(fb);
+            else ++fb;
+        }
+    }
+
+    for (auto & t : pool) t->assigned = false;
+
+    slotTextures.assign(slots.size(), ~0u);
+    for (uint32_t s = 0; s < slots.size(); ++s)
+    {
+        uint32_t t = 0;
+        while (t < pool.size() && (pool[t]->assigned || !(pool[t]->desc == slots[s]))) ++t;
+        if (t == pool.size())
+        {
+            pool.emplace_back(new pooled_texture());
+            pool.back()->desc = slots[s];
+            create_storage(pool.back()->texture, slots[s]);
+        }
+
+        pool[t]->assigned = true;
+        pool[t]->unusedFrames = 0;
+        slotTextures[s] = t;
+    }
+
+    for (auto & t : pool) if (!t->assigned) ++t->unusedFrames;
+}
+
+void render_graph::execute(profiler & prof)
+{
+    if (!compiled) throw std::runtime_error("render_graph: execute() before compile()");
+
+    assign_textures();
+
+    render_pass_context context(*this);
+    for (pass_node & pass : passes)
+    {
+        if (pass.culled) continue;
+
+        profile_scope cpuScope(prof, pass.name, pass.index);
+        gpu_profile_scope gpuScope(prof, pass.name, pass.index);
+        pass.execute(context);
+    }
+}
+
+uint32_t render_graph::get_culled_pass_count() const
+{
+    return static_cast<uint32_t>(std::count_if(passes.begin(), passes.end(), [](const pass_node & p) { return p.culled; }));
+}
+
+uint64_t render_graph::get_transient_bytes() const
+{
+    uint64_t bytes = 0;
+    for (const render_target_desc & s : slots) bytes += s.size_bytes();
+    return bytes;
+}
+
+uint64_t render_graph::get_unaliased_bytes() const
+{
+    uint64_t bytes = 0;
+    for (const resource_node & r : resources) if (r.transient && r.slot != ~0u) bytes += r.desc.size_bytes();
+    return bytes;
+}
+
+/////////////////////////////
+//   render_pass_context   //
+/////////////////////////////
+
+GLuint render_pass_context::texture(const render_resource r) const
+{
+    const render_graph::resource_node & n = graph.node(r);
+    if (!n.transient) return n.texture;
+    if (n.slot == ~0u) throw std::runtime_error(std::string("render_graph: ") + n.name + " is only used by culled passes");
+    return graph.pool[graph.slotTextures[n.slot]]->texture;
+}
+
+GLuint render_pass_context::framebuffer(std::initializer_list<render_resource> colors, const render_resource depth, const int layer)
+{
+    std::vector<GLuint> key = { static_cast<GLuint>(layer + 1), depth.valid() ? texture(depth) : 0 };
+    for (const render_resource & c : colors) key.push_back(texture(c));
+
+    auto it = graph.framebuffers.find(key);
+    if (it != graph.framebuffers.end()) return it->second;
+
+    gl_framebuffer & fb = graph.framebuffers[key];
+
+    const auto attach = [&](const GLenum attachment, const GLuint tex)
+    {
+        if (layer < 0) glNamedFramebufferTextureEXT(fb, attachment, tex, 0);
+        else glNamedFramebufferTextureLayerEXT(fb, attachment, tex, 0, layer);
+    };
+
+    std::vector<GLenum> drawBuffers;
+    for (size_t c = 0; c < colors.size(); ++c)
+    {
+        drawBuffers.push_back(GL_COLOR_ATTACHMENT0 + static_cast<GLenum>(c));
+        attach(drawBuffers.back(), key[2 + c]);
+    }
+    if (depth.valid()) attach(depth_attachment(desc(depth).format), key[1]);
+
+    if (drawBuffers.empty()) glFramebufferDrawBufferEXT(fb, GL_NONE);
+    else glFramebufferDrawBuffersEXT(fb, static_cast<GLsizei>(drawBuffers.size()), drawBuffers.data());
+
+    fb.check_complete();
+    return fb;
+}
@@ -0,0 +1,179 @@
+/*
+ * Render graph. Every frame the renderer declares its passes in execution order, each with the resources it
+ * reads and writes, instead of running them directly. compile() culls the passes whose results are never
+ * used: a pass is kept if it writes a resource that is exported or read by a later pass that is kept, or if
+ * it writes nothing in the graph at all, since its effects are then outside of it. Writers keep each other,
+ * so passes that draw over the same target in turn are all kept.
+ *
+ * Textures created through the graph are transient. They exist from the first to the last kept pass that uses
+ * them, and transients of the same description whose lifetimes do not overlap are placed in one texture, from
+ * a pool kept across frames. Imported resources are owned elsewhere: textures that must outlive the frame or
+ * were made by an earlier one, and state such as uniform buffers that only orders passes.
+ *
+ * execute() runs the kept passes in order, each inside a cpu and a gpu profiler scope named after it.
+ */
+
+#pragma once
+
+#ifndef polymer_render_graph_hpp
+#define polymer_render_graph_hpp
+
+#include "math-core.hpp"
+#include "gl-api.hpp"
+#include "profiling.hpp"
+
+#include <functional>
+#include <map>
+
+namespace polymer
+{
+    struct render_target_desc
+    {
+        uint2 size;
+        GLenum format{ GL_RGBA8 };      // sized internal format
+        uint32_t samples{ 0 };          // zero for a texture that is not multisampled
+        uint32_t layers{ 0 };           // zero for a 2d texture, otherwise the layers of an array
+
+        uint64_t size_bytes() const;
+    };
+
+    inline bool operator == (const render_target_desc & a, const render_target_desc & b)
+    {
+        return a.size == b.size && a.format == b.format && a.samples == b.samples && a.layers == b.layers;
+    }
+
+    struct render_resource
+    {
+        uint32_t id{ ~0u };
+        bool valid() const { return id != ~0u; }
+    };
+
+    class render_pass_context;
+
+    //////////////////////
+    //   render_graph   //
+    //////////////////////
+
+    class render_graph
+    {
+        struct resource_node
+        {
+            const char * name;
+            render_target_desc desc;
+            GLuint texture{ 0 };                        // of imported textures; zero for imported state
+            bool transient{ false };
+            bool exported{ false };
+            bool written{ false };                      // by a pass declared so far
+            uint32_t firstPass{ ~0u };                  // kept passes using a transient
+            uint32_t lastPass{ 0 };
+            uint32_t slot{ ~0u };                       // shared by the transients placed in the same texture
+        };
+
+        struct pass_node
+        {
+            profile_marker name;
+            uint32_t index;
+            std::vector<uint32_t> reads;
+            std::vector<uint32_t> writes;
+            std::function<void(render_pass_context &)> execute;
+            bool culled{ false };
+        };
+
+        struct pooled_texture
+        {
+            render_target_desc desc;
+            gl_texture_object texture;
+            uint32_t unusedFrames{ 0 };
+            bool assigned{ false };
+        };
+
+        std::vector<resource_node> resources;
+        std::vector<pass_node> passes;
+        std::vector<render_target_desc> slots;          // descriptions of the textures the transients are placed in
+        std::vector<uint32_t> slotTextures;             // index into `pool` per slot, during execute()
+        std::vector<std::unique_ptr<pooled_texture>> pool;
+        std::map<std::vector<GLuint>, gl_framebuffer> framebuffers;
+        std::map<GLuint, render_target_desc> importedTextures;  // as last imported, by texture name
+        bool compiled{ false };
+
+        const resource_node & node(const render_resource r) const;
+        void assign_textures();
+
+        friend class render_pass_context;
+
+    public:
+
+        uint32_t keepUnusedFrames{ 8 };                 // frames a pooled texture is kept while no transient is placed in it
+
+        render_graph() = default;
+        render_graph(const render_graph &) = delete;
+        render_graph & operator = (const render_graph &) = delete;
+
+        // Forgets the passes and resources of the last frame; pooled textures and framebuffers are kept
+        void clear();
+
+        // Framebuffers are cached by the names of their textures, and those using an imported name are dropped
+        // when it is imported with a different description. An owner that deletes an imported texture and may get
+        // its name back for one of the same description must call this, or the deleted one stays attached.
+        void release_framebuffers() { framebuffers.clear(); }
+
+        render_resource create_texture(const char * name, const render_target_desc & desc);
+        render_resource import_texture(const char * name, const GLuint texture, const render_target_desc & desc);
+        render_resource import_state(const char * name);
+
+        // Keeps the passes writing `r`, as the result of the frame
+        void export_resource(const render_resource r);
+
+        // Invalid handles are skipped, so optional inputs can be passed as they are. Throws if a transient is
+        // read before any pass has written it.
+        void add_pass(const profile_marker & name, const uint32_t index, std::initializer_list<render_resource> reads,
+            std::initializer_list<render_resource> writes, std::function<void(render_pass_context &)> execute);
+
+        void add_pass(const profile_marker & name, std::initializer_list<render_resource> reads,
+            std::initializer_list<render_resource> writes, std::function<void(render_pass_context &)> execute)
+        {
+            add_pass(name, profile_sample::no_index, reads, writes, std::move(execute));
+        }
+
+        // Culls passes and places the transients; does not touch gl
+        void compile();
+
+        // Must be called on the gl thread after compile()
+        void execute(profiler & prof);
+
+        uint32_t get_pass_count() const { return static_cast<uint32_t>(passes.size()); }
+        uint32_t get_culled_pass_count() const;
+        bool is_culled(const uint32_t pass) const { return passes[pass].culled; }
+
+        // Texture shared by a transient after compile(); transients with equal slots alias
+        uint32_t get_slot(const render_resource r) const { return node(r).slot; }
+        uint32_t get_slot_count() const { return static_cast<uint32_t>(slots.size()); }
+
+        // Bytes of the textures the transients are placed in, and of the transients if none were shared
+        uint64_t get_transient_bytes() const;
+        uint64_t get_unaliased_bytes() const;
+    };
+
+    /////////////////////////////
+    //   render_pass_context   //
+    /////////////////////////////
+
+    class render_pass_context
+    {
+        render_graph & graph;
+
+    public:
+
+        explicit render_pass_context(render_graph & graph) : graph(graph) {}
+
+        GLuint texture(const render_resource r) const;
+        const render_target_desc & desc(const render_resource r) const { return graph.node(r).desc; }
+
+        // A framebuffer with these attachments, created the first time it is asked for; a `layer` of zero or more
+        // attaches that layer of array textures, otherwise they are attached layered
+        GLuint framebuffer(std::initializer_list<render_resource> colors, const render_resource depth = {}, const int layer = -1);
+    };
+
+} // end namespace polymer
+
+#endif // end polymer_render_graph_hpp
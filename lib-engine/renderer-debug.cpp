@@ -0,0 +1,315 @@
+#include "renderer-debug.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace polymer;
+
+namespace
+{
+    const GLsizeiptr min_region_bytes = 64 * 1024;
+    const GLbitfield ring_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    constexpr const char debug_line_vert[] = R"(#version 330
+        layout(location = 0) in vec3 inPosition;
+        layout(location = 1) in vec3 inColor;
+        uniform mat4 u_viewProj;
+        out vec3 v_color;
+        void main()
+        {
+            gl_Position = u_viewProj * vec4(inPosition, 1);
+            v_color = inColor;
+        }
+    )";
+
+    // The model matrix of an instance occupies locations 2 to 5. Frusta are drawn through an inverse
+    // projection; their world positions are left homogeneous, which the view projection preserves.
+    constexpr const char debug_instance_vert[] = R"(#version 330
+        layout(location = 0) in vec3 inPosition;
+        layout(location = 1) in vec3 inColor;
+        layout(location = 2) in mat4 inModel;
+        layout(location = 6) in vec4 inInstanceColor;
+        uniform mat4 u_viewProj;
+        out vec3 v_color;
+        void main()
+        {
+            gl_Position = u_viewProj * (inModel * vec4(inPosition, 1));
+            v_color = inColor * inInstanceColor.rgb;
+        }
+    )";
+
+    constexpr const char debug_frag[] = R"(#version 330
+        in vec3 v_color;
+        out vec4 f_color;
+        void main() { f_color = vec4(v_color, 1); }
+    )";
+
+    GLsizeiptr align_bytes(const GLsizeiptr bytes) { return (bytes + 15) & ~GLsizeiptr(15); }
+
+    float4x4 make_box_model(const aabb_3d & bounds)
+    {
+        return make_translation_matrix(bounds.center()) * make_scaling_matrix(bounds.size() * 0.5f);
+    }
+}
+
+debug_primitive_geometry polymer::make_debug_primitives(const uint32_t sphereSegments)
+{
+    debug_primitive_geometry g;
+    const float3 white = { 1, 1, 1 };
+
+    const auto begin = [&](const debug_primitive p) { g.first[(uint32_t) p] = static_cast<uint32_t>(g.vertices.size()); };
+    const auto end = [&](const debug_primitive p) { g.count[(uint32_t) p] = static_cast<uint32_t>(g.vertices.size()) - g.first[(uint32_t) p]; };
+
+    // Great circles around x, y and z
+    begin(debug_primitive::sphere);
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        for (uint32_t s = 0; s < sphereSegments; ++s)
+        {
+            for (const uint32_t i : { s, s + 1 })
+            {
+                const float angle = float(POLYMER_TAU) * i / sphereSegments;
+                const float u = std::cos(angle), v = std::sin(angle);
+                float3 p;
+                p[axis] = 0.f;
+                p[(axis + 1) % 3] = u;
+                p[(axis + 2) % 3] = v;
+                g.vertices.push_back({ p, white });
+            }
+        }
+    }
+    end(debug_primitive::sphere);
+
+    // Every edge joins two corners that differ in one bit
+    begin(debug_primitive::box);
+    for (uint32_t corner = 0; corner < 8; ++corner)
+    {
+        for (const uint32_t bit : { 1u, 2u, 4u })
+        {
+            if (corner & bit) continue;
+            const uint32_t other = corner | bit;
+            for (const uint32_t c : { corner, other })
+            {
+                g.vertices.push_back({ float3(c & 1 ? 1.f : -1.f, c & 2 ? 1.f : -1.f, c & 4 ? 1.f : -1.f), white });
+            }
+        }
+    }
+    end(debug_primitive::box);
+
+    begin(debug_primitive::axis);
+    for (uint32_t axis = 0; axis < 3; ++axis)
+    {
+        float3 direction = { 0, 0, 0 };
+        direction[axis] = 1.f;
+        g.vertices.push_back({ float3(0, 0, 0), direction });
+        g.vertices.push_back({ direction, direction });
+    }
+    end(debug_primitive::axis);
+
+    return g;
+}
+
+/////////////////////////
+//   debug_draw_list   //
+/////////////////////////
+
+void debug_draw_list::clear()
+{
+    lines.clear();
+    for (auto & i : instances) i.clear();
+    ++version;
+}
+
+void debug_draw_list::draw_line(const float3 & from, const float3 & to, const float3 color)
+{
+    lines.push_back({ from, color });
+    lines.push_back({ to, color });
+    ++version;
+}
+
+void debug_draw_list::draw_line(const transform & pose, const float3 & from, const float3 & to, const float3 color)
+{
+    draw_line(pose.transform_coord(from), pose.transform_coord(to), color);
+}
+
+void debug_draw_list::draw_box(const aabb_3d & world_bounds, const float3 color)
+{
+    draw_instance(debug_primitive::box, make_box_model(world_bounds), color);
+}
+
+void debug_draw_list::draw_box(const transform & pose, const aabb_3d & local_bounds, const float3 color)
+{
+    draw_instance(debug_primitive::box, pose.matrix() * make_box_model(local_bounds), color);
+}
+
+void debug_draw_list::draw_sphere(const transform & pose, const float radius, const float3 color)
+{
+    draw_instance(debug_primitive::sphere, pose.matrix() * make_scaling_matrix(radius), color);
+}
+
+void debug_draw_list::draw_axis(const transform & pose, const float3 color, const float length)
+{
+    draw_instance(debug_primitive::axis, pose.matrix() * make_scaling_matrix(length), color);
+}
+
+void debug_draw_list::draw_frustum(const float4x4 & viewProjectionMatrix, const float3 color)
+{
+    draw_instance(debug_primitive::box, inverse(viewProjectionMatrix), color);
+}
+
+void debug_draw_list::draw_instance(const debug_primitive primitive, const float4x4 & model, const float3 color)
+{
+    instances[(uint32_t) primitive].push_back({ model, float4(color, 1) });
+    ++version;
+}
+
+size_t debug_draw_list::get_shape_count() const
+{
+    size_t count = lines.size() / 2;
+    for (auto & i : instances) count += i.size();
+    return count;
+}
+
+size_t debug_draw_list::get_size_bytes() const
+{
+    size_t bytes = align_bytes(lines.size() * sizeof(debug_vertex));
+    for (auto & i : instances) bytes += align_bytes(i.size() * sizeof(debug_instance));
+    return bytes;
+}
+
+////////////////////////
+//   renderer_debug   //
+////////////////////////
+
+renderer_debug::renderer_debug()
+{
+    lineShader = gl_shader(debug_line_vert, debug_frag);
+    instanceShader = gl_shader(debug_instance_vert, debug_frag);
+
+    primitives = make_debug_primitives();
+    glNamedBufferStorageEXT(primitiveBuffer, primitives.vertices.size() * sizeof(debug_vertex), primitives.vertices.data(), 0);
+
+    glEnableVertexArrayAttribEXT(instanceArray, 0);
+    glEnableVertexArrayAttribEXT(instanceArray, 1);
+    glVertexArrayVertexAttribOffsetEXT(instanceArray, primitiveBuffer, 0, 3, GL_FLOAT, GL_FALSE, sizeof(debug_vertex), offsetof(debug_vertex, position));
+    glVertexArrayVertexAttribOffsetEXT(instanceArray, primitiveBuffer, 1, 3, GL_FLOAT, GL_FALSE, sizeof(debug_vertex), offsetof(debug_vertex, color));
+    for (GLuint index = 2; index <= 6; ++index)
+    {
+        glEnableVertexArrayAttribEXT(instanceArray, index);
+        glVertexArrayVertexAttribDivisorEXT(instanceArray, index, 1);
+    }
+
+    glEnableVertexArrayAttribEXT(lineArray, 0);
+    glEnableVertexArrayAttribEXT(lineArray, 1);
+
+    gl_check_error(__FILE__, __LINE__);
+}
+
+renderer_debug::~renderer_debug()
+{
+    for (auto & r : regions) if (r.fence) glDeleteSync(r.fence);
+}
+
+void renderer_debug::wait_region(const uint32_t r)
+{
+    GLsync & fence = regions[r].fence;
+    if (!fence) return;
+
+    // Only reached when the gpu is more than two debug uploads behind
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+    glDeleteSync(fence);
+    fence = nullptr;
+}
+
+void renderer_debug::reserve(const GLsizeiptr bytes)
+{
+    if (bytes <= regionBytes) return;
+
+    for (uint32_t r = 0; r < ring_regions; ++r) wait_region(r);
+
+    regionBytes = std::max(regionBytes, min_region_bytes);
+    while (regionBytes < bytes) regionBytes *= 2;
+
+    // Storage is immutable, so a larger ring is a new buffer; the old one is unmapped when deleted
+    ring = gl_buffer();
+    ring.size = regionBytes * ring_regions;
+    glNamedBufferStorageEXT(ring, ring.size, nullptr, ring_flags);
+    mapped = static_cast<uint8_t *>(glMapNamedBufferRangeEXT(ring, 0, ring.size, ring_flags));
+    if (!mapped) throw std::runtime_error("renderer_debug: could not map the ring buffer");
+}
+
+void renderer_debug::upload()
+{
+    reserve(static_cast<GLsizeiptr>(get_size_bytes()));
+
+    region = (region + 1) % ring_regions;
+    wait_region(region);
+
+    uint8_t * out = mapped + region * regionBytes;
+    GLintptr offset = 0;
+
+    const std::vector<debug_vertex> & l = get_lines();
+    if (!l.empty()) std::memcpy(out, l.data(), l.size() * sizeof(debug_vertex));
+    offset += align_bytes(l.size() * sizeof(debug_vertex));
+
+    for (uint32_t p = 0; p < (uint32_t) debug_primitive::count; ++p)
+    {
+        const std::vector<debug_instance> & i = get_instances((debug_primitive) p);
+        if (!i.empty()) std::memcpy(out + offset, i.data(), i.size() * sizeof(debug_instance));
+        instanceOffsets[p] = offset;
+        offset += align_bytes(i.size() * sizeof(debug_instance));
+    }
+
+    uploadedVersion = get_version();
+}
+
+void renderer_debug::draw(const float4x4 & viewProjectionMatrix)
+{
+    drawCalls = 0;
+    if (get_shape_count() == 0) return;
+
+    if (uploadedVersion != get_version()) upload();
+    const GLintptr base = region * regionBytes;
+
+    const GLsizei lineVertices = static_cast<GLsizei>(get_lines().size());
+    if (lineVertices)
+    {
+        glVertexArrayVertexAttribOffsetEXT(lineArray, ring, 0, 3, GL_FLOAT, GL_FALSE, sizeof(debug_vertex), base + offsetof(debug_vertex, position));
+        glVertexArrayVertexAttribOffsetEXT(lineArray, ring, 1, 3, GL_FLOAT, GL_FALSE, sizeof(debug_vertex), base + offsetof(debug_vertex, color));
+
+        lineShader.bind();
+        lineShader.uniform("u_viewProj", viewProjectionMatrix);
+        gl_state().bind_vertex_array(lineArray);
+        glDrawArrays(GL_LINES, 0, lineVertices);
+        lineShader.unbind();
+        ++drawCalls;
+    }
+
+    instanceShader.bind();
+    instanceShader.uniform("u_viewProj", viewProjectionMatrix);
+    gl_state().bind_vertex_array(instanceArray);
+
+    for (uint32_t p = 0; p < (uint32_t) debug_primitive::count; ++p)
+    {
+        const GLsizei count = static_cast<GLsizei>(get_instances((debug_primitive) p).size());
+        if (!count) continue;
+
+        const GLintptr offset = base + instanceOffsets[p];
+        for (GLuint column = 0; column < 4; ++column)
+        {
+            glVertexArrayVertexAttribOffsetEXT(instanceArray, ring, 2 + column, 4, GL_FLOAT, GL_FALSE, sizeof(debug_instance), offset + offsetof(debug_instance, model) + column * sizeof(float4));
+        }
+        glVertexArrayVertexAttribOffsetEXT(instanceArray, ring, 6, 4, GL_FLOAT, GL_FALSE, sizeof(debug_instance), offset + offsetof(debug_instance, color));
+
+        glDrawArraysInstanced(GL_LINES, primitives.first[p], primitives.count[p], count);
+        ++drawCalls;
+    }
+
+    instanceShader.unbind();
+
+    // The region may not be written again until the gpu has read it
+    if (regions[region].fence) glDeleteSync(regions[region].fence);
+    regions[region].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    gl_check_error(__FILE__, __LINE__);
+}
@@ -1,3 +1,15 @@
+/*
+ * Debug drawing. Shapes are recorded into a debug_draw_list over the course of a frame: lines as pairs of
+ * vertices, and spheres, boxes, axes and frusta as instances of a few unit line primitives, each with a
+ * transform and a color. Recording a shape never builds geometry, so thousands of octree cells or collider
+ * bounds cost a matrix and a color each.
+ *
+ * renderer_debug copies the list into one region of a persistently mapped ring buffer and draws it with a
+ * single draw for the lines and one instanced draw per primitive type. Regions are fenced and reused in turn,
+ * so writing the next frame's shapes never waits on the gpu reading the previous ones; the ring grows when a
+ * frame does not fit in a region.
+ */
+
 #pragma once
 
 #ifndef polymer_renderer_debug_hpp
@@ -5,100 +17,126 @@
 
 #include "math-core.hpp"
 #include "gl-api.hpp"
-#include "procedural_mesh.hpp"
 
 namespace polymer
 {
-    class renderer_debug
+    struct debug_vertex
     {
-        struct Vertex { float3 position; float3 color; };
-        std::vector<Vertex> vertices;
-
-        gl_mesh payload;
-        gl_shader shader;
-
-        constexpr static const char debugVertexShader[] = R"(#version 330 
-            layout(location = 0) in vec3 v; 
-            layout(location = 1) in vec3 c; 
-            uniform mat4 u_mvp; 
-            out vec3 color; 
-            void main() { gl_Position = u_mvp * vec4(v.xyz, 1); color = c; }
-        )";
-
-        constexpr static const char debugFragmentShader[] = R"(#version 330 
-            in vec3 color; 
-            out vec4 f_color; 
-            void main() { f_color = vec4(color.rgb, 1); }
-        )";
+        float3 position;
+        float3 color;
+    };
 
-    public:
+    struct debug_instance
+    {
+        float4x4 model;
+        float4 color;           // multiplies the colors of the primitive's vertices; alpha is unused
+    };
+
+    // A box spanning [-1, 1] on every axis doubles as the frustum, drawn through an inverse view projection
+    enum class debug_primitive : uint32_t
+    {
+        sphere,
+        box,
+        axis,
+        count
+    };
+
+    // Line lists of the unit primitives in one vertex array: a sphere of radius one as three great circles of
+    // `sphereSegments` lines, the box, and an axis of unit length colored red, green and blue
+    struct debug_primitive_geometry
+    {
+        std::vector<debug_vertex> vertices;
+        uint32_t first[(uint32_t) debug_primitive::count];
+        uint32_t count[(uint32_t) debug_primitive::count];
+    };
 
-        renderer_debug() { shader = gl_shader(debugVertexShader, debugFragmentShader); }
+    debug_primitive_geometry make_debug_primitives(const uint32_t sphereSegments = 32);
 
-        void clear() { vertices.clear(); }
+    /////////////////////////
+    //   debug_draw_list   //
+    /////////////////////////
+
+    class debug_draw_list
+    {
+        std::vector<debug_vertex> lines;
+        std::vector<debug_instance> instances[(uint32_t) debug_primitive::count];
+        uint64_t version{ 0 };  // changes with every shape recorded or cleared
+
+    public:
+
+        void clear();
 
         // World-space
-        void draw_line(const float3 & from, const float3 & to, const float3 color = float3(1, 1, 1))
-        {
-            vertices.push_back({ from, color });
-            vertices.push_back({ to, color });
-        }
+        void draw_line(const float3 & from, const float3 & to, const float3 color = float3(1, 1, 1));
+        void draw_line(const transform & pose, const float3 & from, const float3 & to, const float3 color = float3(1, 1, 1));
 
-        void draw_line(const transform & pose, const float3 & from, const float3 & to, const float3 color = float3(1, 1, 1))
-        {
-            vertices.push_back({ pose.transform_coord(from), color });
-            vertices.push_back({ pose.transform_coord(to), color });
-        }
+        void draw_box(const aabb_3d & world_bounds, const float3 color = float3(1, 1, 1));
+        void draw_box(const transform & pose, const aabb_3d & local_bounds, const float3 color = float3(1, 1, 1));
+        void draw_sphere(const transform & pose, const float radius = 1.f, const float3 color = float3(1, 1, 1));
+        void draw_axis(const transform & pose, const float3 color = float3(1, 1, 1), const float length = 1.f);
 
-        void draw_box(const transform & pose, const aabb_3d & local_bounds, const float3 color = float3(1, 1, 1))
-        {
-            auto unit_cube = make_cube();
+        // Outline of the volume a camera with this view projection matrix sees
+        void draw_frustum(const float4x4 & viewProjectionMatrix, const float3 color = float3(1, 1, 1));
 
-            for (auto & v : unit_cube.vertices)
-            {
-                v *= local_bounds.size() / 2.f; // scale
-                auto tV = pose.transform_coord(v); // translate
-                vertices.push_back({ tV, color });
-            }
-        }
+        // `model` maps the unit primitive into world space
+        void draw_instance(const debug_primitive primitive, const float4x4 & model, const float3 color = float3(1, 1, 1));
 
-        void draw_sphere(const transform & pose, const float radius = 1.f, const float3 color = float3(1, 1, 1))
-        {
-            auto unit_sphere = make_sphere(1.f);
+        const std::vector<debug_vertex> & get_lines() const { return lines; }
+        const std::vector<debug_instance> & get_instances(const debug_primitive primitive) const { return instances[(uint32_t) primitive]; }
+        uint64_t get_version() const { return version; }
 
-            for (auto & v : unit_sphere.vertices)
-            {
-                v *= radius;
-                auto tV = pose.transform_coord(v);
-                vertices.push_back({ tV, color });
-            }
-        }
+        size_t get_shape_count() const;
+        size_t get_size_bytes() const;
+    };
 
-        void draw_axis(const transform & pose, const float3 color = float3(1, 1, 1))
-        {
-            auto axis = make_axis();
+    ////////////////////////
+    //   renderer_debug   //
+    ////////////////////////
 
-            for (int i = 0; i < axis.vertices.size(); ++i)
-            {
-                auto v = axis.vertices[i];
-                v = pose.transform_coord(v);
-                vertices.push_back({ v, axis.colors[i].xyz });
-            }
-        }
+    class renderer_debug : public debug_draw_list
+    {
+        static const uint32_t ring_regions = 3;
 
-        void draw(const float4x4 & viewProjectionMatrix)
+        struct ring_region
         {
-            payload.set_vertices(vertices.size(), vertices.data(), GL_STREAM_DRAW);
-            payload.set_attribute(0, &Vertex::position);
-            payload.set_attribute(1, &Vertex::color);
-            payload.set_non_indexed(GL_LINES);
+            GLsync fence{ nullptr };
+        };
+
+        gl_buffer ring;
+        uint8_t * mapped{ nullptr };
+        GLsizeiptr regionBytes{ 0 };
+        ring_region regions[ring_regions];
+        uint32_t region{ 0 };
+        uint64_t uploadedVersion{ ~0ull };
+
+        // Byte offsets within the current region
+        GLintptr instanceOffsets[(uint32_t) debug_primitive::count];
+
+        gl_buffer primitiveBuffer;
+        debug_primitive_geometry primitives;
+        gl_vertex_array_object lineArray;
+        gl_vertex_array_object instanceArray;
+        gl_shader lineShader;
+        gl_shader instanceShader;
+        uint32_t drawCalls{ 0 };
+
+        void wait_region(const uint32_t r);
+        void reserve(const GLsizeiptr bytes);
+        void upload();
+
+    public:
+
+        renderer_debug();
+        ~renderer_debug();
+
+        renderer_debug(const renderer_debug &) = delete;
+        renderer_debug & operator = (const renderer_debug &) = delete;
 
-            shader.bind();
-            shader.uniform("u_mvp", viewProjectionMatrix * Identity4x4);
-            payload.draw_elements();
-            shader.unbind();
-        }
+        // May be called several times a frame, e.g. once per eye; the shapes are uploaded once until they change
+        void draw(const float4x4 & viewProjectionMatrix);
 
+        // Draws issued by the last call to draw()
+        uint32_t get_draw_call_count() const { return drawCalls; }
     };
 
 } // end namespace polymer
@@ -3,9 +3,46 @@
 #include "math-spatial.hpp"
 #include "geometry.hpp"
 #include "system-render.hpp"
+#include "logging.hpp"
 
 #include <execution>
 
+namespace
+{
+    // World space bounds of transformed local bounds (Arvo, "Transforming Axis-Aligned Bounding Boxes")
+    aabb_3d transform_bounds(const aabb_3d & local, const float4x4 & m)
+    {
+        aabb_3d world(m[3].xyz(), m[3].xyz());
+        for (int col = 0; col < 3; ++col)
+        {
+            const float3 a = m[col].xyz() * local._min[col];
+            const float3 b = m[col].xyz() * local._max[col];
+            world._min += min(a, b);
+            world._max += max(a, b);
+        }
+        return world;
+    }
+
+    void create_view_color_texture(gl_texture_2d & texture, const int2 size)
+    {
+        texture.setup(size.x, size.y, GL_RGBA8, GL_RGBA, GL_FLOAT, nullptr, false);
+        glTextureParameteriEXT(texture, GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTextureParameteriEXT(texture, GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTextureParameteriEXT(texture, GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    }
+
+    void clear_view_targets(const GLuint framebuffer, const float4 & color, const bool stencil)
+    {
+        const GLfloat defaultColor[] = { color.x, color.y, color.z, color.w };
+        const GLfloat defaultDepth = 1.f;
+        const GLuint defaultStencil = 0;
+
+        glClearNamedFramebufferfv(framebuffer, GL_COLOR, 0, &defaultColor[0]);
+        glClearNamedFramebufferfv(framebuffer, GL_DEPTH, 0, &defaultDepth);
+        if (stencil) glClearNamedFramebufferuiv(framebuffer, GL_STENCIL, 0, &defaultStencil);
+    }
+}
+
 ////////////////////////////////////////////////
 //   stable_cascaded_shadows implementation   //
 ////////////////////////////////////////////////
@@ -16,9 +53,24 @@ stable_cascaded_shadows::stable_cascaded_shadows()
     shadowArrayDepth.setup(GL_TEXTURE_2D_ARRAY, size, size, uniforms::NUM_CASCADES, GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
     glNamedFramebufferTextureEXT(shadowArrayFramebuffer, GL_DEPTH_ATTACHMENT, shadowArrayDepth, 0);
     shadowArrayFramebuffer.check_complete();
+
+    staticArrayDepth.setup(GL_TEXTURE_2D_ARRAY, size, size, uniforms::NUM_CASCADES, GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glNamedFramebufferTextureEXT(staticArrayFramebuffer, GL_DEPTH_ATTACHMENT, staticArrayDepth, 0);
+    staticArrayFramebuffer.check_complete();
+
+    // The nearest cascade may refresh every frame, each further one half as often
+    for (uint32_t c = 0; c < uniforms::NUM_CASCADES; ++c) staticUpdateInterval[c] = 1u << c;
+
     gl_check_error(__FILE__, __LINE__);
 }
 
+void stable_cascaded_shadows::set_static_caster_hash(const uint64_t hash)
+{
+    if (hash == staticCasterHash) return;
+    staticCasterHash = hash;
+    for (auto & c : cache) c.staticDirty = true;
+}
+
 void stable_cascaded_shadows::update_cascades(const float4x4 & view, const float near, const float far, const float aspectRatio, const float vfov, const float3 & lightDir)
 {
     nearPlanes.clear();
@@ -28,6 +80,21 @@ void stable_cascaded_shadows::update_cascades(const float4x4 & view, const float
     projMatrices.clear();
     shadowMatrices.clear();
 
+    // Cascade centers are snapped in a light-space frame that only depends on the light direction
+    const float4x4 lightRotation = lookat_rh(float3(0, 0, 0), -lightDir).view_matrix();
+    const float4x4 invLightRotation = inverse(lightRotation);
+
+    struct cascade_candidate
+    {
+        float4x4 viewMatrix;
+        float4x4 projMatrix;
+        float3 center;
+        float radius;
+        float2 split;
+        bool adopt;
+    };
+    cascade_candidate candidates[uniforms::NUM_CASCADES];
+
     for (size_t C = 0; C < uniforms::NUM_CASCADES; ++C)
     {
         const float splitIdx = uniforms::NUM_CASCADES;
@@ -74,10 +141,17 @@ void stable_cascaded_shadows::update_cascades(const float4x4 & view, const float
 
         sphereRadius = (std::ceil(sphereRadius * 32.0f) / 32.0f);
 
+        // Snap the center to a grid of snapTexels and grow the cascade by one step, so it still contains
+        // the sphere wherever the centroid lies within the step
+        const float snapStep = std::max(snapTexels, 1.f) * (2.f * sphereRadius / resolution);
+        const float3 lightSpaceCentroid = transform_coord(lightRotation, frustumCentroid);
+        const float3 snappedCentroid = transform_coord(invLightRotation, floor(lightSpaceCentroid / snapStep + 0.5f) * snapStep);
+        sphereRadius += snapStep;
+
         const float3 maxExtents = float3(sphereRadius, sphereRadius, sphereRadius);
         const float3 minExtents = -maxExtents;
 
-        const transform cascadePose = lookat_rh(frustumCentroid + lightDir * -minExtents.z, frustumCentroid);
+        const transform cascadePose = lookat_rh(snappedCentroid + lightDir * -minExtents.z, snappedCentroid);
         const float4x4 splitViewMatrix = cascadePose.view_matrix();
 
         const float3 cascadeExtents = maxExtents - minExtents;
@@ -94,48 +168,152 @@ void stable_cascaded_shadows::update_cascades(const float4x4 & view, const float
         roundOffset.w = 0;
         shadowProjectionMatrix[3] += roundOffset;
 
-        const float4x4 theShadowMatrix = (shadowProjectionMatrix * splitViewMatrix);
+        // A cascade must adopt the new matrices if its cached volume no longer holds the sphere of its split, since
+        // the split is then partly outside of its shadow map. The cube of the cascade holds any sphere within its
+        // half extent of the center, whatever the light direction, less the texel the rounding may shift it by.
+        cascade_cache & cached = cache[C];
+        cached.framesSinceUpdate++;
+
+        const float coveredRadius = cached.radius * (1.f - 2.f / resolution);
+        const bool uncovered = length(frustumCentroid - cached.center) + (sphereRadius - snapStep) > coveredRadius || cached.split != float2(splitNear, splitFar);
+
+        candidates[C] = { splitViewMatrix, shadowProjectionMatrix, snappedCentroid, sphereRadius, float2(splitNear, splitFar), false };
+        candidates[C].adopt = !cacheStaticCasters || !cached.valid || uncovered;
+    }
+
+    // Cascades that could refresh with new matrices share the budget left over, the one waiting longest first
+    staticUpdateMask = 0;
+    uint32_t staticUpdates = 0;
+    for (uint32_t C = 0; C < uniforms::NUM_CASCADES; ++C) if (candidates[C].adopt) staticUpdates++;
+
+    while (staticUpdates < maxStaticUpdatesPerFrame)
+    {
+        uint32_t oldest = uniforms::NUM_CASCADES;
+        for (uint32_t C = 0; C < uniforms::NUM_CASCADES; ++C)
+        {
+            const cascade_cache & cached = cache[C];
+            const bool changed = cached.viewMatrix != candidates[C].viewMatrix || cached.projMatrix != candidates[C].projMatrix;
+            if (candidates[C].adopt || !(changed || cached.staticDirty) || cached.framesSinceUpdate < staticUpdateInterval[C]) continue;
+            if (oldest == uniforms::NUM_CASCADES || cached.framesSinceUpdate > cache[oldest].framesSinceUpdate) oldest = C;
+        }
+        if (oldest == uniforms::NUM_CASCADES) break;
+
+        candidates[oldest].adopt = true;
+        staticUpdates++;
+    }
+
+    for (uint32_t C = 0; C < uniforms::NUM_CASCADES; ++C)
+    {
+        cascade_cache & cached = cache[C];
+        const cascade_candidate & candidate = candidates[C];
+
+        if (candidate.adopt)
+        {
+            cached.viewMatrix = candidate.viewMatrix;
+            cached.projMatrix = candidate.projMatrix;
+            cached.center = candidate.center;
+            cached.radius = candidate.radius;
+            cached.split = candidate.split;
+            cached.nearPlane = -candidate.radius;
+            cached.farPlane = candidate.radius;
+            cached.valid = true;
+            cached.staticDirty = !cacheStaticCasters; // refresh once caching is turned back on
+            cached.framesSinceUpdate = 0;
+            staticUpdateMask |= (1u << C);
+        }
+
+        // Splits are those of the matrices in use; a cascade only keeps old matrices while they cover the same split
+        viewMatrices.push_back(cached.viewMatrix);
+        projMatrices.push_back(cached.projMatrix);
+        shadowMatrices.push_back(cached.projMatrix * cached.viewMatrix);
+        splitPlanes.push_back(cached.split);
+        nearPlanes.push_back(cached.nearPlane);
+        farPlanes.push_back(cached.farPlane);
+    }
+}
 
-        viewMatrices.push_back(splitViewMatrix);
-        projMatrices.push_back(shadowProjectionMatrix);
-        shadowMatrices.push_back(theShadowMatrix);
-        splitPlanes.push_back(float2(splitNear, splitFar));
-        nearPlanes.push_back(-maxExtents.z);
-        farPlanes.push_back(-minExtents.z);
+uint32_t stable_cascaded_shadows::get_cascade_mask(const aabb_3d & worldBounds) const
+{
+    uint32_t mask = 0;
+    for (uint32_t c = 0; c < shadowMatrices.size(); ++c)
+    {
+        float3 ndcMin(std::numeric_limits<float>::max()), ndcMax(std::numeric_limits<float>::lowest());
+        for (int i = 0; i < 8; ++i)
+        {
+            const float3 corner((i & 1) ? worldBounds._max.x : worldBounds._min.x, (i & 2) ? worldBounds._max.y : worldBounds._min.y, (i & 4) ? worldBounds._max.z : worldBounds._min.z);
+            const float3 ndc = transform_coord(shadowMatrices[c], corner);
+            ndcMin = min(ndcMin, ndc);
+            ndcMax = max(ndcMax, ndc);
+        }
+        if (ndcMax.x >= -1.f && ndcMin.x <= 1.f && ndcMax.y >= -1.f && ndcMin.y <= 1.f && ndcMax.z >= -1.f && ndcMin.z <= 1.f) mask |= (1u << c);
     }
+    return mask;
 }
 
-void stable_cascaded_shadows::pre_draw()
+void stable_cascaded_shadows::bind_program()
 {
-    glEnable(GL_DEPTH_TEST);
+    gl_state().enable(GL_DEPTH_TEST);
+    gl_state().depth_mask(GL_TRUE);
 
-    glEnable(GL_CULL_FACE);
-    glCullFace(GL_FRONT);
+    gl_state().enable(GL_CULL_FACE);
+    gl_state().cull_face(GL_FRONT);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, shadowArrayFramebuffer);
-    glViewport(0, 0, static_cast<GLsizei>(resolution), static_cast<GLsizei>(resolution));
-    glClear(GL_DEPTH_BUFFER_BIT);
+    gl_state().viewport_rect(0, 0, static_cast<GLsizei>(resolution), static_cast<GLsizei>(resolution));
 
     auto & shader = program.get()->get_variant()->shader;
 
     shader.bind();
-    shader.uniform("u_cascadeViewMatrixArray", uniforms::NUM_CASCADES, viewMatrices);
-    shader.uniform("u_cascadeProjMatrixArray", uniforms::NUM_CASCADES, projMatrices);
+    shader.uniform(const_hash("u_cascadeViewMatrixArray"), uniforms::NUM_CASCADES, viewMatrices);
+    shader.uniform(const_hash("u_cascadeProjMatrixArray"), uniforms::NUM_CASCADES, projMatrices);
+}
+
+bool stable_cascaded_shadows::begin_static_pass()
+{
+    if (!cacheStaticCasters || !staticUpdateMask) return false;
+
+    const GLsizei size = static_cast<GLsizei>(resolution);
+    const float clearDepth = 1.f;
+    for (uint32_t c = 0; c < uniforms::NUM_CASCADES; ++c)
+    {
+        if (staticUpdateMask & (1u << c)) glClearTexSubImage(staticArrayDepth, 0, 0, 0, c, size, size, 1, GL_DEPTH_COMPONENT, GL_FLOAT, &clearDepth);
+    }
+
+    gl_state().bind_framebuffer(GL_FRAMEBUFFER, staticArrayFramebuffer);
+    bind_program();
+    return true;
+}
+
+void stable_cascaded_shadows::begin_dynamic_pass()
+{
+    const GLsizei size = static_cast<GLsizei>(resolution);
+
+    gl_state().bind_framebuffer(GL_FRAMEBUFFER, shadowArrayFramebuffer);
+
+    if (cacheStaticCasters)
+    {
+        glCopyImageSubData(staticArrayDepth, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, shadowArrayDepth, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, size, size, uniforms::NUM_CASCADES);
+    }
+    else
+    {
+        const float clearDepth = 1.f;
+        glClearTexImage(shadowArrayDepth, 0, GL_DEPTH_COMPONENT, GL_FLOAT, &clearDepth);
+    }
+
+    bind_program();
 }
 
-void stable_cascaded_shadows::update_shadow_matrix(const float4x4 & shadowModelMatrix)
+void stable_cascaded_shadows::update_shadow_matrix(const float4x4 & shadowModelMatrix, const uint32_t cascadeMask)
 {
     auto & shader = program.get()->get_variant()->shader;
-    shader.uniform("u_modelShadowMatrix", shadowModelMatrix);
+    shader.uniform(const_hash("u_modelShadowMatrix"), shadowModelMatrix);
+    shader.uniform(const_hash("u_cascadeMask"), static_cast<int>(cascadeMask));
 }
 
 void stable_cascaded_shadows::post_draw()
 {
-    auto & shader = program.get()->get_variant()->shader; // should this be a call to default()?
-    glCullFace(GL_BACK);
-    glEnable(GL_CULL_FACE);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    shader.unbind();
+    gl_state().cull_face(GL_BACK);
+    gl_state().enable(GL_CULL_FACE);
+    gl_state().bind_framebuffer(GL_FRAMEBUFFER, 0);
 }
 
 GLuint stable_cascaded_shadows::get_output_texture() const
@@ -143,57 +321,713 @@ GLuint stable_cascaded_shadows::get_output_texture() const
     return shadowArrayDepth.id();
 }
 
+////////////////////////////////////////////////
+//   render_payload_snapshot implementation   //
+////////////////////////////////////////////////
+
+void render_payload_snapshot::capture(const render_payload & source)
+{
+    payload = source;
+
+    const size_t numComponents = source.render_components.size();
+    materials.resize(numComponents);
+    meshes.resize(numComponents);
+    world_transforms.resize(numComponents);
+    local_transforms.resize(numComponents);
+    geometries.resize(numComponents);
+
+    for (size_t i = 0; i < numComponents; ++i)
+    {
+        const render_component & src = source.render_components[i];
+        render_component & dst = payload.render_components[i];
+
+        if (src.material) { materials[i] = *src.material; dst.material = &materials[i]; }
+        if (src.mesh) { meshes[i] = *src.mesh; dst.mesh = &meshes[i]; }
+        if (src.world_transform) { world_transforms[i] = *src.world_transform; dst.world_transform = &world_transforms[i]; }
+        if (src.geometry) { geometries[i] = *src.geometry; dst.geometry = &geometries[i]; }
+
+        // The hierarchy is not needed for rendering, so skip copying the list of children
+        if (src.local_transform)
+        {
+            local_transform_component & local = local_transforms[i];
+            local = local_transform_component(src.local_transform->get_entity());
+            local.local_pose = src.local_transform->local_pose;
+            local.local_scale = src.local_transform->local_scale;
+            local.parent = src.local_transform->parent;
+            dst.local_transform = &local;
+        }
+    }
+
+    point_lights.resize(source.point_lights.size());
+    for (size_t i = 0; i < source.point_lights.size(); ++i)
+    {
+        point_lights[i] = *source.point_lights[i];
+        payload.point_lights[i] = &point_lights[i];
+    }
+
+    if (source.sunlight)
+    {
+        sunlight = *source.sunlight;
+        payload.sunlight = &sunlight;
+    }
+}
+
+///////////////////////////////////////////
+//   clustered_lighting implementation   //
+///////////////////////////////////////////
+
+namespace
+{
+    const uint32_t tiles_per_slice = uniforms::LIGHT_CLUSTERS_X * uniforms::LIGHT_CLUSTERS_Y;
+    const uint32_t cluster_count = tiles_per_slice * uniforms::LIGHT_CLUSTERS_Z;
+
+    // Slices are distributed exponentially in view depth so froxels stay roughly cubic
+    uint32_t depth_slice(const float depth, const float4 & params)
+    {
+        const float s = std::log(std::max(depth, 1e-4f)) * params.z + params.w;
+        return static_cast<uint32_t>(clamp(s, 0.f, static_cast<float>(uniforms::LIGHT_CLUSTERS_Z - 1)));
+    }
+
+    float slice_depth(const uint32_t slice, const float near, const float far)
+    {
+        return near * std::pow(far / near, static_cast<float>(slice) / uniforms::LIGHT_CLUSTERS_Z);
+    }
+
+    bool sphere_intersects_aabb(const float3 & center, const float radius, const float3 & bmin, const float3 & bmax)
+    {
+        const float3 closest = clamp(center, bmin, bmax);
+        const float3 d = center - closest;
+        return dot(d, d) <= radius * radius;
+    }
+}
+
+void clustered_lighting::build_froxel_bounds(view_clusters & v, const view_data & view) const
+{
+    const float4x4 invProjection = inverse(view.projectionMatrix);
+
+    // Direction of the ray through a point in ndc, scaled so that it has unit view depth
+    const auto unit_depth_ray = [&](const float nx, const float ny)
+    {
+        const float4 p = invProjection * float4(nx, ny, -1.f, 1.f);
+        const float3 pv = p.xyz() / p.w;
+        return pv / -pv.z;
+    };
+
+    v.bounds.resize(cluster_count);
+    for (uint32_t z = 0; z < uniforms::LIGHT_CLUSTERS_Z; ++z)
+    {
+        const float zNear = slice_depth(z, view.nearClip, view.farClip);
+        const float zFar = slice_depth(z + 1, view.nearClip, view.farClip);
+
+        for (uint32_t y = 0; y < uniforms::LIGHT_CLUSTERS_Y; ++y)
+        {
+            const float ny0 = (static_cast<float>(y) / uniforms::LIGHT_CLUSTERS_Y) * 2.f - 1.f;
+            const float ny1 = (static_cast<float>(y + 1) / uniforms::LIGHT_CLUSTERS_Y) * 2.f - 1.f;
+
+            for (uint32_t x = 0; x < uniforms::LIGHT_CLUSTERS_X; ++x)
+            {
+                const float nx0 = (static_cast<float>(x) / uniforms::LIGHT_CLUSTERS_X) * 2.f - 1.f;
+                const float nx1 = (static_cast<float>(x + 1) / uniforms::LIGHT_CLUSTERS_X) * 2.f - 1.f;
+
+                const float3 rays[4] = { unit_depth_ray(nx0, ny0), unit_depth_ray(nx1, ny0), unit_depth_ray(nx0, ny1), unit_depth_ray(nx1, ny1) };
+
+                froxel_bounds & b = v.bounds[(z * uniforms::LIGHT_CLUSTERS_Y + y) * uniforms::LIGHT_CLUSTERS_X + x];
+                b.min = float3(std::numeric_limits<float>::max());
+                b.max = float3(std::numeric_limits<float>::lowest());
+                for (const float3 & r : rays)
+                {
+                    b.min = min(b.min, min(r * zNear, r * zFar));
+                    b.max = max(b.max, max(r * zNear, r * zFar));
+                }
+            }
+        }
+    }
+
+    v.projection = view.projectionMatrix;
+}
+
+void clustered_lighting::assign_slices(const view_clusters & v, slice_job & job) const
+{
+    job.clusters.resize((job.lastSlice - job.firstSlice) * tiles_per_slice);
+    job.indices.clear();
+    job.tileLights.resize(tiles_per_slice);
+
+    for (uint32_t z = job.firstSlice; z < job.lastSlice; ++z)
+    {
+        for (const uint32_t lightIdx : visibleLights)
+        {
+            const light_bounds & l = viewLights[lightIdx];
+            if (z < l.minSlice || z > l.maxSlice) continue;
+
+            for (uint32_t y = l.minTile.y; y <= l.maxTile.y; ++y)
+            {
+                for (uint32_t x = l.minTile.x; x <= l.maxTile.x; ++x)
+                {
+                    const uint32_t tile = y * uniforms::LIGHT_CLUSTERS_X + x;
+                    const froxel_bounds & b = v.bounds[z * tiles_per_slice + tile];
+                    if (sphere_intersects_aabb(l.viewCenter, l.radius, b.min, b.max)) job.tileLights[tile].push_back(lightIdx);
+                }
+            }
+        }
+
+        for (uint32_t tile = 0; tile < tiles_per_slice; ++tile)
+        {
+            std::vector<uint32_t> & list = job.tileLights[tile];
+            job.clusters[(z - job.firstSlice) * tiles_per_slice + tile] = uint2(static_cast<uint32_t>(job.indices.size()), static_cast<uint32_t>(list.size()));
+            job.indices.insert(job.indices.end(), list.begin(), list.end());
+            list.clear();
+        }
+    }
+}
+
+void clustered_lighting::bin_view(view_clusters & v, const view_data & view, simple_thread_pool & pool)
+{
+    const float near = view.nearClip;
+    const float far = view.farClip;
+    const float logRatio = std::log(far / near);
+    v.depthParams = float4(near, far, uniforms::LIGHT_CLUSTERS_Z / logRatio, -uniforms::LIGHT_CLUSTERS_Z * std::log(near) / logRatio);
+
+    // Froxel bounds only depend on the projection
+    if (v.bounds.empty() || v.projection != view.projectionMatrix) build_froxel_bounds(v, view);
+
+    // Find the depth slices and screen tiles covered by each light
+    viewLights.resize(lights.size());
+    visibleLights.clear();
+    for (uint32_t i = 0; i < lights.size(); ++i)
+    {
+        const uniforms::point_light & light = lights[i];
+        light_bounds & l = viewLights[i];
+        l.viewCenter = transform_coord(view.viewMatrix, light.position);
+        l.radius = light.radius;
+
+        const float depth = -l.viewCenter.z;
+        if (depth + l.radius < near || depth - l.radius > far) continue;
+
+        l.minSlice = depth_slice(std::max(depth - l.radius, near), v.depthParams);
+        l.maxSlice = depth_slice(std::min(depth + l.radius, far), v.depthParams);
+
+        // Project the corners of the view-space bounding box, clamped in front of the near plane
+        float2 ndcMin(1.f), ndcMax(-1.f);
+        for (int c = 0; c < 8; ++c)
+        {
+            float3 corner = l.viewCenter + float3((c & 1) ? l.radius : -l.radius, (c & 2) ? l.radius : -l.radius, (c & 4) ? l.radius : -l.radius);
+            corner.z = std::min<float>(corner.z, -near);
+            const float4 clip = view.projectionMatrix * float4(corner, 1.f);
+            const float2 ndc = clip.xy() / clip.w;
+            ndcMin = min(ndcMin, ndc);
+            ndcMax = max(ndcMax, ndc);
+        }
+        if (ndcMax.x < -1.f || ndcMax.y < -1.f || ndcMin.x > 1.f || ndcMin.y > 1.f) continue;
+
+        const auto to_tile = [](const float ndc, const uint32_t count)
+        {
+            return static_cast<uint32_t>(clamp((ndc * 0.5f + 0.5f) * count, 0.f, static_cast<float>(count - 1)));
+        };
+
+        l.minTile = uint2(to_tile(ndcMin.x, uniforms::LIGHT_CLUSTERS_X), to_tile(ndcMin.y, uniforms::LIGHT_CLUSTERS_Y));
+        l.maxTile = uint2(to_tile(ndcMax.x, uniforms::LIGHT_CLUSTERS_X), to_tile(ndcMax.y, uniforms::LIGHT_CLUSTERS_Y));
+        visibleLights.push_back(i);
+    }
+
+    // Slices are independent, so each job owns a contiguous range of them
+    const uint32_t minLightsPerJob = 16;
+    const uint32_t numJobs = std::max<uint32_t>(1, std::min<uint32_t>(std::thread::hardware_concurrency(), static_cast<uint32_t>(visibleLights.size() / minLightsPerJob)));
+    const uint32_t jobCount = std::min<uint32_t>(numJobs, uniforms::LIGHT_CLUSTERS_Z);
+
+    jobs.resize(jobCount);
+    for (uint32_t j = 0; j < jobCount; ++j)
+    {
+        jobs[j].firstSlice = (uniforms::LIGHT_CLUSTERS_Z * j) / jobCount;
+        jobs[j].lastSlice = (uniforms::LIGHT_CLUSTERS_Z * (j + 1)) / jobCount;
+    }
+
+    if (jobCount == 1)
+    {
+        assign_slices(v, jobs[0]);
+    }
+    else
+    {
+        std::vector<std::future<void>> tasks;
+        for (auto & job : jobs) tasks.emplace_back(pool.enqueue([this, &v, &job]() { assign_slices(v, job); }));
+        for (auto & t : tasks) t.get();
+    }
+
+    // Stitch the per-job lists together
+    v.clusters.resize(cluster_count);
+    v.indices.clear();
+    for (const auto & job : jobs)
+    {
+        const uint32_t base = static_cast<uint32_t>(v.indices.size());
+        const uint32_t firstCluster = job.firstSlice * tiles_per_slice;
+        for (size_t c = 0; c < job.clusters.size(); ++c) v.clusters[firstCluster + c] = uint2(job.clusters[c].x + base, job.clusters[c].y);
+        v.indices.insert(v.indices.end(), job.indices.begin(), job.indices.end());
+    }
+    if (v.indices.empty()) v.indices.push_back(0); // storage buffers may not be empty
+
+    v.clusterBuffer.set_buffer_data(v.clusters.size() * sizeof(uint2), v.clusters.data(), GL_STREAM_DRAW);
+    v.indexBuffer.set_buffer_data(v.indices.size() * sizeof(uint32_t), v.indices.data(), GL_STREAM_DRAW);
+}
+
+void clustered_lighting::update(const std::vector<view_data> & sceneViews, const std::vector<point_light_component *> & pointLights, const float2 & renderSize, simple_thread_pool & pool)
+{
+    lights.clear();
+    for (auto * light : pointLights)
+    {
+        if (light->enabled && light->data.radius > 0.f) lights.push_back(light->data);
+    }
+
+    const uniforms::point_light placeholder = {};
+    if (lights.empty()) lightBuffer.set_buffer_data(sizeof(uniforms::point_light), &placeholder, GL_STREAM_DRAW);
+    else lightBuffer.set_buffer_data(lights.size() * sizeof(uniforms::point_light), lights.data(), GL_STREAM_DRAW);
+
+    views.resize(sceneViews.size());
+    for (size_t i = 0; i < sceneViews.size(); ++i)
+    {
+        if (views[i].renderSize != renderSize) views[i].bounds.clear();
+        views[i].renderSize = renderSize;
+        bin_view(views[i], sceneViews[i], pool);
+    }
+    combinedDirty = true;
+}
+
+float4 clustered_lighting::bind(const uint32_t viewIndex)
+{
+    gl_state_cache & state = gl_state();
+    state.bind_buffer_base(GL_SHADER_STORAGE_BUFFER, uniforms::light_clusters::lights_binding, lightBuffer);
+    state.bind_buffer_base(GL_SHADER_STORAGE_BUFFER, uniforms::light_clusters::clusters_binding, views[viewIndex].clusterBuffer);
+    state.bind_buffer_base(GL_SHADER_STORAGE_BUFFER, uniforms::light_clusters::indices_binding, views[viewIndex].indexBuffer);
+    return views[viewIndex].depthParams;
+}
+
+void clustered_lighting::bind_all_views()
+{
+    if (combinedDirty)
+    {
+        combinedClusters.clear();
+        combinedIndices.clear();
+        for (const auto & v : views)
+        {
+            const uint32_t base = static_cast<uint32_t>(combinedIndices.size());
+            for (const uint2 & c : v.clusters) combinedClusters.push_back(uint2(c.x + base, c.y));
+            combinedIndices.insert(combinedIndices.end(), v.indices.begin(), v.indices.end());
+        }
+        combinedClusterBuffer.set_buffer_data(combinedClusters.size() * sizeof(uint2), combinedClusters.data(), GL_STREAM_DRAW);
+        combinedIndexBuffer.set_buffer_data(combinedIndices.size() * sizeof(uint32_t), combinedIndices.data(), GL_STREAM_DRAW);
+        combinedDirty = false;
+    }
+
+    gl_state_cache & state = gl_state();
+    state.bind_buffer_base(GL_SHADER_STORAGE_BUFFER, uniforms::light_clusters::lights_binding, lightBuffer);
+    state.bind_buffer_base(GL_SHADER_STORAGE_BUFFER, uniforms::light_clusters::clusters_binding, combinedClusterBuffer);
+    state.bind_buffer_base(GL_SHADER_STORAGE_BUFFER, uniforms::light_clusters::indices_binding, combinedIndexBuffer);
+}
+
 /////////////////////////////////////
 //   pbr_renderer implementation   //
 /////////////////////////////////////
 
-void pbr_renderer::update_per_object_uniform_buffer(const transform & p, const float3 & scale, const bool recieveShadow, const view_data & d)
+void pbr_renderer::update_per_object_uniform_buffer(const uniforms::per_object * objects, const uint32_t count)
+{
+    perObject.set_buffer_data(sizeof(uniforms::per_object) * count, objects, GL_STREAM_DRAW);
+}
+
+// Records of a packet are laid out per view, so an instanced stereo draw uploads both eyes at once
+// With gpu culling the draw is sourced from the packet's entry in the indirect buffer, which the cull
+// shader has zeroed if the packet is occluded
+void pbr_renderer::submit_packet(const uint32_t packetIndex, const view_data & view, const render_payload & scene)
+{
+    const draw_packet & packet = drawPackets[packetIndex];
+    const mesh_component * mesh = scene.render_components[packet.mesh_id].mesh;
+
+    if (instanced_stereo()) update_per_object_uniform_buffer(&instanceData[packet.instance_offset], 2);
+    else update_per_object_uniform_buffer(&instanceData[packet.instance_offset + view.index], 1);
+
+    if (frameCulling.hizIndirect) mesh->draw_indirect(packetIndex * sizeof(gl_draw_indirect_command), packet.lod);
+    else if (instanced_stereo()) mesh->draw(2, packet.lod);
+    else mesh->draw(0, packet.lod);
+}
+
+// Runs on the render thread before packets are built, since cpu meshes are resolved through the asset tables
+void pbr_renderer::update_component_bounds(const render_payload & scene)
+{
+    const uint32_t numComponents = static_cast<uint32_t>(scene.render_components.size());
+    componentBounds.assign(numComponents, nullptr);
+
+    ++boundsFrame;
+
+    for (uint32_t i = 0; i < numComponents; ++i)
+    {
+        const render_component & r = scene.render_components[i];
+        if (!r.geometry || !r.geometry->geom.assigned()) continue;
+
+        const runtime_mesh & mesh = r.geometry->geom.get();
+        if (mesh.vertices.empty()) continue;
+
+        // Meshes are rarely edited in place, so a new asset under the name or a new vertex count is a good
+        // enough signal to refresh the bounds
+        cached_bounds & cached = meshBounds[r.geometry->geom.name];
+        if (cached.mesh != &mesh || cached.vertexCount != mesh.vertices.size())
+        {
+            cached.mesh = &mesh;
+            cached.vertexCount = mesh.vertices.size();
+            cached.bounds = compute_bounds(mesh);
+        }
+        cached.frame = boundsFrame;
+        componentBounds[i] = &cached.bounds;
+    }
+
+    // Meshes no longer drawn are forgotten, so a later mesh never inherits their bounds
+    for (auto itr = meshBounds.begin(); itr != meshBounds.end();)
+    {
+        if (itr->second.frame != boundsFrame) itr = meshBounds.erase(itr);
+        else ++itr;
+    }
+}
+
+// Runs on the render thread, since chains are resolved through the asset tables. Workers only touch
+// the selection state of their own components.
+void pbr_renderer::update_component_lods(const render_payload & scene)
+{
+    const uint32_t numComponents = static_cast<uint32_t>(scene.render_components.size());
+    componentLods.assign(numComponents, { nullptr, nullptr });
+    ++lodFrame;
+
+    for (uint32_t i = 0; i < numComponents; ++i)
+    {
+        const render_component & r = scene.render_components[i];
+        cached_lod_chain & cached = meshLodChains[r.mesh->mesh.name];
+        if (cached.frame == 0) cached.chain = lod_chain_handle(r.mesh->mesh.name);
+        cached.frame = lodFrame;
+        if (!cached.chain.assigned() || cached.chain.get().levels.empty()) continue;
+
+        mesh_lod_state & state = lodStates[r.get_entity()];
+        state.lastFrame = lodFrame;
+        componentLods[i] = { &cached.chain.get(), &state };
+    }
+
+    // Meshes no longer drawn are forgotten, so a later mesh under the name resolves its chain anew
+    for (auto itr = meshLodChains.begin(); itr != meshLodChains.end();)
+    {
+        if (itr->second.frame != lodFrame) itr = meshLodChains.erase(itr);
+        else ++itr;
+    }
+
+    // Forget the state of entities that are no longer drawn
+    if (lodStates.size() > 2 * numComponents + 64)
+    {
+        for (auto itr = lodStates.begin(); itr != lodStates.end();)
+        {
+            if (itr->second.lastFrame != lodFrame) itr = lodStates.erase(itr);
+            else ++itr;
+        }
+    }
+}
+
+void pbr_renderer::run_occlusion_culling(const render_payload & scene, const view_data & cullView)
 {
-    uniforms::per_object object = {};
-    object.modelMatrix = p.matrix() * make_scaling_matrix(scale);
-    object.modelMatrixIT = inverse(transpose(object.modelMatrix));
-    object.modelViewMatrix = d.viewMatrix * object.modelMatrix;
-    object.receiveShadow = static_cast<float>(recieveShadow);
-    perObject.set_buffer_data(sizeof(object), &object, GL_STREAM_DRAW);
+    occlusionCuller.begin_frame(cullView.viewProjMatrix);
+
+    for (uint32_t i = 0; i < componentBounds.size(); ++i)
+    {
+        if (!componentBounds[i]) continue;
+        const render_component & r = scene.render_components[i];
+        const float4x4 modelMatrix = r.world_transform->world_pose.matrix() * make_scaling_matrix(r.local_transform->local_scale);
+        occlusionCuller.add_occluder(r.geometry->geom.get(), *componentBounds[i], modelMatrix, r.geometry->occluder);
+    }
+
+    occlusionCuller.rasterize(&packetWorkers);
+}
+
+// Builds the indirect command of every visible packet, along with world space bounds for the cull shader
+void pbr_renderer::run_hiz_culling(const render_payload & scene)
+{
+    const GLuint instances = instanced_stereo() ? 2 : 1;
+
+    indirectCommands.resize(visiblePacketCount);
+    indirectBounds.resize(visiblePacketCount);
+
+    for (uint32_t i = 0; i < visiblePacketCount; ++i)
+    {
+        const draw_packet & packet = drawPackets[i];
+        indirectCommands[i] = scene.render_components[packet.mesh_id].mesh->get_indirect_command(instances, packet.lod);
+
+        hiz_draw_bounds & b = indirectBounds[i];
+        const aabb_3d * local = componentBounds[packet.mesh_id];
+        if (!local)
+        {
+            b.min = b.max = float4(0.f); // never culled
+            continue;
+        }
+
+        const aabb_3d world = transform_bounds(*local, instanceData[packet.instance_offset].modelMatrix);
+        b.min = float4(world._min, 1.f);
+        b.max = float4(world._max, 1.f);
+    }
+
+    hiz->cull_draws(indirectCommands, indirectBounds);
+}
+
+void pbr_renderer::build_draw_packets(const render_payload & scene, const view_data & sortView)
+{
+    // Below this many components per chunk the dispatch overhead outweighs the work
+    static const uint32_t minPacketsPerChunk = 256;
+
+    const uint32_t numComponents = static_cast<uint32_t>(scene.render_components.size());
+    const uint32_t numViews = static_cast<uint32_t>(scene.views.size());
+
+    // Resolving a material variant is expensive and touches the (non thread-safe) asset tables,
+    // so it happens once per unique material here. Workers only read the results.
+    resolvedMaterials.clear();
+    componentMaterials.resize(numComponents);
+    pbrMaterials.clear();
+    const material_view_layout layout = view_layout();
+    for (uint32_t i = 0; i < numComponents; ++i)
+    {
+        material_interface * mat = scene.render_components[i].material->material.get().get();
+        auto itr = resolvedMaterials.find(mat);
+        if (itr == resolvedMaterials.end())
+        {
+            const uint32_t id = mat->id(layout);
+
+            // A variant still compiling in the background is drawn with the fallback until it is ready
+            material_interface * drawn = mat->is_pending(layout) ? get_fallback_material() : mat;
+
+            // Other material types bind their own parameters and ignore the index
+            const polymer_pbr_standard * pbr = dynamic_cast<const polymer_pbr_standard *>(drawn);
+            const uint32_t materialIndex = pbr ? pbrMaterials.add(*pbr) : 0;
+
+            itr = resolvedMaterials.insert({ mat, { drawn, drawn == mat ? id : drawn->id(fallback_layout()), materialIndex } }).first;
+        }
+        componentMaterials[i] = itr->second;
+    }
+    pbrMaterials.upload();
+
+    drawPackets.resize(numComponents);
+    instanceData.resize(numComponents * numViews);
+
+    // We follow the sorting strategy outlined here: http://realtimecollisiondetection.net/blog/?p=86
+    // Sort by material (expensive shader state change), then front-to-back by distance.
+    const auto sort_by_key = [](const draw_packet & lhs, const draw_packet & rhs) { return lhs.sort_key < rhs.sort_key; };
+
+    const bool crossFade = settings.meshLod && settings.lodCrossFade;
+    const float viewportHeight = static_cast<float>(settings.renderSize.y);
+
+    // Projected sizes are measured against every view, so stereo eyes always agree on a level
+    struct projected_component { float pixelsPerUnit; float maxScale; float radius; };
+    const auto project_component = [&](const uint32_t i, const float4x4 & modelMatrix)
+    {
+        const aabb_3d * bounds = componentBounds.empty() ? nullptr : componentBounds[i];
+
+        const float3 scale = float3(length(modelMatrix[0].xyz()), length(modelMatrix[1].xyz()), length(modelMatrix[2].xyz()));
+        const float maxScale = std::max<float>(std::max<float>(scale.x, scale.y), scale.z);
+
+        float3 center = modelMatrix[3].xyz();
+        float radius = 0.f;
+        if (bounds)
+        {
+            center = transform_coord(modelMatrix, bounds->center());
+            radius = length(bounds->size() * scale) * 0.5f;
+        }
+
+        float pixelsPerUnit = 0.f;
+        for (const view_data & v : scene.views)
+        {
+            const float dist = distance(v.pose.position, center) - radius;
+            pixelsPerUnit = std::max(pixelsPerUnit, projected_pixels_per_unit(v.projectionMatrix, viewportHeight, dist));
+        }
+
+        return projected_component{ pixelsPerUnit, maxScale, radius };
+    };
+
+    const auto select_lod = [&](const uint32_t i, const projected_component & p)
+    {
+        const component_lod & lod = componentLods[i];
+        const uint32_t target = select_mesh_lod(*lod.chain, p.pixelsPerUnit * p.maxScale, lod.state->level, settings.lodErrorPixels, settings.lodHysteresis);
+        update_mesh_lod(*lod.state, target, crossFade ? settings.lodFadeFrames : 0);
+    };
+
+    const bool texelSpans = settings.textureStreaming && textureStreamer;
+    componentTexelSpans.resize(texelSpans ? numComponents : 0);
+
+    auto build_range = [&](const uint32_t begin, const uint32_t end, std::vector<draw_packet> & fades)
+    {
+        POLYMER_PROFILE_SCOPE(renderProfiler, "build_packet_range");
+
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            const render_component & r = scene.render_components[i];
+            const float4x4 modelMatrix = r.world_transform->world_pose.matrix() * make_scaling_matrix(r.local_transform->local_scale);
+            const float4x4 modelMatrixIT = inverse(transpose(modelMatrix));
+
+            const mesh_lod_state * lod = componentLods.empty() ? nullptr : componentLods[i].state;
+            const projected_component projected = (lod || texelSpans) ? project_component(i, modelMatrix) : projected_component{ 0.f, 0.f, 0.f };
+            if (lod) select_lod(i, projected);
+            const bool fading = lod && lod->fade < 1.f;
+
+            for (uint32_t v = 0; v < numViews; ++v)
+            {
+                uniforms::per_object & object = instanceData[i * numViews + v];
+                object.modelMatrix = modelMatrix;
+                object.modelMatrixIT = modelMatrixIT;
+                object.modelViewMatrix = scene.views[v].viewMatrix * modelMatrix;
+                object.receiveShadow = static_cast<float>(r.material->receive_shadow);
+                object.lodFade = fading ? lod->fade : 0.f;
+                object.materialIndex = componentMaterials[i].materialIndex;
+                object.pickId = i + 1;
+            }
+
+            // Distances are non-negative, so their bit patterns order the same way as the values
+            float dist = distance(sortView.pose.position, r.world_transform->world_pose.position);
+            uint32_t distBits;
+            std::memcpy(&distBits, &dist, sizeof(distBits));
+
+            draw_packet & packet = drawPackets[i];
+            packet.sort_key = (static_cast<uint64_t>(~componentMaterials[i].id) << 32) | distBits;
+            packet.mesh_id = i;
+            packet.material_id = componentMaterials[i].id;
+            packet.instance_offset = i * numViews;
+            packet.flags = (r.material->cast_shadow ? packet_cast_shadow : 0) | (r.material->receive_shadow ? packet_receive_shadow : 0);
+            packet.lod = lod ? lod->level : 0;
+            if (r.material->static_caster) packet.flags |= packet_static_caster;
+
+            // Occluded packets still cast shadows into the visible part of the scene
+            const aabb_3d * bounds = componentBounds.empty() ? nullptr : componentBounds[i];
+            const bool occluded = bounds && ((frameCulling.software && !occlusionCuller.is_visible(*bounds, modelMatrix)) ||
+                (frameCulling.hizReadback && !hiz->is_visible(*bounds, modelMatrix)));
+
+            if (occluded)
+            {
+                packet.sort_key = ~0ull;
+                packet.flags |= packet_occluded;
+            }
+
+            // The diameter of the bounds on screen, or one unit of the model for components without cpu geometry
+            if (texelSpans) componentTexelSpans[i] = occluded ? 0.f : std::max<float>(projected.radius * 2.f, projected.maxScale) * projected.pixelsPerUnit;
+
+            // The outgoing level is appended once the workers are done; its records are copied from these
+            if (fading)
+            {
+                draw_packet previous = packet;
+                previous.lod = lod->previousLevel;
+                previous.flags |= packet_lod_fade_out;
+                fades.push_back(previous);
+            }
+        }
+
+        std::sort(drawPackets.begin() + begin, drawPackets.begin() + end, sort_by_key);
+    };
+
+    const uint32_t numChunks = std::min<uint32_t>(static_cast<uint32_t>(std::thread::hardware_concurrency()), numComponents / minPacketsPerChunk);
+    fadePackets.resize(std::max<uint32_t>(numChunks, 1));
+    for (auto & f : fadePackets) f.clear();
+
+    // Few objects are fading at any time, so their outgoing levels are merged into the sorted stream serially
+    const auto append_fade_packets = [&]()
+    {
+        const size_t first = drawPackets.size();
+        for (const auto & chunk : fadePackets)
+        {
+            for (draw_packet packet : chunk)
+            {
+                const uint32_t source = packet.instance_offset;
+                packet.instance_offset = static_cast<uint32_t>(instanceData.size());
+                for (uint32_t v = 0; v < numViews; ++v)
+                {
+                    uniforms::per_object object = instanceData[source + v];
+                    object.lodFade = -object.lodFade;
+                    instanceData.push_back(object);
+                }
+                drawPackets.push_back(packet);
+            }
+        }
+
+        if (drawPackets.size() == first) return;
+        std::sort(drawPackets.begin() + first, drawPackets.end(), sort_by_key);
+        std::inplace_merge(drawPackets.begin(), drawPackets.begin() + first, drawPackets.end(), sort_by_key);
+    };
+
+    const auto count_visible_packets = [this]()
+    {
+        const auto first_occluded = std::partition_point(drawPackets.begin(), drawPackets.end(), [](const draw_packet & p) { return !(p.flags & packet_occluded); });
+        visiblePacketCount = static_cast<uint32_t>(first_occluded - drawPackets.begin());
+    };
+
+    if (numChunks <= 1)
+    {
+        build_range(0, numComponents, fadePackets[0]);
+        append_fade_packets();
+        count_visible_packets();
+        return;
+    }
+
+    std::vector<uint32_t> chunkBegin(numChunks + 1);
+    for (uint32_t c = 0; c <= numChunks; ++c) chunkBegin[c] = static_cast<uint32_t>((uint64_t(numComponents) * c) / numChunks);
+
+    std::vector<std::future<void>> tasks;
+    for (uint32_t c = 0; c < numChunks; ++c)
+    {
+        tasks.emplace_back(packetWorkers.enqueue(build_range, chunkBegin[c], chunkBegin[c + 1], std::ref(fadePackets[c])));
+    }
+    for (auto & t : tasks) t.get();
+
+    // Each chunk is sorted, so finish with a bottom-up merge where every pass merges neighbouring runs in parallel
+    for (uint32_t width = 1; width < numChunks; width *= 2)
+    {
+        tasks.clear();
+        for (uint32_t c = 0; c + width < numChunks; c += 2 * width)
+        {
+            const uint32_t first = chunkBegin[c];
+            const uint32_t middle = chunkBegin[c + width];
+            const uint32_t last = chunkBegin[std::min(c + 2 * width, numChunks)];
+            tasks.emplace_back(packetWorkers.enqueue([this, first, middle, last, sort_by_key]()
+            {
+                POLYMER_PROFILE_SCOPE(renderProfiler, "merge_packet_runs");
+                std::inplace_merge(drawPackets.begin() + first, drawPackets.begin() + middle, drawPackets.begin() + last, sort_by_key);
+            }));
+        }
+        for (auto & t : tasks) t.get();
+    }
+
+    append_fade_packets();
+    count_visible_packets();
 }
 
 void pbr_renderer::run_stencil_prepass(const view_data & view, const render_payload & scene)
 {
     gl_check_error(__FILE__, __LINE__);
 
-    GLboolean colorMask[4];
-    glGetBooleanv(GL_COLOR_WRITEMASK, &colorMask[0]);
-    GLboolean wasCullingEnabled = glIsEnabled(GL_CULL_FACE);
-    GLboolean wasDepthTestingEnabled = glIsEnabled(GL_DEPTH_TEST);
-    GLboolean wasBlendingEnabled = glIsEnabled(GL_BLEND);
+    gl_state_cache & state = gl_state();
 
-    glColorMask(0, 0, 0, 0);                                // do not write color
-    glDepthMask(GL_FALSE);                                  // do not write depth
-    glStencilMask(GL_TRUE);                                 // only write stencil
+    const bool wasCullingEnabled = state.is_enabled(GL_CULL_FACE);
+    const bool wasDepthTestingEnabled = state.is_enabled(GL_DEPTH_TEST);
+    const bool wasBlendingEnabled = state.is_enabled(GL_BLEND);
 
-    glDisable(GL_BLEND);                                    // 0 into alpha
-    glDisable(GL_DEPTH_TEST);                               // disable depth
-    glDisable(GL_CULL_FACE);                                // do not cull since winding will might be flipped per-eye
-    glEnable(GL_STENCIL_TEST);                              // enable stencil test
+    state.color_mask(0, 0, 0, 0);                           // do not write color
+    state.depth_mask(GL_FALSE);                             // do not write depth
+    state.stencil_mask(GL_TRUE);                            // only write stencil
 
-    glStencilFunc(GL_ALWAYS, 1, 1);                         // set stencil func
-    glStencilOp(GL_REPLACE, GL_REPLACE, GL_REPLACE);        // set stencil op (GL_REPLACE, GL_REPLACE, GL_REPLACE)
+    state.disable(GL_BLEND);                                // 0 into alpha
+    state.disable(GL_DEPTH_TEST);                           // disable depth
+    state.disable(GL_CULL_FACE);                            // do not cull since winding will might be flipped per-eye
+    state.enable(GL_STENCIL_TEST);                          // enable stencil test
+
+    state.stencil_func(GL_ALWAYS, 1, 1);                    // set stencil func
+    state.stencil_op(GL_REPLACE, GL_REPLACE, GL_REPLACE);   // set stencil op (GL_REPLACE, GL_REPLACE, GL_REPLACE)
 
     auto & shader = no_op.get()->get_variant()->shader;
     shader.bind();
     if (view.index == 0) left_stencil_mask.draw_elements();
     else if (view.index == 1) right_stencil_mask.draw_elements();
-    shader.unbind();
 
-    glStencilFunc(GL_EQUAL, 0, 1);                          // reset stencil func
-    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);                 // reset stencil op
+    state.stencil_func(GL_EQUAL, 0, 1);                     // reset stencil func
+    state.stencil_op(GL_KEEP, GL_KEEP, GL_KEEP);            // reset stencil op
 
-    glDepthMask(GL_TRUE);                                   // it's ok to write depth
-    glStencilMask(GL_FALSE);                                // no other passes should write to stencil
-    glColorMask(colorMask[0], colorMask[1], colorMask[2], colorMask[3]); // Restore color mask state
-    if (wasCullingEnabled) glEnable(GL_CULL_FACE);
-    if (wasDepthTestingEnabled) glEnable(GL_DEPTH_TEST);
-    if (wasBlendingEnabled) glEnable(GL_BLEND);
+    state.depth_mask(GL_TRUE);                              // it's ok to write depth
+    state.stencil_mask(GL_FALSE);                           // no other passes should write to stencil
+    state.color_mask(1, 1, 1, 1);                           // color writes are on by default in the renderer
+    state.set_enabled(GL_CULL_FACE, wasCullingEnabled);
+    state.set_enabled(GL_DEPTH_TEST, wasDepthTestingEnabled);
+    state.set_enabled(GL_BLEND, wasBlendingEnabled);
 
     gl_check_error(__FILE__, __LINE__);
 }
@@ -208,7 +1042,7 @@ void pbr_renderer::set_stencil_mask(const uint32_t idx, gl_mesh && m)
 
 uint32_t pbr_renderer::get_color_texture(const uint32_t idx) const
 {
-    assert(idx <= settings.cameraCount);
+    assert(idx < settings.cameraCount);
     if (settings.tonemapEnabled)
     {
         return postTextures[idx];
@@ -230,59 +1064,102 @@ stable_cascaded_shadows * pbr_renderer::get_shadow_pass() const
 
 void pbr_renderer::run_depth_prepass(const view_data & view, const render_payload & scene)
 {
-    GLboolean colorMask[4];
-    glGetBooleanv(GL_COLOR_WRITEMASK, &colorMask[0]);
+    gl_state_cache & state = gl_state();
 
-    glEnable(GL_DEPTH_TEST);    // Enable depth testing
-    glDepthFunc(GL_LESS);       // Nearest pixel
-    glDepthMask(GL_TRUE);       // Need depth mask on
-    glColorMask(0, 0, 0, 0);    // Do not write any color
+    state.enable(GL_DEPTH_TEST);        // Enable depth testing
+    state.depth_func(GL_LESS);          // Nearest pixel
+    state.depth_mask(GL_TRUE);          // Need depth mask on
+    state.color_mask(0, 0, 0, 0);       // Do not write any color
 
-    auto & shader = renderPassEarlyZ.get()->get_variant()->shader;
+    std::vector<std::string> defines;
+    if (instanced_stereo()) defines.push_back("INSTANCED_STEREO");
+    if (settings.meshLod && settings.lodCrossFade) defines.push_back("LOD_CROSS_FADE");
+
+    auto & shader = renderPassEarlyZ.get()->get_variant(defines)->shader;
     shader.bind();
 
-    for (const render_component & r : scene.render_components)
+    if (frameCulling.hizIndirect) glBindBuffer(GL_DRAW_INDIRECT_BUFFER, hiz->get_command_buffer());
+
+    // Occluded packets are sorted to the back and skipped
+    for (uint32_t i = 0; i < visiblePacketCount; ++i)
     {
-        update_per_object_uniform_buffer(r.world_transform->world_pose, r.local_transform->local_scale, r.material->receive_shadow, view);
-        r.mesh->draw();
+        submit_packet(i, view, scene);
     }
 
-    shader.unbind();
+    if (frameCulling.hizIndirect) glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    // Restore color writes
+    state.color_mask(1, 1, 1, 1);
+}
+
+// Draws are not instanced and ignore the hi-z indirect buffer, whose commands may cover both eyes; packets
+// culled on the cpu are still skipped.
+void pbr_renderer::run_entity_id_pass(const view_data & view, const render_payload & scene)
+{
+    gl_state_cache & state = gl_state();
+
+    state.enable(GL_DEPTH_TEST);
+    state.depth_func(GL_LESS);
+    state.depth_mask(GL_TRUE);
+
+    std::vector<std::string> defines;
+    if (settings.meshLod && settings.lodCrossFade) defines.push_back("LOD_CROSS_FADE");
+
+    auto & shader = renderPassEntityId.get()->get_variant(defines)->shader;
+    shader.bind();
 
-    // Restore color mask state
-    glColorMask(colorMask[0], colorMask[1], colorMask[2], colorMask[3]);
+    for (uint32_t i = 0; i < visiblePacketCount; ++i)
+    {
+        const draw_packet & packet = drawPackets[i];
+        update_per_object_uniform_buffer(&instanceData[packet.instance_offset + view.index], 1);
+        scene.render_components[packet.mesh_id].mesh->draw(0, packet.lod);
+    }
 }
 
 void pbr_renderer::run_skybox_pass(const view_data & view, const render_payload & scene)
 {
     if (!scene.skybox) return;
 
-    const GLboolean wasDepthTestingEnabled = glIsEnabled(GL_DEPTH_TEST);
-    const GLboolean wasCullingEnabled = glIsEnabled(GL_CULL_FACE);
+    const bool wasDepthTestingEnabled = gl_state().is_enabled(GL_DEPTH_TEST);
 
-    glDisable(GL_DEPTH_TEST);
+    gl_state().disable(GL_DEPTH_TEST);
 
-    //glDepthMask(GL_FALSE);
-    //glDisable(GL_CULL_FACE);
+    // The baked sky is a cubemap lookup; the sky model itself is only evaluated per pixel without it
+    if (use_sky_environment(scene)) skyEnvironment->draw_skybox(view.viewProjMatrix);
+    else scene.skybox->render(view.viewProjMatrix, view.pose.position, view.farClip);
 
-    //auto & program = shader_handle("ibl").get()->get_variant()->shader;
-    //program.bind();
-    //program.uniform("u_mvp", (view.projectionMatrix * rotation_matrix(qconj(view.pose.orientation))));
-    //program.texture("sc_ibl", 0, texture_handle("wells-radiance-cubemap").get(), GL_TEXTURE_CUBE_MAP);
-    //auto m = make_cube_mesh();
-    //m.draw_elements();
-    //program.unbind();
-
-    scene.skybox->render(view.viewProjMatrix, view.pose.position, view.farClip);
+    gl_state().set_enabled(GL_DEPTH_TEST, wasDepthTestingEnabled);
+}
 
-    //glDepthMask(GL_TRUE);
-    //if (wasCullingEnabled) glEnable(GL_CULL_FACE);
+uint64_t polymer::hash_static_caster(const render_component & r, const float4x4 & modelMatrix, const uint32_t lod)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    const auto add = [&h](const void * data, const size_t bytes)
+    {
+        const uint8_t * p = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < bytes; ++i) h = (h ^ p[i]) * 0x100000001b3ull;
+    };
 
-    if (wasDepthTestingEnabled) glEnable(GL_DEPTH_TEST);
+    const entity e = r.get_entity();
+    add(&e, sizeof(e));
+    if (r.mesh) add(r.mesh->mesh.name.data(), r.mesh->mesh.name.size());
+    add(&modelMatrix, sizeof(float4x4));
+    add(&lod, sizeof(lod));
+    return h;
 }
 
 void pbr_renderer::run_shadow_pass(const view_data & view, const render_payload & scene)
 {
+    uint64_t staticCasterHash = 0;
+    for (const draw_packet & packet : drawPackets)
+    {
+        if ((packet.flags & packet_cast_shadow) && (packet.flags & packet_static_caster) && !(packet.flags & packet_lod_fade_out))
+        {
+            staticCasterHash += hash_static_caster(scene.render_components[packet.mesh_id], instanceData[packet.instance_offset].modelMatrix, packet.lod);
+        }
+    }
+    shadow->set_static_caster_hash(staticCasterHash);
+
     shadow->update_cascades(view.viewMatrix,
         view.nearClip,
         view.farClip,
@@ -290,40 +1167,88 @@ void pbr_renderer::run_shadow_pass(const view_data & view, const render_payload
         vfov_from_projection(view.projectionMatrix),
         scene.sunlight->data.direction);
 
-    shadow->pre_draw();
+    // Casters without cpu geometry have no bounds and are drawn into every cascade
+    const auto cascade_mask = [&](const draw_packet & packet) -> uint32_t
+    {
+        const aabb_3d * local = componentBounds.empty() ? nullptr : componentBounds[packet.mesh_id];
+        if (!local) return ~0u;
+        return shadow->get_cascade_mask(transform_bounds(*local, instanceData[packet.instance_offset].modelMatrix));
+    };
+
+    const auto draw_caster = [&](const draw_packet & packet, const uint32_t mask)
+    {
+        if (!mask) return;
+        shadow->update_shadow_matrix(instanceData[packet.instance_offset].modelMatrix, mask);
+        scene.render_components[packet.mesh_id].mesh->draw(0, packet.lod);
+    };
 
-    for (const render_component & r : scene.render_components)
+    if (shadow->begin_static_pass())
     {
-        if (r.material->cast_shadow)
+        POLYMER_PROFILE_GPU_SCOPE(renderProfiler, "render_static_casters");
+        for (const draw_packet & packet : drawPackets)
         {
-            const float4x4 modelMatrix = (r.world_transform->world_pose.matrix() * make_scaling_matrix(r.local_transform->local_scale));
-            shadow->update_shadow_matrix(modelMatrix);
-            r.mesh->draw();
+            if ((packet.flags & packet_cast_shadow) && (packet.flags & packet_static_caster) && !(packet.flags & packet_lod_fade_out))
+            {
+                draw_caster(packet, cascade_mask(packet) & shadow->get_static_update_mask());
+            }
         }
     }
 
+    shadow->begin_dynamic_pass();
+    for (const draw_packet & packet : drawPackets)
+    {
+        const bool cached = shadow->cacheStaticCasters && (packet.flags & packet_static_caster);
+        if ((packet.flags & packet_cast_shadow) && !(packet.flags & packet_lod_fade_out) && !cached) draw_caster(packet, cascade_mask(packet));
+    }
+
     shadow->post_draw();
 
     gl_check_error(__FILE__, __LINE__);
 }
 
-void pbr_renderer::run_forward_pass(std::vector<const render_component *> & render_queue, const view_data & view, const render_payload & scene)
+void pbr_renderer::run_forward_pass(const view_data & view, const render_payload & scene)
 {
     if (settings.useDepthPrepass)
     {
-        glEnable(GL_DEPTH_TEST);
-        glDepthFunc(GL_LEQUAL);
-        glDepthMask(GL_FALSE); // depth already comes from the prepass
+        gl_state().enable(GL_DEPTH_TEST);
+        gl_state().depth_func(GL_LEQUAL);
+        gl_state().depth_mask(GL_FALSE); // depth already comes from the prepass
     }
 
-    for (const render_component * r : render_queue)
+    if (frameCulling.hizIndirect) glBindBuffer(GL_DRAW_INDIRECT_BUFFER, hiz->get_command_buffer());
+
+    // Once the first set of maps is prefiltered, the sky replaces the environment maps of the payload
+    const bool skyLighting = use_sky_environment(scene) && skyEnvironment->has_ibl();
+    const GLuint irradianceCubemap = skyLighting ? skyEnvironment->get_irradiance() : GLuint(scene.ibl_irradianceCubemap.get());
+    const GLuint radianceCubemap = skyLighting ? skyEnvironment->get_radiance() : GLuint(scene.ibl_radianceCubemap.get());
+
+    pbrMaterials.bind();
+
+    // Packets are sorted by program, so runs of pbr materials that share a variant and textures are drawn
+    // back to back, each picking its parameters by the material index of its per-object record
+    material_interface * bound = nullptr;
+    const material_view_layout materialLayout = view_layout();
+    const material_view_layout fallbackLayout = fallback_layout();
+
+    // Occluded packets are sorted to the back and skipped
+    for (uint32_t i = 0; i < visiblePacketCount; ++i)
     {
-        update_per_object_uniform_buffer(r->world_transform->world_pose, r->local_transform->local_scale, r->material->receive_shadow, view);
+        const draw_packet & packet = drawPackets[i];
+
+        // The material resolved for this component in build_draw_packets, which is the fallback while
+        // the component's own variant is still compiling
+        material_interface * mat = componentMaterials[packet.mesh_id].material;
+        const material_view_layout & layout = (mat == fallbackMaterial.get()) ? fallbackLayout : materialLayout;
+
+        const polymer_pbr_standard * boundPbr = dynamic_cast<const polymer_pbr_standard *>(bound);
+        const polymer_pbr_standard * pbr = dynamic_cast<const polymer_pbr_standard *>(mat);
+        if (bound == mat || (boundPbr && pbr && boundPbr->shares_bindings(*pbr, layout)))
+        {
+            submit_packet(i, view, scene);
+            continue;
+        }
 
-        // Lookup the material component (materials[e]), .get() the asset_handle, and then .get() since 
-        // materials instances are stored as shared pointers. 
-        material_interface * mat = r->material->material.get().get();
-        mat->update_uniforms();
+        mat->update_uniforms(layout);
 
         // @todo - handle other specific material requirements here
         if (auto * mr = dynamic_cast<polymer_pbr_standard*>(mat))
@@ -331,99 +1256,399 @@ void pbr_renderer::run_forward_pass(std::vector<const render_component *> & rend
             if (settings.shadowsEnabled)
             {
                 // @todo - ideally compile this out from the shader if not using shadows
-                mr->update_uniforms_shadow(shadow->get_output_texture());
+                mr->update_uniforms_shadow(shadow->get_output_texture(), layout);
             }
 
-            mr->update_uniforms_ibl(scene.ibl_irradianceCubemap.get(), scene.ibl_radianceCubemap.get());
+            mr->update_uniforms_ibl(irradianceCubemap, radianceCubemap, layout);
         }
-        mat->use();
+        mat->use(layout);
+        bound = mat;
 
-        r->mesh->draw();
+        submit_packet(i, view, scene);
     }
 
+    if (frameCulling.hizIndirect) glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
     if (settings.useDepthPrepass)
     {
-        glDepthMask(GL_TRUE); // cleanup state
+        gl_state().depth_mask(GL_TRUE); // cleanup state
     }
 }
 
-void pbr_renderer::run_post_pass(const view_data & view, const render_payload & scene)
+void pbr_renderer::run_post_pass(const GLuint colorTexture, const GLuint outputFramebuffer)
 {
-    if (!settings.tonemapEnabled) return;
+    gl_state_cache & state = gl_state();
 
-    GLboolean wasCullingEnabled = glIsEnabled(GL_CULL_FACE);
-    GLboolean wasDepthTestingEnabled = glIsEnabled(GL_DEPTH_TEST);
+    const bool wasCullingEnabled = state.is_enabled(GL_CULL_FACE);
+    const bool wasDepthTestingEnabled = state.is_enabled(GL_DEPTH_TEST);
 
     // Disable culling and depth testing for post processing
-    glDisable(GL_CULL_FACE);
-    glDisable(GL_DEPTH_TEST);
+    state.disable(GL_CULL_FACE);
+    state.disable(GL_DEPTH_TEST);
+
+    state.bind_framebuffer(GL_FRAMEBUFFER, outputFramebuffer);
+    state.viewport_rect(0, 0, settings.renderSize.x, settings.renderSize.y);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, postFramebuffers[view.index]);
-    glViewport(0, 0, settings.renderSize.x, settings.renderSize.y);
+    // Stretch the drawn viewport over the full output, keeping the filter footprint inside of it
+    const float2 renderSize = float2(settings.renderSize);
+    const float2 drawnSize = float2(viewportSize);
 
     auto & shader = renderPassTonemap.get()->get_variant()->shader;
     shader.bind();
-    shader.texture("s_texColor", 0, eyeTextures[view.index], GL_TEXTURE_2D);
+    shader.texture(const_hash("s_texColor"), 0, colorTexture, GL_TEXTURE_2D);
+    shader.uniform(const_hash("u_uvScale"), drawnSize / renderSize);
+    shader.uniform(const_hash("u_uvMax"), (drawnSize - 0.5f) / renderSize);
+    shader.uniform(const_hash("u_exposure"), settings.exposure);
     post_quad.draw_elements();
-    shader.unbind();
 
-    if (wasCullingEnabled) glEnable(GL_CULL_FACE);
-    if (wasDepthTestingEnabled) glEnable(GL_DEPTH_TEST);
+    state.set_enabled(GL_CULL_FACE, wasCullingEnabled);
+    state.set_enabled(GL_DEPTH_TEST, wasDepthTestingEnabled);
 }
 
-pbr_renderer::pbr_renderer(const renderer_settings settings) : settings(settings)
+// Passes are declared in the order they run. New passes only need to name what they read and write; the graph
+// drops any pass whose results nothing reads.
+void pbr_renderer::add_frame_passes(const render_payload & scene, const view_data & shadowView, uniforms::per_scene & sceneUniforms)
 {
-    assert(settings.renderSize.x > 0 && settings.renderSize.y > 0);
-    assert(settings.cameraCount >= 1);
+    resolveTraffic = {};
 
-    eyeFramebuffers.resize(settings.cameraCount);
-    eyeTextures.resize(settings.cameraCount);
-    eyeDepthTextures.resize(settings.cameraCount);
+    frame_resources frame;
+    frame.sceneUniforms = renderGraph.import_state("per_scene");
+
+    // Shadow pass can only run if we've configured a directional sunlight
+    if (settings.shadowsEnabled && scene.sunlight)
+    {
+        const uint32_t size = static_cast<uint32_t>(shadow->resolution);
+        frame.shadowMap = renderGraph.import_texture("shadow_array", shadow->get_output_texture(), { uint2(size, size), GL_DEPTH_COMPONENT32F, 0, uniforms::NUM_CASCADES });
+
+        renderGraph.add_pass("run_shadow_pass", {}, { frame.shadowMap }, [this, &scene, &sceneUniforms, shadowView](render_pass_context &)
+        {
+            run_shadow_pass(shadowView, scene);
+
+            for (int c = 0; c < uniforms::NUM_CASCADES; c++)
+            {
+                sceneUniforms.cascadesPlane[c] = float4(shadow->splitPlanes[c].x, shadow->splitPlanes[c].y, 0, 0);
+                sceneUniforms.cascadesMatrix[c] = shadow->shadowMatrices[c];
+                sceneUniforms.cascadesNear[c] = shadow->nearPlanes[c];
+                sceneUniforms.cascadesFar[c] = shadow->farPlanes[c];
+            }
+        });
+    }
+
+    // Per-scene can be uploaded now that the shadow pass has completed
+    renderGraph.add_pass("update_per_scene", { frame.shadowMap }, { frame.sceneUniforms }, [this, &sceneUniforms](render_pass_context &)
+    {
+        perScene.set_buffer_data(sizeof(sceneUniforms), &sceneUniforms, GL_STREAM_DRAW);
+    });
+
+    // Bakes the sky when its parameters have changed and prefilters a few faces of its lighting
+    if (settings.skyEnvironment && scene.skybox)
+    {
+        if (!skyEnvironment) skyEnvironment.reset(new sky_environment());
+        frame.skyMaps = renderGraph.import_state("sky_environment");
+        renderGraph.add_pass("update_sky_environment", {}, { frame.skyMaps }, [this, &scene](render_pass_context &)
+        {
+            skyEnvironment->update(*scene.skybox);
+        });
+    }
 
-    // Generate multisample render buffers for color and depth, attach to multi-sampled framebuffer target
-    glNamedRenderbufferStorageMultisampleEXT(multisampleRenderbuffers[0], settings.msaaSamples, GL_RGBA, settings.renderSize.x, settings.renderSize.y);
-    glNamedFramebufferRenderbufferEXT(multisampleFramebuffer, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, multisampleRenderbuffers[0]);
-    glNamedRenderbufferStorageMultisampleEXT(multisampleRenderbuffers[1], settings.msaaSamples, GL_DEPTH24_STENCIL8, settings.renderSize.x, settings.renderSize.y);
-    glNamedFramebufferRenderbufferEXT(multisampleFramebuffer, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, multisampleRenderbuffers[1]);
+    // Forward passes and resolves into the per-view targets
+    if (instanced_stereo()) add_instanced_view_passes(scene, frame);
+    else add_view_passes(scene, frame);
+
+    if (settings.entityIdPass && entityPicker.has_requests()) add_entity_id_pass(scene, frame);
+}
 
-    multisampleFramebuffer.check_complete();
+// Each view draws into multisampled targets of its own. Their lifetimes do not overlap, so the graph places
+// every view's targets in the same textures.
+void pbr_renderer::add_view_passes(const render_payload & scene, const frame_resources & frame)
+{
+    const uint2 renderSize = uint2(settings.renderSize);
 
-    // Generate textures and framebuffers for |settings.cameraCount|
     for (uint32_t camIdx = 0; camIdx < settings.cameraCount; ++camIdx)
     {
-        // Depth
-        eyeDepthTextures[camIdx].setup(settings.renderSize.x, settings.renderSize.y, GL_DEPTH_COMPONENT32, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        const render_resource color = renderGraph.create_texture("msaa_color", { renderSize, GL_RGBA8, settings.msaaSamples });
+        const render_resource depth = renderGraph.create_texture("msaa_depth", { renderSize, GL_DEPTH24_STENCIL8, settings.msaaSamples });
+
+        const auto bind_targets = [this, color, depth](render_pass_context & context)
+        {
+            gl_state().bind_framebuffer(GL_DRAW_FRAMEBUFFER, context.framebuffer({ color }, depth));
+            gl_state().viewport_rect(0, 0, viewportSize.x, viewportSize.y);
+        };
+
+        renderGraph.add_pass("clear_view", camIdx, {}, { color, depth }, [this, &scene, camIdx, color, depth, bind_targets](render_pass_context & context)
+        {
+            // Update per-view uniform buffer
+            uniforms::per_view v = {};
+            v.view = scene.views[camIdx].viewMatrix;
+            v.viewProj = scene.views[camIdx].viewProjMatrix;
+            v.eyePos = float4(scene.views[camIdx].pose.position, 1);
+            v.clusterDepth = lightClusters.bind(camIdx);
+            perView.set_buffer_data(sizeof(v), &v, GL_STREAM_DRAW);
+
+            // Render into multisampled fbo
+            gl_state().enable(GL_MULTISAMPLE);
+            bind_targets(context);
+            clear_view_targets(context.framebuffer({ color }, depth), scene.clear_color, using_stencil_mask);
+        });
+
+        if (settings.useDepthPrepass)
+        {
+            renderGraph.add_pass("run_depth_prepass", camIdx, { frame.sceneUniforms }, { depth }, [this, &scene, camIdx, bind_targets](render_pass_context & context)
+            {
+                bind_targets(context);
+                run_depth_prepass(scene.views[camIdx], scene);
+            });
+        }
 
-        // Color
-        eyeTextures[camIdx].setup(settings.renderSize.x, settings.renderSize.y, GL_RGBA, GL_RGBA, GL_FLOAT, nullptr, false);
-        glTextureParameteriEXT(eyeTextures[camIdx], GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTextureParameteriEXT(eyeTextures[camIdx], GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTextureParameteriEXT(eyeTextures[camIdx], GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        // Hidden area mesh for stereo rendering with openvr
+        if (using_stencil_mask)
+        {
+            renderGraph.add_pass("run_stencil_prepass", camIdx, {}, { depth }, [this, &scene, camIdx, bind_targets](render_pass_context & context)
+            {
+                bind_targets(context);
+                run_stencil_prepass(scene.views[camIdx], scene);
+            });
+        }
+
+        if (scene.skybox)
+        {
+            renderGraph.add_pass("run_skybox_pass", camIdx, { frame.skyMaps }, { color }, [this, &scene, camIdx, bind_targets](render_pass_context & context)
+            {
+                bind_targets(context);
+                run_skybox_pass(scene.views[camIdx], scene);
+            });
+        }
 
-        // Attachments
-        glNamedFramebufferTexture2DEXT(eyeFramebuffers[camIdx], GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, eyeTextures[camIdx], 0);
-        glNamedFramebufferTexture2DEXT(eyeFramebuffers[camIdx], GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, eyeDepthTextures[camIdx], 0);
+        renderGraph.add_pass("run_forward_pass", camIdx, { frame.sceneUniforms, frame.shadowMap, frame.skyMaps }, { color, depth }, [this, &scene, camIdx, bind_targets](render_pass_context & context)
+        {
+            bind_targets(context);
+            run_forward_pass(scene.views[camIdx], scene);
+        });
 
-        eyeFramebuffers[camIdx].check_complete();
+        add_output_passes(scene, camIdx, color, depth, -1);
     }
+}
 
-    if (settings.tonemapEnabled)
+// Both eyes share every pass that does not depend on the eye: a single clear, and one instanced draw per
+// packet for the depth prepass and the forward pass. Only the hidden area masks, the skybox and the
+// resolves are issued once per eye, through a framebuffer that targets that eye's layer.
+void pbr_renderer::add_instanced_view_passes(const render_payload & scene, const frame_resources & frame)
+{
+    const uint2 renderSize = uint2(settings.renderSize);
+    const render_resource color = renderGraph.create_texture("msaa_color", { renderSize, GL_RGBA8, settings.msaaSamples, 2 });
+    const render_resource depth = renderGraph.create_texture("msaa_depth", { renderSize, GL_DEPTH24_STENCIL8, settings.msaaSamples, 2 });
+
+    // Instanced draws go to the layered framebuffer; passes that draw a single eye use the one of its layer
+    const auto bind_targets = [this, color, depth](render_pass_context & context, const int layer)
+    {
+        gl_state().bind_framebuffer(GL_DRAW_FRAMEBUFFER, context.framebuffer({ color }, depth, layer));
+        gl_state().viewport_rect(0, 0, viewportSize.x, viewportSize.y);
+    };
+
+    renderGraph.add_pass("clear_view", {}, { color, depth }, [this, &scene, color, depth, bind_targets](render_pass_context & context)
+    {
+        uniforms::per_view v[2] = {};
+        for (uint32_t camIdx = 0; camIdx < 2; ++camIdx)
+        {
+            v[camIdx].view = scene.views[camIdx].viewMatrix;
+            v[camIdx].viewProj = scene.views[camIdx].viewProjMatrix;
+            v[camIdx].eyePos = float4(scene.views[camIdx].pose.position, 1);
+            v[camIdx].clusterDepth = lightClusters.get_depth_params(camIdx);
+        }
+        perView.set_buffer_data(sizeof(v), &v[0], GL_STREAM_DRAW);
+        lightClusters.bind_all_views();
+
+        // Render into the layered multisampled fbo
+        gl_state().enable(GL_MULTISAMPLE);
+        bind_targets(context, -1);
+        clear_view_targets(context.framebuffer({ color }, depth), scene.clear_color, using_stencil_mask);
+    });
+
+    if (settings.useDepthPrepass)
+    {
+        renderGraph.add_pass("run_depth_prepass", { frame.sceneUniforms }, { depth }, [this, &scene, bind_targets](render_pass_context & context)
+        {
+            bind_targets(context, -1);
+            run_depth_prepass(scene.views[0], scene);
+        });
+    }
+
+    for (uint32_t camIdx = 0; camIdx < 2; ++camIdx)
+    {
+        // Hidden area mesh for stereo rendering with openvr
+        if (using_stencil_mask)
+        {
+            renderGraph.add_pass("run_stencil_prepass", camIdx, {}, { depth }, [this, &scene, camIdx, bind_targets](render_pass_context & context)
+            {
+                bind_targets(context, camIdx);
+                run_stencil_prepass(scene.views[camIdx], scene);
+            });
+        }
+
+        if (scene.skybox)
+        {
+            renderGraph.add_pass("run_skybox_pass", camIdx, { frame.skyMaps }, { color }, [this, &scene, camIdx, bind_targets](render_pass_context & context)
+            {
+                bind_targets(context, camIdx);
+                run_skybox_pass(scene.views[camIdx], scene);
+            });
+        }
+    }
+
+    // Execute the forward pass for both eyes
+    renderGraph.add_pass("run_forward_pass", { frame.sceneUniforms, frame.shadowMap, frame.skyMaps }, { color, depth }, [this, &scene, bind_targets](render_pass_context & context)
+    {
+        bind_targets(context, -1);
+        run_forward_pass(scene.views[0], scene);
+    });
+
+    // Resolve each layer into its per-view targets
+    for (uint32_t camIdx = 0; camIdx < 2; ++camIdx) add_output_passes(scene, camIdx, color, depth, camIdx);
+}
+
+// Ids are drawn after the views into single-sampled targets of their own, since integer attachments cannot be
+// resolved from the multisampled ones. The pass writes the picker's state, which the frame exports so the graph
+// keeps it; it is only declared while picks are requested.
+void pbr_renderer::add_entity_id_pass(const render_payload & scene, const frame_resources & frame)
+{
+    const uint2 renderSize = uint2(settings.renderSize);
+    const render_resource ids = renderGraph.create_texture("entity_ids", { renderSize, GL_R32UI });
+    const render_resource depth = renderGraph.create_texture("entity_id_depth", { renderSize, GL_DEPTH24_STENCIL8 });
+    const render_resource picks = renderGraph.import_state("entity_picker");
+    renderGraph.export_resource(picks);
+
+    renderGraph.add_pass("run_entity_id_pass", 0, { frame.sceneUniforms }, { ids, depth, picks }, [this, &scene, ids, depth](render_pass_context & context)
+    {
+        // The view passes leave the uniforms of the last view, or of both eyes, bound
+        uniforms::per_view v = {};
+        v.view = scene.views[0].viewMatrix;
+        v.viewProj = scene.views[0].viewProjMatrix;
+        v.eyePos = float4(scene.views[0].pose.position, 1);
+        v.clusterDepth = lightClusters.get_depth_params(0);
+        perView.set_buffer_data(sizeof(v), &v, GL_STREAM_DRAW);
+
+        const GLuint framebuffer = context.framebuffer({ ids }, depth);
+        const GLuint noEntity[] = { 0, 0, 0, 0 };
+        const GLfloat defaultDepth = 1.f;
+        glClearNamedFramebufferuiv(framebuffer, GL_COLOR, 0, &noEntity[0]);
+        glClearNamedFramebufferfv(framebuffer, GL_DEPTH, 0, &defaultDepth);
+
+        gl_state().bind_framebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+        gl_state().viewport_rect(0, 0, viewportSize.x, viewportSize.y);
+
+        run_entity_id_pass(scene.views[0], scene);
+
+        componentEntities.resize(scene.render_components.size());
+        for (size_t i = 0; i < componentEntities.size(); ++i) componentEntities[i] = scene.render_components[i].get_entity();
+        entityPicker.capture(framebuffer, settings.renderSize, int2(viewportSize), componentEntities);
+    });
+}
+
+// Resolves one view, or one layer, of the multisampled targets, tonemaps it into the view's output and reduces
+// its depth for the next frame's hi-z culling
+void pbr_renderer::add_output_passes(const render_payload & scene, const uint32_t camIdx, const render_resource msaaColor, const render_resource msaaDepth, const int layer)
+{
+    const uint2 renderSize = uint2(settings.renderSize);
+
+    const render_resource depth = renderGraph.import_texture("view_depth", eyeDepthTextures[camIdx], { renderSize, GL_DEPTH_COMPONENT32 });
+    renderGraph.export_resource(depth);
+
+    resolveTraffic += estimate_resolve_traffic(viewportSize, renderSize, settings.msaaSamples);
+
+    if (settings.tonemapEnabled && settings.fusedResolve && fused_resolve_pass::is_supported(settings.msaaSamples))
+    {
+        const render_resource output = renderGraph.import_texture("post_color", postTextures[camIdx], { renderSize, GL_RGBA8 });
+        renderGraph.export_resource(output);
+
+        renderGraph.add_pass("resolve_depth", camIdx, { msaaDepth }, { depth }, [this, msaaDepth, depth, layer](render_pass_context & context)
+        {
+            gl_state().disable(GL_MULTISAMPLE);
+            glBlitNamedFramebuffer(context.framebuffer({}, msaaDepth, layer), context.framebuffer({}, depth),
+                0, 0, viewportSize.x, viewportSize.y, 0, 0,
+                viewportSize.x, viewportSize.y, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        });
+
+        renderGraph.add_pass("fused_resolve", camIdx, { msaaColor }, { output }, [this, msaaColor, output, layer, renderSize](render_pass_context & context)
+        {
+            fusedResolve.execute(context.texture(msaaColor), layer, settings.msaaSamples, viewportSize, context.texture(output), renderSize, settings.exposure);
+        });
+    }
+    else
     {
-        postFramebuffers.resize(settings.cameraCount);
-        postTextures.resize(settings.cameraCount);
-        post_quad = make_fullscreen_quad();
+        // Resolved color only feeds the post pass when tonemapping, so the views can share its texture
+        render_resource color;
+        if (settings.tonemapEnabled) color = renderGraph.create_texture("view_color", { renderSize, GL_RGBA8 });
+        else color = renderGraph.import_texture("view_color", eyeTextures[camIdx], { renderSize, GL_RGBA8 });
 
-        for (uint32_t camIdx = 0; camIdx < settings.cameraCount; ++camIdx)
+        renderGraph.add_pass("resolve", camIdx, { msaaColor, msaaDepth }, { color, depth }, [this, msaaColor, msaaDepth, color, depth, layer](render_pass_context & context)
         {
-            postTextures[camIdx].setup(settings.renderSize.x, settings.renderSize.y, GL_RGBA, GL_RGBA, GL_FLOAT, nullptr, false);
-            glTextureParameteriEXT(postTextures[camIdx], GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-            glTextureParameteriEXT(postTextures[camIdx], GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-            glTextureParameteriEXT(postTextures[camIdx], GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
-            glNamedFramebufferTexture2DEXT(postFramebuffers[camIdx], GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, postTextures[camIdx], 0);
-            postFramebuffers[camIdx].check_complete();
+            gl_state().disable(GL_MULTISAMPLE);
+
+            const GLuint source = context.framebuffer({ msaaColor }, msaaDepth, layer);
+            const GLuint target = context.framebuffer({ color }, depth);
+
+            // blit color 
+            glBlitNamedFramebuffer(source, target,
+                0, 0, viewportSize.x, viewportSize.y, 0, 0,
+                viewportSize.x, viewportSize.y, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+
+            // blit depth
+            glBlitNamedFramebuffer(source, target,
+                0, 0, viewportSize.x, viewportSize.y, 0, 0,
+                viewportSize.x, viewportSize.y, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        });
+
+        if (settings.tonemapEnabled)
+        {
+            const render_resource output = renderGraph.import_texture("post_color", postTextures[camIdx], { renderSize, GL_RGBA8 });
+            renderGraph.export_resource(output);
+
+            renderGraph.add_pass("run_post_pass", camIdx, { color }, { output }, [this, color, output](render_pass_context & context)
+            {
+                run_post_pass(context.texture(color), context.framebuffer({ output }));
+            });
         }
+        else renderGraph.export_resource(color);
+    }
+
+    // Reduce the resolved depth for the next frame
+    if (hiz && settings.hizCulling)
+    {
+        renderGraph.add_pass("build_hiz_pyramid", camIdx, { depth }, {}, [this, &scene, camIdx](render_pass_context &)
+        {
+            hiz->build(camIdx, eyeDepthTextures[camIdx], viewportSize, scene.views[camIdx].viewProjMatrix, !settings.hizGpuCulling);
+        });
+    }
+}
+
+pbr_renderer::pbr_renderer(const renderer_settings settings) : settings(settings)
+{
+    assert(settings.renderSize.x > 0 && settings.renderSize.y > 0);
+    assert(settings.cameraCount >= 1);
+
+    viewportSize = uint2(settings.renderSize);
+
+    // Instanced stereo needs the vertex stage to select the layer
+    if (settings.instancedStereo && settings.cameraCount == 2 && !GLAD_GL_ARB_shader_viewport_layer_array && !GLAD_GL_AMD_vertex_shader_layer)
+    {
+        log::get()->engine_log->info("pbr_renderer: vertex shader layer selection is not supported, falling back to a pass per eye");
+        this->settings.instancedStereo = false;
+    }
+
+    // Resolved depth is read after the frame and by hi-z culling. The tonemap pass may be toggled at runtime,
+    // so the color outputs of both configurations exist from the start and get_color_texture() is always valid.
+    eyeTextures.resize(settings.cameraCount);
+    postTextures.resize(settings.cameraCount);
+    eyeDepthTextures.resize(settings.cameraCount);
+    for (uint32_t camIdx = 0; camIdx < settings.cameraCount; ++camIdx)
+    {
+        create_view_color_texture(eyeTextures[camIdx], settings.renderSize);
+        create_view_color_texture(postTextures[camIdx], settings.renderSize);
+        eyeDepthTextures[camIdx].setup(settings.renderSize.x, settings.renderSize.y, GL_DEPTH_COMPONENT32, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
     }
 
+    post_quad = make_fullscreen_quad();
+
     gl_check_error(__FILE__, __LINE__);
 
     // Only create shadow resources if the user has requested them. 
@@ -433,8 +1658,7 @@ pbr_renderer::pbr_renderer(const renderer_settings settings) : settings(settings
     }
 
     // Respect performance profiling settings on construction
-    gpuProfiler.set_enabled(settings.performanceProfiling);
-    cpuProfiler.set_enabled(settings.performanceProfiling);
+    renderProfiler.set_enabled(settings.performanceProfiling);
 
     timer.start();
 }
@@ -444,27 +1668,113 @@ pbr_renderer::~pbr_renderer()
     timer.stop();
 }
 
+void pbr_renderer::report_texture_usage(const render_payload & scene)
+{
+    // Components sharing a material share its textures, so each texture is reported once at the largest span.
+    // Spans assume the textures cover the model once and ignore the texcoord scale of the material.
+    materialTexelSpans.clear();
+    for (uint32_t i = 0; i < componentTexelSpans.size(); ++i)
+    {
+        material_interface * mat = scene.render_components[i].material->material.get().get();
+        float & span = materialTexelSpans[mat];
+        span = std::max<float>(span, componentTexelSpans[i]);
+    }
+
+    for (const auto & m : materialTexelSpans)
+    {
+        if (m.second <= 0.f) continue;
+        for (const texture_handle * tex : m.first->get_textures()) textureStreamer->report(tex->name, m.second);
+    }
+}
+
+texture_streamer * pbr_renderer::get_texture_streamer()
+{
+    if (settings.textureStreaming && !textureStreamer) textureStreamer.reset(new texture_streamer());
+    return textureStreamer.get();
+}
+
+material_interface * pbr_renderer::get_fallback_material()
+{
+    if (!fallbackMaterial)
+    {
+        fallbackMaterial.reset(new polymer_pbr_standard());
+        fallbackMaterial->baseAlbedo = float3(0.5f, 0.5f, 0.5f);
+        fallbackMaterial->metallicFactor = 0.f;
+        fallbackMaterial->roughnessFactor = 0.8f;
+    }
+
+    return fallbackMaterial.get();
+}
+
+void pbr_renderer::update_viewport_size()
+{
+    // Only the post pass can stretch a smaller viewport back over the output
+    if (!settings.dynamicResolution || !settings.tonemapEnabled)
+    {
+        resolutionController.reset();
+        viewportSize = uint2(settings.renderSize);
+        return;
+    }
+
+    resolutionController.budgetMs = settings.frameBudgetMs;
+    resolutionController.minScale = settings.minResolutionScale;
+
+    // Frame times arrive a few frames late; every frame that has completed since the last call is fed in order
+    resolutionTimer.collect([this](const gl_gpu_timer::result & r)
+    {
+        resolutionController.update(static_cast<float>(r.elapsed_ms()));
+    });
+
+    viewportSize = scaled_viewport(uint2(settings.renderSize), resolutionController.get_scale());
+}
+
 void pbr_renderer::render_frame(const render_payload & scene)
 {
     assert(settings.cameraCount == scene.views.size());
 
-    cpuProfiler.begin("render_frame");
+    // Collect everything recorded during the previous frame by this thread, the packet workers and the gpu
+    renderProfiler.end_frame();
+
+    POLYMER_PROFILE_SCOPE(renderProfiler, "render_frame");
+    POLYMER_PROFILE_GPU_SCOPE(renderProfiler, "render_frame");
+
+    // Anything may have touched the context since the last frame, so start from an empty shadow state
+    gl_state_cache & state = gl_state();
+    state.begin_frame();
+
+    update_viewport_size();
+
+    // Uploads levels decoded since the last frame and requests those the last frame's texel spans asked for
+    if (textureStreamer)
+    {
+        POLYMER_PROFILE_SCOPE(renderProfiler, "update_texture_streaming");
+        textureStreamer->update();
+    }
+
+    // The whole frame is timed for the resolution controller, independent of the profiler
+    resolutionTiming = settings.dynamicResolution && settings.tonemapEnabled;
+    if (resolutionTiming)
+    {
+        const uint64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        resolutionTimer.begin_frame(++resolutionFrame, nowNs);
+        resolutionScope = resolutionTimer.start();
+    }
 
     // Renderer default state
-    glEnable(GL_CULL_FACE);
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_FRAMEBUFFER_SRGB);
+    state.enable(GL_CULL_FACE);
+    state.enable(GL_DEPTH_TEST);
+    state.enable(GL_FRAMEBUFFER_SRGB);
+    state.color_mask(1, 1, 1, 1);
 
-    glBindBufferBase(GL_UNIFORM_BUFFER, uniforms::per_scene::binding, perScene);
-    glBindBufferBase(GL_UNIFORM_BUFFER, uniforms::per_view::binding, perView);
-    glBindBufferBase(GL_UNIFORM_BUFFER, uniforms::per_object::binding, perObject);
+    state.bind_buffer_base(GL_UNIFORM_BUFFER, uniforms::per_scene::binding, perScene);
+    state.bind_buffer_base(GL_UNIFORM_BUFFER, uniforms::per_view::binding, perView);
+    state.bind_buffer_base(GL_UNIFORM_BUFFER, uniforms::per_object::binding, perObject);
 
     // Update per-scene uniform buffer
     uniforms::per_scene b = {};
     b.time = timer.milliseconds().count() / 1000.f; // expressed in seconds
-    b.resolution = float2(settings.renderSize);
+    b.resolution = float2(viewportSize);
     b.invResolution = 1.f / b.resolution;
-    b.activePointLights = static_cast<int>(scene.point_lights.size());
     b.sunlightActive = 0;
 
     if (scene.sunlight)
@@ -475,19 +1785,6 @@ void pbr_renderer::render_frame(const render_payload & scene)
         b.directional_light.amount = scene.sunlight->data.amount;
     }
 
-    assert(scene.point_lights.size() <= uniforms::MAX_POINT_LIGHTS);
-    uint32_t lightIdx = 0;
-    for (auto & light : scene.point_lights)
-    {
-        if (!light->enabled) continue;
-        b.point_lights[lightIdx] = light->data;
-        lightIdx++;
-    }
-
-    GLfloat defaultColor[] = { scene.clear_color.x, scene.clear_color.y, scene.clear_color.z, scene.clear_color.w };
-    GLfloat defaultDepth = 1.f;
-    GLuint  defaultStencil = 0;
-
     view_data shadowAndCullingView = scene.views[0];
 
     // For stereo rendering, we project the shadows from a center view frustum combining both eyes
@@ -508,134 +1805,75 @@ void pbr_renderer::render_frame(const render_payload & scene)
         near_far_clip_from_projection(shadowAndCullingView.projectionMatrix, shadowAndCullingView.nearClip, shadowAndCullingView.farClip);
     }
 
-    // Shadow pass can only run if we've configured a directional sunlight
+    // Hi-z culling tests against pyramids built at the end of earlier frames; the readback variant
+    // only starts culling once a copy of every view has arrived
+    if (settings.hizCulling && !hiz) hiz.reset(new hiz_culling(settings.cameraCount, uint2(settings.renderSize)));
+    if (hiz) hiz->poll();
 
-    if (settings.shadowsEnabled && scene.sunlight)
-    {
-        cpuProfiler.begin("run_shadow_pass");
-        gpuProfiler.begin("run_shadow_pass");
-        run_shadow_pass(shadowAndCullingView, scene);
-        gpuProfiler.end("run_shadow_pass");
-        cpuProfiler.end("run_shadow_pass");
+    frameCulling.software = settings.occlusionCulling;
+    frameCulling.hizReadback = settings.hizCulling && !settings.hizGpuCulling && hiz->has_readback();
+    frameCulling.hizIndirect = settings.hizCulling && settings.hizGpuCulling && hiz->has_pyramid();
 
-        for (int c = 0; c < uniforms::NUM_CASCADES; c++)
-        {
-            b.cascadesPlane[c] = float4(shadow->splitPlanes[c].x, shadow->splitPlanes[c].y, 0, 0);
-            b.cascadesMatrix[c] = shadow->shadowMatrices[c];
-            b.cascadesNear[c] = shadow->nearPlanes[c];
-            b.cascadesFar[c] = shadow->farPlanes[c];
-        }
-    }
+    // Bounds also restrict shadow casters to the cascades they overlap
+    const bool needsBounds = frameCulling.software || frameCulling.hizReadback || frameCulling.hizIndirect || (settings.shadowsEnabled && scene.sunlight) || settings.meshLod || (settings.textureStreaming && textureStreamer);
+    if (needsBounds) update_component_bounds(scene);
+    else componentBounds.clear();
 
-    // Per-scene can be uploaded now that the shadow pass has completed
-    perScene.set_buffer_data(sizeof(b), &b, GL_STREAM_DRAW);
+    if (settings.meshLod) update_component_lods(scene);
+    else componentLods.clear();
 
-    // We follow the sorting strategy outlined here: http://realtimecollisiondetection.net/blog/?p=86
-    auto materialSortFunc = [this, scene, shadowAndCullingView](const render_component * lhs, const render_component * rhs)
+    // Stereo views are culled once from the combined center frustum
+    if (frameCulling.software)
     {
-        // Sort by material (expensive shader state change)
-        // @fixme - why is this so expensive? Adds an additional ~2ms to the sort
-        auto lid = lhs->material->material.get()->id();
-        auto rid = rhs->material->material.get()->id();
-        if (lid != rid) return lid > rid;
-
-        const float lDist = distance(shadowAndCullingView.pose.position, lhs->world_transform->world_pose.position);
-        const float rDist = distance(shadowAndCullingView.pose.position, rhs->world_transform->world_pose.position);
-
-        // Otherwise sort by distance
-        return lDist < rDist;
-    };
-
-    cpuProfiler.begin("sort-render_queue_material");
-    std::vector<const render_component *> render_queue_material(scene.render_components.size());
-    for (int i = 0; i < scene.render_components.size(); ++i) 
-    { 
-        render_queue_material[i] = (&(scene.render_components[i]));
+        POLYMER_PROFILE_SCOPE(renderProfiler, "run_occlusion_culling");
+        view_data cullView = shadowAndCullingView;
+        cullView.viewProjMatrix = cullView.projectionMatrix * cullView.viewMatrix;
+        run_occlusion_culling(scene, cullView);
     }
-    std::sort(render_queue_material.begin(), render_queue_material.end(), materialSortFunc);
-    cpuProfiler.end("sort-render_queue_material");
 
-    for (uint32_t camIdx = 0; camIdx < settings.cameraCount; ++camIdx)
+    // Matrices, sort keys and the sorted packet stream are produced on the worker pool
     {
-        // Update per-view uniform buffer
-        uniforms::per_view v = {};
-        v.view = scene.views[camIdx].viewMatrix;
-        v.viewProj = scene.views[camIdx].viewProjMatrix;
-        v.eyePos = float4(scene.views[camIdx].pose.position, 1);
-        perView.set_buffer_data(sizeof(v), &v, GL_STREAM_DRAW);
-
-        // Render into multisampled fbo
-        glEnable(GL_MULTISAMPLE);
-        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, multisampleFramebuffer);
-        glViewport(0, 0, settings.renderSize.x, settings.renderSize.y);
-        glClearNamedFramebufferfv(multisampleFramebuffer, GL_COLOR, 0, &defaultColor[0]);
-        glClearNamedFramebufferfv(multisampleFramebuffer, GL_DEPTH, 0, &defaultDepth);
-        if (using_stencil_mask) glClearNamedFramebufferuiv(multisampleFramebuffer, GL_STENCIL, 0, &defaultStencil);
-
-        if (settings.useDepthPrepass)
-        {
-            gpuProfiler.begin("depth-prepass-" + std::to_string(camIdx));
-            run_depth_prepass(scene.views[camIdx], scene);
-            gpuProfiler.end("depth-prepass-" + std::to_string(camIdx));
-        }
-
-        // Hidden area mesh for stereo rendering with openvr
-        if (using_stencil_mask)
-        {
-            cpuProfiler.begin("run_stencil_prepass-" + std::to_string(camIdx));
-            gpuProfiler.begin("run_stencil_prepass-" + std::to_string(camIdx));
-            run_stencil_prepass(scene.views[camIdx], scene);
-            gpuProfiler.end("run_stencil_prepass-" + std::to_string(camIdx));
-            cpuProfiler.end("run_stencil_prepass-" + std::to_string(camIdx));
-        }
-
-        // Execute the forward passes
-        gpuProfiler.begin("run_skybox_pass-" + std::to_string(camIdx));
-        cpuProfiler.begin("run_skybox_pass-" + std::to_string(camIdx));
-        run_skybox_pass(scene.views[camIdx], scene);
-        cpuProfiler.end("run_skybox_pass-" + std::to_string(camIdx));
-        gpuProfiler.end("run_skybox_pass-" + std::to_string(camIdx));
-
-        gpuProfiler.begin("run_forward_pass-" + std::to_string(camIdx));
-        cpuProfiler.begin("run_forward_pass-" + std::to_string(camIdx));
-        run_forward_pass(render_queue_material, scene.views[camIdx], scene);
-        cpuProfiler.end("run_forward_pass-" + std::to_string(camIdx));
-        gpuProfiler.end("run_forward_pass-" + std::to_string(camIdx));
-
-        glDisable(GL_MULTISAMPLE);
-
-        // Resolve multisample into per-view framebuffer
-        {
-            gpuProfiler.begin("blit-" + std::to_string(camIdx));
+        POLYMER_PROFILE_SCOPE(renderProfiler, "build_draw_packets");
+        build_draw_packets(scene, shadowAndCullingView);
+    }
 
-            // blit color 
-            glBlitNamedFramebuffer(multisampleFramebuffer, eyeFramebuffers[camIdx],
-                0, 0, settings.renderSize.x, settings.renderSize.y, 0, 0,
-                settings.renderSize.x, settings.renderSize.y, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    if (!componentTexelSpans.empty())
+    {
+        POLYMER_PROFILE_SCOPE(renderProfiler, "report_texture_usage");
+        report_texture_usage(scene);
+    }
 
-            // blit depth
-            glBlitNamedFramebuffer(multisampleFramebuffer, eyeFramebuffers[camIdx],
-                0, 0, settings.renderSize.x, settings.renderSize.y, 0, 0,
-                settings.renderSize.x, settings.renderSize.y, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    if (frameCulling.hizIndirect)
+    {
+        POLYMER_PROFILE_SCOPE(renderProfiler, "run_hiz_culling");
+        POLYMER_PROFILE_GPU_SCOPE(renderProfiler, "run_hiz_culling");
+        run_hiz_culling(scene);
+    }
 
-            gpuProfiler.end("blit-" + std::to_string(camIdx));
-        }
+    // Point lights are binned per view into froxels on the same pool
+    {
+        POLYMER_PROFILE_SCOPE(renderProfiler, "assign_light_clusters");
+        lightClusters.update(scene.views, scene.point_lights, float2(settings.renderSize), packetWorkers);
+        b.activePointLights = static_cast<int>(lightClusters.get_light_count());
     }
 
-    // Execute the post passes after having resolved the multisample framebuffers
+    // Shadows, the views and their outputs are declared to the render graph, which culls the passes nothing
+    // reads, places the transient targets and times every pass
+    renderGraph.clear();
+    add_frame_passes(scene, shadowAndCullingView, b);
+    renderGraph.compile();
+    renderGraph.execute(renderProfiler);
+
+    if (resolutionTiming)
     {
-        gpuProfiler.begin("run_post_pass");
-        cpuProfiler.begin("run_post_pass");
-        for (uint32_t camIdx = 0; camIdx < settings.cameraCount; ++camIdx)
-        {
-            run_post_pass(scene.views[camIdx], scene);
-        }
-        cpuProfiler.end("run_post_pass");
-        gpuProfiler.end("run_post_pass");
+        resolutionTimer.stop(resolutionScope);
+        resolutionTimer.end_frame();
     }
 
-    glDisable(GL_FRAMEBUFFER_SRGB);
-    cpuProfiler.end("render_frame");
+    // Leave the context the way callers expect to find it
+    state.disable(GL_FRAMEBUFFER_SRGB);
+    state.use_program(0);
+    state.bind_vertex_array(0);
 
     gl_check_error(__FILE__, __LINE__);
 }
\ No newline at end of file
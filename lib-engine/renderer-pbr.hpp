@@ -9,6 +9,16 @@
 #include "queue-circular.hpp"
 #include "human_time.hpp"
 #include "profiling.hpp"
+#include "thread-pool.hpp"
+#include "occlusion-culling.hpp"
+#include "hiz-culling.hpp"
+#include "mesh-lod.hpp"
+#include "dynamic-resolution.hpp"
+#include "sky-environment.hpp"
+#include "texture-streaming.hpp"
+#include "render-graph.hpp"
+#include "fused-resolve.hpp"
+#include "entity-picking.hpp"
 
 #include "gl-camera.hpp"
 #include "gl-async-gpu-timer.hpp"
@@ -27,16 +37,49 @@ namespace polymer
     //   stable_cascaded_shadows   //
     /////////////////////////////////
 
+    // Casters are split into a static layer, cached per cascade, and dynamic casters composited on top of a
+    // copy of it every frame. Cascades re-center in coarse steps rather than following the camera, so a cascade's
+    // matrices (and with them its static layer) only change when the camera leaves a step, the light moves, or
+    // the static casters change. Static layers are refreshed within a per-frame budget, given to the cascade that
+    // has waited longest; a cascade waiting for its turn keeps rendering with its previous matrices as long as they
+    // still cover its split, and is refreshed outside of the budget otherwise.
     class stable_cascaded_shadows
     {
-        gl_texture_3d shadowArrayDepth;
+        struct cascade_cache
+        {
+            float4x4 viewMatrix;
+            float4x4 projMatrix;
+            float nearPlane{ 0.f };
+            float farPlane{ 0.f };
+            float3 center;                      // of the cube the matrices cover, with half extent `radius`
+            float radius{ 0.f };
+            float2 split;                       // view depth range the matrices were fit to
+            bool valid{ false };
+            bool staticDirty{ true };
+            uint32_t framesSinceUpdate{ 0 };
+        };
+
+        gl_texture_3d shadowArrayDepth;         // static layer plus dynamic casters; sampled by materials
+        gl_texture_3d staticArrayDepth;         // static casters only
         gl_framebuffer shadowArrayFramebuffer;
+        gl_framebuffer staticArrayFramebuffer;
         shader_handle program = { "cascaded-shadows" };
 
+        cascade_cache cache[uniforms::NUM_CASCADES];
+        uint64_t staticCasterHash{ 0 };
+        uint32_t staticUpdateMask{ 0 };
+
+        void bind_program();
+
     public:
 
         float resolution = 4096;        // cascade resolution
         float splitLambda = 0.675f;     // frustum split constant
+        float snapTexels = 64.f;        // cascades re-center in steps of this many texels; the cascade grows by one step to compensate
+
+        bool cacheStaticCasters{ true };
+        uint32_t maxStaticUpdatesPerFrame{ 1 };                     // static layers re-rendered per frame, at most
+        uint32_t staticUpdateInterval[uniforms::NUM_CASCADES];      // minimum frames between refreshes of each cascade
 
         std::vector<float2> splitPlanes;
         std::vector<float> nearPlanes;
@@ -48,9 +91,23 @@ namespace polymer
 
         stable_cascaded_shadows();
 
+        // A change of the hash (e.g. a static caster was moved or removed) schedules every static layer for a refresh
+        void set_static_caster_hash(const uint64_t hash);
+
         void update_cascades(const float4x4 & view, const float near, const float far, const float aspectRatio, const float vfov, const float3 & lightDir);
-        void update_shadow_matrix(const float4x4 & shadowModelMatrix);
-        void pre_draw();
+
+        // One bit per cascade whose light-space volume the world space bounds overlap
+        uint32_t get_cascade_mask(const aabb_3d & worldBounds) const;
+        uint32_t get_static_update_mask() const { return staticUpdateMask; }
+
+        // Returns false if no static layer is refreshed this frame. Otherwise clears the refreshed layers; static
+        // casters are then drawn with update_shadow_matrix(), restricted to get_static_update_mask().
+        bool begin_static_pass();
+
+        // Starts the final layers from a copy of the static ones (or cleared, without caching) for the dynamic casters
+        void begin_dynamic_pass();
+
+        void update_shadow_matrix(const float4x4 & shadowModelMatrix, const uint32_t cascadeMask = ~0u);
         void post_draw();
 
         GLuint get_output_texture() const;
@@ -60,6 +117,8 @@ namespace polymer
     {
         f("shadowmap_resolution", o.resolution);
         f("cascade_split", o.splitLambda, range_metadata<float>{ 0.1f, 1.0f });
+        f("cache_static_casters", o.cacheStaticCasters);
+        f("max_static_updates_per_frame", o.maxStaticUpdatesPerFrame);
     }
 
     ////////////////////////////////////////
@@ -74,7 +133,25 @@ namespace polymer
         bool performanceProfiling{ true };
         bool useDepthPrepass{ false };
         bool tonemapEnabled{ true };
+        bool fusedResolve{ true };      // with tonemapEnabled, resolve and tonemap each view in one compute dispatch (see fused-resolve.hpp)
+        float exposure{ 1.f };
         bool shadowsEnabled{ true };
+        bool instancedStereo{ false };  // with two cameras, draw both eyes in a single instanced pass
+        bool occlusionCulling{ false }; // test renderables with cpu geometry against a software depth buffer
+        bool hizCulling{ false };       // test renderables with cpu geometry against the previous frame's depth
+        bool hizGpuCulling{ false };    // with hizCulling, cull on the gpu into an indirect draw buffer instead of reading back
+        bool meshLod{ true };           // draw the level of detail chain of meshes that have one (see mesh-lod.hpp)
+        float lodErrorPixels{ 1.f };    // largest projected error a level of detail may have
+        float lodHysteresis{ 0.25f };   // fraction of the error threshold a coarser level must stay under before switching
+        bool lodCrossFade{ false };     // dither between levels after a switch; adds a discard to every material variant
+        uint32_t lodFadeFrames{ 8 };
+        bool dynamicResolution{ false };    // scale the viewport within the render size to meet a gpu frame time; needs the tonemap pass
+        float frameBudgetMs{ 11.1f };
+        float minResolutionScale{ 0.5f };
+        bool asyncShaderCompile{ false };   // draw with a neutral material while new material variants compile in the background
+        bool skyEnvironment{ false };       // bake the procedural sky into a cubemap and light with it once prefiltered, instead of the payload cubemaps
+        bool textureStreaming{ false };     // load image textures through a texture_streamer and report their on-screen size to it
+        bool entityIdPass{ false };         // while picks are requested, draw the entity ids of the first view (see entity-picking.hpp)
     };
 
     struct view_data
@@ -111,6 +188,131 @@ namespace polymer
         gl_procedural_sky * skybox{ nullptr };
     };
 
+    /////////////////////////////////
+    //   render_payload_snapshot   //
+    /////////////////////////////////
+
+    // A render_payload only points at components owned by the ECS. When a frame is rendered on another
+    // thread while the next one is simulated, capture() copies everything the renderer reads so the
+    // snapshot's payload stays immutable. Materials, meshes and the skybox are shared, not copied.
+    struct render_payload_snapshot
+    {
+        render_payload payload;
+        std::vector<material_component> materials;
+        std::vector<mesh_component> meshes;
+        std::vector<world_transform_component> world_transforms;
+        std::vector<local_transform_component> local_transforms;
+        std::vector<geometry_component> geometries;
+        std::vector<point_light_component> point_lights;
+        directional_light_component sunlight;
+
+        void capture(const render_payload & source);
+    };
+
+    ////////////////////////////
+    //   clustered_lighting   //
+    ////////////////////////////
+
+    // Froxel light assignment for forward shading. Each view frustum is divided into screen-space tiles and
+    // exponentially distributed depth slices (uniforms::LIGHT_CLUSTERS_*), and every enabled point light is
+    // binned on the CPU into the froxels its sphere of influence overlaps. Slices are split into jobs on
+    // the renderer's worker pool. The light list, the per-froxel ranges and the index list are uploaded to
+    // storage buffers, so shaded fragments only loop over the lights of their own froxel.
+    class clustered_lighting
+    {
+        struct froxel_bounds { float3 min, max; };
+
+        struct view_clusters
+        {
+            float4x4 projection;
+            float2 renderSize;
+            std::vector<froxel_bounds> bounds;      // view-space aabbs, rebuilt when the projection changes
+            std::vector<uint2> clusters;            // (first index, count)
+            std::vector<uint32_t> indices;
+            float4 depthParams;
+            gl_buffer clusterBuffer;
+            gl_buffer indexBuffer;
+        };
+
+        struct light_bounds
+        {
+            float3 viewCenter;
+            float radius;
+            uint32_t minSlice, maxSlice;
+            uint2 minTile, maxTile;
+        };
+
+        struct slice_job
+        {
+            uint32_t firstSlice, lastSlice;
+            std::vector<uint2> clusters;            // offsets relative to this job's indices
+            std::vector<uint32_t> indices;
+            std::vector<std::vector<uint32_t>> tileLights;
+        };
+
+        std::vector<uniforms::point_light> lights;
+        std::vector<light_bounds> viewLights;       // lights of the view being binned, indexed like `lights`
+        std::vector<uint32_t> visibleLights;
+        std::vector<slice_job> jobs;
+        std::vector<view_clusters> views;
+        gl_buffer lightBuffer;
+
+        // All views back to back, for shaders that select the view themselves (INSTANCED_STEREO)
+        std::vector<uint2> combinedClusters;
+        std::vector<uint32_t> combinedIndices;
+        gl_buffer combinedClusterBuffer;
+        gl_buffer combinedIndexBuffer;
+        bool combinedDirty{ true };
+
+        void build_froxel_bounds(view_clusters & v, const view_data & view) const;
+        void bin_view(view_clusters & v, const view_data & view, simple_thread_pool & pool);
+        void assign_slices(const view_clusters & v, slice_job & job) const;
+
+    public:
+
+        // Bins the lights for every view and uploads the results; must be called on the GL thread
+        void update(const std::vector<view_data> & views, const std::vector<point_light_component *> & pointLights, const float2 & renderSize, simple_thread_pool & pool);
+
+        // Binds the storage buffers of one view and returns the depth parameters for uniforms::per_view
+        float4 bind(const uint32_t viewIndex);
+
+        // Binds the clusters of every view, stored one after another; depth parameters are still per view
+        void bind_all_views();
+        float4 get_depth_params(const uint32_t viewIndex) const { return views[viewIndex].depthParams; }
+
+        uint32_t get_light_count() const { return static_cast<uint32_t>(lights.size()); }
+    };
+
+    // Identifies a static shadow caster by what stays the same from frame to frame and across payload snapshots:
+    // its entity, the name of its gpu mesh, its model matrix and its level of detail. Summed over the static
+    // casters of a frame, a change tells the shadow pass to redraw its cached cascades.
+    uint64_t hash_static_caster(const render_component & r, const float4x4 & modelMatrix, const uint32_t lod);
+
+    /////////////////////
+    //   draw_packet   //
+    /////////////////////
+
+    // Flat, self-contained record for a single draw. Packets are built and sorted off the GL thread;
+    // the GL thread only walks the finished stream and issues commands.
+    struct draw_packet
+    {
+        uint64_t sort_key;          // [~material id : 32][view distance bits : 32], ascending
+        uint32_t mesh_id;           // index of the source render_component in the render_payload
+        uint32_t material_id;       // program handle of the resolved material variant
+        uint32_t instance_offset;   // first uniforms::per_object record; one record per view follows
+        uint32_t flags;             // draw_packet_flags
+        uint32_t lod;               // submesh of the mesh to draw; 0 is the full detail mesh
+    };
+
+    enum draw_packet_flags : uint32_t
+    {
+        packet_cast_shadow = 1 << 0,
+        packet_receive_shadow = 1 << 1,
+        packet_occluded = 1 << 2,       // sorted after every visible packet; only drawn into shadow maps
+        packet_static_caster = 1 << 3,  // shadow is cached with the static layer of the cascades
+        packet_lod_fade_out = 1 << 4,   // previous level of a cross-fade; not drawn into shadow maps
+    };
+
     //////////////////////
     //   pbr_renderer   //
     //////////////////////
@@ -123,15 +325,19 @@ namespace polymer
         gl_buffer perView;
         gl_buffer perObject;
 
-        // MSAA Targets
-        gl_renderbuffer multisampleRenderbuffers[2]; // color, depth/stencil
-        gl_framebuffer multisampleFramebuffer;
+        // Passes are declared to the graph every frame. Multisampled targets, and the resolved color when it is
+        // tonemapped, are transient; the textures read after the frame are imported.
+        render_graph renderGraph;
+        struct frame_resources { render_resource sceneUniforms, shadowMap, skyMaps; };
 
-        // Non-MSAA Targets
-        std::vector<gl_framebuffer> eyeFramebuffers;
+        // Resolved targets per view. Color is only kept without the tonemap pass, which writes the post textures instead.
         std::vector<gl_texture_2d> eyeTextures, eyeDepthTextures;
 
+        fused_resolve_pass fusedResolve;
+        resolve_traffic resolveTraffic;
+
         std::unique_ptr<stable_cascaded_shadows> shadow;
+        clustered_lighting lightClusters;
         gl_mesh post_quad;
 
         gl_mesh left_stencil_mask, right_stencil_mask;
@@ -140,23 +346,90 @@ namespace polymer
         shader_handle renderPassEarlyZ = { "depth-prepass" };
         shader_handle renderPassTonemap = { "post-tonemap" };
         shader_handle no_op = { "no-op" };
-
-        void update_per_object_uniform_buffer(const transform & p, const float3 & scale, const bool receiveShadow, const view_data & d);
+        shader_handle renderPassEntityId = { "entity-id" };
+
+        entity_picker entityPicker;
+        std::vector<entity> componentEntities;                  // of the frame whose ids are being captured
+
+        // Render list construction
+        simple_thread_pool packetWorkers;
+        std::vector<draw_packet> drawPackets;
+        std::vector<uniforms::per_object> instanceData;
+        struct resolved_material { material_interface * material; uint32_t id; uint32_t materialIndex; };
+        std::vector<resolved_material> componentMaterials;
+        std::unordered_map<material_interface *, resolved_material> resolvedMaterials;
+        std::unique_ptr<polymer_pbr_standard> fallbackMaterial;    // stands in for materials with a pending variant
+        pbr_material_buffer pbrMaterials;                           // parameters of the pbr materials resolved for the frame
+
+        std::unique_ptr<sky_environment> skyEnvironment;        // created the first time a skybox is rendered with it
+        std::unique_ptr<texture_streamer> textureStreamer;      // created the first time it is asked for with streaming enabled
+        std::vector<float> componentTexelSpans;                 // on-screen size in pixels, zero when occluded
+        std::unordered_map<material_interface *, float> materialTexelSpans;
+        uint32_t visiblePacketCount{ 0 };
+
+        // Occlusion culling; local bounds are cached per cpu mesh asset, for the meshes drawn by the last frame
+        struct cached_bounds { const runtime_mesh * mesh{ nullptr }; size_t vertexCount{ 0 }; uint64_t frame{ 0 }; aabb_3d bounds; };
+        struct culling_state { bool software; bool hizReadback; bool hizIndirect; };
+        culling_state frameCulling{ false, false, false };    // latched from the settings once per frame
+        occlusion_culler occlusionCuller;
+        std::unique_ptr<hiz_culling> hiz;                       // created the first time it is enabled
+        uint64_t boundsFrame{ 0 };
+        std::unordered_map<std::string, cached_bounds> meshBounds;
+        std::vector<const aabb_3d *> componentBounds;           // null for components without cpu geometry
+        std::vector<gl_draw_indirect_command> indirectCommands;
+        std::vector<hiz_draw_bounds> indirectBounds;
+
+        // Level of detail; chains are cached per gpu mesh asset, for the meshes drawn by the last frame, and
+        // selection state is kept per entity
+        struct component_lod { const mesh_lod_chain * chain; mesh_lod_state * state; };
+        struct cached_lod_chain { lod_chain_handle chain; uint64_t frame{ 0 }; };
+        uint64_t lodFrame{ 0 };
+        std::unordered_map<std::string, cached_lod_chain> meshLodChains;
+        std::unordered_map<entity, mesh_lod_state> lodStates;
+        std::vector<component_lod> componentLods;               // null chain for components without levels of detail
+        std::vector<std::vector<draw_packet>> fadePackets;      // per build chunk, the outgoing level of each cross-fade
+
+        // Dynamic resolution; targets keep the render size and each frame draws into the lower left viewportSize pixels
+        gl_gpu_timer resolutionTimer;
+        dynamic_resolution_controller resolutionController;
+        uint64_t resolutionFrame{ 0 };
+        uint32_t resolutionScope{ 0 };
+        bool resolutionTiming{ false };
+        uint2 viewportSize;
+
+        void update_component_bounds(const render_payload & scene);
+        void update_component_lods(const render_payload & scene);
+        void update_viewport_size();
+        void run_occlusion_culling(const render_payload & scene, const view_data & cullView);
+        void run_hiz_culling(const render_payload & scene);
+        void build_draw_packets(const render_payload & scene, const view_data & sortView);
+        void report_texture_usage(const render_payload & scene);
+        material_interface * get_fallback_material();
+        bool use_sky_environment(const render_payload & scene) const { return settings.skyEnvironment && scene.skybox && skyEnvironment && skyEnvironment->has_environment(); }
+        bool instanced_stereo() const { return settings.instancedStereo && settings.cameraCount == 2; }
+        material_view_layout view_layout() const { return { instanced_stereo(), settings.meshLod && settings.lodCrossFade, settings.asyncShaderCompile }; }
+        material_view_layout fallback_layout() const { material_view_layout l = view_layout(); l.compileAsync = false; return l; }  // the fallback is never pending
+        void update_per_object_uniform_buffer(const uniforms::per_object * objects, const uint32_t count);
+        void submit_packet(const uint32_t packetIndex, const view_data & view, const render_payload & scene);
+        void add_frame_passes(const render_payload & scene, const view_data & shadowView, uniforms::per_scene & sceneUniforms);
+        void add_view_passes(const render_payload & scene, const frame_resources & frame);
+        void add_instanced_view_passes(const render_payload & scene, const frame_resources & frame);
+        void add_output_passes(const render_payload & scene, const uint32_t camIdx, const render_resource msaaColor, const render_resource msaaDepth, const int layer);
+        void add_entity_id_pass(const render_payload & scene, const frame_resources & frame);
         void run_stencil_prepass(const view_data & view, const render_payload & scene);
         void run_depth_prepass(const view_data & view, const render_payload & scene);
+        void run_entity_id_pass(const view_data & view, const render_payload & scene);
         void run_skybox_pass(const view_data & view, const render_payload & scene);
         void run_shadow_pass(const view_data & view, const render_payload & scene);
-        void run_forward_pass(std::vector<const render_component *> & render_queue, const view_data & view, const render_payload & scene);
-        void run_post_pass(const view_data & view, const render_payload & scene);
+        void run_forward_pass(const view_data & view, const render_payload & scene);
+        void run_post_pass(const GLuint colorTexture, const GLuint outputFramebuffer);
 
     public:
 
-        std::vector<gl_framebuffer> postFramebuffers;
         std::vector<gl_texture_2d> postTextures;
 
         renderer_settings settings;
-        profiler<simple_cpu_timer> cpuProfiler;
-        profiler<gl_gpu_timer> gpuProfiler;
+        profiler renderProfiler;
 
         pbr_renderer(const renderer_settings settings);
         ~pbr_renderer();
@@ -168,6 +441,35 @@ namespace polymer
         void set_stencil_mask(const uint32_t idx, gl_mesh && m);
 
         stable_cascaded_shadows * get_shadow_pass() const;
+
+        // Passes of the last frame, with the ones that were culled and the placement of its transient targets
+        const render_graph & get_render_graph() const { return renderGraph; }
+
+        // Estimated memory traffic of the color resolves and tonemapping of the last frame on either path. The
+        // profiler times them as "fused_resolve", or as "resolve" and "run_post_pass" on the blit path.
+        const resolve_traffic & get_resolve_traffic() const { return resolveTraffic; }
+
+        // Statistics of the occlusion culling pass of the last frame
+        const occlusion_culling_stats & get_occlusion_stats() const { return occlusionCuller.get_stats(); }
+        uint32_t get_draw_count() const { return static_cast<uint32_t>(drawPackets.size()); }
+
+        // Records of the pbr material buffer used by the last frame, and how many of them had to be written
+        const pbr_material_buffer & get_pbr_material_buffer() const { return pbrMaterials; }
+        uint32_t get_occluded_draw_count() const { return get_draw_count() - visiblePacketCount; }
+
+        // Draws skipped by gpu hi-z culling; read back asynchronously, so a few frames old
+        uint32_t get_gpu_occluded_draw_count() const { return (hiz && frameCulling.hizIndirect) ? hiz->get_gpu_culled_count() : 0; }
+
+        // Pixels drawn by the last frame, the render size unless dynamic resolution is enabled
+        uint2 get_viewport_size() const { return viewportSize; }
+        float get_resolution_scale() const { return resolutionController.get_scale(); }
+
+        // Picks are requested from and polled on the renderer's picker; requests only draw ids with entityIdPass
+        entity_picker & get_entity_picker() { return entityPicker; }
+
+        // Null while texture streaming is disabled. Textures added to it are sized by the views of this renderer;
+        // they keep the levels they have if streaming is disabled later.
+        texture_streamer * get_texture_streamer();
     };
 
     template<class F> void visit_fields(pbr_renderer & o, F f)
@@ -178,7 +480,23 @@ namespace polymer
         f("performance_profiling", o.settings.performanceProfiling);
         f("depth_prepass", o.settings.useDepthPrepass);
         f("tonemap_pass", o.settings.tonemapEnabled);
+        f("fused_resolve", o.settings.fusedResolve);
+        f("exposure", o.settings.exposure, range_metadata<float>{ 0.125f, 8.f });
         f("shadow_pass", o.settings.shadowsEnabled);
+        f("instanced_stereo", o.settings.instancedStereo, editor_hidden{});
+        f("occlusion_culling", o.settings.occlusionCulling);
+        f("hiz_culling", o.settings.hizCulling);
+        f("hiz_gpu_culling", o.settings.hizGpuCulling);
+        f("mesh_lod", o.settings.meshLod);
+        f("lod_error_pixels", o.settings.lodErrorPixels, range_metadata<float>{ 0.25f, 16.f });
+        f("lod_cross_fade", o.settings.lodCrossFade);
+        f("dynamic_resolution", o.settings.dynamicResolution);
+        f("frame_budget_ms", o.settings.frameBudgetMs, range_metadata<float>{ 4.f, 50.f });
+        f("min_resolution_scale", o.settings.minResolutionScale, range_metadata<float>{ 0.25f, 1.f });
+        f("async_shader_compile", o.settings.asyncShaderCompile);
+        f("sky_environment", o.settings.skyEnvironment);
+        f("texture_streaming", o.settings.textureStreaming);
+        f("entity_id_pass", o.settings.entityIdPass);
     }
 
 }
@@ -40,6 +40,11 @@ namespace polymer
                 base_path + "/shaders/renderer/no_op_frag.glsl",
                 base_path + "/shaders/renderer");
 
+            monitor.watch("entity-id",
+                base_path + "/shaders/renderer/renderer_vert.glsl",
+                base_path + "/shaders/renderer/entity_id_frag.glsl",
+                base_path + "/shaders/renderer");
+
             monitor.watch("cascaded-shadows",
                 base_path + "/shaders/renderer/shadowcascade_vert.glsl",
                 base_path + "/shaders/renderer/shadowcascade_frag.glsl",
@@ -0,0 +1,228 @@
+#include "shader-cache.hpp"
+#include "file_io.hpp"
+#include "logging.hpp"
+
+#include <filesystem>
+#include <cstring>
+
+using namespace polymer;
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+    // FIPS 180-4
+    class sha256
+    {
+        uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+        uint8_t block[64];
+        size_t blockSize{ 0 };
+        uint64_t totalBytes{ 0 };
+
+        static uint32_t rotr(const uint32_t x, const uint32_t n) { return (x >> n) | (x << (32 - n)); }
+
+        void compress()
+        {
+            static const uint32_t k[64] =
+            {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+            };
+
+            uint32_t w[64];
+            for (int i = 0; i < 16; ++i) w[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16) | (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+            for (int i = 16; i < 64; ++i)
+            {
+                const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+            for (int i = 0; i < 64; ++i)
+            {
+                const uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+                const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+            }
+
+            state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+            state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        }
+
+    public:
+
+        void update(const void * data, size_t size)
+        {
+            const uint8_t * bytes = static_cast<const uint8_t *>(data);
+            totalBytes += size;
+            while (size > 0)
+            {
+                const size_t n = std::min<size_t>(64 - blockSize, size);
+                std::memcpy(block + blockSize, bytes, n);
+                blockSize += n;
+                bytes += n;
+                size -= n;
+                if (blockSize == 64) { compress(); blockSize = 0; }
+            }
+        }
+
+        std::string hex_digest()
+        {
+            const uint64_t totalBits = totalBytes * 8;
+            const uint8_t one = 0x80, zero = 0x00;
+            update(&one, 1);
+            while (blockSize != 56) update(&zero, 1);
+
+            uint8_t length[8];
+            for (int i = 0; i < 8; ++i) length[i] = static_cast<uint8_t>(totalBits >> (56 - i * 8));
+            update(length, 8);
+
+            static const char digits[] = "0123456789abcdef";
+            std::string hex(64, '0');
+            for (int i = 0; i < 32; ++i)
+            {
+                const uint8_t byte = static_cast<uint8_t>(state[i / 4] >> (24 - (i % 4) * 8));
+                hex[i * 2] = digits[byte >> 4];
+                hex[i * 2 + 1] = digits[byte & 0xf];
+            }
+            return hex;
+        }
+    };
+
+    struct cache_entry_header
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t format;
+        uint32_t length;
+    };
+
+    const char cache_entry_magic[4] = { 'P', 'L', 'P', 'B' };
+    const uint32_t cache_entry_version = 1;
+
+    std::string gl_string(const GLenum name)
+    {
+        const GLubyte * str = glGetString(name);
+        return str ? reinterpret_cast<const char *>(str) : "";
+    }
+}
+
+std::string polymer::sha256_hex(const void * data, const size_t size)
+{
+    sha256 h;
+    h.update(data, size);
+    return h.hex_digest();
+}
+
+//////////////////////////
+//   gl_program_cache   //
+//////////////////////////
+
+gl_program_cache::gl_program_cache(const std::string & dir)
+{
+    GLint formatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+
+    driver = gl_string(GL_VENDOR) + "\n" + gl_string(GL_RENDERER) + "\n" + gl_string(GL_VERSION) + "\n" + gl_string(GL_SHADING_LANGUAGE_VERSION);
+
+    try
+    {
+        // Absolute, so later changes of the working directory do not move the cache
+        fs::create_directories(dir);
+        directory = fs::absolute(dir).string();
+        supported = formatCount > 0;
+    }
+    catch (const std::exception & e)
+    {
+        log::get()->engine_log->warn("gl_program_cache: could not create {} ({})", dir, e.what());
+    }
+
+    if (formatCount == 0) log::get()->engine_log->info("gl_program_cache: the driver exposes no program binary formats, caching is disabled");
+}
+
+std::string gl_program_cache::make_key(const std::vector<std::string> & stageSources, const std::vector<std::string> & defines, const std::string & driver)
+{
+    // Every field is length prefixed so that no two different inputs serialize to the same bytes
+    sha256 h;
+    const auto add = [&h](const std::string & field)
+    {
+        const uint64_t length = field.size();
+        h.update(&length, sizeof(length));
+        h.update(field.data(), field.size());
+    };
+
+    add(driver);
+    for (auto & d : defines) add(d);
+    add({}); // separates the defines from the sources
+    for (auto & s : stageSources) add(s);
+    return h.hex_digest();
+}
+
+std::string gl_program_cache::entry_path(const std::string & key) const
+{
+    return directory + "/" + key + ".bin";
+}
+
+bool gl_program_cache::load(const std::string & key, gl_shader & program) const
+{
+    if (!supported) return false;
+
+    const std::string path = entry_path(key);
+    std::error_code ec;
+    if (!fs::exists(path, ec)) return false;
+
+    std::vector<uint8_t> entry;
+    try { entry = read_file_binary(path); }
+    catch (const std::exception &) { return false; }
+
+    cache_entry_header header;
+    if (entry.size() < sizeof(header)) return false;
+    std::memcpy(&header, entry.data(), sizeof(header));
+
+    if (std::memcmp(header.magic, cache_entry_magic, sizeof(header.magic)) != 0 || header.version != cache_entry_version || entry.size() - sizeof(header) != header.length)
+    {
+        log::get()->engine_log->warn("gl_program_cache: ignoring malformed entry {}", path);
+        return false;
+    }
+
+    return program.load_binary(header.format, entry.data() + sizeof(header), static_cast<GLsizei>(header.length));
+}
+
+void gl_program_cache::store(const std::string & key, const gl_shader & program) const
+{
+    if (!supported || !program.handle()) return;
+
+    GLenum format = 0;
+    const std::vector<uint8_t> binary = program.get_binary(format);
+    if (binary.empty()) return;
+
+    cache_entry_header header;
+    std::memcpy(header.magic, cache_entry_magic, sizeof(header.magic));
+    header.version = cache_entry_version;
+    header.format = format;
+    header.length = static_cast<uint32_t>(binary.size());
+
+    std::vector<uint8_t> entry(sizeof(header) + binary.size());
+    std::memcpy(entry.data(), &header, sizeof(header));
+    std::memcpy(entry.data() + sizeof(header), binary.data(), binary.size());
+
+    // Written under a temporary name and renamed, so a crash mid-write never leaves a truncated entry
+    const std::string path = entry_path(key);
+    const std::string temporaryPath = path + ".tmp";
+
+    try
+    {
+        write_file_binary(temporaryPath, entry);
+        fs::rename(temporaryPath, path);
+    }
+    catch (const std::exception & e)
+    {
+        log::get()->engine_log->warn("gl_program_cache: could not write {} ({})", path, e.what());
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ * On-disk cache of linked program binaries. A program is keyed by a SHA-256 digest of its fully
+ * preprocessed stage sources, the defines it was built with and the vendor, renderer and version strings
+ * of the driver that linked it. Includes are expanded before hashing, so editing any file a variant
+ * pulls in changes its key and the stale entry is simply never looked up again; a driver update does
+ * the same for every entry. Binaries the driver rejects anyway are ignored and rebuilt from source.
+ *
+ * Each entry is a single file named after its key, holding a small header and the binary returned
+ * by glGetProgramBinary. Loading and storing happen on the GL thread.
+ */
+
+#pragma once
+
+#ifndef polymer_shader_cache_hpp
+#define polymer_shader_cache_hpp
+
+#include "gl-api.hpp"
+
+#include <string>
+#include <vector>
+
+namespace polymer
+{
+    // Lowercase hex digest of `size` bytes
+    std::string sha256_hex(const void * data, const size_t size);
+
+    //////////////////////////
+    //   gl_program_cache   //
+    //////////////////////////
+
+    class gl_program_cache
+    {
+        std::string directory;
+        std::string driver;
+        bool supported{ false };
+
+        std::string entry_path(const std::string & key) const;
+
+    public:
+
+        // Creates `directory` if needed. Must be constructed on the gl thread, which is queried for
+        // the driver strings and for program binary support.
+        explicit gl_program_cache(const std::string & directory);
+
+        // Key of a program built from `stageSources`, in stage order, with `defines` by the driver `driver`
+        static std::string make_key(const std::vector<std::string> & stageSources, const std::vector<std::string> & defines, const std::string & driver);
+        std::string make_key(const std::vector<std::string> & stageSources, const std::vector<std::string> & defines) const { return make_key(stageSources, defines, driver); }
+
+        // True if an entry for `key` exists and the driver accepted it into `program`
+        bool load(const std::string & key, gl_shader & program) const;
+
+        // Writes the linked `program` under `key`; failures are logged and otherwise ignored
+        void store(const std::string & key, const gl_shader & program) const;
+
+        bool enabled() const { return supported; }
+    };
+
+} // end namespace polymer
+
+#endif // end polymer_shader_cache_hpp
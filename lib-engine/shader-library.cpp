@@ -1,5 +1,7 @@
 #include "shader-library.hpp"
 #include "asset-handle-utils.hpp"
+#include "logging.hpp"
+#include "json.hpp"
 
 using namespace polymer;
 using namespace std::experimental::filesystem;
@@ -11,8 +13,10 @@ system_clock::time_point write_time(const std::string & file_path)
     catch (...) { return system_clock::time_point::min(); };
 }
 
-gl_shader_monitor::gl_shader_monitor(const std::string & root_path) : root_path(root_path)
+gl_shader_monitor::gl_shader_monitor(const std::string & root_path, const std::string & program_cache_path) : root_path(root_path)
 {
+    if (!program_cache_path.empty()) program_cache = std::make_shared<gl_program_cache>(program_cache_path);
+
     watch_thread = std::thread([this, root_path]()
     {
         while (!watch_should_exit)
@@ -42,6 +46,7 @@ void gl_shader_monitor::watch(const std::string & name, const std::string & vert
 {
     std::lock_guard<std::mutex> guard(watch_mutex);
     auto asset = std::make_shared<gl_shader_asset>(name, vert_path, frag_path);
+    asset->set_program_cache(program_cache);
     assets[name] = asset;
     create_handle_for_asset(name.c_str(), std::move(asset));
 }
@@ -50,6 +55,7 @@ void gl_shader_monitor::watch(const std::string & name, const std::string & vert
 {
     std::lock_guard<std::mutex> guard(watch_mutex);
     auto asset = std::make_shared<gl_shader_asset>(name, vert_path, frag_path, "", include_path);
+    asset->set_program_cache(program_cache);
     assets[name] = asset;
     create_handle_for_asset(name.c_str(), std::move(asset));
 }
@@ -58,6 +64,7 @@ void gl_shader_monitor::watch(const std::string & name, const std::string & vert
 {
     std::lock_guard<std::mutex> guard(watch_mutex);
     auto asset = std::make_shared<gl_shader_asset>(name, vert_path, frag_path, geom_path, include_path);
+    asset->set_program_cache(program_cache);
     assets[name] = asset;
     create_handle_for_asset(name.c_str(), std::move(asset));
 }
@@ -125,5 +132,70 @@ void gl_shader_monitor::handle_recompile()
             asset.second->recompile_all();
             asset.second->shouldRecompile = false;
         }
+
+        if (asset.second->has_pending()) asset.second->poll_pending();
+    }
+}
+
+void gl_shader_monitor::load_variant_manifest(const std::string & manifest_path)
+{
+    nlohmann::json manifest;
+    try { manifest = nlohmann::json::parse(read_file_text(manifest_path)); }
+    catch (const std::exception & e)
+    {
+        log::get()->engine_log->info("gl_shader_monitor: no variant manifest loaded from {} ({})", manifest_path, e.what());
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(watch_mutex);
+
+    uint32_t requested = 0;
+    for (auto shader = manifest.begin(); shader != manifest.end(); ++shader)
+    {
+        auto asset = assets.find(shader.key());
+
+        for (auto & entry : shader.value())
+        {
+            const std::vector<std::string> defines = entry.get<std::vector<std::string>>();
+            manifest_variants[shader.key()].insert(gl_shader_asset::variant_key(defines));
+
+            if (asset == assets.end()) continue;
+            asset->second->request_variant(defines);
+            ++requested;
+        }
+    }
+
+    log::get()->engine_log->info("gl_shader_monitor: requested {} variants from {}", requested, manifest_path);
+}
+
+void gl_shader_monitor::save_variant_manifest(const std::string & manifest_path)
+{
+    std::lock_guard<std::mutex> guard(watch_mutex);
+
+    for (auto & asset : assets)
+    {
+        for (auto & defines : asset.second->get_variant_defines())
+        {
+            manifest_variants[asset.first].insert(gl_shader_asset::variant_key(defines));
+        }
+    }
+
+    // Keys are the defines of a variant, each followed by a newline
+    nlohmann::json manifest = nlohmann::json::object();
+    for (auto & shader : manifest_variants)
+    {
+        nlohmann::json & variants = manifest[shader.first] = nlohmann::json::array();
+        for (auto & key : shader.second)
+        {
+            std::vector<std::string> defines;
+            for (size_t begin = 0, end; (end = key.find('\n', begin)) != std::string::npos; begin = end + 1) defines.push_back(key.substr(begin, end - begin));
+            variants.push_back(defines);
+        }
+    }
+
+    try { write_file_text(manifest_path, manifest.dump(4)); }
+    catch (const std::exception & e)
+    {
+        log::get()->engine_log->warn("gl_shader_monitor: could not write variant manifest {} ({})", manifest_path, e.what());
     }
 }
\ No newline at end of file
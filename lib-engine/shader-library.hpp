@@ -8,12 +8,15 @@
 #include "string_utils.hpp"
 #include "gl-loaders.hpp"
 #include "shader.hpp"
+#include "shader-cache.hpp"
 
 #include <regex>
 #include <unordered_map>
 #include <chrono>
 #include <filesystem>
 #include <atomic>
+#include <map>
+#include <set>
 
 using namespace std::experimental::filesystem;
 using namespace std::chrono;
@@ -28,18 +31,29 @@ namespace polymer
         std::thread watch_thread;
         std::mutex watch_mutex;
         std::atomic<bool> watch_should_exit{ false };
+        std::shared_ptr<gl_program_cache> program_cache;
+        std::map<std::string, std::set<std::string>> manifest_variants;   // shader name to variant_key()s
 
         void walk_asset_dir();
 
     public:
 
-        // This must be constructed on the gl thread
-        gl_shader_monitor(const std::string & asset_path);
+        // This must be constructed on the gl thread. With a `program_cache_path`, linked variants are
+        // cached there and loaded instead of compiled on later runs (see gl_program_cache).
+        gl_shader_monitor(const std::string & asset_path, const std::string & program_cache_path = {});
         ~gl_shader_monitor();
 
-        // Call this regularly on the gl thread
+        // Call this regularly on the gl thread; also finishes variants compiling in the background
         void handle_recompile();
 
+        // Requests every variant listed in a manifest written by save_variant_manifest() in an earlier
+        // session, so they compile in the background while loading instead of on first use. Variants of
+        // shaders that are not watched are kept for the next save.
+        void load_variant_manifest(const std::string & manifest_path);
+
+        // Writes the variants of every watched shader, together with those of the loaded manifest
+        void save_variant_manifest(const std::string & manifest_path);
+
         // Watch vertex and fragment
         void watch(const std::string & name, const std::string & vert_path, const std::string & frag_path);
 
@@ -1,4 +1,7 @@
 #include "shader.hpp"
+#include "shader-cache.hpp"
+
+#include <algorithm>
 
 using namespace polymer;
 
@@ -6,31 +9,49 @@ using namespace polymer;
 //   Shader Preprocessing Functions   //
 ////////////////////////////////////////
 
+// Matches `#include "file"` or `#include <file>` with optional spaces around the `#`. Every line of every
+// variant passes through here, so this is a plain scan rather than a std::regex.
+bool parse_include_line(const std::string & line, std::string & includeFile)
+{
+    size_t i = line.find_first_not_of(' ');
+    if (i == std::string::npos || line[i] != '#') return false;
+
+    i = line.find_first_not_of(' ', i + 1);
+    if (i == std::string::npos || line.compare(i, 7, "include") != 0) return false;
+
+    i += 7;
+    const size_t open = line.find_first_not_of(' ', i);
+    if (open == i || open == std::string::npos || (line[open] != '"' && line[open] != '<')) return false;
+
+    const size_t close = line.find_first_of("\">", open + 1);
+    if (close == std::string::npos) return false;
+
+    includeFile = line.substr(open + 1, close - open - 1);
+    return true;
+}
+
 std::string process_includes_recursive(const std::string & source, const std::string & includeSearchPath, std::vector<std::string> & includes, int depth)
 {
     if (depth > 4) throw std::runtime_error("exceeded max include recursion depth");
 
-    static const std::regex re("^[ ]*#[ ]*include[ ]+[\"<](.*)[\">].*");
     std::stringstream input;
     std::stringstream output;
 
     input << source;
 
     size_t lineNumber = 1;
-    std::smatch matches;
+    std::string includeFile;
     std::string line;
 
     while (std::getline(input, line))
     {
-        if (std::regex_search(line, matches, re))
+        if (parse_include_line(line, includeFile))
         {
-            std::string includeFile = matches[1];
-            std::string includeString = read_file_text(includeSearchPath + "/" + includeFile);
-
             if (!includeFile.empty())
             {
+                std::string includeString = read_file_text(includeSearchPath + "/" + includeFile);
                 includes.push_back(includeSearchPath + "/" + includeFile);
-                output << process_includes_recursive(includeString, includeSearchPath, includes, depth++) << std::endl;
+                output << process_includes_recursive(includeString, includeSearchPath, includes, depth + 1) << std::endl;
             }
         }
         else
@@ -66,7 +87,8 @@ std::string preprocess_version(const std::string & source)
     return result.str();
 }
 
-gl_shader preprocess(const std::string & vertexShader,
+// Expands the defines and includes of every stage; empty stages stay empty
+std::vector<std::string> preprocess(const std::string & vertexShader,
     const std::string & fragmentShader,
     const std::string & geomShader,
     const std::string & includeSearchPath,
@@ -88,19 +110,11 @@ gl_shader preprocess(const std::string & vertexShader,
     if (fragmentShader.size()) fragment << fragmentShader;
     if (geomShader.size()) geom << geomShader;
 
-    if (geomShader.size())
-    {
-        return gl_shader(
-            preprocess_version(process_includes_recursive(vertex.str(), includeSearchPath, includes, 0)),
-            preprocess_version(process_includes_recursive(fragment.str(), includeSearchPath, includes, 0)),
-            preprocess_version(process_includes_recursive(geom.str(), includeSearchPath, includes, 0)));
-    }
-    else
-    {
-        return gl_shader(
-            preprocess_version(process_includes_recursive(vertex.str(), includeSearchPath, includes, 0)),
-            preprocess_version(process_includes_recursive(fragment.str(), includeSearchPath, includes, 0)));
-    }
+    std::vector<std::string> stages;
+    stages.push_back(preprocess_version(process_includes_recursive(vertex.str(), includeSearchPath, includes, 0)));
+    stages.push_back(preprocess_version(process_includes_recursive(fragment.str(), includeSearchPath, includes, 0)));
+    stages.push_back(geomShader.size() ? preprocess_version(process_includes_recursive(geom.str(), includeSearchPath, includes, 0)) : std::string());
+    return stages;
 }
 
 ///////////////////////////////////////
@@ -110,48 +124,160 @@ gl_shader preprocess(const std::string & vertexShader,
 gl_shader_asset::gl_shader_asset(const std::string & n, const std::string & v, const std::string & f, const std::string & g, const std::string & inc) 
     : name(n), vertexPath(v), fragmentPath(f), geomPath(g), includePath(inc) {}
 
+std::string gl_shader_asset::variant_key(const std::vector<std::string> & defines)
+{
+    std::vector<std::string> sorted = defines;
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+    std::string key;
+    for (auto & define : sorted) key += define + "\n";
+    return key;
+}
+
 uint64_t gl_shader_asset::hash(const std::vector<std::string> & defines)
 {
-    uint64_t sumOfHashes = 0;
-    for (auto & define : defines) sumOfHashes += poly_hash_fnv1a(define);
-    return sumOfHashes;
+    // 64-bit FNV-1a of the key
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const char c : variant_key(defines)) h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3ull;
+    return h;
 }
 
-std::shared_ptr<shader_variant> gl_shader_asset::get_variant(const std::vector<std::string> defines)
+std::shared_ptr<shader_variant> gl_shader_asset::make_variant(const std::vector<std::string> & defines)
 {
-    // Hash the defines
-    uint64_t theHash = hash(defines);
+    auto newVariant = std::make_shared<shader_variant>();
+    newVariant->defines = defines;
+    std::sort(newVariant->defines.begin(), newVariant->defines.end());
+    newVariant->defines.erase(std::unique(newVariant->defines.begin(), newVariant->defines.end()), newVariant->defines.end());
+    newVariant->hash = hash(newVariant->defines);
+    shaders[variant_key(newVariant->defines)] = newVariant;
+    return newVariant;
+}
 
+std::shared_ptr<shader_variant> gl_shader_asset::get_variant(const std::vector<std::string> defines)
+{
     // Lookup if exists
-    auto itr = shaders.find(theHash);
-    if (itr != shaders.end()) return itr->second;
+    auto itr = shaders.find(variant_key(defines));
+    if (itr != shaders.end())
+    {
+        if (itr->second->pending)
+        {
+            for (auto p = pending.begin(); p != pending.end(); ++p)
+            {
+                if (p->variant != itr->second) continue;
+                finish_compile(*p);
+                pending.erase(p);
+                break;
+            }
+        }
+        return itr->second;
+    }
 
     // Create if not
-    auto newVariant = std::make_shared<shader_variant>();
-    newVariant->shader = std::move(compile_variant(defines));
-    newVariant->defines = defines;
-    newVariant->hash = theHash;
-    shaders[theHash] = newVariant;
+    auto newVariant = make_variant(defines);
+    newVariant->shader = std::move(compile_variant(newVariant->defines));
+    return newVariant;
+}
+
+std::shared_ptr<shader_variant> gl_shader_asset::request_variant(const std::vector<std::string> defines)
+{
+    auto itr = shaders.find(variant_key(defines));
+    if (itr != shaders.end()) return itr->second;
+
+    // Drivers with parallel compilation build programs on their own threads; ask for as many as they allow
+    static bool compilerThreadsSet = false;
+    if (!compilerThreadsSet)
+    {
+        if (GLAD_GL_KHR_parallel_shader_compile) glMaxShaderCompilerThreadsKHR(0xffffffff);
+        compilerThreadsSet = true;
+    }
+
+    auto newVariant = make_variant(defines);
+
+    try
+    {
+        const std::vector<std::string> stages = preprocess_variant(newVariant->defines);
+
+        std::string cacheKey;
+        if (programCache && programCache->enabled())
+        {
+            cacheKey = programCache->make_key(stages, newVariant->defines);
+            if (programCache->load(cacheKey, newVariant->shader)) return newVariant;
+        }
+
+        pending_compile p;
+        p.variant = newVariant;
+        p.shader = gl_shader(gl_shader::deferred_link{}, stages[0], stages[1], stages[2]);
+        p.cacheKey = cacheKey;
+        pending.push_back(std::move(p));
+        newVariant->pending = true;
+    }
+    catch (const std::exception & e)
+    {
+        //@todo use logger
+        std::cout << "Shader compilation error: " << e.what() << std::endl;
+    }
+
     return newVariant;
 }
 
+void gl_shader_asset::finish_compile(pending_compile & p)
+{
+    try
+    {
+        p.shader.finish_link();
+        if (!p.cacheKey.empty()) programCache->store(p.cacheKey, p.shader);
+        p.variant->shader = std::move(p.shader);
+    }
+    catch (const std::exception & e)
+    {
+        //@todo use logger
+        std::cout << "Shader compilation error: " << e.what() << std::endl;
+    }
+
+    p.variant->pending = false;
+}
+
+void gl_shader_asset::poll_pending()
+{
+    uint32_t finished = 0;
+    for (auto p = pending.begin(); p != pending.end();)
+    {
+        // Without parallel compilation finishing waits on the driver, so spread the cost over calls
+        if (!GLAD_GL_KHR_parallel_shader_compile && finished > 0) break;
+
+        if (!p->shader.link_completed())
+        {
+            ++p;
+            continue;
+        }
+
+        finish_compile(*p);
+        p = pending.erase(p);
+        ++finished;
+    }
+}
+
+std::vector<std::vector<std::string>> gl_shader_asset::get_variant_defines() const
+{
+    std::vector<std::vector<std::string>> result;
+    for (auto & variant : shaders) result.push_back(variant.second->defines);
+    return result;
+}
+
 gl_shader & gl_shader_asset::get()
 {
-    std::shared_ptr<shader_variant> theDefault;
-    if (shaders.size() == 0) theDefault = get_variant();
-    else theDefault = shaders[0];
-    return theDefault->shader;
+    return get_variant()->shader;
 }
 
 void gl_shader_asset::recompile_all()
 {
+    // Anything still queued was built from the old sources
+    for (auto & p : pending) p.variant->pending = false;
+    pending.clear();
+
     // Compile at least the default variant with no includes defined... 
-    if (shaders.empty())
-    {
-        auto newVariant = std::make_shared<shader_variant>();
-        newVariant->shader = std::move(compile_variant({}));
-        shaders[0] = newVariant;
-    }
+    if (shaders.empty()) make_variant({});
 
     for (auto & variant : shaders)
     {
@@ -159,20 +285,33 @@ void gl_shader_asset::recompile_all()
     }
 }
 
+std::vector<std::string> gl_shader_asset::preprocess_variant(const std::vector<std::string> & defines)
+{
+    if (defines.size() > 0 || includePath.size() > 0)
+    {
+        return preprocess(read_file_text(vertexPath), read_file_text(fragmentPath), read_file_text(geomPath), includePath, defines, includes);
+    }
+    return { read_file_text(vertexPath), read_file_text(fragmentPath), read_file_text(geomPath) };
+}
+
 gl_shader gl_shader_asset::compile_variant(const std::vector<std::string> defines)
 {
     gl_shader variant;
 
     try
     {
-        if (defines.size() > 0 || includePath.size() > 0)
-        {
-            variant = preprocess(read_file_text(vertexPath), read_file_text(fragmentPath), read_file_text(geomPath), includePath, defines, includes);
-        }
-        else
+        const std::vector<std::string> stages = preprocess_variant(defines);
+
+        // The key covers the expanded sources, so edits to any include select a different entry
+        std::string key;
+        if (programCache && programCache->enabled())
         {
-            variant = gl_shader(read_file_text(vertexPath), read_file_text(fragmentPath), read_file_text(geomPath));
+            key = programCache->make_key(stages, defines);
+            if (programCache->load(key, variant)) return variant;
         }
+
+        variant = gl_shader(stages[0], stages[1], stages[2]);
+        if (!key.empty()) programCache->store(key, variant);
     }
     catch (const std::exception & e)
     {
@@ -181,4 +320,4 @@ gl_shader gl_shader_asset::compile_variant(const std::vector<std::string> define
     }
 
     return std::move(variant);
-}
\ No newline at end of file
+}
@@ -18,32 +18,66 @@
 
 namespace polymer
 {
+    class gl_program_cache;
+
     struct shader_variant
     {
         uint64_t hash;
-        std::vector<std::string> defines;
-        gl_shader shader;
+        std::vector<std::string> defines;   // sorted and without duplicates
+        gl_shader shader;                   // empty while pending
+        bool pending{ false };              // requested with request_variant() and still being compiled
         bool enabled(const std::string & define) { for (auto & d : defines) if (d == define) return true; return false; }
     };
 
     class gl_shader_asset
     {
+        struct pending_compile
+        {
+            std::shared_ptr<shader_variant> variant;
+            gl_shader shader;
+            std::string cacheKey;
+        };
+
         std::string name;
         std::string vertexPath, fragmentPath, geomPath, includePath;
         std::vector<std::string> includes;
-        std::unordered_map<uint64_t, std::shared_ptr<shader_variant>> shaders;
+        std::unordered_map<std::string, std::shared_ptr<shader_variant>> shaders;   // keyed by variant_key()
+        std::vector<pending_compile> pending;
         bool shouldRecompile{ true };
         int64_t writeTime{ 0 };
+        std::shared_ptr<gl_program_cache> programCache;  // optional; variants are then loaded from and saved to disk
         friend class gl_shader_monitor;
 
+        std::vector<std::string> preprocess_variant(const std::vector<std::string> & defines);
+        std::shared_ptr<shader_variant> make_variant(const std::vector<std::string> & defines);
+        void finish_compile(pending_compile & p);
+
     public:
 
         gl_shader_asset(const std::string & n, const std::string & v, const std::string & f, const std::string & g = "", const std::string & inc = "");
         gl_shader compile_variant(const std::vector<std::string> defines);
+
+        // Compiles the variant on first use and waits for it, including one still pending from request_variant()
         std::shared_ptr<shader_variant> get_variant(const std::vector<std::string> defines = {});
+
+        // Returns immediately. A variant that is neither compiled nor in the program cache is queued and
+        // stays `pending`, with an empty shader, until a later poll_pending() finds its link completed.
+        std::shared_ptr<shader_variant> request_variant(const std::vector<std::string> defines);
+
+        // Finishes queued variants whose link has completed. Never waits on drivers exposing
+        // GL_KHR_parallel_shader_compile; elsewhere at most one variant is finished per call.
+        void poll_pending();
+        bool has_pending() const { return !pending.empty(); }
+
         gl_shader & get(); // returns compiled shader, assumes no defines
-        uint64_t hash(const std::vector<std::string> & defines);
         void recompile_all();
+        void set_program_cache(std::shared_ptr<gl_program_cache> cache) { programCache = cache; }
+        std::vector<std::vector<std::string>> get_variant_defines() const;
+
+        // The same set of defines in any order, with or without repeats, maps to the same key. Variants are
+        // stored by the key itself, so distinct sets never share a variant; the hash is a quick comparison.
+        static std::string variant_key(const std::vector<std::string> & defines);
+        static uint64_t hash(const std::vector<std::string> & defines);
     };
 }
 
@@ -0,0 +1,296 @@
+#include "sky-environment.hpp"
+
+using namespace polymer;
+
+namespace
+{
+    // Draws one cube face with a quad covering it; the face direction of every fragment follows the
+    // GL cubemap face layout, with s and t measured from the first texel of the face
+    constexpr const char prefilter_vert[] = R"(#version 450
+        layout(location = 0) in vec3 position;
+        out vec2 v_st;
+        void main()
+        {
+            gl_Position = vec4(position.xy, 0.0, 1.0);
+            v_st = position.xy;
+        }
+    )";
+
+    constexpr const char prefilter_common[] = R"(#version 450
+        uniform samplerCube s_environment;
+        uniform int u_face;
+        uniform float u_environmentSize;
+        in vec2 v_st;
+        out vec4 f_color;
+
+        const float PI = 3.14159265359;
+
+        vec3 face_direction(int face, vec2 st)
+        {
+            if (face == 0) return vec3( 1.0, -st.y, -st.x);
+            if (face == 1) return vec3(-1.0, -st.y,  st.x);
+            if (face == 2) return vec3( st.x,  1.0,  st.y);
+            if (face == 3) return vec3( st.x, -1.0, -st.y);
+            if (face == 4) return vec3( st.x, -st.y,  1.0);
+            return vec3(-st.x, -st.y, -1.0);
+        }
+
+        void tangent_frame(vec3 N, out vec3 T, out vec3 B)
+        {
+            vec3 up = abs(N.y) < 0.999 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);
+            T = normalize(cross(up, N));
+            B = cross(N, T);
+        }
+
+        // Matches linearrgb_to_srgb1 with the default gamma, which materials undo when sampling
+        vec3 encode(vec3 c)
+        {
+            vec3 curve = 1.055 * pow(max(c, vec3(0.0031308)), vec3(1.0 / 2.2)) - 0.055;
+            return mix(max(c, vec3(0.0)) * 12.92, curve, step(vec3(0.0031308), c));
+        }
+    )";
+
+    // Cosine weighted hemisphere integral, read from a level of the environment small enough that the
+    // fixed step between samples does not alias
+    constexpr const char irradiance_frag[] = R"(
+        uniform float u_sourceLevel;
+
+        void main()
+        {
+            vec3 N = normalize(face_direction(u_face, v_st));
+            vec3 T, B;
+            tangent_frame(N, T, B);
+
+            const float delta = 0.05;
+            vec3 sum = vec3(0.0);
+            float count = 0.0;
+            for (float phi = 0.0; phi < 2.0 * PI; phi += delta)
+            {
+                for (float theta = 0.0; theta < 0.5 * PI; theta += delta)
+                {
+                    vec3 L = sin(theta) * (cos(phi) * T + sin(phi) * B) + cos(theta) * N;
+                    sum += textureLod(s_environment, L, u_sourceLevel).rgb * cos(theta) * sin(theta);
+                    count += 1.0;
+                }
+            }
+
+            f_color = vec4(encode(PI * sum / count), 1.0);
+        }
+    )";
+
+    // GGX importance sampling with N = V = R. Every sample reads the mip whose texels cover about the
+    // solid angle the sample stands for, which hides the noise of a small sample count.
+    constexpr const char radiance_frag[] = R"(
+        uniform float u_roughness;
+
+        const uint SAMPLE_COUNT = 128u;
+
+        vec2 hammersley(uint i)
+        {
+            return vec2(float(i) / float(SAMPLE_COUNT), float(bitfieldReverse(i)) * 2.3283064365386963e-10);
+        }
+
+        void main()
+        {
+            vec3 N = normalize(face_direction(u_face, v_st));
+            vec3 T, B;
+            tangent_frame(N, T, B);
+
+            float alpha = u_roughness * u_roughness;
+            float texelSolidAngle = 4.0 * PI / (6.0 * u_environmentSize * u_environmentSize);
+
+            vec3 sum = vec3(0.0);
+            float weight = 0.0;
+            for (uint i = 0u; i < SAMPLE_COUNT; ++i)
+            {
+                vec2 xi = hammersley(i);
+                float phi = 2.0 * PI * xi.x;
+                float cosTheta = sqrt((1.0 - xi.y) / (1.0 + (alpha * alpha - 1.0) * xi.y));
+                float sinTheta = sqrt(1.0 - cosTheta * cosTheta);
+                vec3 H = sinTheta * (cos(phi) * T + sin(phi) * B) + cosTheta * N;
+                vec3 L = 2.0 * dot(N, H) * H - N;
+
+                float NdotL = dot(N, L);
+                if (NdotL <= 0.0) continue;
+
+                // With N = V the pdf of L reduces to D / 4
+                float d = (alpha * alpha) / (PI * pow(cosTheta * cosTheta * (alpha * alpha - 1.0) + 1.0, 2.0));
+                float sampleSolidAngle = 1.0 / (float(SAMPLE_COUNT) * d * 0.25 + 1e-4);
+                float level = max(0.5 * log2(sampleSolidAngle / texelSolidAngle), 0.0);
+
+                sum += textureLod(s_environment, L, level).rgb * NdotL;
+                weight += NdotL;
+            }
+
+            f_color = vec4(encode(sum / max(weight, 1e-4)), 1.0);
+        }
+    )";
+
+    // Directions have no translation, and a depth of w puts the sky on the far plane
+    constexpr const char skybox_vert[] = R"(#version 450
+        layout(location = 0) in vec3 position;
+        uniform mat4 u_viewProj;
+        out vec3 v_direction;
+        void main()
+        {
+            v_direction = position;
+            gl_Position = (u_viewProj * vec4(position, 0.0)).xyww;
+        }
+    )";
+
+    constexpr const char skybox_frag[] = R"(#version 450
+        uniform samplerCube s_environment;
+        in vec3 v_direction;
+        out vec4 f_color;
+        void main()
+        {
+            f_color = vec4(textureLod(s_environment, v_direction, 0.0).rgb, 1.0);
+        }
+    )";
+
+    uint32_t mip_count(const uint32_t size)
+    {
+        uint32_t count = 1;
+        while ((size >> count) > 0) ++count;
+        return count;
+    }
+
+    void allocate_cubemap(gl_texture_2d & texture, const uint32_t size, const uint32_t levels)
+    {
+        glTextureStorage2DEXT(texture, GL_TEXTURE_CUBE_MAP, levels, GL_RGBA16F, size, size);
+        glTextureParameteriEXT(texture, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glTextureParameteriEXT(texture, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTextureParameteriEXT(texture, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTextureParameteriEXT(texture, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTextureParameteriEXT(texture, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        texture.width = texture.height = static_cast<float>(size);
+    }
+}
+
+/////////////////////////
+//   sky_environment   //
+/////////////////////////
+
+sky_environment::sky_environment()
+{
+    gl_state().enable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+    allocate_cubemap(environment, environment_size, mip_count(environment_size));
+    for (auto & m : maps)
+    {
+        allocate_cubemap(m.irradiance, irradiance_size, 1);
+        allocate_cubemap(m.radiance, radiance_size, radiance_levels);
+    }
+
+    irradianceProgram = gl_shader(prefilter_vert, std::string(prefilter_common) + irradiance_frag);
+    radianceProgram = gl_shader(prefilter_vert, std::string(prefilter_common) + radiance_frag);
+    skyboxProgram = gl_shader(skybox_vert, skybox_frag);
+
+    faceQuad = make_fullscreen_quad_ndc();
+    skyboxCube = make_cube_mesh();
+
+    nextUnit = unit_count();
+
+    gl_check_error(__FILE__, __LINE__);
+}
+
+void sky_environment::bake(gl_procedural_sky & sky)
+{
+    // Standard cubemap face orientations: looking down each axis with the up vectors of the GL face layout
+    static const float3 targets[6] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+    static const float3 ups[6] = { { 0, -1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 }, { 0, -1, 0 }, { 0, -1, 0 } };
+
+    const float4x4 projectionMatrix = make_projection_matrix(to_radians(90.f), 1.f, 0.1f, 10.f);
+
+    gl_state_cache & state = gl_state();
+    state.bind_framebuffer(GL_FRAMEBUFFER, framebuffer);
+    state.viewport_rect(0, 0, environment_size, environment_size);
+
+    for (uint32_t face = 0; face < 6; ++face)
+    {
+        glNamedFramebufferTexture2DEXT(framebuffer, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, environment, 0);
+        const float4x4 viewMatrix = lookat_rh(float3(0, 0, 0), targets[face], ups[face]).view_matrix();
+
+        // The sky sphere is drawn around the origin just inside the far clip
+        sky.render(projectionMatrix * viewMatrix, float3(0, 0, 0), 1.f);
+    }
+
+    glGenerateTextureMipmapEXT(environment, GL_TEXTURE_CUBE_MAP);
+
+    gl_check_error(__FILE__, __LINE__);
+}
+
+void sky_environment::prefilter(const prefilter_unit & unit)
+{
+    const ibl_maps & target = maps[buildingMaps];
+    const gl_shader & program = unit.irradiance ? irradianceProgram : radianceProgram;
+    const uint32_t size = std::max<uint32_t>((unit.irradiance ? irradiance_size : radiance_size) >> unit.level, 1u);
+
+    gl_state_cache & state = gl_state();
+    state.bind_framebuffer(GL_FRAMEBUFFER, framebuffer);
+    state.viewport_rect(0, 0, size, size);
+    glNamedFramebufferTexture2DEXT(framebuffer, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + unit.face, unit.irradiance ? target.irradiance : target.radiance, unit.level);
+
+    program.texture(const_hash("s_environment"), 0, environment, GL_TEXTURE_CUBE_MAP);
+    program.uniform(const_hash("u_face"), static_cast<int>(unit.face));
+    program.uniform(const_hash("u_environmentSize"), static_cast<float>(environment_size));
+
+    // The irradiance integral reads the 16 texel wide level of the environment
+    if (unit.irradiance) program.uniform(const_hash("u_sourceLevel"), std::log2(environment_size / 16.f));
+    else program.uniform(const_hash("u_roughness"), prefiltered_level_roughness(unit.level, radiance_levels));
+
+    state.use_program(program.handle());
+    faceQuad.draw_elements();
+}
+
+void sky_environment::update(gl_procedural_sky & sky)
+{
+    gl_state_cache & state = gl_state();
+    const bool blendEnabled = state.is_enabled(GL_BLEND);
+    const bool depthTestEnabled = state.is_enabled(GL_DEPTH_TEST);
+    const bool cullFaceEnabled = state.is_enabled(GL_CULL_FACE);
+
+    state.disable(GL_BLEND);
+    state.disable(GL_DEPTH_TEST);
+    state.disable(GL_CULL_FACE);
+
+    // A new sky restarts filtering into the maps not in use; the maps in use keep lighting until it finishes
+    if (!baked || sky.get_version() != bakedVersion)
+    {
+        bake(sky);
+        baked = true;
+        bakedVersion = sky.get_version();
+        buildingMaps = completeMaps == 0 ? 1 : 0;
+        nextUnit = 0;
+    }
+
+    for (uint32_t i = 0; i < unitsPerFrame && nextUnit < unit_count(); ++i)
+    {
+        prefilter(get_prefilter_unit(nextUnit++));
+    }
+
+    if (nextUnit == unit_count() && completeMaps != static_cast<int32_t>(buildingMaps))
+    {
+        completeMaps = static_cast<int32_t>(buildingMaps);
+    }
+
+    state.set_enabled(GL_BLEND, blendEnabled);
+    state.set_enabled(GL_DEPTH_TEST, depthTestEnabled);
+    state.set_enabled(GL_CULL_FACE, cullFaceEnabled);
+}
+
+void sky_environment::draw_skybox(const float4x4 & viewProjectionMatrix)
+{
+    if (!baked) return;
+
+    gl_state_cache & state = gl_state();
+    const bool cullFaceEnabled = state.is_enabled(GL_CULL_FACE);
+    state.disable(GL_CULL_FACE);
+
+    skyboxProgram.uniform(const_hash("u_viewProj"), viewProjectionMatrix);
+    skyboxProgram.texture(const_hash("s_environment"), 0, environment, GL_TEXTURE_CUBE_MAP);
+    state.use_program(skyboxProgram.handle());
+    skyboxCube.draw_elements();
+
+    state.set_enabled(GL_CULL_FACE, cullFaceEnabled);
+}
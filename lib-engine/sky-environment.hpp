@@ -0,0 +1,109 @@
+/*
+ * Image based lighting from the procedural sky. The sky is drawn into a cubemap only when its parameters
+ * change, which turns the skybox pass into a single cubemap lookup instead of evaluating the sky model for
+ * every pixel of every view. The same cubemap is prefiltered on the gpu into an irradiance map and a radiance
+ * map whose mips hold the sky convolved with increasingly rough GGX lobes, in the layout the pbr material
+ * expects: level i serves roughness 2^(i - (levels - 1)).
+ *
+ * Prefiltering is split into units of one cube face of one map level, and only a few units run per frame.
+ * They fill a second set of maps that replaces the one in use once complete, so lighting never shows a half
+ * filtered sky; a change of the sky during filtering simply restarts it. The prefiltered maps are written with
+ * the sRGB curve like the dds environment maps the materials decode.
+ */
+
+#pragma once
+
+#ifndef polymer_sky_environment_hpp
+#define polymer_sky_environment_hpp
+
+#include "math-core.hpp"
+#include "gl-api.hpp"
+#include "gl-procedural-sky.hpp"
+
+namespace polymer
+{
+    // Roughness the pbr material samples from `level` of a radiance map with `levelCount` levels
+    inline float prefiltered_level_roughness(const uint32_t level, const uint32_t levelCount)
+    {
+        return std::exp2(static_cast<float>(level) - static_cast<float>(levelCount - 1));
+    }
+
+    struct prefilter_unit
+    {
+        bool irradiance;    // otherwise a level of the radiance map
+        uint32_t level;
+        uint32_t face;      // GL_TEXTURE_CUBE_MAP_POSITIVE_X + face
+    };
+
+    // The irradiance faces come first, then the radiance map from its sharpest level up
+    inline prefilter_unit get_prefilter_unit(const uint32_t index)
+    {
+        if (index < 6) return { true, 0, index };
+        return { false, (index - 6) / 6, (index - 6) % 6 };
+    }
+
+    /////////////////////////
+    //   sky_environment   //
+    /////////////////////////
+
+    class sky_environment
+    {
+        struct ibl_maps
+        {
+            gl_texture_2d irradiance;
+            gl_texture_2d radiance;
+        };
+
+        gl_texture_2d environment;
+        ibl_maps maps[2];
+        int32_t completeMaps{ -1 };         // index of the maps in use; -1 until the first set is finished
+        uint32_t buildingMaps{ 0 };
+        uint32_t nextUnit{ 0 };             // next prefilter unit of buildingMaps; unit_count() when idle
+        uint64_t bakedVersion{ 0 };
+        bool baked{ false };
+
+        gl_framebuffer framebuffer;
+        gl_shader irradianceProgram;
+        gl_shader radianceProgram;
+        gl_shader skyboxProgram;
+        gl_mesh faceQuad;
+        gl_mesh skyboxCube;
+
+        void bake(gl_procedural_sky & sky);
+        void prefilter(const prefilter_unit & unit);
+
+    public:
+
+        static const uint32_t environment_size = 256;
+        static const uint32_t irradiance_size = 32;
+        static const uint32_t radiance_size = 128;
+        static const uint32_t radiance_levels = 6;
+
+        static constexpr uint32_t unit_count() { return 6 * (1 + radiance_levels); }
+
+        uint32_t unitsPerFrame{ 6 };
+
+        sky_environment();
+
+        sky_environment(const sky_environment &) = delete;
+        sky_environment & operator = (const sky_environment &) = delete;
+
+        // Re-bakes the cubemap if the sky changed since the last call and runs the next prefilter units.
+        // Renders into its own framebuffer and leaves the framebuffer binding and viewport undefined.
+        void update(gl_procedural_sky & sky);
+
+        // Draws the baked sky behind everything in the bound framebuffer
+        void draw_skybox(const float4x4 & viewProjectionMatrix);
+
+        bool has_environment() const { return baked; }
+        bool has_ibl() const { return completeMaps >= 0; }
+        bool is_filtering() const { return nextUnit < unit_count(); }
+
+        GLuint get_environment() const { return environment; }
+        GLuint get_irradiance() const { return maps[completeMaps].irradiance; }
+        GLuint get_radiance() const { return maps[completeMaps].radiance; }
+    };
+
+} // end namespace polymer
+
+#endif // end polymer_sky_environment_hpp
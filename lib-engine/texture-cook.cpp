@@ -0,0 +1,299 @@
+#include "texture-cook.hpp"
+#include "texture-streaming.hpp"
+#include "shader-cache.hpp"
+#include "file_io.hpp"
+#include "gl-loaders.hpp"
+#include "logging.hpp"
+
+#include <filesystem>
+#include <limits>
+#include <thread>
+
+using namespace polymer;
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+    // Changing an encoder changes its output, so cooked files of older versions are not looked up again
+    const uint32_t cook_version = 1;
+
+    uint16_t pack_565(const float3 & c)
+    {
+        const uint32_t r = static_cast<uint32_t>(std::min<float>(std::max<float>(c.x, 0.f), 255.f) * 31.f / 255.f + 0.5f);
+        const uint32_t g = static_cast<uint32_t>(std::min<float>(std::max<float>(c.y, 0.f), 255.f) * 63.f / 255.f + 0.5f);
+        const uint32_t b = static_cast<uint32_t>(std::min<float>(std::max<float>(c.z, 0.f), 255.f) * 31.f / 255.f + 0.5f);
+        return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+    }
+
+    float3 unpack_565(const uint16_t c)
+    {
+        const uint32_t r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+        return float3(float((r << 3) | (r >> 2)), float((g << 2) | (g >> 4)), float((b << 3) | (b >> 2)));
+    }
+
+    void write_le(uint8_t * dst, uint64_t value, const uint32_t bytes)
+    {
+        for (uint32_t i = 0; i < bytes; ++i, value >>= 8) dst[i] = static_cast<uint8_t>(value & 0xff);
+    }
+
+    // Gathers the block at `bx, by` of a level; texels past the edge repeat the last row and column
+    void fetch_block(const std::vector<uint8_t> & rgba, const uint2 size, const uint32_t bx, const uint32_t by, uint8_t block[64])
+    {
+        for (uint32_t y = 0; y < 4; ++y)
+        {
+            for (uint32_t x = 0; x < 4; ++x)
+            {
+                const uint32_t sx = std::min<uint32_t>(bx * 4 + x, size.x - 1), sy = std::min<uint32_t>(by * 4 + y, size.y - 1);
+                for (uint32_t c = 0; c < 4; ++c) block[(y * 4 + x) * 4 + c] = rgba[(sy * size.x + sx) * 4 + c];
+            }
+        }
+    }
+}
+
+void polymer::encode_bc1_block(const uint8_t rgba[64], uint8_t block[8])
+{
+    float3 texels[16];
+    float3 mean;
+    for (int i = 0; i < 16; ++i)
+    {
+        texels[i] = float3(rgba[i * 4], rgba[i * 4 + 1], rgba[i * 4 + 2]);
+        mean += texels[i] / 16.f;
+    }
+
+    // Principal axis of the texel colors by power iteration on their covariance
+    float cov[6] = {};
+    for (const float3 & t : texels)
+    {
+        const float3 d = t - mean;
+        cov[0] += d.x * d.x; cov[1] += d.x * d.y; cov[2] += d.x * d.z;
+        cov[3] += d.y * d.y; cov[4] += d.y * d.z; cov[5] += d.z * d.z;
+    }
+
+    // Starting from the covariance row of largest norm, which cannot be orthogonal to the principal axis
+    const float3 rows[3] = { float3(cov[0], cov[1], cov[2]), float3(cov[1], cov[3], cov[4]), float3(cov[2], cov[4], cov[5]) };
+    float3 axis = rows[0];
+    if (length2(rows[1]) > length2(axis)) axis = rows[1];
+    if (length2(rows[2]) > length2(axis)) axis = rows[2];
+    for (int i = 0; i < 8; ++i)
+    {
+        const float3 next(cov[0] * axis.x + cov[1] * axis.y + cov[2] * axis.z,
+                          cov[1] * axis.x + cov[3] * axis.y + cov[4] * axis.z,
+                          cov[2] * axis.x + cov[4] * axis.y + cov[5] * axis.z);
+        const float len = length(next);
+        if (len < 1e-6f) break;
+        axis = next / len;
+    }
+
+    float minProjection = std::numeric_limits<float>::max(), maxProjection = -std::numeric_limits<float>::max();
+    for (const float3 & t : texels)
+    {
+        const float p = dot(t - mean, axis);
+        minProjection = std::min<float>(minProjection, p);
+        maxProjection = std::max<float>(maxProjection, p);
+    }
+
+    // The four color mode needs the first endpoint to be the larger one
+    uint16_t c0 = pack_565(mean + axis * maxProjection);
+    uint16_t c1 = pack_565(mean + axis * minProjection);
+    if (c0 < c1) std::swap(c0, c1);
+
+    uint32_t indices = 0;
+    if (c0 != c1)
+    {
+        const float3 e0 = unpack_565(c0), e1 = unpack_565(c1);
+        const float3 palette[4] = { e0, e1, (e0 * 2.f + e1) / 3.f, (e0 + e1 * 2.f) / 3.f };
+        for (int i = 0; i < 16; ++i)
+        {
+            uint32_t best = 0;
+            float bestDistance = std::numeric_limits<float>::max();
+            for (uint32_t p = 0; p < 4; ++p)
+            {
+                const float d = length2(texels[i] - palette[p]);
+                if (d < bestDistance) { bestDistance = d; best = p; }
+            }
+            indices |= best << (i * 2);
+        }
+    }
+
+    write_le(block, c0, 2);
+    write_le(block + 2, c1, 2);
+    write_le(block + 4, indices, 4);
+}
+
+void polymer::encode_bc4_block(const uint8_t values[16], uint8_t block[8])
+{
+    uint8_t lo = 255, hi = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        lo = std::min<uint8_t>(lo, values[i]);
+        hi = std::max<uint8_t>(hi, values[i]);
+    }
+
+    // Eight value mode, which needs the first endpoint to be the larger one; a flat block uses index 0 throughout
+    uint64_t indices = 0;
+    if (hi != lo)
+    {
+        float palette[8] = { float(hi), float(lo) };
+        for (int p = 1; p < 7; ++p) palette[p + 1] = (float(hi) * (7 - p) + float(lo) * p) / 7.f;
+
+        for (int i = 0; i < 16; ++i)
+        {
+            uint64_t best = 0;
+            float bestDistance = std::numeric_limits<float>::max();
+            for (uint32_t p = 0; p < 8; ++p)
+            {
+                const float d = std::abs(float(values[i]) - palette[p]);
+                if (d < bestDistance) { bestDistance = d; best = p; }
+            }
+            indices |= best << (i * 3);
+        }
+    }
+
+    block[0] = hi;
+    block[1] = lo;
+    write_le(block + 2, indices, 6);
+}
+
+void polymer::encode_bc3_block(const uint8_t rgba[64], uint8_t block[16])
+{
+    uint8_t alpha[16];
+    for (int i = 0; i < 16; ++i) alpha[i] = rgba[i * 4 + 3];
+    encode_bc4_block(alpha, block);
+    encode_bc1_block(rgba, block + 8);
+}
+
+void polymer::encode_bc5_block(const uint8_t red[16], const uint8_t green[16], uint8_t block[16])
+{
+    encode_bc4_block(red, block);
+    encode_bc4_block(green, block + 8);
+}
+
+gli::format polymer::select_cooked_format(const texture_map_type type, const bool hasAlpha)
+{
+    switch (type)
+    {
+    case texture_map_type::normal: return gli::FORMAT_RG_ATI2N_UNORM_BLOCK16;
+    case texture_map_type::scalar: return gli::FORMAT_R_ATI1N_UNORM_BLOCK8;
+    default: return hasAlpha ? gli::FORMAT_RGBA_DXT5_UNORM_BLOCK16 : gli::FORMAT_RGB_DXT1_UNORM_BLOCK8;
+    }
+}
+
+gli::texture2d polymer::cook_texture(const uint8_t * pixels, const uint2 size, const uint32_t channels, const texture_map_type type)
+{
+    if (channels < 1 || channels > 4) throw std::runtime_error("unsupported number of channels");
+
+    // Grey images fill red, green and blue; grey and alpha images keep their alpha
+    std::vector<uint8_t> rgba(size.x * size.y * 4);
+    bool hasAlpha = false;
+    for (uint32_t i = 0; i < size.x * size.y; ++i)
+    {
+        const uint8_t * src = pixels + i * channels;
+        uint8_t * dst = &rgba[i * 4];
+        dst[0] = src[0];
+        dst[1] = channels >= 3 ? src[1] : src[0];
+        dst[2] = channels >= 3 ? src[2] : src[0];
+        dst[3] = channels == 4 ? src[3] : channels == 2 ? src[1] : 255;
+        hasAlpha |= dst[3] != 255;
+    }
+
+    const gli::format format = select_cooked_format(type, hasAlpha);
+    const uint32_t levelCount = mip_level_count(std::max<uint32_t>(size.x, size.y));
+    gli::texture2d tex(format, gli::extent2d(size.x, size.y), levelCount);
+
+    uint2 levelSize = size;
+    for (uint32_t level = 0; level < levelCount; ++level)
+    {
+        if (level > 0)
+        {
+            rgba = downsample_mip(rgba, levelSize, 4);
+            levelSize = mip_level_size(size, level);
+        }
+
+        uint8_t * dst = static_cast<uint8_t *>(tex[level].data());
+        const uint32_t blockBytes = static_cast<uint32_t>(gli::block_size(format));
+        const uint32_t blocksX = (levelSize.x + 3) / 4, blocksY = (levelSize.y + 3) / 4;
+
+        for (uint32_t by = 0; by < blocksY; ++by)
+        {
+            for (uint32_t bx = 0; bx < blocksX; ++bx, dst += blockBytes)
+            {
+                uint8_t texels[64];
+                fetch_block(rgba, levelSize, bx, by, texels);
+
+                if (type == texture_map_type::color)
+                {
+                    if (hasAlpha) encode_bc3_block(texels, dst);
+                    else encode_bc1_block(texels, dst);
+                    continue;
+                }
+
+                uint8_t red[16], green[16];
+                for (int i = 0; i < 16; ++i) { red[i] = texels[i * 4]; green[i] = texels[i * 4 + 1]; }
+                if (type == texture_map_type::normal) encode_bc5_block(red, green, dst);
+                else encode_bc4_block(red, dst);
+            }
+        }
+    }
+
+    return tex;
+}
+
+////////////////////////////
+//   texture_cook_cache   //
+////////////////////////////
+
+texture_cook_cache::texture_cook_cache(const std::string & dir)
+{
+    try
+    {
+        // Absolute, so later changes of the working directory do not move the cache
+        fs::create_directories(dir);
+        directory = fs::absolute(dir).string();
+    }
+    catch (const std::exception & e)
+    {
+        log::get()->engine_log->warn("texture_cook_cache: could not create {} ({}), cooked textures are not stored", dir, e.what());
+    }
+}
+
+std::string texture_cook_cache::make_key(const std::vector<uint8_t> & sourceFile, const texture_map_type type)
+{
+    const std::string key = sha256_hex(sourceFile.data(), sourceFile.size()) + "/" + std::to_string(static_cast<uint32_t>(type)) + "/" + std::to_string(cook_version);
+    return sha256_hex(key.data(), key.size());
+}
+
+gli::texture2d texture_cook_cache::load_or_cook(const std::string & sourcePath, const texture_map_type type) const
+{
+    const std::vector<uint8_t> source = read_file_binary(sourcePath);
+    const std::string path = directory.empty() ? std::string() : directory + "/" + make_key(source, type) + ".dds";
+
+    std::error_code ec;
+    if (!path.empty() && fs::exists(path, ec))
+    {
+        gli::texture2d cooked(gli::load_dds(path));
+        if (!cooked.empty()) return cooked;
+        log::get()->engine_log->warn("texture_cook_cache: ignoring malformed entry {}", path);
+    }
+
+    const decoded_image image = decode_image(source.data(), source.size(), false);
+    if (image.hdr) throw std::runtime_error("hdr images are not cooked (" + sourcePath + ")");
+
+    gli::texture2d cooked = cook_texture(image.pixels.get(), uint2(image.width, image.height), image.channels, type);
+
+    if (path.empty()) return cooked;
+
+    // Written under a name of this thread and renamed, so neither a crash nor a concurrent cook of the same
+    // image leaves a truncated entry
+    const std::string temporaryPath = path + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+    try
+    {
+        if (!gli::save_dds(cooked, temporaryPath)) throw std::runtime_error("save_dds failed");
+        fs::rename(temporaryPath, path);
+    }
+    catch (const std::exception & e)
+    {
+        log::get()->engine_log->warn("texture_cook_cache: could not write {} ({})", path, e.what());
+    }
+
+    return cooked;
+}
@@ -0,0 +1,67 @@
+/*
+ * Block compressed textures. Image files are cooked into DDS files holding their full mip chain in the
+ * BCn format that suits how materials sample them: color maps become BC1, or BC3 if any texel is not
+ * opaque; normal maps keep their x and y in BC5 and the shaders rebuild z; single channel maps such as
+ * roughness, metallic or occlusion keep their red channel in BC4. That is 4 to 8 times less memory and
+ * bandwidth than the 8 bit textures load_image() creates.
+ *
+ * Cooked files are cached by a SHA-256 digest of the source file, the map type and the version of the
+ * encoders, so an edited image is simply cooked again under a new name. The encoders fit each block's
+ * endpoints to the principal axis (BC1) or the range (BC4) of its texels; they are meant for an offline
+ * quality/speed trade-off of a few hundred milliseconds per 2k map, not for runtime use.
+ */
+
+#pragma once
+
+#ifndef polymer_texture_cook_hpp
+#define polymer_texture_cook_hpp
+
+#include "math-core.hpp"
+#include "gli/gli.hpp"
+
+#include <string>
+#include <vector>
+
+namespace polymer
+{
+    enum class texture_map_type : uint32_t
+    {
+        color,      // albedo, diffuse, emissive
+        normal,     // tangent space, z rebuilt from x and y
+        scalar      // roughness, metallic, height, occlusion; the red channel
+    };
+
+    // Encoders take one block of four by four texels in row order and write it in the layout of the format
+    void encode_bc1_block(const uint8_t rgba[64], uint8_t block[8]);        // alpha is ignored
+    void encode_bc3_block(const uint8_t rgba[64], uint8_t block[16]);
+    void encode_bc4_block(const uint8_t values[16], uint8_t block[8]);
+    void encode_bc5_block(const uint8_t red[16], const uint8_t green[16], uint8_t block[16]);
+
+    gli::format select_cooked_format(const texture_map_type type, const bool hasAlpha);
+
+    // Compresses an image of 1 to 4 channels, in row order of the file, and the mip chain built from it
+    gli::texture2d cook_texture(const uint8_t * pixels, const uint2 size, const uint32_t channels, const texture_map_type type);
+
+    ////////////////////////////
+    //   texture_cook_cache   //
+    ////////////////////////////
+
+    class texture_cook_cache
+    {
+        std::string directory;
+
+    public:
+
+        // Creates `directory` if needed
+        explicit texture_cook_cache(const std::string & directory);
+
+        static std::string make_key(const std::vector<uint8_t> & sourceFile, const texture_map_type type);
+
+        // The cooked texture of the image at `sourcePath`, which is cooked and stored first if it is not cached.
+        // Safe to call from several threads. Throws if the source cannot be read or decoded.
+        gli::texture2d load_or_cook(const std::string & sourcePath, const texture_map_type type) const;
+    };
+
+} // end namespace polymer
+
+#endif // end polymer_texture_cook_hpp
@@ -0,0 +1,446 @@
+#include "texture-streaming.hpp"
+#include "asset-handle-utils.hpp"
+#include "gl-loaders.hpp"
+#include "file_io.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace polymer;
+
+namespace
+{
+    const uint32_t upload_slot_count = 3;
+    const uint32_t decode_thread_count = 2;
+    const uint32_t unknown_level = ~0u;
+    const uint32_t refine_retry_frames = 30;        // before a failed refinement is requested again, doubling with every failure in a row
+
+    bool fence_signaled(GLsync fence)
+    {
+        const GLenum result = glClientWaitSync(fence, 0, 0);
+        return result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED;
+    }
+
+    // Storage for the levels from `firstLevel` to the end of the chain, with the sampling state of load_image()
+    gl_texture_2d create_texture(const uint2 size, const GLenum internalFormat, const uint32_t firstLevel, const uint32_t levelCount)
+    {
+        const uint2 baseSize = mip_level_size(size, firstLevel);
+
+        gl_texture_2d tex;
+        glTextureStorage2DEXT(tex, GL_TEXTURE_2D, levelCount - firstLevel, internalFormat, baseSize.x, baseSize.y);
+        glTextureParameteriEXT(tex, GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTextureParameteriEXT(tex, GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTextureParameteriEXT(tex, GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTextureParameteriEXT(tex, GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        tex.width = static_cast<float>(baseSize.x);
+        tex.height = static_cast<float>(baseSize.y);
+        return tex;
+    }
+
+    // Copies the levels from `firstLevel` to the end of the chain between textures whose base levels differ
+    void copy_levels(const GLuint source, const uint32_t sourceBase, const GLuint destination, const uint32_t destinationBase,
+        const uint2 size, const uint32_t firstLevel, const uint32_t levelCount)
+    {
+        for (uint32_t level = firstLevel; level < levelCount; ++level)
+        {
+            const uint2 s = mip_level_size(size, level);
+            glCopyImageSubData(source, GL_TEXTURE_2D, level - sourceBase, 0, 0, 0, destination, GL_TEXTURE_2D, level - destinationBase, 0, 0, 0, s.x, s.y, 1);
+        }
+    }
+}
+
+//////////////////////////
+//   texture_streamer   //
+//////////////////////////
+
+texture_streamer::texture_streamer() : slots(upload_slot_count), decodeWorkers(decode_thread_count) {}
+
+texture_streamer::~texture_streamer()
+{
+    for (auto & slot : slots) if (slot.fence) glDeleteSync(slot.fence);
+}
+
+uint64_t texture_streamer::level_bytes(const streamed_texture & t, const uint32_t first, const uint32_t last)
+{
+    uint64_t bytes = 0;
+    for (uint32_t level = first; level < last; ++level)
+    {
+        const uint2 s = mip_level_size(t.size, level);
+        bytes += t.format.rows(s) * t.format.row_bytes(s);
+    }
+    return bytes;
+}
+
+// Every level of the image or of its cooked version; throws if it cannot be decoded
+std::shared_ptr<texture_streamer::decoded_chain> texture_streamer::load_chain(const std::string & path, const texture_map_type type, const texture_cook_cache * cooker)
+{
+    std::shared_ptr<decoded_chain> chain = std::make_shared<decoded_chain>();
+
+    if (cooker)
+    {
+        const gli::texture2d cooked = cooker->load_or_cook(path, type);
+        chain->size = uint2(cooked.extent(0).x, cooked.extent(0).y);
+
+        const uint32_t levelCount = mip_level_count(std::max<uint32_t>(chain->size.x, chain->size.y));
+        if (cooked.levels() != levelCount) throw std::runtime_error("cooked texture without a full mip chain");
+
+        gli::gl GL(gli::gl::PROFILE_GL33);
+        chain->format.internalFormat = GL.translate(cooked.format(), cooked.swizzles()).Internal;
+        chain->format.blockBytes = static_cast<uint32_t>(gli::block_size(cooked.format()));
+
+        for (uint32_t l = 0; l < levelCount; ++l)
+        {
+            const uint8_t * data = static_cast<const uint8_t *>(cooked[l].data());
+            chain->levels.emplace_back(data, data + cooked[l].size());
+        }
+        return chain;
+    }
+
+    // The whole file is decoded either way, since stb cannot decode at a reduced size
+    const decoded_image image = load_image_data(path);
+    if (image.hdr) throw std::runtime_error("hdr images are not streamed");
+
+    const uint32_t channels = image.channels;
+    chain->size = uint2(image.width, image.height);
+    chain->format.channels = channels;
+    switch (channels)
+    {
+    case 1: chain->format.internalFormat = GL_R8; chain->format.format = GL_RED; break;
+    case 2: chain->format.internalFormat = GL_RG8; chain->format.format = GL_RG; break;
+    case 3: chain->format.internalFormat = GL_RGB8; chain->format.format = GL_RGB; break;
+    default: chain->format.internalFormat = GL_RGBA8; chain->format.format = GL_RGBA; break;
+    }
+
+    const uint8_t * pixels = image.pixels.get();
+    chain->levels.emplace_back(pixels, pixels + image.size_bytes());
+
+    const uint32_t levelCount = mip_level_count(std::max<uint32_t>(image.width, image.height));
+    for (uint32_t l = 1; l < levelCount; ++l)
+    {
+        chain->levels.push_back(downsample_mip(chain->levels[l - 1], mip_level_size(chain->size, l - 1), channels));
+    }
+    return chain;
+}
+
+// Keeps the levels [first, stop) of the image or of its cooked version, taken from `source` when there is one. The
+// first decode of a texture passes `unknown_level` for both and keeps its tail from the floor; refinements hand
+// their chain back for the next step.
+texture_streamer::decoded_levels texture_streamer::decode(const std::string path, const texture_map_type type, std::shared_ptr<const texture_cook_cache> cooker,
+    std::shared_ptr<const decoded_chain> source, const uint32_t floorSize, const uint32_t first, const uint32_t stop)
+{
+    decoded_levels result;
+
+    try
+    {
+        std::shared_ptr<decoded_chain> loaded;
+        if (!source) source = loaded = load_chain(path, type, cooker.get());
+
+        result.size = source->size;
+        result.format = source->format;
+
+        const uint32_t levelCount = static_cast<uint32_t>(source->levels.size());
+        result.firstLevel = first;
+        if (first == unknown_level)
+        {
+            result.firstLevel = 0;
+            while (std::max<uint32_t>(result.size.x >> result.firstLevel, result.size.y >> result.firstLevel) > floorSize && result.firstLevel + 1 < levelCount) ++result.firstLevel;
+        }
+
+        // Levels of a chain nothing else holds on to are moved rather than copied
+        const bool keepSource = first != unknown_level;
+        const uint32_t stopLevel = std::min<uint32_t>(stop, levelCount);
+        for (uint32_t l = result.firstLevel; l < stopLevel; ++l)
+        {
+            if (loaded && !keepSource) result.levels.push_back(std::move(loaded->levels[l]));
+            else result.levels.push_back(source->levels[l]);
+        }
+
+        if (keepSource) result.source = source;
+    }
+    catch (const std::exception & e)
+    {
+        result.error = e.what();
+    }
+
+    return result;
+}
+
+size_t texture_streamer::get_pending_count() const
+{
+    return std::count_if(textures.begin(), textures.end(), [](const auto & t) { return t.second->busy(); });
+}
+
+void texture_streamer::add(const std::string & name, const std::string & path, const texture_map_type type, std::shared_ptr<const texture_cook_cache> cooker)
+{
+    if (textures.count(name)) return;
+
+    std::unique_ptr<streamed_texture> t(new streamed_texture());
+    t->name = name;
+    t->path = path;
+    t->type = type;
+    t->cooker = cooker;
+    t->lastUsedFrame = frame;
+
+    t->decode = decodeWorkers.enqueue(&texture_streamer::decode, path, type, cooker, nullptr, residentFloorSize, unknown_level, unknown_level);
+
+    t->decoding = true;
+    textures[name] = std::move(t);
+}
+
+void texture_streamer::report(const std::string & name, const float pixelSpan)
+{
+    auto it = textures.find(name);
+    if (it == textures.end()) return;
+
+    streamed_texture & t = *it->second;
+    t.pixelSpan = std::max<float>(t.pixelSpan, pixelSpan);
+    t.lastUsedFrame = frame;
+}
+
+uint32_t texture_streamer::wanted_level(const streamed_texture & t) const
+{
+    if (t.lastUsedFrame != frame) return t.floorLevel;
+    return std::min<uint32_t>(streaming_level_for_span(t.size, t.pixelSpan, levelBias), t.floorLevel);
+}
+
+void texture_streamer::receive(streamed_texture & t, decoded_levels && data)
+{
+    t.decoding = false;
+
+    if (!data.error.empty() || data.levels.empty())
+    {
+        log::get()->engine_log->warn("texture_streamer: could not decode {} ({})", t.path, data.error);
+
+        // Without a first decode there is nothing to draw; a failed refinement keeps what is resident and
+        // is retried, backing off while it keeps failing
+        if (t.levelCount == 0)
+        {
+            t.failed = true;
+            return;
+        }
+
+        residentBytes -= level_bytes(t, t.requestedLevel, t.residentLevel);
+        t.source.reset();
+        t.retryFrame = frame + (uint64_t(refine_retry_frames) << std::min<uint32_t>(t.refineFailures, 5));
+        t.refineFailures++;
+        return;
+    }
+
+    t.source = std::move(data.source);
+    t.refineFailures = 0;
+
+    const bool firstDecode = t.levelCount == 0;
+    if (firstDecode)
+    {
+        t.size = data.size;
+        t.format = data.format;
+        t.levelCount = mip_level_count(std::max<uint32_t>(data.size.x, data.size.y));
+        t.floorLevel = data.firstLevel;
+        t.residentLevel = t.levelCount;
+        residentBytes += level_bytes(t, data.firstLevel, t.levelCount);
+    }
+
+    // The levels already resident are copied into the new texture now; the uploads only fill in the rest
+    t.staging = create_texture(t.size, t.format.internalFormat, data.firstLevel, t.levelCount);
+    if (!firstDecode) copy_levels(texture_handle(t.name).get(), t.residentLevel, t.staging, data.firstLevel, t.size, t.residentLevel, t.levelCount);
+
+    t.staged = std::move(data);
+    t.uploadLevel = 0;
+    t.uploadRow = 0;
+    t.uploading = true;
+    uploads.push_back(&t);
+}
+
+void texture_streamer::finish_upload(streamed_texture & t)
+{
+    const bool firstUpload = t.residentLevel == t.levelCount;
+
+    t.residentLevel = t.staged.firstLevel;
+    t.staged = {};
+    t.uploading = false;
+
+    if (firstUpload) create_handle_for_asset(t.name.c_str(), std::move(t.staging));
+    else texture_handle(t.name).get() = std::move(t.staging);
+    t.staging = {};
+}
+
+void texture_streamer::upload()
+{
+    uploadedBytes = 0;
+    if (uploads.empty()) return;
+
+    upload_slot & slot = slots[nextSlot];
+    if (slot.fence)
+    {
+        // The gpu has not consumed the uploads from the last use of this slot yet; try again next frame
+        if (!fence_signaled(slot.fence)) return;
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+    }
+
+    struct band { streamed_texture * t; uint32_t level, row, rows; GLintptr offset; };
+    std::vector<band> bands;
+    std::vector<streamed_texture *> finished;
+
+    // A single row is always uploaded, even if it alone exceeds the budget
+    const streamed_texture & front = *uploads.front();
+    const uint64_t limit = std::max<uint64_t>(uploadBudgetBytes, front.format.row_bytes(mip_level_size(front.size, front.staged.firstLevel)));
+    if (slot.buffer.size < static_cast<GLsizeiptr>(limit)) slot.buffer.set_buffer_data(static_cast<GLsizeiptr>(limit), nullptr, GL_STREAM_DRAW);
+
+    uint8_t * mapped = static_cast<uint8_t *>(glMapNamedBufferRangeEXT(slot.buffer, 0, slot.buffer.size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+    if (!mapped) return;
+
+    uint64_t offset = 0;
+    while (!uploads.empty())
+    {
+        streamed_texture & t = *uploads.front();
+        const uint32_t level = t.staged.firstLevel + t.uploadLevel;
+        const uint2 s = mip_level_size(t.size, level);
+        const uint64_t rowBytes = t.format.row_bytes(s);
+        const uint32_t levelRows = t.format.rows(s);
+
+        const uint32_t rows = static_cast<uint32_t>(std::min<uint64_t>(levelRows - t.uploadRow, (limit - offset) / rowBytes));
+        if (rows == 0) break;
+
+        std::memcpy(mapped + offset, t.staged.levels[t.uploadLevel].data() + t.uploadRow * rowBytes, rows * rowBytes);
+        bands.push_back({ &t, level, t.uploadRow, rows, static_cast<GLintptr>(offset) });
+        offset += rows * rowBytes;
+
+        t.uploadRow += rows;
+        if (t.uploadRow == levelRows)
+        {
+            t.staged.levels[t.uploadLevel] = {};
+            t.uploadRow = 0;
+            if (++t.uploadLevel == t.staged.levels.size())
+            {
+                finished.push_back(&t);
+                uploads.pop_front();
+            }
+        }
+    }
+
+    glUnmapNamedBufferEXT(slot.buffer);
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (const band & b : bands)
+    {
+        const streamed_format & f = b.t->format;
+        const uint2 s = mip_level_size(b.t->size, b.level);
+        const GLint level = b.level - b.t->staged.firstLevel;
+        const GLvoid * data = reinterpret_cast<const GLvoid *>(b.offset);
+
+        // Compressed bands start on a block row; the last one of a level may be cut short by its height
+        if (f.blockBytes)
+        {
+            const uint32_t y = b.row * 4, height = std::min<uint32_t>(b.rows * 4, s.y - y);
+            glCompressedTextureSubImage2DEXT(b.t->staging, GL_TEXTURE_2D, level, 0, y, s.x, height, f.internalFormat, static_cast<GLsizei>(b.rows * f.row_bytes(s)), data);
+        }
+        else glTextureSubImage2DEXT(b.t->staging, GL_TEXTURE_2D, level, 0, b.row, s.x, b.rows, f.format, GL_UNSIGNED_BYTE, data);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    nextSlot = (nextSlot + 1) % upload_slot_count;
+    uploadedBytes = offset;
+
+    for (streamed_texture * t : finished) finish_upload(*t);
+}
+
+void texture_streamer::trim(streamed_texture & t, const uint32_t level)
+{
+    gl_texture_2d smaller = create_texture(t.size, t.format.internalFormat, level, t.levelCount);
+    copy_levels(texture_handle(t.name).get(), t.residentLevel, smaller, level, t.size, level, t.levelCount);
+    texture_handle(t.name).get() = std::move(smaller);
+
+    residentBytes -= level_bytes(t, t.residentLevel, level);
+    t.residentLevel = level;
+}
+
+void texture_streamer::trim_to_budget(const uint64_t bytesNeeded)
+{
+    if (residentBytes + bytesNeeded <= memoryBudgetBytes) return;
+
+    std::vector<streamed_texture *> candidates;
+    std::vector<streaming_residency> residency;
+    for (auto & t : textures)
+    {
+        const streamed_texture & c = *t.second;
+        if (c.busy() || c.failed || c.residentLevel >= wanted_level(c)) continue;
+
+        streaming_residency r;
+        r.lastUsedFrame = c.lastUsedFrame;
+        r.residentLevel = c.residentLevel;
+        r.wantedLevel = wanted_level(c);
+        r.floorLevel = c.floorLevel;
+        for (uint32_t level = 0; level < c.levelCount; ++level) r.levelBytes.push_back(level_bytes(c, level, level + 1));
+
+        candidates.push_back(t.second.get());
+        residency.push_back(std::move(r));
+    }
+
+    // Textures drawn this frame only give up levels finer than they need
+    const std::vector<uint32_t> levels = choose_resident_levels(residency, residentBytes, bytesNeeded, memoryBudgetBytes);
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        if (levels[i] != candidates[i]->residentLevel) trim(*candidates[i], levels[i]);
+    }
+}
+
+void texture_streamer::update()
+{
+    uint32_t decodesInFlight = 0;
+    for (auto & entry : textures)
+    {
+        streamed_texture & t = *entry.second;
+        if (!t.decoding) continue;
+        if (t.decode.wait_for(std::chrono::seconds(0)) == std::future_status::ready) receive(t, t.decode.get());
+        else ++decodesInFlight;
+    }
+
+    upload();
+
+    // Textures drawn this frame that want finer levels than they have, the largest shortfall first. The decoded
+    // chain of a texture that stopped refining is not needed anymore.
+    std::vector<streamed_texture *> requests;
+    for (auto & entry : textures)
+    {
+        streamed_texture & t = *entry.second;
+        if (t.busy() || t.failed || t.levelCount == 0) continue;
+
+        const bool refining = t.lastUsedFrame == frame && wanted_level(t) < t.residentLevel;
+        if (!refining) t.source.reset();
+        else if (frame >= t.retryFrame) requests.push_back(&t);
+    }
+
+    std::sort(requests.begin(), requests.end(), [this](const streamed_texture * a, const streamed_texture * b)
+    {
+        return a->residentLevel - wanted_level(*a) > b->residentLevel - wanted_level(*b);
+    });
+
+    for (streamed_texture * t : requests)
+    {
+        if (decodesInFlight >= maxDecodes) break;
+
+        const uint32_t level = wanted_level(*t);
+        const uint64_t bytesNeeded = level_bytes(*t, level, t->residentLevel);
+
+        trim_to_budget(bytesNeeded);
+        if (residentBytes + bytesNeeded > memoryBudgetBytes) continue;
+
+        // Reserved now so that decodes in flight count against the budget
+        residentBytes += bytesNeeded;
+
+        t->decode = decodeWorkers.enqueue(&texture_streamer::decode, t->path, t->type, t->cooker, t->source, residentFloorSize, level, t->residentLevel);
+        t->requestedLevel = level;
+
+        t->decoding = true;
+        ++decodesInFlight;
+    }
+
+    // Spans are gathered anew for the next frame
+    for (auto & entry : textures) entry.second->pixelSpan = 0.f;
+    ++frame;
+}
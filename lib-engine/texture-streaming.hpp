@@ -0,0 +1,262 @@
+/*
+ * Texture streaming. A streamed texture is first made resident with only the tail of its mip chain, the
+ * levels at most `residentFloorSize` texels wide, and the asset is assigned once those have arrived. From
+ * then on the renderer reports, every frame, how many pixels the objects using the texture cover on screen;
+ * that span selects the finest level worth having, and finer levels are streamed in when it is not resident.
+ *
+ * Images are decoded and their mips built on worker threads. Levels reach the gpu through a ring of pixel
+ * unpack buffers, a row band at a time, within a per-frame byte budget, and a ring slot is only reused once
+ * the fence of its last uploads has signaled, so the gl thread never waits on either. New levels are uploaded
+ * into a larger copy of the texture, the resident levels are copied over on the gpu, and the copy replaces
+ * the asset when complete. The resident texel bytes of all streamed textures are held under a memory budget
+ * by dropping the finest levels of the least recently used textures down to what they still need.
+ *
+ * While a texture keeps asking for finer levels, the decoded chain of its last refinement is kept, so the next
+ * step copies levels out of it instead of reading and decoding the file again; it is dropped once the texture
+ * stops refining. A failed refinement leaves the texture at its resident level and is retried a while later.
+ *
+ * Textures added with a texture_cook_cache stream the levels of their cooked, block compressed version instead,
+ * a row of blocks at a time. Decoded levels keep the row order of the file, like load_image() without flipping.
+ */
+
+#pragma once
+
+#ifndef polymer_texture_streaming_hpp
+#define polymer_texture_streaming_hpp
+
+#include "math-core.hpp"
+#include "gl-api.hpp"
+#include "thread-pool.hpp"
+#include "texture-cook.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <unordered_map>
+
+namespace polymer
+{
+    // Levels in a full mip chain of a texture whose larger dimension is `size`
+    inline uint32_t mip_level_count(const uint32_t size)
+    {
+        uint32_t count = 1;
+        while ((size >> count) > 0) ++count;
+        return count;
+    }
+
+    inline uint2 mip_level_size(const uint2 size, const uint32_t level)
+    {
+        return uint2(std::max<uint32_t>(size.x >> level, 1u), std::max<uint32_t>(size.y >> level, 1u));
+    }
+
+    // Finest level whose texels are not smaller than a pixel when the texture spans `pixelSpan` pixels
+    inline uint32_t streaming_level_for_span(const uint2 size, const float pixelSpan, const float bias = 0.f)
+    {
+        const uint32_t levelCount = mip_level_count(std::max<uint32_t>(size.x, size.y));
+        if (pixelSpan <= 0.f) return levelCount - 1;
+
+        const float level = std::floor(std::log2(static_cast<float>(std::max<uint32_t>(size.x, size.y)) / pixelSpan) + bias);
+        return static_cast<uint32_t>(std::min<float>(std::max<float>(level, 0.f), static_cast<float>(levelCount - 1)));
+    }
+
+    // Averages two by two texels into one; a dimension of one is kept
+    inline std::vector<uint8_t> downsample_mip(const uint8_t * source, const uint2 sourceSize, const uint32_t channels)
+    {
+        const uint2 size = mip_level_size(sourceSize, 1);
+        std::vector<uint8_t> result(size.x * size.y * channels);
+
+        for (uint32_t y = 0; y < size.y; ++y)
+        {
+            const uint32_t y0 = std::min<uint32_t>(y * 2, sourceSize.y - 1), y1 = std::min<uint32_t>(y * 2 + 1, sourceSize.y - 1);
+            for (uint32_t x = 0; x < size.x; ++x)
+            {
+                const uint32_t x0 = std::min<uint32_t>(x * 2, sourceSize.x - 1), x1 = std::min<uint32_t>(x * 2 + 1, sourceSize.x - 1);
+                for (uint32_t c = 0; c < channels; ++c)
+                {
+                    const uint32_t sum = source[(y0 * sourceSize.x + x0) * channels + c] + source[(y0 * sourceSize.x + x1) * channels + c]
+                                       + source[(y1 * sourceSize.x + x0) * channels + c] + source[(y1 * sourceSize.x + x1) * channels + c];
+                    result[(y * size.x + x) * channels + c] = static_cast<uint8_t>((sum + 2) / 4);
+                }
+            }
+        }
+
+        return result;
+    }
+
+    inline std::vector<uint8_t> downsample_mip(const std::vector<uint8_t> & source, const uint2 sourceSize, const uint32_t channels)
+    {
+        return downsample_mip(source.data(), sourceSize, channels);
+    }
+
+    // A streamed texture as the memory budget sees it
+    struct streaming_residency
+    {
+        uint64_t lastUsedFrame{ 0 };
+        uint32_t residentLevel{ 0 };                    // finest resident level
+        uint32_t wantedLevel{ 0 };                      // finest level it is still drawn with
+        uint32_t floorLevel{ 0 };                       // finest level of the tail that is never dropped
+        std::vector<uint64_t> levelBytes;               // of every level of its chain
+    };
+
+    // Finest levels `textures` keep so that `residentBytes` plus `bytesNeeded` fit in `budgetBytes`. The least
+    // recently used drop their finest levels first, each down to the level it is still drawn with but never
+    // into its tail; the rest keep their resident level, even when the budget cannot be met.
+    inline std::vector<uint32_t> choose_resident_levels(const std::vector<streaming_residency> & textures, uint64_t residentBytes,
+        const uint64_t bytesNeeded, const uint64_t budgetBytes)
+    {
+        std::vector<uint32_t> levels(textures.size());
+        std::vector<size_t> order(textures.size());
+        for (size_t i = 0; i < textures.size(); ++i)
+        {
+            levels[i] = textures[i].residentLevel;
+            order[i] = i;
+        }
+
+        std::stable_sort(order.begin(), order.end(), [&](const size_t a, const size_t b) { return textures[a].lastUsedFrame < textures[b].lastUsedFrame; });
+
+        for (const size_t i : order)
+        {
+            if (residentBytes + bytesNeeded <= budgetBytes) break;
+
+            const streaming_residency & t = textures[i];
+            const uint32_t keep = std::min<uint32_t>(t.wantedLevel, t.floorLevel);
+            for (uint32_t level = t.residentLevel; level < keep && level < t.levelBytes.size(); ++level) residentBytes -= t.levelBytes[level];
+            levels[i] = std::max<uint32_t>(t.residentLevel, keep);
+        }
+
+        return levels;
+    }
+
+    //////////////////////////
+    //   texture_streamer   //
+    //////////////////////////
+
+    class texture_streamer
+    {
+        // Texel layout of a streamed texture; block compressed when blockBytes is not zero
+        struct streamed_format
+        {
+            uint32_t channels{ 0 };
+            GLenum internalFormat{ 0 };
+            GLenum format{ 0 };                         // of uncompressed uploads
+            uint32_t blockBytes{ 0 };
+
+            uint32_t rows(const uint2 levelSize) const { return blockBytes ? (levelSize.y + 3) / 4 : levelSize.y; }
+            uint64_t row_bytes(const uint2 levelSize) const { return blockBytes ? uint64_t((levelSize.x + 3) / 4) * blockBytes : uint64_t(levelSize.x) * channels; }
+        };
+
+        // Every level of a decoded image
+        struct decoded_chain
+        {
+            uint2 size;                                 // of level 0
+            streamed_format format;
+            std::vector<std::vector<uint8_t>> levels;
+        };
+
+        struct decoded_levels
+        {
+            uint2 size;                                 // of level 0
+            streamed_format format;
+            uint32_t firstLevel{ 0 };                   // levels[0] holds this level
+            std::vector<std::vector<uint8_t>> levels;
+            std::shared_ptr<const decoded_chain> source;    // of refinements, for the next one
+            std::string error;
+        };
+
+        struct streamed_texture
+        {
+            std::string name;
+            std::string path;
+            texture_map_type type;
+            std::shared_ptr<const texture_cook_cache> cooker;
+
+            uint2 size;                                 // of level 0; unknown until the first decode
+            streamed_format format;
+            uint32_t levelCount{ 0 };
+            uint32_t floorLevel{ 0 };                   // finest level of the tail that is always resident
+            uint32_t residentLevel{ 0 };                // finest resident level; levelCount before the first upload
+
+            float pixelSpan{ 0.f };                     // largest span reported this frame
+            uint64_t lastUsedFrame{ 0 };
+
+            std::future<decoded_levels> decode;
+            bool decoding{ false };
+
+            decoded_levels staged;                      // levels waiting for upload into `staging`
+            gl_texture_2d staging;
+            uint32_t uploadLevel{ 0 };
+            uint32_t uploadRow{ 0 };                    // in blocks for compressed textures
+            uint32_t requestedLevel{ 0 };               // finest level of the decode in flight
+            bool uploading{ false };
+            bool failed{ false };                       // the first decode failed; nothing is ever resident
+
+            std::shared_ptr<const decoded_chain> source;    // kept while the texture is refined
+            uint32_t refineFailures{ 0 };               // in a row
+            uint64_t retryFrame{ 0 };                   // no refinement is requested before this frame
+
+            bool busy() const { return decoding || uploading; }
+        };
+
+        struct upload_slot
+        {
+            gl_buffer buffer;
+            GLsync fence{ nullptr };
+        };
+
+        std::unordered_map<std::string, std::unique_ptr<streamed_texture>> textures;
+        std::deque<streamed_texture *> uploads;
+        std::vector<upload_slot> slots;
+        uint32_t nextSlot{ 0 };
+        uint64_t frame{ 0 };
+        uint64_t residentBytes{ 0 };
+        uint64_t uploadedBytes{ 0 };                    // during the last update
+        simple_thread_pool decodeWorkers;
+
+        static std::shared_ptr<decoded_chain> load_chain(const std::string & path, const texture_map_type type, const texture_cook_cache * cooker);
+        static decoded_levels decode(const std::string path, const texture_map_type type, std::shared_ptr<const texture_cook_cache> cooker,
+            std::shared_ptr<const decoded_chain> source, const uint32_t floorSize, const uint32_t first, const uint32_t stop);
+        static uint64_t level_bytes(const streamed_texture & t, const uint32_t first, const uint32_t last);
+        void receive(streamed_texture & t, decoded_levels && data);
+        void upload();
+        void finish_upload(streamed_texture & t);
+        void trim(streamed_texture & t, const uint32_t level);
+        void trim_to_budget(const uint64_t bytesNeeded);
+        uint32_t wanted_level(const streamed_texture & t) const;
+
+    public:
+
+        uint64_t uploadBudgetBytes{ 8ull << 20 };       // texel (or block) bytes uploaded per update
+        uint64_t memoryBudgetBytes{ 512ull << 20 };     // resident texel (or block) bytes of all streamed textures
+        uint32_t residentFloorSize{ 64 };               // levels at most this wide are loaded up front and never dropped
+        uint32_t maxDecodes{ 4 };                       // decodes in flight
+        float levelBias{ 0.f };                         // added to the level selected for a span; positive is blurrier
+
+        texture_streamer();
+        ~texture_streamer();
+
+        texture_streamer(const texture_streamer &) = delete;
+        texture_streamer & operator = (const texture_streamer &) = delete;
+
+        // Starts loading the tail of the mip chain of the image at `path`; the texture_handle `name` is
+        // assigned once it is resident. With a `cooker`, the levels come from the block compressed texture
+        // it cooks for `type`. Adding a name again is ignored.
+        void add(const std::string & name, const std::string & path, const texture_map_type type = texture_map_type::color,
+            std::shared_ptr<const texture_cook_cache> cooker = nullptr);
+        bool is_streamed(const std::string & name) const { return textures.count(name) != 0; }
+
+        // The texture `name` was drawn across `pixelSpan` pixels this frame; unknown names are ignored
+        void report(const std::string & name, const float pixelSpan);
+
+        // Call once per frame on the gl thread: picks up decodes, uploads within the budget, drops unused
+        // levels and starts loading the levels reported as needed
+        void update();
+
+        uint64_t get_resident_bytes() const { return residentBytes; }
+        uint64_t get_uploaded_bytes() const { return uploadedBytes; }
+        size_t get_texture_count() const { return textures.size(); }
+        size_t get_pending_count() const;
+    };
+
+} // end namespace polymer
+
+#endif // end polymer_texture_streaming_hpp
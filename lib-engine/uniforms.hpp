@@ -10,9 +10,14 @@ using namespace polymer;
 
 namespace uniforms
 {
-    static const int MAX_POINT_LIGHTS = 4;
     static const int NUM_CASCADES = 2;
 
+    // Froxel grid used for light assignment; must match renderer_common.glsl
+    static const int LIGHT_CLUSTERS_X = 16;
+    static const int LIGHT_CLUSTERS_Y = 9;
+    static const int LIGHT_CLUSTERS_Z = 24;
+
+    // Also the std430 element of the point light storage buffer (32 bytes)
     struct point_light
     {
         ALIGNED(16) float3    color;
@@ -40,7 +45,6 @@ namespace uniforms
     {
         static const int      binding = 0;
         directional_light     directional_light;
-        point_light           point_lights[MAX_POINT_LIGHTS];
         float                 time;
         int                   activePointLights;
         int                   sunlightActive;
@@ -58,6 +62,7 @@ namespace uniforms
         ALIGNED(16) float4x4  view;
         ALIGNED(16) float4x4  viewProj;
         ALIGNED(16) float4    eyePos;
+        ALIGNED(16) float4    clusterDepth; // near, far, slice scale, slice bias (slice = log(depth) * scale + bias)
     };
 
     struct per_object
@@ -67,6 +72,46 @@ namespace uniforms
         ALIGNED(16) float4x4  modelMatrixIT;
         ALIGNED(16) float4x4  modelViewMatrix;
         ALIGNED(16) float     receiveShadow;
+        float                 lodFade;      // dithered level of detail cross-fade; 0 when not fading, negative for the outgoing level
+        uint32_t              materialIndex;    // record of the object's material in the pbr material buffer
+        uint32_t              pickId;           // one plus the index of the object's render component; written by the entity id pass
+    };
+
+    // A record of the pbr material storage buffer (64 bytes in std430), indexed by per_object::materialIndex.
+    // Laid out without implicit padding so records can be compared bytewise before re-uploading.
+    struct pbr_material
+    {
+        static const int      binding = 7;
+        ALIGNED(16) float3    albedo;
+        float                 opacity;
+        ALIGNED(16) float3    emissive;
+        float                 emissiveStrength;
+        float                 roughness;
+        float                 metallic;
+        float                 specularLevel;
+        float                 occlusionStrength;
+        float                 ambientStrength;
+        float                 shadowOpacity;
+        float2                texcoordScale;
+    };
+
+    // Storage buffers written by clustered_lighting. A cluster is a uint2 of (first index, count)
+    // into the index list, and each index refers to an entry of the light list.
+    struct light_clusters
+    {
+        static const int      lights_binding = 4;
+        static const int      clusters_binding = 5;
+        static const int      indices_binding = 6;
+    };
+
+    // Bound as a uniform block for each draw of a blinn-phong material
+    struct blinn_phong_material
+    {
+        static const int      binding = 3;
+        ALIGNED(16) float3    diffuseColor;
+        float                 specularShininess;
+        ALIGNED(16) float3    specularColor;
+        float                 specularStrength;
     };
 
 }
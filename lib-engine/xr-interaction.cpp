@@ -346,7 +346,7 @@ void xr_controller_system::process(const float dt)
 
     // Update uniforms
     laser_pointer_material->use();
-    auto & laser_shader = laser_pointer_material->compiled_shader->shader;
+    auto & laser_shader = laser_pointer_material->get_variant()->shader;
     laser_shader.uniform("u_alpha", laser_alpha);
     laser_shader.unbind();
 }
@@ -427,7 +427,7 @@ void xr_imgui_system::process(const float dt)
 
     // Update material uniforms
     imgui_material->use();
-    auto & imgui_shader = imgui_material->compiled_shader->shader;
+    auto & imgui_shader = imgui_material->get_variant()->shader;
     imgui_shader.texture("s_texture", 0, get_render_texture(), GL_TEXTURE_2D);
     imgui_shader.unbind();
 }
@@ -167,6 +167,214 @@ void polymer::optimize_model(runtime_mesh & input)
     // todo 
 }
 
+namespace
+{
+    // Real-Time Collision Detection (Ericson), 5.1.5
+    float3 closest_point_on_triangle(const float3 & p, const float3 & a, const float3 & b, const float3 & c)
+    {
+        const float3 ab = b - a, ac = c - a, ap = p - a;
+        const float d1 = dot(ab, ap), d2 = dot(ac, ap);
+        if (d1 <= 0.f && d2 <= 0.f) return a;
+
+        const float3 bp = p - b;
+        const float d3 = dot(ab, bp), d4 = dot(ac, bp);
+        if (d3 >= 0.f && d4 <= d3) return b;
+
+        const float vc = d1 * d4 - d3 * d2;
+        if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f) return a + ab * (d1 / (d1 - d3));
+
+        const float3 cp = p - c;
+        const float d5 = dot(ab, cp), d6 = dot(ac, cp);
+        if (d6 >= 0.f && d5 <= d6) return c;
+
+        const float vb = d5 * d2 - d1 * d6;
+        if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f) return a + ac * (d2 / (d2 - d6));
+
+        const float va = d3 * d6 - d5 * d4;
+        if (va <= 0.f && (d4 - d3) >= 0.f && (d5 - d6) >= 0.f) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+        const float denom = 1.f / (va + vb + vc);
+        return a + ab * (vb * denom) + ac * (vc * denom);
+    }
+
+    // Uniform grid over the triangles of a level, for nearest-surface queries
+    class triangle_grid
+    {
+        const std::vector<float3> & vertices;
+        const std::vector<uint32_t> & indices;
+        float3 origin;
+        float cellSize;
+        int3 dims;
+        std::vector<std::vector<uint32_t>> cells;
+        mutable std::vector<uint32_t> visited;
+        mutable uint32_t query{ 0 };
+
+        int3 cell_of(const float3 & p) const { return clamp(int3(floor((p - origin) / cellSize)), int3(0), dims - 1); }
+        std::vector<uint32_t> & cell(const int3 & c) { return cells[(c.z * dims.y + c.y) * dims.x + c.x]; }
+        const std::vector<uint32_t> & cell(const int3 & c) const { return cells[(c.z * dims.y + c.y) * dims.x + c.x]; }
+
+    public:
+
+        triangle_grid(const std::vector<float3> & vertices, const std::vector<uint32_t> & indices, const aabb_3d & bounds)
+            : vertices(vertices), indices(indices), visited(indices.size() / 3, 0)
+        {
+            const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+            const float3 extent = max(bounds.size(), float3(1e-6f));
+            const int resolution = clamp(static_cast<int>(std::cbrt(static_cast<float>(triangleCount))), 1, 64);
+
+            origin = bounds.min();
+            cellSize = std::max<float>(std::max<float>(extent.x, extent.y), extent.z) / resolution;
+            dims = clamp(int3(ceil(extent / cellSize)), int3(1), int3(resolution));
+            cells.resize(dims.x * dims.y * dims.z);
+
+            for (uint32_t t = 0; t < triangleCount; ++t)
+            {
+                const float3 & a = vertices[indices[t * 3 + 0]], & b = vertices[indices[t * 3 + 1]], & c = vertices[indices[t * 3 + 2]];
+                const int3 first = cell_of(min(min(a, b), c)), last = cell_of(max(max(a, b), c));
+                for (int z = first.z; z <= last.z; ++z)
+                    for (int y = first.y; y <= last.y; ++y)
+                        for (int x = first.x; x <= last.x; ++x) cell({ x, y, z }).push_back(t);
+            }
+        }
+
+        // Searches rings of cells outward until no unvisited cell can hold a nearer triangle
+        float distance_to_surface(const float3 & p) const
+        {
+            const int3 center = cell_of(p);
+            const int maxRing = std::max<int>(std::max<int>(dims.x, dims.y), dims.z);
+            float best = std::numeric_limits<float>::max();
+            ++query;
+
+            for (int ring = 0; ring <= maxRing; ++ring)
+            {
+                const int3 first = max(center - ring, int3(0)), last = min(center + ring, dims - 1);
+                for (int z = first.z; z <= last.z; ++z)
+                {
+                    for (int y = first.y; y <= last.y; ++y)
+                    {
+                        for (int x = first.x; x <= last.x; ++x)
+                        {
+                            const int3 d = abs(int3(x, y, z) - center);
+                            if (std::max<int>(std::max<int>(d.x, d.y), d.z) != ring) continue;
+
+                            for (const uint32_t t : cell({ x, y, z }))
+                            {
+                                if (visited[t] == query) continue;
+                                visited[t] = query;
+                                const float3 q = closest_point_on_triangle(p, vertices[indices[t * 3 + 0]], vertices[indices[t * 3 + 1]], vertices[indices[t * 3 + 2]]);
+                                best = std::min(best, length(p - q));
+                            }
+                        }
+                    }
+                }
+                if (best <= ring * cellSize) break;
+            }
+            return best;
+        }
+    };
+}
+
+mesh_lod_chain polymer::generate_lod_chain(const runtime_mesh & mesh, const mesh_lod_settings & settings)
+{
+    mesh_lod_chain chain;
+    if (mesh.faces.size() <= settings.minTriangles || mesh.vertices.empty()) return chain;
+
+    const size_t vertexCount = mesh.vertices.size();
+
+    // Every vertex is remapped to the first one at the same position; the simplifier only sees those
+    std::vector<uint32_t> weld(vertexCount);
+    {
+        unordered_map_generator<float3, uint32_t>::Type firstAtPosition;
+        for (uint32_t v = 0; v < vertexCount; ++v) weld[v] = firstAtPosition.insert({ mesh.vertices[v], v }).first->second;
+    }
+
+    std::vector<uint32_t> source(mesh.faces.size() * 3);
+    for (size_t f = 0; f < mesh.faces.size(); ++f)
+    {
+        for (int c = 0; c < 3; ++c) source[f * 3 + c] = weld[mesh.faces[f][c]];
+    }
+
+    // Welded corners take back the duplicate whose normal best matches the simplified face, which keeps hard edges
+    std::vector<std::vector<uint32_t>> duplicates;
+    if (!mesh.normals.empty())
+    {
+        duplicates.resize(vertexCount);
+        for (uint32_t v = 0; v < vertexCount; ++v) if (weld[v] != v) duplicates[weld[v]].push_back(v);
+    }
+
+    const auto unweld = [&](const uint32_t corner, const float3 & faceNormal)
+    {
+        if (duplicates.empty() || duplicates[corner].empty()) return corner;
+        uint32_t best = corner;
+        float bestDot = dot(mesh.normals[corner], faceNormal);
+        for (const uint32_t d : duplicates[corner])
+        {
+            const float cosine = dot(mesh.normals[d], faceNormal);
+            if (cosine > bestDot) { best = d; bestDot = cosine; }
+        }
+        return best;
+    };
+
+    // Every used vertex of the source is a sample of its surface; very dense meshes are subsampled
+    std::vector<uint32_t> samples;
+    {
+        std::vector<uint8_t> used(vertexCount, 0);
+        for (const uint32_t i : source) used[i] = 1;
+        for (uint32_t v = 0; v < vertexCount; ++v) if (used[v]) samples.push_back(v);
+
+        const size_t maxSamples = 16384;
+        if (samples.size() > maxSamples)
+        {
+            const size_t stride = (samples.size() + maxSamples - 1) / maxSamples;
+            size_t write = 0;
+            for (size_t i = 0; i < samples.size(); i += stride) samples[write++] = samples[i];
+            samples.resize(write);
+        }
+    }
+
+    const aabb_3d bounds = compute_bounds(mesh);
+
+    std::vector<uint32_t> previous = source;
+    std::vector<uint32_t> simplified(source.size());
+    float previousError = 0.f;
+
+    for (uint32_t level = 0; level < settings.maxLevels; ++level)
+    {
+        const size_t previousTriangles = previous.size() / 3;
+        const size_t targetTriangles = static_cast<size_t>(previousTriangles * settings.reduction);
+        if (targetTriangles < settings.minTriangles) break;
+
+        // Each level continues from the one before it, so the cost shrinks with every level
+        const size_t indexCount = meshopt_simplify(simplified.data(), previous.data(), previous.size(), &mesh.vertices[0].x, vertexCount, sizeof(float3), targetTriangles * 3);
+        if (indexCount == 0 || indexCount > previous.size() * 9 / 10) break;
+
+        simplified.resize(indexCount);
+        meshopt_optimizeVertexCache(simplified.data(), simplified.data(), indexCount, vertexCount);
+
+        mesh_lod lod;
+        lod.faces.resize(indexCount / 3);
+        for (size_t f = 0; f < lod.faces.size(); ++f)
+        {
+            const uint32_t a = simplified[f * 3 + 0], b = simplified[f * 3 + 1], c = simplified[f * 3 + 2];
+            const float3 n = safe_normalize(cross(mesh.vertices[b] - mesh.vertices[a], mesh.vertices[c] - mesh.vertices[a]));
+            lod.faces[f] = uint3(unweld(a, n), unweld(b, n), unweld(c, n));
+        }
+
+        // Errors are measured against the source rather than the previous level and never decrease along the chain
+        const triangle_grid grid(mesh.vertices, simplified, bounds);
+        for (const uint32_t s : samples) lod.error = std::max(lod.error, grid.distance_to_surface(mesh.vertices[s]));
+        lod.error = std::max(lod.error, previousError);
+        previousError = lod.error;
+
+        chain.levels.push_back(std::move(lod));
+
+        previous.swap(simplified);
+        simplified.resize(previous.size());
+    }
+
+    return chain;
+}
+
 runtime_mesh polymer::import_mesh_binary(const std::string & path)
 {
     std::ifstream file(path, std::ios::binary | std::ios::ate);
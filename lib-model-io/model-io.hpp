@@ -95,6 +95,33 @@ namespace polymer
     // Currently a no-op
     void optimize_model(runtime_mesh & input);
 
+    ///////////////////////
+    //   Level of Detail  //
+    ///////////////////////
+
+    struct mesh_lod
+    {
+        std::vector<uint3> faces;       // indexes the vertices of the source mesh
+        float error{ 0.f };             // largest distance of the source surface from this level, in object space
+    };
+
+    // levels[i] is level of detail i + 1; level 0 is the source mesh itself
+    struct mesh_lod_chain
+    {
+        std::vector<mesh_lod> levels;
+    };
+
+    struct mesh_lod_settings
+    {
+        uint32_t maxLevels{ 4 };        // in addition to the source mesh
+        float reduction{ 0.5f };        // triangle count of each level relative to the one before it
+        uint32_t minTriangles{ 64 };    // levels are not reduced below this
+    };
+
+    // Simplifies `mesh` with the meshoptimizer edge collapser. Vertices are welded by position first so
+    // attribute seams cannot open into cracks. The chain ends early once the simplifier stops making progress.
+    mesh_lod_chain generate_lod_chain(const runtime_mesh & mesh, const mesh_lod_settings & settings = {});
+
 } // end namespace polymer
 
 #endif // end polymer_model_io_hpp
@@ -0,0 +1,389 @@
+/*
+ * File: samples/engine-benchmark.cpp
+ * Headless benchmark of the pbr_renderer. A synthetic scene of a configurable number of objects, materials
+ * and point lights is rendered for a fixed number of frames into the renderer's own targets, without a
+ * visible window or a swap chain, and the harness reports the CPU time of each profiled stage, the draw and
+ * state change counts of a frame and the memory used.
+ *
+ * The context is created by glfw through its native, EGL or OSMesa backend (`--api`), so the same binary runs
+ * on a desktop driver or a software one such as Mesa's llvmpipe, which makes results comparable across
+ * machines without a gpu. Mesa only exposes EXT_direct_state_access to compatibility contexts, hence the
+ * compatibility profile.
+ *
+ * Usage: engine-benchmark [--objects 4096] [--materials 16] [--lights 64] [--frames 240] [--warmup 30]
+ *                         [--size 1280x720] [--api native|egl|osmesa] [--texture-streaming 0|1]
+ *                         [--compress-textures 0|1] [--trace file.json]
+ *
+ * Texture streaming and texture cooking are off unless asked for, since the time they take depends on the
+ * machine rather than the renderer: decodes on worker threads, and whether the cook cache is warm or cold.
+ */
+
+#include "lib-polymer.hpp"
+#include "lib-engine.hpp"
+
+#include "ecs/core-ecs.hpp"
+#include "environment.hpp"
+#include "renderer-util.hpp"
+
+#if defined(_WIN32)
+    #include <windows.h>
+    #include <psapi.h>
+#else
+    #include <sys/resource.h>
+#endif
+
+using namespace polymer;
+
+namespace
+{
+    struct benchmark_options
+    {
+        uint32_t objects{ 4096 };
+        uint32_t materials{ 16 };
+        uint32_t lights{ 64 };
+        uint32_t frames{ 240 };
+        uint32_t warmup{ 30 };
+        int2 size{ 1280, 720 };
+        int contextApi{ GLFW_NATIVE_CONTEXT_API };
+        bool textureStreaming{ false };
+        bool compressTextures{ false };
+        std::string tracePath;
+    };
+
+    benchmark_options parse_options(int argc, char * argv[])
+    {
+        benchmark_options o;
+
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            if (i + 1 >= argc) throw std::invalid_argument("missing value for " + arg);
+            const std::string value = argv[++i];
+
+            if (arg == "--objects") o.objects = std::stoul(value);
+            else if (arg == "--materials") o.materials = std::max<uint32_t>(std::stoul(value), 1);
+            else if (arg == "--lights") o.lights = std::stoul(value);
+            else if (arg == "--frames") o.frames = std::max<uint32_t>(std::stoul(value), 1);
+            else if (arg == "--warmup") o.warmup = std::stoul(value);
+            else if (arg == "--trace") o.tracePath = value;
+            else if (arg == "--texture-streaming") o.textureStreaming = std::stoul(value) != 0;
+            else if (arg == "--compress-textures") o.compressTextures = std::stoul(value) != 0;
+            else if (arg == "--size")
+            {
+                const size_t x = value.find('x');
+                if (x == std::string::npos) throw std::invalid_argument("--size expects <width>x<height>");
+                o.size = { std::stoi(value.substr(0, x)), std::stoi(value.substr(x + 1)) };
+            }
+            else if (arg == "--api")
+            {
+                if (value == "native") o.contextApi = GLFW_NATIVE_CONTEXT_API;
+                else if (value == "egl") o.contextApi = GLFW_EGL_CONTEXT_API;
+                else if (value == "osmesa") o.contextApi = GLFW_OSMESA_CONTEXT_API;
+                else throw std::invalid_argument("--api expects native, egl or osmesa");
+            }
+            else throw std::invalid_argument("unknown option " + arg);
+        }
+
+        return o;
+    }
+
+    uint64_t get_peak_memory_bytes()
+    {
+    #if defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS counters = {};
+        if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+        return counters.PeakWorkingSetSize;
+    #else
+        rusage usage = {};
+        if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+        #if defined(__APPLE__)
+        return uint64_t(usage.ru_maxrss);
+        #else
+        return uint64_t(usage.ru_maxrss) * 1024;
+        #endif
+    #endif
+    }
+
+    double to_mb(const uint64_t bytes) { return bytes / (1024.0 * 1024.0); }
+}
+
+//////////////////////////
+//   headless_context   //
+//////////////////////////
+
+// A hidden 1x1 window owning a GL 4.5 context. The renderer draws into its own framebuffers, so the window's
+// surface is never drawn to or presented.
+class headless_context
+{
+    GLFWwindow * window{ nullptr };
+
+public:
+
+    explicit headless_context(const int contextApi)
+    {
+        glfwSetErrorCallback([](int err, const char * desc) { printf("glfw error - %i, desc: %s\n", err, desc); });
+
+        if (!glfwInit()) throw std::runtime_error("could not initialize glfw...");
+
+        glfwWindowHint(GLFW_VISIBLE, 0);
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, contextApi);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_COMPAT_PROFILE);
+
+        window = glfwCreateWindow(1, 1, "engine-benchmark", nullptr, nullptr);
+        if (!window)
+        {
+            glfwTerminate();
+            throw std::runtime_error("could not create a GL 4.5 context");
+        }
+
+        glfwMakeContextCurrent(window);
+        glfwSwapInterval(0);
+
+        if (!gladLoadGLLoader(reinterpret_cast<GLADloadproc>(glfwGetProcAddress))) throw std::runtime_error("gladLoadGLLoader(...) failed");
+        if (!GLAD_GL_EXT_direct_state_access) throw std::runtime_error("the context does not support GL_EXT_direct_state_access");
+
+        std::cout << "GL_VERSION     = " << (char *) glGetString(GL_VERSION) << std::endl;
+        std::cout << "GL_RENDERER    = " << (char *) glGetString(GL_RENDERER) << std::endl;
+    }
+
+    ~headless_context()
+    {
+        if (window) glfwDestroyWindow(window);
+        glfwTerminate();
+    }
+
+    headless_context(const headless_context &) = delete;
+    headless_context & operator = (const headless_context &) = delete;
+};
+
+/////////////////////////
+//   benchmark_scene   //
+/////////////////////////
+
+// Objects are scattered through a cube whose volume grows with their count, so the density of the scene,
+// and with it the fraction occluded, stays about the same at every size
+struct benchmark_scene
+{
+    std::unique_ptr<gl_shader_monitor> shaderMonitor;
+    std::unique_ptr<entity_orchestrator> orchestrator;
+    std::unique_ptr<asset_resolver> resolver;
+
+    environment scene;
+    render_payload payload;
+    float extent{ 1.f };
+
+    benchmark_scene(const benchmark_options & options)
+    {
+        shaderMonitor.reset(new gl_shader_monitor("../../assets/"));
+        orchestrator.reset(new entity_orchestrator());
+        resolver.reset(new asset_resolver());
+        resolver->compressTextures = options.compressTextures;
+
+        load_required_renderer_assets("../../assets/", *shaderMonitor);
+
+        // Shaders are compiled up front rather than in the background, so that frames after the warmup
+        // draw every material with its own program
+        renderer_settings settings;
+        settings.renderSize = options.size;
+        settings.asyncShaderCompile = false;
+        settings.textureStreaming = options.textureStreaming;
+
+        scene.collision_system = orchestrator->create_system<collision_system>(orchestrator.get());
+        scene.xform_system = orchestrator->create_system<transform_system>(orchestrator.get());
+        scene.identifier_system = orchestrator->create_system<identifier_system>(orchestrator.get());
+        scene.render_system = orchestrator->create_system<render_system>(settings, orchestrator.get());
+        scene.mat_library.reset(new polymer::material_library("../../assets/sample-material.json"));
+        scene.event_manager.reset(new polymer::event_manager_async());
+
+        payload.skybox = scene.render_system->get_skybox();
+        payload.sunlight = scene.render_system->get_implicit_sunlight();
+
+        resolver->resolve("../../assets/", &scene, scene.mat_library.get());
+
+        // Seeded, so that every run and every machine renders the same scene
+        std::mt19937 gen(1337);
+        const auto rand = [&gen](const float min, const float max) { return std::uniform_real_distribution<float>(min, max)(gen); };
+        const auto rand_color = [&rand]() { return float3(rand(0.f, 1.f), rand(0.f, 1.f), rand(0.f, 1.f)); };
+        const auto rand_position = [&rand](const float e) { return float3(rand(-e, e), rand(-e, e), rand(-e, e)); };
+
+        extent = 4.f * std::cbrt(float(std::max<uint32_t>(options.objects, 1)));
+
+        // Several meshes of different vertex counts
+        const std::vector<std::pair<std::string, geometry>> meshes = {
+            { "benchmark-icosahedron", make_icosasphere(3) },
+            { "benchmark-cube", make_cube() },
+            { "benchmark-torus", make_torus(32) },
+            { "benchmark-capsule", make_capsule(16, 0.5f, 1.f) },
+        };
+
+        for (auto & m : meshes)
+        {
+            create_handle_for_asset(m.first.c_str(), make_mesh_from_geometry(m.second)); // gpu mesh
+            create_handle_for_asset(m.first.c_str(), geometry(m.second)); // cpu mesh
+        }
+
+        // Alternate pbr and blinn-phong materials with random parameters. They are registered as assets but not
+        // added to the material library, which would write them to disk when it is destroyed.
+        std::vector<std::string> materials;
+        for (uint32_t i = 0; i < options.materials; ++i)
+        {
+            const std::string name = "benchmark-material-" + std::to_string(i);
+            std::shared_ptr<material_interface> material;
+
+            if (i % 2 == 0)
+            {
+                auto pbr = std::make_shared<polymer_pbr_standard>();
+                pbr->baseAlbedo = rand_color();
+                pbr->roughnessFactor = rand(0.05f, 1.f);
+                pbr->metallicFactor = rand(0.f, 1.f);
+                material = pbr;
+            }
+            else
+            {
+                auto phong = std::make_shared<polymer_blinn_phong_standard>();
+                phong->diffuseColor = rand_color();
+                phong->specularColor = float3(1, 1, 1);
+                phong->specularShininess = rand(4.f, 64.f);
+                phong->specularStrength = rand(0.f, 1.f);
+                material = phong;
+            }
+
+            create_handle_for_asset(name.c_str(), static_cast<std::shared_ptr<material_interface>>(material));
+            materials.push_back(name);
+        }
+
+        for (uint32_t i = 0; i < options.objects; ++i)
+        {
+            const entity e = scene.track_entity(orchestrator->create_entity());
+            const std::string & mesh = meshes[i % meshes.size()].first;
+
+            const float3 position = rand_position(extent);
+            const quatf orientation = make_rotation_quat_axis_angle(safe_normalize(float3(rand(-1.f, 1.f), 1.f, rand(-1.f, 1.f))), rand(0.f, float(POLYMER_TAU)));
+
+            scene.identifier_system->create(e, "benchmark-object-" + std::to_string(i));
+            scene.xform_system->create(e, transform(orientation, position), float3(rand(0.25f, 1.f)));
+
+            polymer::mesh_component mesh_component(e);
+            mesh_component.mesh = gpu_mesh_handle(mesh);
+            scene.render_system->create(e, std::move(mesh_component));
+
+            // Cpu geometry lets the occlusion and hi-z cullers test the object
+            polymer::geometry_component geom_component(e);
+            geom_component.geom = cpu_mesh_handle(mesh);
+            scene.collision_system->create(e, std::move(geom_component));
+
+            polymer::material_component material_component(e);
+            material_component.material = material_handle(materials[i % materials.size()]);
+            scene.render_system->create(e, std::move(material_component));
+
+            payload.render_components.push_back(assemble_render_component(scene, e));
+        }
+
+        for (uint32_t i = 0; i < options.lights; ++i)
+        {
+            const entity e = scene.track_entity(orchestrator->create_entity());
+            scene.identifier_system->create(e, "benchmark-light-" + std::to_string(i));
+            scene.xform_system->create(e, transform(), float3(1.f));
+
+            polymer::point_light_component light(e);
+            light.data.position = rand_position(extent);
+            light.data.color = rand_color();
+            light.data.radius = rand(2.f, 8.f);
+            payload.point_lights.push_back(scene.render_system->create(e, std::move(light)));
+        }
+    }
+};
+
+//////////////
+//   main   //
+//////////////
+
+int main(int argc, char * argv[])
+{
+    try
+    {
+        const benchmark_options options = parse_options(argc, argv);
+        headless_context context(options.contextApi);
+
+        benchmark_scene bench(options);
+        pbr_renderer * renderer = bench.scene.render_system->get_renderer();
+
+        perspective_camera cam;
+        const float aspect = float(options.size.x) / float(options.size.y);
+
+        uint64_t drawn = 0, occluded = 0, stateIssued = 0, stateElided = 0;
+        double frameMs = 0.0;
+
+        // The camera orbits the scene from just outside of it, a full turn over the measured frames
+        const uint32_t totalFrames = options.warmup + options.frames;
+        for (uint32_t frame = 0; frame < totalFrames; ++frame)
+        {
+            const float angle = float(POLYMER_TAU) * frame / options.frames;
+            const float radius = bench.extent * 1.5f;
+            cam.look_at({ std::cos(angle) * radius, bench.extent * 0.5f, std::sin(angle) * radius }, { 0, 0, 0 });
+
+            bench.payload.views.clear();
+            bench.payload.views.emplace_back(view_data(0, cam.pose, cam.get_projection_matrix(aspect)));
+
+            // Nothing counted during the warmup carries into the measured frames
+            if (frame == options.warmup) gl_state().reset_counters();
+
+            manual_timer timer;
+            timer.start();
+            renderer->render_frame(bench.payload);
+
+            // Wait for the frame, so that a slow software rasterizer does not let commands pile up across frames
+            glFinish();
+            timer.stop();
+
+            if (frame < options.warmup) continue;
+
+            frameMs += timer.get();
+            drawn += renderer->get_draw_count() - renderer->get_occluded_draw_count();
+            occluded += renderer->get_occluded_draw_count();
+
+            const gl_state_counters counters = gl_state().get_running_counters();
+            stateIssued += counters.issued;
+            stateElided += counters.elided;
+        }
+
+        // Collect the samples of the last frame
+        renderer->renderProfiler.end_frame();
+
+        const double frames = double(options.frames);
+
+        std::cout << std::endl;
+        std::cout << "scene          = " << options.objects << " objects, " << options.materials << " materials, " << options.lights << " lights" << std::endl;
+        std::cout << "frames         = " << options.frames << " at " << options.size.x << "x" << options.size.y << " after " << options.warmup << " warmup" << std::endl;
+        std::cout << "textures       = streaming " << (options.textureStreaming ? "on" : "off") << ", compression " << (options.compressTextures ? "on" : "off") << std::endl;
+        std::cout << "frame          = " << frameMs / frames << " ms (including glFinish)" << std::endl;
+        std::cout << "draws          = " << drawn / frames << " drawn, " << occluded / frames << " occluded" << std::endl;
+        std::cout << "state changes  = " << stateIssued / frames << " issued, " << stateElided / frames << " elided" << std::endl;
+        std::cout << "render targets = " << to_mb(renderer->get_render_graph().get_transient_bytes()) << " MB transient, "
+                  << to_mb(renderer->get_render_graph().get_unaliased_bytes()) << " MB without aliasing" << std::endl;
+        std::cout << "peak memory    = " << to_mb(get_peak_memory_bytes()) << " MB" << std::endl;
+
+        // The profiler keeps a limited history, so stages are averaged over the most recent frames
+        std::cout << std::endl << "cpu stage averages:" << std::endl;
+        for (auto & t : renderer->renderProfiler.get_summary(options.frames))
+        {
+            if (t.type != profile_sample_type::cpu) continue;
+            std::cout << "  " << std::string(t.depth * 2, ' ') << t.label() << " - " << t.average_ms << " ms (max " << t.max_ms << " ms)" << std::endl;
+        }
+
+        if (!options.tracePath.empty())
+        {
+            std::ofstream trace(options.tracePath);
+            renderer->renderProfiler.export_chrome_trace(trace);
+            std::cout << std::endl << "wrote " << options.tracePath << std::endl;
+        }
+    }
+    catch (const std::exception & e)
+    {
+        POLYMER_ERROR("[Fatal] Caught exception: \n" << e.what());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -163,9 +163,10 @@ void sample_engine_ecs::on_draw()
     fullscreen_surface->draw(scene.render_system->get_renderer()->get_color_texture(viewIndex));
 
     // Optional debug output
-    for (auto & t : scene.render_system->get_renderer()->cpuProfiler.get_data())
+    for (auto & t : scene.render_system->get_renderer()->renderProfiler.get_summary())
     {
-        std::cout << "[render_system CPU] " << t.first.c_str() << " - " << t.second << "ms" << std::endl;
+        if (t.type != profile_sample_type::cpu) continue;
+        std::cout << "[render_system CPU] " << std::string(t.depth * 2, ' ') << t.label() << " - " << t.average_ms << "ms" << std::endl;
     }
 
     gl_check_error(__FILE__, __LINE__);
@@ -47,6 +47,7 @@ sample_vr_app::sample_vr_app() : polymer_app(1280, 800, "sample-engine-openvr-sc
         renderer_settings settings;
         settings.renderSize = int2(eye_target_size.x, eye_target_size.y);
         settings.cameraCount = 2;
+        settings.instancedStereo = true;
         settings.performanceProfiling = true;
 
         // Create required systems
@@ -90,6 +91,11 @@ sample_vr_app::sample_vr_app() : polymer_app(1280, 800, "sample-engine-openvr-sc
     // Setup left/right eye debug view we see on the desktop window
     eye_views.push_back(simple_texture_view()); // for the left view
     eye_views.push_back(simple_texture_view()); // for the right view
+
+    // The hmd, the xr interaction systems (which upload geometry while processing) and the renderer
+    // all live on the render thread, keeping window event handling off the compositor's critical path.
+    set_render_thread(1);
+    frame_window_size.resize(get_frame_slot_count());
 }
 
 sample_vr_app::~sample_vr_app()
@@ -105,10 +111,24 @@ void sample_vr_app::on_window_resize(int2 size)
 
 void sample_vr_app::on_input(const app_input_event & event) 
 {
-    desktop_imgui->update_input(event);
+    std::lock_guard<std::mutex> guard(input_mutex);
+    pending_input.push_back(event);
 }
 
 void sample_vr_app::on_update(const app_update_event & e)
+{
+    run_on_render_thread([this, e]()
+    {
+        update_xr(e);
+    });
+}
+
+void sample_vr_app::on_submit(const uint32_t slot)
+{
+    glfwGetWindowSize(window, &frame_window_size[slot].x, &frame_window_size[slot].y);
+}
+
+void sample_vr_app::update_xr(const app_update_event & e)
 {
     shaderMonitor.handle_recompile();
 
@@ -130,12 +150,16 @@ void sample_vr_app::on_update(const app_update_event & e)
 
 void sample_vr_app::on_draw()
 {
-    glfwMakeContextCurrent(window);
-
-    int width, height;
-    glfwGetWindowSize(window, &width, &height);
+    const int width = frame_window_size[get_draw_slot()].x;
+    const int height = frame_window_size[get_draw_slot()].y;
     glViewport(0, 0, width, height);
 
+    {
+        std::lock_guard<std::mutex> guard(input_mutex);
+        for (const app_input_event & event : pending_input) desktop_imgui->update_input(event);
+        pending_input.clear();
+    }
+
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
@@ -191,9 +215,14 @@ void sample_vr_app::on_draw()
     const auto headPose = hmd->get_hmd_pose();
     desktop_imgui->begin_frame();
     ImGui::Text("Head Pose: %f, %f, %f", headPose.position.x, headPose.position.y, headPose.position.z);
+    const app_frame_timing timing = get_frame_timing();
+    ImGui::Text("[Frame] update %.2f ms, wait %.2f ms, draw %.2f ms, gpu %.2f ms", timing.update_ms, timing.wait_ms, timing.draw_ms, timing.gpu_ms);
     if (scene.render_system->get_renderer()->settings.performanceProfiling)
     {
-        for (auto & t : scene.render_system->get_renderer()->gpuProfiler.get_data()) ImGui::Text("[Renderer GPU] %s %f ms", t.first.c_str(), t.second);
+        for (auto & t : scene.render_system->get_renderer()->renderProfiler.get_summary())
+        {
+            if (t.type == profile_sample_type::gpu) ImGui::Text("[Renderer GPU] %s %f ms", t.label().c_str(), t.average_ms);
+        }
     }
     desktop_imgui->end_frame();
 
@@ -14,7 +14,7 @@ struct viewport_t
 
 struct sample_vr_app : public polymer_app
 {
-    gl_shader_monitor shaderMonitor{ "../../assets/" };
+    gl_shader_monitor shaderMonitor{ "../../assets/", "program-cache" };
 
     std::unique_ptr<openvr_hmd> hmd;
     std::unique_ptr<gui::imgui_instance> desktop_imgui;
@@ -31,6 +31,12 @@ struct sample_vr_app : public polymer_app
     uint64_t frame_count{ 0 };
     entity floor;
 
+    // Rendering runs on its own thread. Desktop input arrives on the main thread and is replayed
+    // into imgui by the render thread, and the window size is captured per frame slot.
+    std::mutex input_mutex;
+    std::vector<app_input_event> pending_input;
+    std::vector<int2> frame_window_size;
+
     render_payload payload;
     environment scene;
 
@@ -40,5 +46,7 @@ struct sample_vr_app : public polymer_app
     void on_window_resize(int2 size) override;
     void on_input(const app_input_event & event) override;
     void on_update(const app_update_event & e) override;
+    void on_submit(const uint32_t slot) override;
+    void update_xr(const app_update_event & e);
     void on_draw() override;
 };
\ No newline at end of file
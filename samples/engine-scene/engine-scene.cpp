@@ -24,12 +24,21 @@ struct sample_engine_scene final : public polymer_app
     render_payload payload;
     environment scene;
 
+    // Frame N is drawn from its own snapshot on the render thread while frame N+1 is simulated
+    struct frame_slot
+    {
+        render_payload_snapshot snapshot;
+        int2 windowSize;
+    };
+    std::vector<frame_slot> frames;
+
     sample_engine_scene();
     ~sample_engine_scene();
 
     void on_window_resize(int2 size) override;
     void on_input(const app_input_event & event) override;
     void on_update(const app_update_event & e) override;
+    void on_submit(const uint32_t slot) override;
     void on_draw() override;
 };
 
@@ -113,6 +122,9 @@ sample_engine_scene::sample_engine_scene() : polymer_app(1280, 720, "sample-engi
 
     cam.look_at({ 0, 0, 2 }, { 0, 0.1f, 0 });
     flycam.set_camera(&cam);
+
+    set_render_thread(1);
+    frames.resize(get_frame_slot_count());
 }
 
 sample_engine_scene::~sample_engine_scene() {}
@@ -126,29 +138,33 @@ void sample_engine_scene::on_input(const app_input_event & event)
 
 void sample_engine_scene::on_update(const app_update_event & e)
 {
-    int width, height;
-    glfwGetWindowSize(window, &width, &height);
     flycam.update(e.timestep_ms);
-    shaderMonitor->handle_recompile();
+    run_on_render_thread([this]() { shaderMonitor->handle_recompile(); });
 }
 
-void sample_engine_scene::on_draw()
+void sample_engine_scene::on_submit(const uint32_t slot)
 {
-    glfwMakeContextCurrent(window);
-
-    int width, height;
-    glfwGetWindowSize(window, &width, &height);
+    frame_slot & frame = frames[slot];
+    glfwGetWindowSize(window, &frame.windowSize.x, &frame.windowSize.y);
 
     const uint32_t viewIndex = 0;
-    const float4x4 projectionMatrix = cam.get_projection_matrix(float(width) / float(height));
-    const float4x4 viewMatrix = cam.get_view_matrix();
-    const float4x4 viewProjectionMatrix = projectionMatrix * viewMatrix;
+    const float4x4 projectionMatrix = cam.get_projection_matrix(float(frame.windowSize.x) / float(frame.windowSize.y));
 
     payload.views.clear();
     payload.views.emplace_back(view_data(viewIndex, cam.pose, projectionMatrix));
-    scene.render_system->get_renderer()->render_frame(payload);
+    frame.snapshot.capture(payload);
+}
+
+void sample_engine_scene::on_draw()
+{
+    const frame_slot & frame = frames[get_draw_slot()];
+    const int width = frame.windowSize.x;
+    const int height = frame.windowSize.y;
+    const uint32_t viewIndex = 0;
+
+    scene.render_system->get_renderer()->render_frame(frame.snapshot.payload);
 
-    glUseProgram(0);
+    gl_state().use_program(0);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
     glViewport(0, 0, width, height);
     glClearColor(1.f, 0.25f, 0.25f, 1.0f);
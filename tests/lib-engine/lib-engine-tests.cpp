@@ -7,6 +7,28 @@
 #include "system-transform.hpp"
 #include "system-identifier.hpp"
 #include "ui-actions.hpp"
+#include "profiling.hpp"
+#include "occlusion-culling.hpp"
+#include "hiz-culling.hpp"
+#include "mesh-lod.hpp"
+#include "dynamic-resolution.hpp"
+#include "shader-cache.hpp"
+#include "shader.hpp"
+#include "sky-environment.hpp"
+#include "texture-streaming.hpp"
+#include "texture-cook.hpp"
+#include "image-decode.hpp"
+#include "render-graph.hpp"
+#include "fused-resolve.hpp"
+#include "renderer-debug.hpp"
+#include "material.hpp"
+#include "entity-picking.hpp"
+#include "renderer-pbr.hpp"
+#include "stb/stb_image_write.h"
+
+#include <deque>
+#include <set>
+#include <tuple>
 
 /// Quick reference for doctest macros
 /// REQUIRE, REQUIRE_FALSE, CHECK, WARN, CHECK_THROWS_AS(func(), std::exception)
@@ -661,5 +683,808 @@ namespace polymer
         REQUIRE(sky_turbidity == 15);
     }
 
-} // end namespace polymer
+    ////////////////////////
+    //   Profiler Tests   //
+    ////////////////////////
+
+    TEST_CASE("profiler nested scopes and worker threads")
+    {
+        profiler p;
+
+        {
+            POLYMER_PROFILE_SCOPE(p, "outer");
+            {
+                POLYMER_PROFILE_SCOPE(p, "inner", 1);
+            }
+
+            std::thread worker([&p]()
+            {
+                POLYMER_PROFILE_SCOPE(p, "worker");
+            });
+            worker.join();
+        }
+
+        p.end_frame();
+
+        std::vector<profile_sample> samples;
+        p.for_each_frame([&](const profile_frame & f) { samples = f.samples; });
+        REQUIRE(samples.size() == 3);
+
+        const auto find = [&](const char * name) { return *std::find_if(samples.begin(), samples.end(), [&](const profile_sample & s) { return std::string(s.name) == name; }); };
+        const profile_sample outer = find("outer");
+        const profile_sample inner = find("inner");
+        const profile_sample worker = find("worker");
+
+        REQUIRE(outer.id == const_hash("outer"));
+        REQUIRE(outer.depth == 0);
+        REQUIRE(inner.depth == 1);
+        REQUIRE(inner.index == 1);
+        REQUIRE(worker.depth == 0);
+        REQUIRE(worker.thread != outer.thread);
+        REQUIRE(inner.begin_ns >= outer.begin_ns);
+        REQUIRE(inner.end_ns <= outer.end_ns);
+
+        const std::vector<profile_summary> summary = p.get_summary();
+        REQUIRE(summary.size() == 3);
+        REQUIRE(summary[0].label() == "outer");
+        REQUIRE(summary[1].label() == "inner[1]");
+
+        std::ostringstream trace;
+        p.export_chrome_trace(trace);
+        REQUIRE(trace.str().find("\"name\":\"worker\"") != std::string::npos);
+    }
+
+    TEST_CASE("profiler history and disabled scopes")
+    {
+        profiler p(4);
+
+        for (int i = 0; i < 8; ++i)
+        {
+            POLYMER_PROFILE_SCOPE(p, "frame");
+            p.end_frame();
+        }
+
+        size_t frames = 0;
+        p.for_each_frame([&](const profile_frame & f) { ++frames; });
+        REQUIRE(frames == 4);
+
+        p.set_enabled(false);
+        {
+            POLYMER_PROFILE_SCOPE(p, "ignored");
+        }
+        p.end_frame();
+
+        size_t samples = 0;
+        p.for_each_frame([&](const profile_frame & f) { samples += f.samples.size(); });
+        REQUIRE(samples == 0);
+    }
+
+
+    ///////////////////////////////////
+    //   Occlusion Culling Tests     //
+    ///////////////////////////////////
+
+    // A camera at the origin looking down -z at a 6x6 wall five units away
+    struct occlusion_test_scene
+    {
+        runtime_mesh wall;
+        aabb_3d wallBounds;
+        float4x4 viewProj = make_projection_matrix(to_radians(60.f), 2.f, 0.1f, 100.f);
+
+        occlusion_test_scene()
+        {
+            wall.vertices = { { -3, -3, -5 }, { 3, -3, -5 }, { 3, 3, -5 }, { -3, 3, -5 } };
+            wall.faces = { { 0, 1, 2 }, { 0, 2, 3 } };
+            wallBounds = compute_bounds(wall);
+        }
+    };
+
+    TEST_CASE("occlusion_culler culls boxes behind an occluder")
+    {
+        occlusion_test_scene scene;
+        const aabb_3d unitBox({ -0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, 0.5f });
+
+        occlusion_culler culler({ 256, 128 });
+        culler.begin_frame(scene.viewProj);
+        culler.add_occluder(scene.wall, scene.wallBounds, float4x4(linalg::identity), true);
+        culler.rasterize();
+        REQUIRE(culler.get_stats().occluders == 1);
+        REQUIRE(culler.get_stats().triangles == 2);
+
+        std::vector<aabb_3d> bounds = { unitBox, unitBox, unitBox, unitBox, unitBox };
+        std::vector<float4x4> models = {
+            make_translation_matrix({ 0, 0, -10 }),     // behind the wall
+            make_translation_matrix({ 0, 0, -2 }),      // in front of it
+            make_translation_matrix({ 9, 0, -10 }),     // beside it
+            make_translation_matrix({ 5.5f, 0, -10 }),   // partially behind its edge
+            make_translation_matrix({ 0, 30, -10 }),     // off-screen
+        };
+
+        std::vector<uint8_t> visible;
+        culler.test(bounds, models, visible);
+        REQUIRE(visible[0] == 0);
+        REQUIRE(visible[1] == 1);
+        REQUIRE(visible[2] == 1);
+        REQUIRE(visible[3] == 1);
+        REQUIRE(visible[4] == 0);
+        REQUIRE(culler.get_stats().tested == 5);
+        REQUIRE(culler.get_stats().culled == 2);
+    }
+
+    TEST_CASE("occlusion_culler occluder selection and threaded rasterization")
+    {
+        occlusion_test_scene scene;
+
+        // The small, far wall is not worth rasterizing
+        occlusion_culler culler({ 250, 128 });
+        REQUIRE(culler.get_resolution() == uint2(252, 128));
+        culler.begin_frame(scene.viewProj);
+        culler.add_occluder(scene.wall, scene.wallBounds, float4x4(linalg::identity), false);
+        culler.add_occluder(scene.wall, scene.wallBounds, make_translation_matrix({ 0, 0, -80 }), false);
+        culler.minOccluderArea = 0.05f;
+        culler.rasterize();
+        REQUIRE(culler.get_stats().candidates == 2);
+        REQUIRE(culler.get_stats().occluders == 1);
+
+        // Bands rasterized on workers produce the same buffer
+        simple_thread_pool pool(4);
+        occlusion_culler threaded({ 250, 128 });
+        threaded.begin_frame(scene.viewProj);
+        threaded.add_occluder(scene.wall, scene.wallBounds, float4x4(linalg::identity), false);
+        threaded.minOccluderArea = 0.05f;
+        threaded.rasterize(&pool);
+        REQUIRE(threaded.get_depth_buffer() == culler.get_depth_buffer());
+
+        // The wall sits at w = 5
+        const std::vector<float> & depth = culler.get_depth_buffer();
+        REQUIRE(depth[64 * 252 + 126] == doctest::Approx(0.2f));
+        REQUIRE(depth[0] == 0.f);
+    }
+
+    TEST_CASE("hiz_depth_pyramid reduces to the farthest depth")
+    {
+        // Odd sizes fold the leftover column and row into the last texel
+        const std::vector<float> depth = {
+            0.1f, 0.2f, 0.3f, 0.4f, 0.9f,
+            0.1f, 0.1f, 0.1f, 0.1f, 0.1f,
+            0.5f, 0.1f, 0.1f, 0.1f, 0.1f,
+        };
+
+        hiz_depth_pyramid pyramid;
+        REQUIRE(pyramid.empty());
+        pyramid.build(depth.data(), { 5, 3 }, { 5, 3 }, 0, float4x4(linalg::identity));
+
+        REQUIRE(pyramid.get_level_count() == 3);
+        REQUIRE(pyramid.get_level_size(1) == uint2(2, 1));
+        REQUIRE(pyramid.get_level(1) == std::vector<float>({ 0.5f, 0.9f }));
+        REQUIRE(pyramid.get_level_size(2) == uint2(1, 1));
+        REQUIRE(pyramid.get_level(2)[0] == 0.9f);
+    }
+
+    TEST_CASE("hiz_depth_pyramid culls boxes behind the previous depth")
+    {
+        occlusion_test_scene scene;
+        const aabb_3d unitBox({ -0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, 0.5f });
+
+        // A half resolution level of a 128x64 depth buffer: a wall at z = -5 fills the left half, the right half is empty
+        const float4 wallClip = scene.viewProj * float4(0, 0, -5, 1);
+        const float wallDepth = wallClip.z / wallClip.w * 0.5f + 0.5f;
+
+        std::vector<float> depth(64 * 32, 1.f);
+        for (uint32_t y = 0; y < 32; ++y) for (uint32_t x = 0; x < 32; ++x) depth[y * 64 + x] = wallDepth;
+
+        hiz_depth_pyramid pyramid;
+        REQUIRE(pyramid.is_visible(unitBox, float4x4(linalg::identity)));
+
+        pyramid.build(depth.data(), { 64, 32 }, { 128, 64 }, 1, scene.viewProj);
+        REQUIRE(pyramid.get_level_count() == 7);
+
+        REQUIRE_FALSE(pyramid.is_visible(unitBox, make_translation_matrix({ -3, 0, -10 })));    // behind the wall
+        REQUIRE(pyramid.is_visible(unitBox, make_translation_matrix({ -1, 0, -2 })));           // in front of it
+        REQUIRE(pyramid.is_visible(unitBox, make_translation_matrix({ 3, 0, -10 })));           // beside it
+        REQUIRE(pyramid.is_visible(unitBox, make_translation_matrix({ 0, 0, -10 })));           // across its edge
+        REQUIRE(pyramid.is_visible(unitBox, make_translation_matrix({ 0, 30, -10 })));          // outside of the previous view
+        REQUIRE(pyramid.is_visible(unitBox, make_translation_matrix({ -3, 0, 0.2f })));         // across the near plane
+    }
+
+    ////////////////////////////
+    //   Level of Detail Tests  //
+    ////////////////////////////
+
+    TEST_CASE("select_mesh_lod picks the coarsest level within the error with hysteresis")
+    {
+        mesh_lod_chain chain;
+        chain.levels.resize(3);
+        chain.levels[0].error = 0.01f;
+        chain.levels[1].error = 0.02f;
+        chain.levels[2].error = 0.04f;
+
+        // At 100 pixels per unit the errors project to 1, 2 and 4 pixels
+        REQUIRE(select_mesh_lod(chain, 100.f, 0, 2.f, 0.f) == 2);
+        REQUIRE(select_mesh_lod(chain, 100.f, 0, 0.5f, 0.f) == 0);
+        REQUIRE(select_mesh_lod(chain, 1.f, 0, 1.f, 0.f) == 3);
+
+        // Within the band a level is kept; outside of it the selection switches either way
+        REQUIRE(select_mesh_lod(chain, 100.f, 1, 2.f, 0.25f) == 1);
+        REQUIRE(select_mesh_lod(chain, 100.f, 2, 2.f, 0.25f) == 2);
+        REQUIRE(select_mesh_lod(chain, 100.f, 3, 2.f, 0.25f) == 2);
+        REQUIRE(select_mesh_lod(chain, 100.f, 0, 2.f, 0.25f) == 1);
+    }
+
+    TEST_CASE("update_mesh_lod cross-fades between levels")
+    {
+        mesh_lod_state state;
+        update_mesh_lod(state, 2, 4);
+        REQUIRE(state.level == 2);
+        REQUIRE(state.fade == 1.f);
+
+        update_mesh_lod(state, 1, 4);
+        REQUIRE(state.level == 1);
+        REQUIRE(state.previousLevel == 2);
+        REQUIRE(state.fade == 0.f);
+
+        for (int i = 0; i < 4; ++i) update_mesh_lod(state, 1, 4);
+        REQUIRE(state.fade == 1.f);
+
+        // Without a fade the switch is immediate
+        update_mesh_lod(state, 3, 0);
+        REQUIRE(state.level == 3);
+        REQUIRE(state.fade == 1.f);
+    }
+
+    //////////////////////////////////
+    //   Dynamic Resolution Tests   //
+    //////////////////////////////////
+
+    TEST_CASE("dynamic_resolution_controller settles on the frame time budget")
+    {
+        dynamic_resolution_controller controller;
+        controller.budgetMs = 12.f;
+
+        // Gpu time grows with the pixel count and is only measured three frames later
+        const auto frame_ms = [](const float scale) { return 4.f + 16.f * scale * scale; };
+        std::deque<float> inFlight;
+
+        float scale = controller.get_scale();
+        float lowest = scale;
+        for (int frame = 0; frame < 300; ++frame)
+        {
+            inFlight.push_back(frame_ms(scale));
+            if (inFlight.size() > 3)
+            {
+                scale = controller.update(inFlight.front());
+                inFlight.pop_front();
+            }
+            lowest = std::min(lowest, scale);
+        }
+        REQUIRE(lowest >= controller.minScale);
+        REQUIRE(frame_ms(scale) == doctest::Approx(12.f).epsilon(0.01));
+
+        // With headroom the scale climbs back to the maximum; a hitch is clamped to a bounded drop
+        for (int frame = 0; frame < 300; ++frame) scale = controller.update(6.f);
+        REQUIRE(scale == controller.maxScale);
+        REQUIRE(controller.update(500.f) > 0.6f);
+    }
+
+    TEST_CASE("scaled_viewport rounds to whole blocks within the render size")
+    {
+        REQUIRE(scaled_viewport({ 1280, 720 }, 1.f) == uint2(1280, 720));
+        REQUIRE(scaled_viewport({ 1280, 720 }, 0.5f) == uint2(640, 360));
+        REQUIRE(scaled_viewport({ 1280, 720 }, 0.701f) == uint2(896, 504));
+        REQUIRE(scaled_viewport({ 1280, 720 }, 0.f) == uint2(8, 8));
+        REQUIRE(scaled_viewport({ 1282, 4 }, 0.999f) == uint2(1280, 4));
+        REQUIRE(scaled_viewport({ 1282, 4 }, 1.f) == uint2(1282, 4));
+    }
+
+    //////////////////////////////
+    //   Program Cache Tests   //
+    //////////////////////////////
+
+    TEST_CASE("sha256_hex matches the FIPS 180-4 examples")
+    {
+        const std::string empty, abc = "abc", twoBlocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+        REQUIRE(sha256_hex(empty.data(), empty.size()) == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+        REQUIRE(sha256_hex(abc.data(), abc.size()) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+        REQUIRE(sha256_hex(twoBlocks.data(), twoBlocks.size()) == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    }
+
+    TEST_CASE("gl_program_cache keys change with the sources, defines and driver")
+    {
+        const std::vector<std::string> stages = { "void main() {}", "out vec4 c; void main() { c = vec4(1); }", "" };
+        const std::string key = gl_program_cache::make_key(stages, { "TWO_SIDED" }, "vendor 1.0");
+
+        REQUIRE(key.size() == 64);
+        REQUIRE(key == gl_program_cache::make_key(stages, { "TWO_SIDED" }, "vendor 1.0"));
+        REQUIRE(key != gl_program_cache::make_key(stages, {}, "vendor 1.0"));
+        REQUIRE(key != gl_program_cache::make_key(stages, { "TWO_SIDED" }, "vendor 1.1"));
 
+        std::vector<std::string> edited = stages;
+        edited[1] += "\n";
+        REQUIRE(key != gl_program_cache::make_key(edited, { "TWO_SIDED" }, "vendor 1.0"));
+
+        // Moving text across a field boundary is a different key
+        REQUIRE(gl_program_cache::make_key({ "ab", "c" }, {}, "") != gl_program_cache::make_key({ "a", "bc" }, {}, ""));
+    }
+
+    TEST_CASE("gl_shader_asset variant keys ignore define order and repeats")
+    {
+        const std::string key = gl_shader_asset::variant_key({ "ENABLE_SHADOWS", "HAS_ALBEDO_MAP", "TWO_CASCADES" });
+        REQUIRE(key == gl_shader_asset::variant_key({ "TWO_CASCADES", "ENABLE_SHADOWS", "HAS_ALBEDO_MAP", "ENABLE_SHADOWS" }));
+        REQUIRE(gl_shader_asset::hash({ "HAS_ALBEDO_MAP", "TWO_CASCADES", "ENABLE_SHADOWS" }) == gl_shader_asset::hash({ "ENABLE_SHADOWS", "HAS_ALBEDO_MAP", "TWO_CASCADES" }));
+
+        // Concatenating the names would alias these two sets
+        REQUIRE(key != gl_shader_asset::variant_key({ "ENABLE_SHADOWS", "HAS_ALBEDO_MAPTWO_CASCADES" }));
+        REQUIRE(gl_shader_asset::variant_key({ "AB", "C" }) != gl_shader_asset::variant_key({ "A", "BC" }));
+        REQUIRE(gl_shader_asset::hash({}) != gl_shader_asset::hash({ "INSTANCED_STEREO" }));
+    }
+
+    //////////////////////////////
+    //   Sky Environment Tests   //
+    //////////////////////////////
+
+    TEST_CASE("sky_environment prefilter units cover every face of every map level once")
+    {
+        std::set<std::tuple<bool, uint32_t, uint32_t>> units;
+        for (uint32_t i = 0; i < sky_environment::unit_count(); ++i)
+        {
+            const prefilter_unit u = get_prefilter_unit(i);
+            units.insert(std::make_tuple(u.irradiance, u.level, u.face));
+            REQUIRE(u.face < 6);
+            REQUIRE(u.level < (u.irradiance ? 1u : sky_environment::radiance_levels));
+        }
+        REQUIRE(units.size() == sky_environment::unit_count());
+
+        // The material picks level (levels - 1) + log2(roughness)
+        for (uint32_t level = 0; level < sky_environment::radiance_levels; ++level)
+        {
+            const float roughness = prefiltered_level_roughness(level, sky_environment::radiance_levels);
+            REQUIRE(std::log2(roughness) + (sky_environment::radiance_levels - 1) == doctest::Approx(float(level)));
+        }
+        REQUIRE(prefiltered_level_roughness(sky_environment::radiance_levels - 1, sky_environment::radiance_levels) == 1.f);
+    }
+
+    ////////////////////////////////
+    //   Texture Streaming Tests   //
+    ////////////////////////////////
+
+    TEST_CASE("texture streaming selects levels by on-screen size and downsamples odd sizes")
+    {
+        REQUIRE(mip_level_count(1) == 1);
+        REQUIRE(mip_level_count(256) == 9);
+        REQUIRE(mip_level_count(300) == 9);
+        REQUIRE(mip_level_size(uint2(300, 20), 5) == uint2(9, 1));
+
+        // A 1024 texture drawn across 256 pixels needs nothing finer than its 256 level
+        const uint2 size(1024, 512);
+        REQUIRE(streaming_level_for_span(size, 256.f) == 2);
+        REQUIRE(streaming_level_for_span(size, 200.f) == 2);
+        REQUIRE(streaming_level_for_span(size, 2048.f) == 0);
+        REQUIRE(streaming_level_for_span(size, 0.f) == 10);
+        REQUIRE(streaming_level_for_span(size, 256.f, 1.f) == 3);
+
+        // Odd sizes round down like gl mip levels, so the last row and column of a three by three image are dropped
+        const std::vector<uint8_t> source = { 0, 4, 100, 8, 12, 100, 20, 20, 20 };
+        const std::vector<uint8_t> half = downsample_mip(source, uint2(3, 3), 1);
+        REQUIRE(half.size() == 1);
+        REQUIRE(half[0] == 6);
+
+        // A dimension of one is kept, so a single row only averages its columns
+        const std::vector<uint8_t> rgb = { 10, 20, 30, 30, 40, 50 };
+        REQUIRE(downsample_mip(rgb, uint2(2, 1), 3) == std::vector<uint8_t>({ 20, 30, 40 }));
+    }
+
+    TEST_CASE("texture streaming evicts the least recently used levels first and never the resident tail")
+    {
+        // 256 wide chains of a byte per texel; the levels at most 64 wide, from level 2 on, are the tail
+        std::vector<uint64_t> levelBytes;
+        for (uint32_t level = 0; level < mip_level_count(256); ++level) levelBytes.push_back(uint64_t(256 >> level) * (256 >> level));
+
+        auto texture = [&](const uint64_t lastUsedFrame, const uint32_t wantedLevel)
+        {
+            streaming_residency r;
+            r.lastUsedFrame = lastUsedFrame;
+            r.residentLevel = 0;
+            r.wantedLevel = wantedLevel;
+            r.floorLevel = 2;
+            r.levelBytes = levelBytes;
+            return r;
+        };
+
+        uint64_t chainBytes = 0;
+        for (const uint64_t b : levelBytes) chainBytes += b;
+
+        // Unused textures want only their tail; the one drawn longest ago goes first and the newest is spared
+        const std::vector<streaming_residency> textures = { texture(7, 2), texture(3, 2), texture(5, 2) };
+        const uint64_t resident = chainBytes * 3;
+        const uint64_t evicted = levelBytes[0] + levelBytes[1];
+        REQUIRE(choose_resident_levels(textures, resident, 0, resident) == std::vector<uint32_t>({ 0, 0, 0 }));
+        REQUIRE(choose_resident_levels(textures, resident, 1, resident) == std::vector<uint32_t>({ 0, 2, 0 }));
+        REQUIRE(choose_resident_levels(textures, resident, evicted + 1, resident) == std::vector<uint32_t>({ 0, 2, 2 }));
+
+        // A texture drawn this frame only gives up the levels finer than it needs
+        const std::vector<streaming_residency> drawn = { texture(9, 1), texture(4, 2) };
+        REQUIRE(choose_resident_levels(drawn, chainBytes * 2, chainBytes * 2, 0) == std::vector<uint32_t>({ 1, 2 }));
+
+        // No budget is small enough to evict the tail, even of a texture wanting only its coarsest level
+        const std::vector<streaming_residency> coarse = { texture(1, 8) };
+        REQUIRE(choose_resident_levels(coarse, chainBytes, 0, 0) == std::vector<uint32_t>({ 2 }));
+
+        // Textures already coarser than they need are left alone
+        std::vector<streaming_residency> trimmed = { texture(1, 2) };
+        trimmed[0].residentLevel = 3;
+        REQUIRE(choose_resident_levels(trimmed, chainBytes, 0, 0) == std::vector<uint32_t>({ 3 }));
+    }
+
+    //////////////////////////////
+    //   Texture Cooking Tests   //
+    //////////////////////////////
+
+    TEST_CASE("texture cook encoders round trip blocks within the precision of their formats")
+    {
+        // A ramp along one color axis is what BC1 represents best
+        uint8_t rgba[64];
+        for (int i = 0; i < 16; ++i)
+        {
+            rgba[i * 4 + 0] = static_cast<uint8_t>(i * 16);
+            rgba[i * 4 + 1] = static_cast<uint8_t>(255 - i * 16);
+            rgba[i * 4 + 2] = 128;
+            rgba[i * 4 + 3] = static_cast<uint8_t>(i * 17);
+        }
+
+        uint8_t bc3[16];
+        encode_bc3_block(rgba, bc3);
+        const gli::detail::texel_block4x4 color = gli::detail::decompress_dxt5_block(*reinterpret_cast<const gli::detail::dxt5_block *>(bc3));
+        for (int i = 0; i < 16; ++i)
+        {
+            const glm::vec4 t = color.Texel[i / 4][i % 4];
+            REQUIRE(std::abs(t.r * 255.f - rgba[i * 4 + 0]) <= 240.f / 6.f + 4.f); // half of one of three steps, and 565 rounding
+            REQUIRE(std::abs(t.g * 255.f - rgba[i * 4 + 1]) <= 240.f / 6.f + 4.f);
+            REQUIRE(std::abs(t.b * 255.f - rgba[i * 4 + 2]) < 8.f);
+            REQUIRE(std::abs(t.a * 255.f - rgba[i * 4 + 3]) <= 255.f / 14.f);  // half of one of seven steps
+        }
+
+        // A flat block of a color that 565 holds exactly decodes exactly
+        for (int i = 0; i < 16; ++i) { rgba[i * 4 + 0] = 255; rgba[i * 4 + 1] = 0; rgba[i * 4 + 2] = 255; }
+        uint8_t bc1[8];
+        encode_bc1_block(rgba, bc1);
+        const gli::detail::texel_block4x4 flat = gli::detail::decompress_dxt1_block(*reinterpret_cast<const gli::detail::dxt1_block *>(bc1));
+        REQUIRE(flat.Texel[3][3].r == doctest::Approx(1.f));
+        REQUIRE(flat.Texel[3][3].g == doctest::Approx(0.f));
+        REQUIRE(flat.Texel[3][3].b == doctest::Approx(1.f));
+
+        // Eight values between the endpoints keep any ramp within half a step
+        uint8_t red[16], green[16];
+        for (int i = 0; i < 16; ++i) { red[i] = static_cast<uint8_t>(40 + i * 9); green[i] = static_cast<uint8_t>(200 - i * 3); }
+        uint8_t bc5[16];
+        encode_bc5_block(red, green, bc5);
+        const gli::detail::texel_block4x4 rg = gli::detail::decompress_bc5unorm_block(*reinterpret_cast<const gli::detail::bc5_block *>(bc5));
+        for (int i = 0; i < 16; ++i)
+        {
+            REQUIRE(std::abs(rg.Texel[i / 4][i % 4].r * 255.f - red[i]) <= 10.f);
+            REQUIRE(std::abs(rg.Texel[i / 4][i % 4].g * 255.f - green[i]) <= 4.f);
+        }
+    }
+
+    TEST_CASE("cook_texture picks formats per map type and compresses the full mip chain")
+    {
+        std::vector<uint8_t> rgb(6 * 5 * 3, 200);
+        const gli::texture2d color = cook_texture(rgb.data(), uint2(6, 5), 3, texture_map_type::color);
+        REQUIRE(color.format() == gli::FORMAT_RGB_DXT1_UNORM_BLOCK8);
+        REQUIRE(color.levels() == 3);
+        REQUIRE(color[0].size() == 2 * 2 * 8);
+        REQUIRE(color[2].size() == 8);
+
+        std::vector<uint8_t> rgba(4 * 4 * 4, 255);
+        rgba[3] = 0;
+        REQUIRE(cook_texture(rgba.data(), uint2(4, 4), 4, texture_map_type::color).format() == gli::FORMAT_RGBA_DXT5_UNORM_BLOCK16);
+        REQUIRE(cook_texture(rgba.data(), uint2(4, 4), 4, texture_map_type::normal).format() == gli::FORMAT_RG_ATI2N_UNORM_BLOCK16);
+        REQUIRE(cook_texture(rgba.data(), uint2(4, 4), 4, texture_map_type::scalar).format() == gli::FORMAT_R_ATI1N_UNORM_BLOCK8);
+
+        std::vector<uint8_t> source = { 1, 2, 3 };
+        const std::string key = texture_cook_cache::make_key(source, texture_map_type::color);
+        REQUIRE(key == texture_cook_cache::make_key(source, texture_map_type::color));
+        REQUIRE(key != texture_cook_cache::make_key(source, texture_map_type::normal));
+        source[1] = 4;
+        REQUIRE(key != texture_cook_cache::make_key(source, texture_map_type::color));
+    }
+
+    TEST_CASE("decode_image flips per call and image_decode_service completes on the processing thread")
+    {
+        // Rows of 2 rgb texels with the row index in red
+        std::vector<uint8_t> texels(2 * 3 * 3, 0);
+        for (uint32_t y = 0; y < 3; ++y) texels[y * 6] = texels[y * 6 + 3] = static_cast<uint8_t>(y * 100);
+
+        std::vector<uint8_t> png;
+        stbi_write_png_to_func([](void * context, void * data, int size)
+        {
+            auto & out = *static_cast<std::vector<uint8_t> *>(context);
+            out.insert(out.end(), static_cast<uint8_t *>(data), static_cast<uint8_t *>(data) + size);
+        }, &png, 2, 3, 3, texels.data(), 2 * 3);
+
+        const decoded_image flipped = decode_image(png.data(), png.size(), true);
+        const decoded_image upright = decode_image(png.data(), png.size(), false);
+        REQUIRE(upright.width == 2);
+        REQUIRE(upright.height == 3);
+        REQUIRE(upright.channels == 3);
+        REQUIRE_FALSE(upright.hdr);
+        REQUIRE(std::equal(texels.begin(), texels.end(), upright.pixels.get()));
+        for (uint32_t y = 0; y < 3; ++y) REQUIRE(flipped.pixels.get()[y * 6 + 3] == (2 - y) * 100);
+
+        const std::vector<uint8_t> garbage = { 1, 2, 3, 4, 5 };
+        CHECK_THROWS_AS(decode_image(garbage.data(), garbage.size(), false), std::exception);
+
+        image_decode_service service(3);
+        const std::thread::id caller = std::this_thread::get_id();
+        std::vector<int> results;
+        for (int i = 0; i < 16; ++i)
+        {
+            // Anything thrown completes the job, not only std::exception
+            service.run<int>("job", [i]() { if (i == 5) throw std::runtime_error("failed"); if (i == 7) throw i; return i * i; }, [&](int & value)
+            {
+                REQUIRE(std::this_thread::get_id() == caller);
+                results.push_back(value);
+            });
+        }
+
+        service.finish();
+        REQUIRE(service.get_pending_count() == 0);
+        REQUIRE(results.size() == 14);
+        std::sort(results.begin(), results.end());
+        REQUIRE(results.back() == 225);
+        REQUIRE(std::find(results.begin(), results.end(), 25) == results.end());
+        REQUIRE(std::find(results.begin(), results.end(), 49) == results.end());
+        REQUIRE(service.process_completions() == 0);
+    }
+
+    TEST_CASE("render_graph culls unused passes and aliases transients with disjoint lifetimes")
+    {
+        render_graph graph;
+        const render_target_desc msaa = { uint2(64, 32), GL_RGBA8, 4 };
+        const render_target_desc resolved = { uint2(64, 32), GL_RGBA8 };
+        const auto nothing = [](render_pass_context &) {};
+
+        const render_resource sceneUniforms = graph.import_state("per_scene");
+        graph.add_pass("update_per_scene", {}, { sceneUniforms }, nothing);
+
+        // Two views, each drawing into a multisampled target that is resolved into an exported output
+        render_resource targets[2], outputs[2];
+        for (uint32_t v = 0; v < 2; ++v)
+        {
+            targets[v] = graph.create_texture("msaa_color", msaa);
+            outputs[v] = graph.import_state("view_color");
+            graph.export_resource(outputs[v]);
+            graph.add_pass("clear_view", v, {}, { targets[v] }, nothing);
+            graph.add_pass("run_forward_pass", v, { sceneUniforms }, { targets[v] }, nothing);
+            graph.add_pass("resolve", v, { targets[v] }, { outputs[v] }, nothing);
+        }
+
+        // Nothing reads the debug target, so both passes are culled; a pass writing nothing in the graph is kept
+        const render_resource debug = graph.create_texture("debug", resolved);
+        graph.add_pass("draw_debug", {}, { debug }, nothing);
+        graph.add_pass("blur_debug", { debug }, { debug }, nothing);
+        graph.add_pass("build_hiz_pyramid", { outputs[0] }, {}, nothing);
+
+        graph.compile();
+        REQUIRE(graph.get_pass_count() == 10);
+        REQUIRE(graph.get_culled_pass_count() == 2);
+        REQUIRE(graph.is_culled(7));
+        REQUIRE(graph.is_culled(8));
+        REQUIRE_FALSE(graph.is_culled(0));
+        REQUIRE_FALSE(graph.is_culled(9));
+        REQUIRE(graph.get_slot(debug) == ~0u);
+
+        REQUIRE(graph.get_slot_count() == 1);
+        REQUIRE(graph.get_slot(targets[0]) == graph.get_slot(targets[1]));
+        REQUIRE(graph.get_transient_bytes() == msaa.size_bytes());
+        REQUIRE(graph.get_unaliased_bytes() == 2 * msaa.size_bytes());
+        REQUIRE(msaa.size_bytes() == 64 * 32 * 4 * 4);
+
+        // Without its export the second view's passes have no use
+        graph.clear();
+        const render_resource target = graph.create_texture("msaa_color", msaa);
+        graph.add_pass("run_forward_pass", {}, { target }, nothing);
+        graph.add_pass("resolve", { target }, { graph.import_state("view_color") }, nothing);
+        graph.compile();
+        REQUIRE(graph.get_culled_pass_count() == 2);
+        REQUIRE(graph.get_transient_bytes() == 0);
+
+        // Overlapping lifetimes need textures of their own
+        graph.clear();
+        const render_resource a = graph.create_texture("a", resolved), b = graph.create_texture("b", resolved);
+        const render_resource out = graph.import_state("out");
+        graph.export_resource(out);
+        graph.add_pass("write_a", {}, { a }, nothing);
+        graph.add_pass("write_b", {}, { b }, nothing);
+        graph.add_pass("combine", { a, b }, { out }, nothing);
+        graph.compile();
+        REQUIRE(graph.get_slot_count() == 2);
+        REQUIRE(graph.get_slot(a) != graph.get_slot(b));
+
+        const render_resource unwritten = graph.create_texture("unwritten", resolved);
+        CHECK_THROWS_AS(graph.add_pass("read_unwritten", { unwritten }, { out }, nothing), std::runtime_error);
+        CHECK_THROWS_AS(graph.export_resource(render_resource{ 100 }), std::invalid_argument);
+    }
+
+    TEST_CASE("fused resolve skips the round trip of the resolved color")
+    {
+        const uint2 size = { 1920, 1080 };
+        const uint64_t texels = uint64_t(size.x) * size.y;
+
+        const resolve_traffic full = estimate_resolve_traffic(size, size, 4);
+        REQUIRE(full.fusedBytes == texels * 4 * 5);
+        REQUIRE(full.separateBytes == texels * 4 * 7);
+        REQUIRE(full.separateBytes - full.fusedBytes == texels * 4 * 2);
+
+        // A reduced viewport reads fewer samples but still writes the full output
+        const resolve_traffic reduced = estimate_resolve_traffic(size / 2u, size, 4);
+        REQUIRE(reduced.fusedBytes == texels * 4 + texels * 4);
+        REQUIRE(reduced.separateBytes - reduced.fusedBytes == texels * 2);
+
+        resolve_traffic frame;
+        frame += full;
+        frame += reduced;
+        REQUIRE(frame.fusedBytes == full.fusedBytes + reduced.fusedBytes);
+        REQUIRE(frame.separateBytes == full.separateBytes + reduced.separateBytes);
+
+        REQUIRE_FALSE(fused_resolve_pass::is_supported(0));
+    }
+
+    TEST_CASE("debug_draw_list records shapes as instances of unit primitives")
+    {
+        const debug_primitive_geometry g = make_debug_primitives(16);
+        const uint32_t sphere = (uint32_t) debug_primitive::sphere, box = (uint32_t) debug_primitive::box, axis = (uint32_t) debug_primitive::axis;
+        REQUIRE(g.count[sphere] == 3 * 16 * 2);
+        REQUIRE(g.count[box] == 12 * 2);
+        REQUIRE(g.count[axis] == 3 * 2);
+        REQUIRE(g.first[box] == g.first[sphere] + g.count[sphere]);
+        REQUIRE(g.vertices.size() == g.first[axis] + g.count[axis]);
+        for (uint32_t v = 0; v < g.count[sphere]; ++v) REQUIRE(length(g.vertices[g.first[sphere] + v].position) == doctest::Approx(1.f));
+        for (uint32_t v = 0; v < g.count[box]; ++v) REQUIRE(abs(g.vertices[g.first[box] + v].position) == float3(1, 1, 1));
+
+        debug_draw_list list;
+        const uint64_t version = list.get_version();
+        list.draw_line(float3(0, 0, 0), float3(1, 0, 0));
+        list.draw_box(aabb_3d({ 1, 2, 3 }, { 3, 6, 11 }), float3(1, 0, 0));
+        list.draw_sphere(transform(float3(0, 5, 0)), 2.f);
+        list.draw_axis(transform(), float3(1, 1, 1), 0.5f);
+        REQUIRE(list.get_version() != version);
+        REQUIRE(list.get_shape_count() == 4);
+        REQUIRE(list.get_lines().size() == 2);
+
+        // The unit box spans the bounds, and the sphere its radius around the pose
+        const debug_instance & b = list.get_instances(debug_primitive::box)[0];
+        REQUIRE(transform_coord(b.model, float3(-1, -1, -1)) == float3(1, 2, 3));
+        REQUIRE(transform_coord(b.model, float3(1, 1, 1)) == float3(3, 6, 11));
+        REQUIRE(b.color == float4(1, 0, 0, 1));
+        const debug_instance & s = list.get_instances(debug_primitive::sphere)[0];
+        REQUIRE(transform_coord(s.model, float3(0, 1, 0)) == float3(0, 7, 0));
+
+        // A frustum is the box seen through the inverse view projection: its far corners land on the far plane
+        const float4x4 projection = make_projection_matrix(1.f, 1.f, 0.5f, 10.f);
+        list.draw_frustum(projection);
+        const debug_instance & f = list.get_instances(debug_primitive::box)[1];
+        REQUIRE(transform_coord(f.model, float3(0, 0, -1)).z == doctest::Approx(-0.5f));
+        REQUIRE(transform_coord(f.model, float3(0, 0, 1)).z == doctest::Approx(-10.f));
+
+        // Thousands of shapes stay a handful of instance arrays
+        for (int i = 0; i < 5000; ++i) list.draw_box(aabb_3d({ 0, 0, 0 }, { 1, 1, 1 }));
+        REQUIRE(list.get_instances(debug_primitive::box).size() == 5002);
+        REQUIRE(list.get_size_bytes() >= 5002 * sizeof(debug_instance));
+
+        list.clear();
+        REQUIRE(list.get_shape_count() == 0);
+        REQUIRE(list.get_size_bytes() == 0);
+    }
+
+    TEST_CASE("pbr material records have a fixed std430 stride and only changed runs are rewritten")
+    {
+        // Must match PbrMaterialData in pbr_material_frag.glsl
+        REQUIRE(sizeof(uniforms::pbr_material) == 64);
+        REQUIRE(offsetof(uniforms::pbr_material, emissive) == 16);
+        REQUIRE(offsetof(uniforms::pbr_material, roughness) == 32);
+        REQUIRE(offsetof(uniforms::pbr_material, texcoordScale) == 56);
+
+        // The material index follows the fade in the per-object record, which keeps its std140 stride
+        REQUIRE(offsetof(uniforms::per_object, materialIndex) == offsetof(uniforms::per_object, lodFade) + 4);
+        REQUIRE(sizeof(uniforms::per_object) == 208);
+
+        std::vector<uniforms::pbr_material> uploaded(6);
+        for (uint32_t i = 0; i < uploaded.size(); ++i) uploaded[i].roughness = float(i);
+
+        // Nothing changed
+        std::vector<uniforms::pbr_material> records = uploaded;
+        REQUIRE(find_changed_records(records, uploaded).empty());
+
+        // Neighbouring edits coalesce into one run; records beyond the uploaded ones are always written
+        records[1].albedo = float3(1, 0, 0);
+        records[2].metallic = 0.5f;
+        records[4].texcoordScale = float2(2, 2);
+        records.push_back({});
+        records.push_back({});
+
+        const std::vector<uint2> runs = find_changed_records(records, uploaded);
+        REQUIRE(runs.size() == 3);
+        REQUIRE(runs[0] == uint2(1, 2));
+        REQUIRE(runs[1] == uint2(4, 1));
+        REQUIRE(runs[2] == uint2(6, 2));
+
+        // A buffer that holds nothing yet is written in full
+        REQUIRE(find_changed_records(records, {}) == std::vector<uint2>{ uint2(0, 8) });
+    }
+
+    TEST_CASE("entity picking maps cursor regions to id texels and orders ids by coverage")
+    {
+        // The pick id follows the material index in the per-object record, which keeps its std140 stride
+        REQUIRE(offsetof(uniforms::per_object, pickId) == offsetof(uniforms::per_object, materialIndex) + 4);
+        REQUIRE(sizeof(uniforms::per_object) == 208);
+
+        // A pixel at the top left of a full resolution frame is the top row of the target
+        pick_region texels = map_pick_region({ int2(0, 0), int2(1, 1) }, int2(64, 32), int2(64, 32));
+        REQUIRE(texels.min == int2(0, 31));
+        REQUIRE(texels.max == int2(1, 32));
+
+        // At half resolution a pixel still covers a texel, and regions are clamped to the drawn viewport
+        texels = map_pick_region({ int2(7, 3), int2(8, 4) }, int2(64, 32), int2(32, 16));
+        REQUIRE(texels.min == int2(3, 14));
+        REQUIRE(texels.max == int2(4, 15));
+
+        texels = map_pick_region({ int2(-8, -8), int2(100, 100) }, int2(64, 32), int2(32, 16));
+        REQUIRE(texels.min == int2(0, 0));
+        REQUIRE(texels.max == int2(32, 16));
+
+        // Entirely outside
+        texels = map_pick_region({ int2(80, 40), int2(90, 50) }, int2(64, 32), int2(64, 32));
+        REQUIRE(texels.max.x - texels.min.x == 0);
+
+        // Zero is the background; ties are broken by id
+        const std::vector<uint32_t> ids = { 0, 3, 3, 5, 0, 2, 5, 3, 9 };
+        REQUIRE(collect_pick_ids(ids.data(), ids.size()) == std::vector<uint32_t>{ 3, 5, 2, 9 });
+        REQUIRE(collect_pick_ids(ids.data(), 1).empty());
+    }
+
+    TEST_CASE("static caster hashes are stable across payload snapshots and change when a caster moves")
+    {
+        mesh_component mesh(7, gpu_mesh_handle("static-caster-mesh"));
+        world_transform_component world(7);
+        world.world_pose.position = float3(1, 2, 3);
+        local_transform_component local(7);
+
+        render_payload payload;
+        payload.sunlight = nullptr;
+        render_component caster(7);
+        caster.mesh = &mesh;
+        caster.world_transform = &world;
+        caster.local_transform = &local;
+        payload.render_components.push_back(caster);
+
+        const auto hash = [](const render_payload & p)
+        {
+            const render_component & r = p.render_components[0];
+            const float4x4 modelMatrix = r.world_transform->world_pose.matrix() * make_scaling_matrix(r.local_transform->local_scale);
+            return hash_static_caster(r, modelMatrix, 0);
+        };
+
+        // Each snapshot holds its own copy of the components, at a different address
+        render_payload_snapshot first, second;
+        first.capture(payload);
+        second.capture(payload);
+        REQUIRE(first.payload.render_components[0].mesh != second.payload.render_components[0].mesh);
+        REQUIRE(hash(first.payload) == hash(second.payload));
+        REQUIRE(hash(first.payload) == hash(payload));
+
+        // Moving the caster, or drawing a coarser level, is a different cached shadow
+        world.world_pose.position.x += 0.5f;
+        second.capture(payload);
+        REQUIRE(hash(second.payload) != hash(first.payload));
+
+        const render_component & r = first.payload.render_components[0];
+        const float4x4 modelMatrix = r.world_transform->world_pose.matrix();
+        REQUIRE(hash_static_caster(r, modelMatrix, 1) != hash_static_caster(r, modelMatrix, 0));
+
+        // Another entity drawing the same mesh in the same place is another caster
+        render_component other(8);
+        other.mesh = r.mesh;
+        REQUIRE(hash_static_caster(other, modelMatrix, 0) != hash_static_caster(r, modelMatrix, 0));
+    }
+
+} // end namespace polymer
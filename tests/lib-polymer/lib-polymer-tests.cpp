@@ -6,6 +6,7 @@
  */
 
 #include "lib-polymer.hpp"
+#include "../../lib-model-io/model-io.hpp"
 
 using namespace polymer;
 
@@ -277,6 +278,15 @@ TEST_CASE("loading & saving binary files")
     REQUIRE_THROWS(read_file_binary("binary-sample-does-not-exist.bin"));
 }
 
+TEST_CASE("compile-time and runtime string hashes agree")
+{
+    // Uniform locations are reflected with the runtime hash and looked up with const_hash
+    constexpr poly_hash_value albedo = const_hash("s_albedo");
+    REQUIRE(albedo == hash("s_albedo"));
+    REQUIRE(albedo == hash("s_albedo[0]", 8));
+    REQUIRE(const_hash("u_roughness") != const_hash("u_metallic"));
+}
+
 TEST_CASE("workgroup split")
 {
     std::vector<uint32_t> even_items{ 0, 1, 2, 3, 4, 5, 6, 7 };
@@ -346,3 +356,32 @@ TEST_CASE("integral and floating point radix sort")
     radix_sorter.sort(int_list.data(), int_list.size());
     radix_sorter.sort(float_list.data(), float_list.size());
 }
+
+TEST_CASE("mesh level of detail chain")
+{
+    const runtime_mesh sphere = make_sphere(1.f);
+    const mesh_lod_chain chain = generate_lod_chain(sphere);
+    REQUIRE(chain.levels.size() >= 2);
+
+    /// Levels index the vertices of the source, shrink, and never claim less error than the level before
+    size_t previousTriangles = sphere.faces.size();
+    float previousError = 0.f;
+    for (const mesh_lod & lod : chain.levels)
+    {
+        REQUIRE(lod.faces.size() < previousTriangles);
+        REQUIRE(lod.error >= previousError);
+        REQUIRE(lod.error < 0.5f);
+
+        uint32_t maxIndex = 0;
+        for (const uint3 & f : lod.faces) maxIndex = std::max<uint32_t>(maxIndex, std::max<uint32_t>(std::max<uint32_t>(f.x, f.y), f.z));
+        REQUIRE(maxIndex < sphere.vertices.size());
+
+        previousTriangles = lod.faces.size();
+        previousError = lod.error;
+    }
+
+    /// Meshes already at the minimum are left alone
+    mesh_lod_settings settings;
+    settings.minTriangles = static_cast<uint32_t>(sphere.faces.size());
+    REQUIRE(generate_lod_chain(sphere, settings).levels.empty());
+}